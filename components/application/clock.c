@@ -0,0 +1,366 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <string.h>
+
+#include "application/clock.h"
+#include "storage/settings.h"
+
+static const char *TAG = "APPLICATION:CLOCK";
+
+// A heartbeat's record: when it was sent, then an echo per peer answered.
+// Big-endian, like the UUID.
+#define APP_CLOCK_SENT_LENGTH 6
+// the peer's MAC suffix, the low half of its timestamp, how long it was held
+#define APP_CLOCK_ECHO_LENGTH 11
+
+static bool app_clock_mac_equal(const protocol_mac_address_t a,
+                                const protocol_mac_address_t b) {
+  return memcmp(a, b, sizeof(protocol_mac_address_t)) == 0;
+}
+
+static void app_clock_put(uint8_t *buffer, uint64_t value, int32_t length) {
+  for (int32_t i = length - 1; i >= 0; i--) {
+    buffer[i] = (uint8_t)value;
+    value >>= 8;
+  }
+}
+
+static uint64_t app_clock_get(const uint8_t *buffer, int32_t length) {
+  uint64_t value = 0;
+  for (int32_t i = 0; i < length; i++) {
+    value = (value << 8) | buffer[i];
+  }
+  return value;
+}
+
+int64_t app_clock_local_at(app_clock_handle_t clock_handle, int64_t timer_us) {
+  if (clock_handle->source == NULL) {
+    return timer_us;
+  }
+  return clock_handle->source(timer_us, clock_handle->source_ctx);
+}
+
+int64_t app_clock_local_us(app_clock_handle_t clock_handle) {
+  return app_clock_local_at(clock_handle, esp_timer_get_time());
+}
+
+static app_clock_peer_t *
+app_clock_peer_locked(app_clock_handle_t clock,
+                      const protocol_mac_address_t mac_address, bool create) {
+  app_clock_peer_t *oldest = NULL;
+
+  for (int32_t i = 0; i < APP_CLOCK_PEERS; i++) {
+    app_clock_peer_t *peer = &clock->peers[i];
+    if (peer->used && app_clock_mac_equal(peer->mac_address, mac_address)) {
+      return peer;
+    }
+    // the first free one, or the least recently heard
+    if (oldest == NULL ||
+        (oldest->used &&
+         (!peer->used || peer->heard_us < oldest->heard_us))) {
+      oldest = peer;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  memset(oldest, 0, sizeof(app_clock_peer_t));
+  oldest->used = true;
+  memcpy(oldest->mac_address, mac_address, sizeof(protocol_mac_address_t));
+  return oldest;
+}
+
+// heard within the prune interval, like `application/peers` keeps them
+static bool app_clock_heard(const app_clock_peer_t *peer, int64_t now_us) {
+  int64_t prune_us =
+      storage_settings_get_u32(STORAGE_SETTING_PEERS_PRUNE_INTERVAL_MS) *
+      1000LL;
+  return peer->used && now_us - peer->heard_us <= prune_us;
+}
+
+static bool app_clock_trusted(const app_clock_peer_t *peer, int64_t now_us) {
+  return app_clock_heard(peer, now_us) &&
+         peer->sample_count >= APP_CLOCK_SAMPLES_MIN;
+}
+
+static int64_t app_clock_offset_at(const app_clock_peer_t *peer,
+                                   int64_t local_us) {
+  return peer->offset_us +
+         (int64_t)(peer->rate_ppm * (local_us - peer->at_us) * 1e-6);
+}
+
+// Fits the peer's offset and rate through the exchanges, weighing each by
+// how close its round trip was to the quickest.
+static void app_clock_fit(app_clock_peer_t *peer) {
+  const app_clock_sample_t *newest =
+      &peer->samples[(peer->sample_next + APP_CLOCK_SAMPLES - 1) %
+                     APP_CLOCK_SAMPLES];
+  int32_t quickest = INT32_MAX;
+  for (int32_t i = 0; i < peer->sample_count; i++) {
+    if (peer->samples[i].delay_us < quickest) {
+      quickest = peer->samples[i].delay_us;
+    }
+  }
+
+  // relative to the newest, so the sums stay small
+  double sum_w = 0;
+  double sum_x = 0;
+  double sum_y = 0;
+  double sum_xx = 0;
+  double sum_xy = 0;
+  double first_x = 0;
+  for (int32_t i = 0; i < peer->sample_count; i++) {
+    const app_clock_sample_t *sample = &peer->samples[i];
+    double slower = (double)(sample->delay_us - quickest) /
+                    APP_CLOCK_DELAY_SLACK_US;
+    double w = 1.0 / (1.0 + slower * slower);
+    double x = (sample->at_us - newest->at_us) / 1e6;
+    double y = (double)(sample->offset_us - newest->offset_us);
+    first_x = x < first_x ? x : first_x;
+    sum_w += w;
+    sum_x += w * x;
+    sum_y += w * y;
+    sum_xx += w * x * x;
+    sum_xy += w * x * y;
+  }
+
+  // a us per s is a ppm
+  double denominator = sum_w * sum_xx - sum_x * sum_x;
+  if (-first_x >= APP_CLOCK_SPAN_MIN_S && denominator > 0) {
+    peer->rate_ppm = (sum_w * sum_xy - sum_x * sum_y) / denominator;
+  }
+  double intercept = (sum_y - peer->rate_ppm * sum_x) / sum_w;
+
+  peer->at_us = newest->at_us;
+  peer->offset_us = newest->offset_us + (int64_t)intercept;
+}
+
+// Their heartbeat echoed ours: `t1` ours leaving, `hold_us` how long they
+// kept it, `t3` theirs leaving and `t4` theirs arriving.
+static void app_clock_exchange_locked(app_clock_handle_t clock,
+                                      app_clock_peer_t *peer, int64_t t1,
+                                      int64_t hold_us, int64_t t3,
+                                      int64_t t4) {
+  // the hold is on their clock, which runs at its own rate
+  int64_t held_us = (int64_t)(hold_us / (1.0 + peer->rate_ppm * 1e-6));
+  int64_t delay_us = (t4 - t1) - held_us;
+  if (delay_us < 0 || delay_us > INT32_MAX) {
+    return;
+  }
+
+  app_clock_sample_t *sample = &peer->samples[peer->sample_next];
+  sample->at_us = t1 + (t4 - t1) / 2;
+  sample->offset_us = t3 - (hold_us + t1 + t4) / 2;
+  sample->delay_us = (int32_t)delay_us;
+  peer->sample_next = (peer->sample_next + 1) % APP_CLOCK_SAMPLES;
+  if (peer->sample_count < APP_CLOCK_SAMPLES) {
+    peer->sample_count++;
+  }
+  app_clock_fit(peer);
+
+  system_metrics_add(clock->metrics.samples, 1);
+  system_metrics_observe(clock->metrics.round_trip_us, (uint32_t)delay_us);
+}
+
+static int32_t app_clock_extension_fill(uint8_t *buffer, void *ctx) {
+  app_clock_handle_t clock = (app_clock_handle_t)ctx;
+  int64_t now_us = app_clock_local_us(clock);
+  int32_t length = APP_CLOCK_SENT_LENGTH;
+  int32_t echoes = 0;
+
+  app_clock_put(buffer, (uint64_t)now_us, APP_CLOCK_SENT_LENGTH);
+
+  xSemaphoreTake(clock->mutex, portMAX_DELAY);
+  // round robin, so every peer is answered when there are many
+  int32_t start = clock->echo_next;
+  for (int32_t i = 0; i < APP_CLOCK_PEERS && echoes < APP_CLOCK_ECHOES_MAX;
+       i++) {
+    int32_t index = (start + i) % APP_CLOCK_PEERS;
+    app_clock_peer_t *peer = &clock->peers[index];
+    int64_t hold_us = now_us - peer->received_us;
+    if (!peer->used || !peer->pending || hold_us < 0 || hold_us > INT32_MAX) {
+      continue;
+    }
+
+    uint8_t *echo = buffer + length;
+    memcpy(echo, peer->mac_address + 3, 3);
+    app_clock_put(echo + 3, (uint32_t)peer->sent_us, 4);
+    app_clock_put(echo + 7, (uint32_t)hold_us, 4);
+    length += APP_CLOCK_ECHO_LENGTH;
+    peer->pending = false;
+    clock->echo_next = (index + 1) % APP_CLOCK_PEERS;
+    echoes++;
+  }
+  xSemaphoreGive(clock->mutex);
+
+  return length;
+}
+
+static void app_clock_extension_receive(protocol_message_handle_t heartbeat,
+                                        const uint8_t *extension,
+                                        int32_t length, void *ctx) {
+  app_clock_handle_t clock = (app_clock_handle_t)ctx;
+  const uint8_t *our_mac_address = clock->device_info->mac_address;
+
+  if (length < APP_CLOCK_SENT_LENGTH || heartbeat->received_us == 0) {
+    return;
+  }
+  int64_t t3 = (int64_t)app_clock_get(extension, APP_CLOCK_SENT_LENGTH);
+  int64_t t4 = app_clock_local_at(clock, heartbeat->received_us);
+
+  xSemaphoreTake(clock->mutex, portMAX_DELAY);
+  app_clock_peer_t *peer =
+      app_clock_peer_locked(clock, heartbeat->header.from_mac_address, true);
+  peer->heard_us = t4;
+  peer->sent_us = t3;
+  peer->received_us = t4;
+  peer->pending = true;
+
+  for (int32_t at = APP_CLOCK_SENT_LENGTH;
+       at + APP_CLOCK_ECHO_LENGTH <= length; at += APP_CLOCK_ECHO_LENGTH) {
+    const uint8_t *echo = extension + at;
+    if (memcmp(echo, our_mac_address + 3, 3) != 0) {
+      continue;
+    }
+    // only the low half was echoed, it was sent less than an hour ago
+    uint32_t sent_low = (uint32_t)app_clock_get(echo + 3, 4);
+    int64_t t1 = t4 - (uint32_t)((uint32_t)t4 - sent_low);
+    int64_t hold_us = (int64_t)app_clock_get(echo + 7, 4);
+    app_clock_exchange_locked(clock, peer, t1, hold_us, t3, t4);
+    break;
+  }
+  xSemaphoreGive(clock->mutex);
+}
+
+// The peer the shared clock follows, NULL when it's ours.
+static app_clock_peer_t *app_clock_reference_locked(app_clock_handle_t clock,
+                                                    int64_t now_us) {
+  const uint8_t *reference = clock->device_info->mac_address;
+  app_clock_peer_t *reference_peer = NULL;
+
+  for (int32_t i = 0; i < APP_CLOCK_PEERS; i++) {
+    app_clock_peer_t *peer = &clock->peers[i];
+    if (app_clock_heard(peer, now_us) &&
+        memcmp(peer->mac_address, reference,
+               sizeof(protocol_mac_address_t)) < 0) {
+      reference = peer->mac_address;
+      reference_peer = peer;
+    }
+  }
+  return reference_peer;
+}
+
+int64_t app_clock_shared_at(app_clock_handle_t clock_handle, int64_t local_us,
+                            bool *synced_ptr) {
+  int64_t now_us = app_clock_local_us(clock_handle);
+  int64_t shared_us = local_us;
+
+  xSemaphoreTake(clock_handle->mutex, portMAX_DELAY);
+  app_clock_peer_t *reference_peer =
+      app_clock_reference_locked(clock_handle, now_us);
+  bool synced = reference_peer == NULL ||
+                app_clock_trusted(reference_peer, now_us);
+  if (reference_peer != NULL && synced) {
+    shared_us += app_clock_offset_at(reference_peer, local_us);
+  }
+  xSemaphoreGive(clock_handle->mutex);
+
+  if (synced_ptr != NULL) {
+    *synced_ptr = synced;
+  }
+  return shared_us;
+}
+
+esp_err_t app_clock_shared_to_local(app_clock_handle_t clock_handle,
+                                    int64_t shared_us, int64_t *local_us_ptr) {
+  esp_err_t ret = ESP_OK;
+  int64_t now_us = app_clock_local_us(clock_handle);
+
+  xSemaphoreTake(clock_handle->mutex, portMAX_DELAY);
+  app_clock_peer_t *reference_peer =
+      app_clock_reference_locked(clock_handle, now_us);
+  if (reference_peer == NULL) {
+    *local_us_ptr = shared_us;
+  } else if (app_clock_trusted(reference_peer, now_us)) {
+    // the offset barely moves in the time it's off by
+    int64_t guess_us = shared_us - reference_peer->offset_us;
+    *local_us_ptr = shared_us - app_clock_offset_at(reference_peer, guess_us);
+  } else {
+    ret = ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreGive(clock_handle->mutex);
+
+  return ret;
+}
+
+esp_err_t app_clock_peer_to_local(app_clock_handle_t clock_handle,
+                                  const protocol_mac_address_t mac_address,
+                                  int64_t peer_us, int64_t *local_us_ptr) {
+  esp_err_t ret = ESP_ERR_NOT_FOUND;
+  int64_t now_us = app_clock_local_us(clock_handle);
+
+  xSemaphoreTake(clock_handle->mutex, portMAX_DELAY);
+  app_clock_peer_t *peer =
+      app_clock_peer_locked(clock_handle, mac_address, false);
+  if (peer != NULL && app_clock_trusted(peer, now_us)) {
+    // the offset barely moves in the time it's off by
+    int64_t guess_us = peer_us - peer->offset_us;
+    *local_us_ptr = peer_us - app_clock_offset_at(peer, guess_us);
+    ret = ESP_OK;
+  }
+  xSemaphoreGive(clock_handle->mutex);
+
+  return ret;
+}
+
+void app_clock_set_source(app_clock_handle_t clock_handle,
+                          app_clock_source_t source, void *ctx) {
+  clock_handle->source_ctx = ctx;
+  clock_handle->source = source;
+}
+
+static esp_err_t app_clock_metrics_init(app_clock_handle_t clock) {
+  system_metric_config_t configs[] = {
+      {"clock_samples_total", "Heartbeat exchanges timed with a peer",
+       SYSTEM_METRIC_COUNTER},
+      {"clock_round_trip_us", "Round trip of a heartbeat exchange",
+       SYSTEM_METRIC_HISTOGRAM},
+  };
+  system_metric_handle_t *handles[] = {
+      &clock->metrics.samples,
+      &clock->metrics.round_trip_us,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]), TAG,
+                        "Failed to register '%s'", configs[i].name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t app_clock_init(app_clock_handle_t *clock_handle_ptr,
+                         app_device_info_handle_t device_info_handle,
+                         app_peers_handle_t peers_handle) {
+  app_clock_handle_t clock = (app_clock_handle_t)calloc(1, sizeof(app_clock_t));
+  ESP_RETURN_ON_FALSE(clock != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to allocate clock");
+
+  clock->device_info = device_info_handle;
+  clock->mutex = xSemaphoreCreateMutex();
+  ESP_RETURN_ON_FALSE(clock->mutex != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to create clock mutex");
+
+  ESP_RETURN_ON_ERROR(app_clock_metrics_init(clock), TAG,
+                      "Failed to register metrics");
+  ESP_RETURN_ON_ERROR(app_peers_add_heartbeat_extension(
+                          peers_handle, APP_PEERS_EXTENSION_CLOCK,
+                          app_clock_extension_fill,
+                          app_clock_extension_receive, clock),
+                      TAG, "Failed to extend heartbeats");
+
+  *clock_handle_ptr = clock;
+
+  return ESP_OK;
+}
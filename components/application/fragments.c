@@ -0,0 +1,376 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <string.h>
+
+#include "application/fragments.h"
+#include "system/memory.h"
+
+static const char *BASE_TAG = "APPLICATION:FRAGMENTS";
+static const char *TASK_TAG = "APPLICATION:FRAGMENTS:TASK";
+
+static const protocol_message_type_info_t TYPE_FRAGMENT = {
+    .name = "fragment",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = PROTOCOL_MESSAGE_BODY_MAX_LENGTH,
+    .priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL,
+};
+
+static int32_t app_fragments_chunk_length(int32_t length, int32_t index) {
+  int32_t remaining = length - index * (int32_t)APP_FRAGMENTS_CHUNK_LENGTH;
+  return remaining < (int32_t)APP_FRAGMENTS_CHUNK_LENGTH
+             ? remaining
+             : (int32_t)APP_FRAGMENTS_CHUNK_LENGTH;
+}
+
+static uint64_t app_fragments_all_received(uint16_t count) {
+  return count >= 64 ? UINT64_MAX : (1ULL << count) - 1;
+}
+
+// // ----------------
+// // Sending
+// // ----------------
+
+// Stands in for the outgoing queue when a message is too long for it.
+static esp_err_t app_fragments_enqueue(protocol_message_handle_t *message_ptr,
+                                       TickType_t ticks_to_wait, void *ctx) {
+  app_fragments_handle_t fragments_handle = (app_fragments_handle_t)ctx;
+
+  if (xQueueSendToBack(fragments_handle->pending, message_ptr,
+                       ticks_to_wait) != pdPASS) {
+    return ESP_ERR_TIMEOUT;
+  }
+  *message_ptr = NULL;
+  return ESP_OK;
+}
+
+static esp_err_t app_fragments_send_one(app_fragments_handle_t fragments_handle,
+                                        protocol_message_handle_t message,
+                                        const app_fragment_header_t *header) {
+  protocol_message_handle_t fragment = NULL;
+  int32_t chunk_length =
+      app_fragments_chunk_length(header->length, header->index);
+  int32_t length = sizeof(app_fragment_header_t) + chunk_length;
+
+  ESP_RETURN_ON_ERROR(protocol_message_init(&fragment, MESSAGE_TYPE_FRAGMENT,
+                                            length,
+                                            message->header.from_mac_address,
+                                            message->header.to_mac_address),
+                      TASK_TAG, "Failed to create fragment");
+
+  // every piece goes where the whole would have
+  fragment->group = message->group;
+
+  // built in place and adopted, rather than copied once more
+  uint8_t *body = (uint8_t *)malloc(length);
+  if (body == NULL) {
+    protocol_message_free(fragment);
+    return ESP_ERR_NO_MEM;
+  }
+  memcpy(body, header, sizeof(app_fragment_header_t));
+  memcpy(body + sizeof(app_fragment_header_t),
+         message->raw.value + header->index * APP_FRAGMENTS_CHUNK_LENGTH,
+         chunk_length);
+  protocol_message_adopt_payload(fragment, body);
+
+  // Only a short queue is joined, and to the back, so whatever is already
+  // waiting (audio first) goes before it.
+  while (uxQueueMessagesWaiting(fragments_handle->queues->outgoing) >
+         APP_FRAGMENTS_OUTGOING_THRESHOLD) {
+    vTaskDelay(pdMS_TO_TICKS(APP_FRAGMENTS_INTERVAL_MS));
+  }
+  esp_err_t ret = app_queues_add_outgoing_message(
+      fragments_handle->queues, &fragment, portMAX_DELAY, false);
+  if (ret != ESP_OK) {
+    protocol_message_free(fragment);
+    return ret;
+  }
+
+  system_metrics_add(fragments_handle->metrics.sent, 1);
+  return ESP_OK;
+}
+
+static void app_fragments_send(app_fragments_handle_t fragments_handle,
+                               protocol_message_handle_t message) {
+  app_fragment_header_t header = {
+      .type = message->header.type,
+      .length = message->header.length,
+      .count = (message->header.length + APP_FRAGMENTS_CHUNK_LENGTH - 1) /
+               APP_FRAGMENTS_CHUNK_LENGTH,
+  };
+  memcpy(header.uuid, message->header.uuid, sizeof(protocol_message_uuid_t));
+
+  ESP_LOGD(TASK_TAG, "Sending type %d, %" PRId32 " bytes in %d fragments",
+           message->header.type, message->header.length, header.count);
+
+  for (header.index = 0; header.index < header.count; header.index++) {
+    if (app_fragments_send_one(fragments_handle, message, &header) != ESP_OK) {
+      // the rest would be wasted, the receiver can't use part of a message
+      ESP_LOGW(TASK_TAG, "Failed to send fragment %d of %d", header.index,
+               header.count);
+      return;
+    }
+    vTaskDelay(pdMS_TO_TICKS(APP_FRAGMENTS_INTERVAL_MS));
+  }
+}
+
+// // ----------------
+// // Reassembly
+// // ----------------
+
+static void app_fragments_release_locked(app_fragments_handle_t fragments,
+                                         app_fragments_slot_t *slot) {
+  free(slot->buffer);
+  fragments->memory -= slot->length;
+  memset(slot, 0, sizeof(app_fragments_slot_t));
+}
+
+static void app_fragments_expire_locked(app_fragments_handle_t fragments,
+                                        int64_t now_us) {
+  for (int32_t i = 0; i < APP_FRAGMENTS_SLOTS; i++) {
+    app_fragments_slot_t *slot = &fragments->slots[i];
+    if (slot->used &&
+        now_us - slot->heard_us > APP_FRAGMENTS_TIMEOUT_MS * 1000LL) {
+      ESP_LOGW(BASE_TAG, "Dropped type %d after %d of %d fragments",
+               slot->type, __builtin_popcountll(slot->received), slot->count);
+      app_fragments_release_locked(fragments, slot);
+      system_metrics_add(fragments->metrics.expired, 1);
+    }
+  }
+}
+
+static app_fragments_slot_t *
+app_fragments_slot_locked(app_fragments_handle_t fragments,
+                          protocol_message_handle_t message,
+                          const app_fragment_header_t *header) {
+  app_fragments_slot_t *free_slot = NULL;
+
+  for (int32_t i = 0; i < APP_FRAGMENTS_SLOTS; i++) {
+    app_fragments_slot_t *slot = &fragments->slots[i];
+    if (!slot->used) {
+      free_slot = free_slot != NULL ? free_slot : slot;
+      continue;
+    }
+    if (memcmp(slot->uuid, header->uuid, sizeof(protocol_message_uuid_t)) ==
+            0 &&
+        memcmp(slot->from_mac_address, message->header.from_mac_address,
+               sizeof(protocol_mac_address_t)) == 0) {
+      return slot;
+    }
+  }
+
+  if (free_slot == NULL ||
+      fragments->memory + header->length > APP_FRAGMENTS_MEMORY_MAX) {
+    return NULL;
+  }
+
+  // can be large and is only copied, so it can go in PSRAM
+  free_slot->buffer =
+      (uint8_t *)system_memory_alloc(header->length, SYSTEM_MEMORY_BULK);
+  if (free_slot->buffer == NULL) {
+    return NULL;
+  }
+
+  free_slot->used = true;
+  memcpy(free_slot->from_mac_address, message->header.from_mac_address,
+         sizeof(protocol_mac_address_t));
+  memcpy(free_slot->to_mac_address, message->header.to_mac_address,
+         sizeof(protocol_mac_address_t));
+  memcpy(free_slot->uuid, header->uuid, sizeof(protocol_message_uuid_t));
+  free_slot->type = header->type;
+  free_slot->length = header->length;
+  free_slot->count = header->count;
+  fragments->memory += header->length;
+  return free_slot;
+}
+
+static bool app_fragments_valid(const app_fragment_header_t *header,
+                                int32_t chunk_length) {
+  const protocol_message_type_info_t *info =
+      protocol_message_type_get((protocol_message_type_t)header->type);
+  if (info == NULL || header->length <= 0 ||
+      header->length > info->max_length ||
+      header->length > PROTOCOL_MESSAGE_LARGE_MAX_LENGTH) {
+    return false;
+  }
+
+  // the count, index and chunk must all agree with the length
+  int32_t count = (header->length + APP_FRAGMENTS_CHUNK_LENGTH - 1) /
+                  APP_FRAGMENTS_CHUNK_LENGTH;
+  return header->count == count && header->index < count &&
+         chunk_length ==
+             app_fragments_chunk_length(header->length, header->index);
+}
+
+// Publishes a complete message, taking the buffer.
+static void app_fragments_publish(app_fragments_handle_t fragments,
+                                  const app_fragments_slot_t *slot) {
+  protocol_message_handle_t message = NULL;
+
+  if (protocol_message_init(&message, slot->type, slot->length,
+                            (uint8_t *)slot->from_mac_address,
+                            (uint8_t *)slot->to_mac_address) != ESP_OK) {
+    free(slot->buffer);
+    return;
+  }
+  memcpy(message->header.uuid, slot->uuid, sizeof(protocol_message_uuid_t));
+
+  if (protocol_message_adopt_payload(message, slot->buffer) != ESP_OK) {
+    ESP_LOGW(BASE_TAG, "Reassembled type %d is invalid", slot->type);
+    free(slot->buffer);
+    protocol_message_free(message);
+    return;
+  }
+
+  system_metrics_add(fragments->metrics.reassembled, 1);
+  // the router takes our reference either way
+  app_router_publish(fragments->queues->incoming, &message);
+}
+
+// Runs on the UDP read task, and only copies.
+static esp_err_t app_fragments_handle_message(protocol_message_handle_t message,
+                                              void *ctx) {
+  app_fragments_handle_t fragments = (app_fragments_handle_t)ctx;
+  app_fragment_header_t header;
+  app_fragments_slot_t complete = {0};
+  int64_t now_us = esp_timer_get_time();
+
+  int32_t chunk_length =
+      message->header.length - (int32_t)sizeof(app_fragment_header_t);
+  if (chunk_length < 0) {
+    goto app_fragments_handle_message_end;
+  }
+  memcpy(&header, message->raw.value, sizeof(app_fragment_header_t));
+  if (!app_fragments_valid(&header, chunk_length)) {
+    ESP_LOGD(BASE_TAG, "Invalid fragment");
+    goto app_fragments_handle_message_end;
+  }
+
+  xSemaphoreTake(fragments->mutex, portMAX_DELAY);
+  app_fragments_expire_locked(fragments, now_us);
+
+  app_fragments_slot_t *slot =
+      app_fragments_slot_locked(fragments, message, &header);
+  if (slot == NULL) {
+    system_metrics_add(fragments->metrics.rejected, 1);
+  } else if (slot->type == header.type && slot->length == header.length) {
+    uint64_t bit = 1ULL << header.index;
+    if (!(slot->received & bit)) {
+      memcpy(slot->buffer + header.index * APP_FRAGMENTS_CHUNK_LENGTH,
+             message->raw.value + sizeof(app_fragment_header_t),
+             chunk_length);
+      slot->received |= bit;
+    }
+    slot->heard_us = now_us;
+
+    if (slot->received == app_fragments_all_received(slot->count)) {
+      // the buffer moves to the message
+      complete = *slot;
+      fragments->memory -= slot->length;
+      memset(slot, 0, sizeof(app_fragments_slot_t));
+    }
+  }
+  xSemaphoreGive(fragments->mutex);
+
+  if (complete.used) {
+    app_fragments_publish(fragments, &complete);
+  }
+
+app_fragments_handle_message_end:
+  protocol_message_free(message);
+  return ESP_OK;
+}
+
+void app_fragments_task(void *pvParameters) {
+  app_fragments_handle_t fragments = (app_fragments_handle_t)pvParameters;
+  protocol_message_handle_t message = NULL;
+
+  while (true) {
+    // wakes up at least once per timeout to drop stale reassemblies
+    if (xQueueReceive(fragments->pending, &message,
+                      pdMS_TO_TICKS(APP_FRAGMENTS_TIMEOUT_MS)) == pdPASS) {
+      app_fragments_send(fragments, message);
+      protocol_message_free(message);
+      message = NULL;
+    }
+
+    xSemaphoreTake(fragments->mutex, portMAX_DELAY);
+    app_fragments_expire_locked(fragments, esp_timer_get_time());
+    xSemaphoreGive(fragments->mutex);
+  }
+}
+
+static esp_err_t app_fragments_metrics_init(app_fragments_handle_t fragments) {
+  system_metric_config_t configs[] = {
+      {"fragments_sent_total", "Fragments of large messages sent",
+       SYSTEM_METRIC_COUNTER},
+      {"fragments_reassembled_total", "Large messages put back together",
+       SYSTEM_METRIC_COUNTER},
+      {"fragments_expired_total",
+       "Large messages dropped while missing fragments", SYSTEM_METRIC_COUNTER},
+      {"fragments_rejected_total",
+       "Fragments with no room to be reassembled", SYSTEM_METRIC_COUNTER},
+  };
+  system_metric_handle_t *handles[] = {
+      &fragments->metrics.sent,
+      &fragments->metrics.reassembled,
+      &fragments->metrics.expired,
+      &fragments->metrics.rejected,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]),
+                        BASE_TAG, "Failed to register '%s'", configs[i].name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t app_fragments_init(app_fragments_handle_t *fragments_handle_ptr,
+                             app_queues_handle_t queues_handle) {
+  app_fragments_handle_t fragments =
+      (app_fragments_handle_t)calloc(1, sizeof(app_fragments_t));
+  ESP_RETURN_ON_FALSE(fragments != NULL, ESP_ERR_NO_MEM, BASE_TAG,
+                      "Failed to allocate fragments");
+
+  fragments->queues = queues_handle;
+  fragments->mutex = xSemaphoreCreateMutex();
+  ESP_RETURN_ON_FALSE(fragments->mutex != NULL, ESP_ERR_NO_MEM, BASE_TAG,
+                      "Failed to create fragments mutex");
+  fragments->pending = xQueueCreate(APP_FRAGMENTS_PENDING_DEPTH,
+                                    sizeof(protocol_message_handle_t));
+  ESP_RETURN_ON_FALSE(fragments->pending != NULL, ESP_ERR_NO_MEM, BASE_TAG,
+                      "Failed to create pending queue");
+
+  ESP_RETURN_ON_ERROR(app_fragments_metrics_init(fragments), BASE_TAG,
+                      "Failed to register metrics");
+  ESP_RETURN_ON_ERROR(
+      protocol_message_type_register(MESSAGE_TYPE_FRAGMENT, &TYPE_FRAGMENT),
+      BASE_TAG, "Failed to register fragment");
+
+  app_router_subscriber_config_t subscriber_config = {
+      .name = "fragments",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_FRAGMENT)},
+      .handler = app_fragments_handle_message,
+      .handler_ctx = fragments,
+  };
+  ESP_RETURN_ON_ERROR(app_router_subscribe(queues_handle->incoming,
+                                           &fragments->subscriber,
+                                           &subscriber_config),
+                      BASE_TAG, "Failed to subscribe to fragments");
+
+  ESP_RETURN_ON_FALSE(
+      system_tasks_create(app_fragments_task, TASK_TAG,
+                          APP_FRAGMENTS_TASK_STACK_DEPTH, fragments,
+                          APP_FRAGMENTS_TASK_PRIORITY, APP_FRAGMENTS_TASK_CORE,
+                          &fragments->task) == pdPASS,
+      ESP_ERR_NO_MEM, BASE_TAG, "Failed to create fragments task");
+
+  // last, so nothing is handed over before the task exists
+  app_queues_set_large_handler(queues_handle, app_fragments_enqueue,
+                               fragments);
+
+  *fragments_handle_ptr = fragments;
+
+  return ESP_OK;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "application/device_info.h"
+#include "application/peers.h"
+#include "protocols/mac.h"
+#include "protocols/messages.h"
+#include "system/metrics.h"
+
+// Peers whose clocks are followed, the least recently heard is forgotten.
+#define APP_CLOCK_PEERS 16
+// exchanges kept per peer, the window the offset and rate are fitted over
+#define APP_CLOCK_SAMPLES 32
+// Exchanges before a peer's clock is trusted. Fewer are fitted too loosely
+// for rooms to play a page within a millisecond of each other.
+#define APP_CLOCK_SAMPLES_MIN 8
+// An exchange whose round trip is this much slower than the quickest kept
+// counts half as much. A slow round trip was likely held up one way more
+// than the other, and half the difference is error.
+#define APP_CLOCK_DELAY_SLACK_US 1000
+// the rate is only fitted over exchanges this far apart, before that the
+// last one is kept
+#define APP_CLOCK_SPAN_MIN_S 5
+// peers a heartbeat answers, the rest wait for the next
+#define APP_CLOCK_ECHOES_MAX 5
+
+// Maps `esp_timer_get_time()` to this station's clock. The host simulator
+// gives each station its own crystal with it, see `tools/simulator`.
+typedef int64_t (*app_clock_source_t)(int64_t timer_us, void *ctx);
+
+// One exchange with a peer, in our clock.
+typedef struct app_clock_sample_t {
+  // halfway between our heartbeat leaving and their answer arriving
+  int64_t at_us;
+  // their clock less ours
+  int64_t offset_us;
+  int32_t delay_us;
+} app_clock_sample_t;
+
+typedef struct app_clock_peer_t {
+  bool used;
+  protocol_mac_address_t mac_address;
+  // our clock, to pick one to forget and to stop trusting quiet ones
+  int64_t heard_us;
+  // their last heartbeat's timestamp and when it got here, echoed back on
+  // our next one
+  int64_t sent_us;
+  int64_t received_us;
+  bool pending;
+
+  int32_t sample_count;
+  int32_t sample_next;
+  app_clock_sample_t samples[APP_CLOCK_SAMPLES];
+  // their clock less ours is `offset_us` at `at_us`, changing by `rate_ppm`
+  int64_t at_us;
+  int64_t offset_us;
+  double rate_ppm;
+} app_clock_peer_t;
+
+// A shared timebase, NTP style, on the heartbeats. Each heartbeat carries
+// when it was sent, and echoes the last heartbeat heard from a few peers
+// with how long it was held. Whoever sent the echoed heartbeat now has all
+// four timestamps of an exchange, so it knows the round trip and the
+// peers' clock offset from it, as long as the trip took as long both ways.
+// Exchanges are filtered to the quickest round trips, and a line is fitted
+// through them, so the crystals' rates are followed between heartbeats.
+//
+// The shared clock is the clock of the lowest MAC address among us and the
+// peers we follow, so every station picks the same one. It jumps when a
+// lower station joins.
+typedef struct app_clock_t {
+  app_device_info_handle_t device_info;
+  app_clock_source_t source;
+  void *source_ctx;
+
+  // guards the peers, used by both heartbeat tasks
+  SemaphoreHandle_t mutex;
+  app_clock_peer_t peers[APP_CLOCK_PEERS];
+  // where the next heartbeat starts looking for peers to echo
+  int32_t echo_next;
+
+  struct {
+    system_metric_handle_t samples;
+    system_metric_handle_t round_trip_us;
+  } metrics;
+} app_clock_t;
+
+typedef app_clock_t *app_clock_handle_t;
+
+esp_err_t app_clock_init(app_clock_handle_t *clock_handle_ptr,
+                         app_device_info_handle_t device_info_handle,
+                         app_peers_handle_t peers_handle);
+// Set before the first heartbeat, NULL is `esp_timer_get_time()` as is.
+void app_clock_set_source(app_clock_handle_t clock_handle,
+                          app_clock_source_t source, void *ctx);
+
+// our own clock now
+int64_t app_clock_local_us(app_clock_handle_t clock_handle);
+// Our clock at `timer_us`, like a message's `received_us`.
+int64_t app_clock_local_at(app_clock_handle_t clock_handle, int64_t timer_us);
+// `local_us` on the shared clock. `synced_ptr`, if given, is false while
+// the station it follows isn't trusted yet, and the local time is returned.
+int64_t app_clock_shared_at(app_clock_handle_t clock_handle, int64_t local_us,
+                            bool *synced_ptr);
+// The other way, a time on the shared clock on ours.
+// `ESP_ERR_INVALID_STATE` while the station it follows isn't trusted yet.
+esp_err_t app_clock_shared_to_local(app_clock_handle_t clock_handle,
+                                    int64_t shared_us, int64_t *local_us_ptr);
+// A time on a peer's clock, like its UUID timestamps, on ours. Returns
+// `ESP_ERR_NOT_FOUND` until the peer is trusted.
+esp_err_t app_clock_peer_to_local(app_clock_handle_t clock_handle,
+                                  const protocol_mac_address_t mac_address,
+                                  int64_t peer_us, int64_t *local_us_ptr);
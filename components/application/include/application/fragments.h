@@ -0,0 +1,105 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "application/queues.h"
+#include "application/router.h"
+#include "protocols/mac.h"
+#include "protocols/messages.h"
+#include "system/metrics.h"
+#include "system/tasks.h"
+
+#define APP_FRAGMENTS_TASK_PRIORITY 1
+#define APP_FRAGMENTS_TASK_STACK_DEPTH (1024 * 3)
+#define APP_FRAGMENTS_TASK_CORE SYSTEM_TASKS_CORE_ANY
+
+// large messages waiting to be sent
+#define APP_FRAGMENTS_PENDING_DEPTH 4
+// A fragment is only queued while the outgoing queue holds at most this
+// many messages, so audio never waits behind a transfer...
+#define APP_FRAGMENTS_OUTGOING_THRESHOLD 1
+// ...and at most one per interval, about 230KB/s
+#define APP_FRAGMENTS_INTERVAL_MS 5
+
+// messages being reassembled at once
+#define APP_FRAGMENTS_SLOTS 4
+// all of the reassembly buffers together
+#define APP_FRAGMENTS_MEMORY_MAX (96 * 1024)
+// a message still missing fragments after this long is dropped
+#define APP_FRAGMENTS_TIMEOUT_MS 3000
+
+// Sent as is, before each fragment's part of the body.
+typedef struct app_fragment_header_t {
+  // the whole message's, each fragment has its own
+  protocol_message_uuid_t uuid;
+  int32_t type;
+  int32_t length;
+  uint16_t index;
+  uint16_t count;
+} app_fragment_header_t;
+
+// every fragment but the last is full
+#define APP_FRAGMENTS_CHUNK_LENGTH                                             \
+  (PROTOCOL_MESSAGE_BODY_MAX_LENGTH - sizeof(app_fragment_header_t))
+// one bit each in `received`
+#define APP_FRAGMENTS_MAX_COUNT 64
+_Static_assert(PROTOCOL_MESSAGE_LARGE_MAX_LENGTH <=
+                   APP_FRAGMENTS_CHUNK_LENGTH * APP_FRAGMENTS_MAX_COUNT,
+               "the largest message needs too many fragments");
+
+typedef struct app_fragments_slot_t {
+  bool used;
+  protocol_mac_address_t from_mac_address;
+  protocol_mac_address_t to_mac_address;
+  protocol_message_uuid_t uuid;
+  protocol_message_type_t type;
+  int32_t length;
+  uint16_t count;
+  uint64_t received;
+  uint8_t *buffer;
+  // our clock, when the last fragment arrived
+  int64_t heard_us;
+} app_fragments_slot_t;
+
+// Splits messages longer than a datagram into fragments, and puts them back
+// together on the other side. Senders don't need to know: large messages
+// given to `app_queues_add_outgoing_message` come here, and reassembled ones
+// are published to the incoming router like any other.
+//
+// Fragments are sent by a low priority task, paced against the outgoing
+// queue. A lost fragment loses the whole message, with at most
+// `APP_FRAGMENTS_SLOTS` messages and `APP_FRAGMENTS_MEMORY_MAX` bytes held
+// while waiting for the rest.
+typedef struct app_fragments_t {
+  // large messages, sent one at a time
+  QueueHandle_t pending;
+  TaskHandle_t task;
+
+  // guards the slots, fragments arrive on the UDP read task
+  SemaphoreHandle_t mutex;
+  app_fragments_slot_t slots[APP_FRAGMENTS_SLOTS];
+  int32_t memory;
+
+  app_router_subscriber_handle_t subscriber;
+  app_queues_handle_t queues;
+
+  struct {
+    system_metric_handle_t sent;
+    system_metric_handle_t reassembled;
+    // still missing fragments after the timeout
+    system_metric_handle_t expired;
+    // didn't fit in the slots or the memory cap
+    system_metric_handle_t rejected;
+  } metrics;
+} app_fragments_t;
+
+typedef app_fragments_t *app_fragments_handle_t;
+
+esp_err_t app_fragments_init(app_fragments_handle_t *fragments_handle_ptr,
+                             app_queues_handle_t queues_handle);
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "application/device_info.h"
+#include "application/queues.h"
+#include "application/router.h"
+#include "application/session.h"
+#include "protocols/mac.h"
+#include "storage/memos.h"
+#include "system/metrics.h"
+#include "system/tasks.h"
+
+// Flash writes wait behind everything else, the subscriber queue absorbs
+// them.
+#define APP_MEMOS_RECORDER_TASK_PRIORITY 1
+#define APP_MEMOS_RECORDER_TASK_STACK_DEPTH (1024 * 3)
+#define APP_MEMOS_RECORDER_TASK_CORE SYSTEM_TASKS_CORE_ANY
+// paces frames like a talker would
+#define APP_MEMOS_PLAYER_TASK_PRIORITY 3
+#define APP_MEMOS_PLAYER_TASK_STACK_DEPTH (1024 * 3)
+#define APP_MEMOS_PLAYER_TASK_CORE SYSTEM_TASKS_CORE_ANY
+
+// Frames waiting to be recorded, about a second and a half at 20ms. Frames
+// that don't fit are dropped from the memo, never from the speaker.
+#define APP_MEMOS_QUEUE_DEPTH 64
+// memos waiting to be played
+#define APP_MEMOS_REQUESTS_DEPTH 4
+// audio from the same sender after a gap this long is a new memo
+#define APP_MEMOS_GAP_MS 2000
+// with no audio for this long, the collected frames are written and the
+// runway is erased a sector at a time
+#define APP_MEMOS_IDLE_MS 250
+// Longer memos are stopped here. The runway is kept long enough to record
+// one this long at `STORAGE_SETTING_AUDIO_BITRATE` without erasing.
+#define APP_MEMOS_LENGTH_MAX_S 60
+
+// Records audio addressed to us into `storage/memos`, and plays it back on
+// request. Each run of audio from one sender is a memo. Only the talker
+// with the floor is recorded, so overlapping talkers don't end up in one
+// memo.
+//
+// Recording never touches the playback path: frames reach the recorder
+// through a router queue that drops when it's full, and flash is only
+// written by the recorder task. Played back frames are published to the
+// incoming router with `PROTOCOL_MESSAGE_FLAG_MEMO`, as if their sender were
+// talking.
+typedef struct app_memos_t {
+  storage_memos_handle_t store;
+  app_device_info_handle_t device_info;
+  app_queues_handle_t queues;
+  app_session_handle_t session;
+  app_router_subscriber_handle_t subscriber;
+
+  struct {
+    TaskHandle_t recorder;
+    TaskHandle_t player;
+  } tasks;
+  // memo ids, played one at a time
+  QueueHandle_t requests;
+  // only used by the player, too big for its stack
+  storage_memos_cursor_t cursor;
+
+  struct {
+    system_metric_handle_t recorded;
+    system_metric_handle_t played;
+    // frames the store refused, the partition is failing
+    system_metric_handle_t failed;
+    // memos stopped short, too long or the runway ran out
+    system_metric_handle_t stopped;
+  } metrics;
+} app_memos_t;
+
+typedef app_memos_t *app_memos_handle_t;
+
+// `ESP_ERR_NOT_FOUND` if there's no memos partition.
+esp_err_t app_memos_init(app_memos_handle_t *memos_handle_ptr,
+                         app_device_info_handle_t device_info_handle,
+                         app_queues_handle_t queues_handle,
+                         app_session_handle_t session_handle);
+
+// Copies up to `max_memos` of the recorded memos, oldest first. Returns how
+// many.
+int32_t app_memos_list(app_memos_handle_t memos_handle, storage_memo_t *memos,
+                       int32_t max_memos);
+
+// Queues a memo to be played. `ESP_ERR_NOT_FOUND` if it was overwritten,
+// `ESP_ERR_NO_MEM` if too many are queued already.
+esp_err_t app_memos_play(app_memos_handle_t memos_handle, uint32_t memo);
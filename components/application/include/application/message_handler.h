@@ -7,14 +7,20 @@
 #include "application/device_info.h"
 #include "application/peers.h"
 #include "application/queues.h"
+#include "system/tasks.h"
 
 #define PROTOCOL_MESSAGE_HANDLER_TASK_PRIORITY 3
+#define PROTOCOL_MESSAGE_HANDLER_TASK_CORE SYSTEM_TASKS_CORE_REALTIME
 #define PROTOCOL_MESSAGE_HANDLER_TASK_STACK_DEPTH 1024 * 4
 
+// texts shouldn't be lost, so the UDP read task waits this long for room
+#define PROTOCOL_MESSAGE_HANDLER_BLOCK_MS 5
+
 typedef struct protocol_message_handler_t {
   app_peers_handle_t peers;
   app_queues_handle_t queues;
   app_device_info_handle_t device_info;
+  app_router_subscriber_handle_t texts;
   struct {
     TaskHandle_t handler;
   } tasks;
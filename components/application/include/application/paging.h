@@ -0,0 +1,94 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdint.h>
+
+#include "application/clock.h"
+#include "application/device_info.h"
+#include "application/queues.h"
+#include "application/router.h"
+#include "system/metrics.h"
+#include "system/tasks.h"
+
+// a frame released late is heard late, so it runs with audio
+#define APP_PAGING_PLAYER_TASK_PRIORITY SYSTEM_TASKS_PRIORITY_AUDIO
+#define APP_PAGING_PLAYER_TASK_STACK_DEPTH (1024 * 3)
+#define APP_PAGING_PLAYER_TASK_CORE SYSTEM_TASKS_CORE_REALTIME
+
+// How long after capture every station plays a frame. Covers the trip, its
+// jitter and the shared clock's error. A frame later than this is dropped
+// rather than played out of step with the other rooms. A room in power save
+// only hears multicast at each DTIM beacon, 102.4ms apart, until the first
+// frames wake it up, so the page's start waits that out.
+#define APP_PAGING_LEAD_MS 120
+// frames waiting for their time, enough for the lead at 5ms frames
+#define APP_PAGING_SLOTS 32
+// pages waiting to be scheduled
+#define APP_PAGING_QUEUE_DEPTH 8
+// Every page starts with when to play it, on the shared clock. Big-endian,
+// like the UUID.
+#define APP_PAGING_PRESENTATION_LENGTH 8
+
+typedef struct app_paging_slot_t {
+  // NULL when free
+  protocol_message_handle_t page;
+  // the `esp_timer_get_time()` to play it at
+  int64_t due_us;
+} app_paging_slot_t;
+
+// All-call. Audio broadcast as `MESSAGE_TYPE_PAGE` carries a presentation
+// time on the shared clock (`application/clock`), a fixed lead after it was
+// captured, and every station plays it at that time instead of as soon as
+// it arrives. Rooms then play the same frame within the shared clock's
+// error of each other, instead of echoing one another by however long each
+// one's network and buffer took.
+//
+// A frame is played by publishing it to the incoming router as
+// `MESSAGE_TYPE_AUDIO` with `PROTOCOL_MESSAGE_FLAG_PAGED`, at its time. Its
+// UUID is the page's, so it is the same frame on every station. A page to
+// one zone is sent to the zone's multicast group, see `network/udp`.
+typedef struct app_paging_t {
+  app_device_info_handle_t device_info;
+  app_queues_handle_t queues;
+  app_clock_handle_t clock;
+  app_router_subscriber_handle_t subscriber;
+
+  // Ours, the next frame's presentation time. Frames follow each other
+  // exactly on the shared clock, unless capture drifts half a frame away.
+  int64_t next_us;
+
+  // only used by the player
+  app_paging_slot_t slots[APP_PAGING_SLOTS];
+  // wakes the player for a frame that's due within a tick or two, which is
+  // too coarse to wait for
+  esp_timer_handle_t timer;
+  TaskHandle_t player;
+
+  struct {
+    system_metric_handle_t sent;
+    system_metric_handle_t played;
+    // arrived after their time, or with no shared clock to place them on
+    system_metric_handle_t late;
+    // arrived with every slot taken
+    system_metric_handle_t overflowed;
+    // how long after its time each frame was released
+    system_metric_handle_t release_us;
+  } metrics;
+} app_paging_t;
+
+typedef app_paging_t *app_paging_handle_t;
+
+esp_err_t app_paging_init(app_paging_handle_t *paging_handle_ptr,
+                          app_device_info_handle_t device_info_handle,
+                          app_queues_handle_t queues_handle,
+                          app_clock_handle_t clock_handle);
+
+// Broadcasts a captured frame to every station in `zone`, 0 is the whole
+// house. Called by the capture task once per frame
+// (`STORAGE_SETTING_AUDIO_FRAME_MS`). `ESP_ERR_INVALID_STATE` until the
+// shared clock is synced, since nobody could place the frame.
+esp_err_t app_paging_send(app_paging_handle_t paging_handle, uint32_t zone,
+                          const uint8_t *audio, int32_t length);
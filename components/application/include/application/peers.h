@@ -7,30 +7,88 @@
 #include "application/device_info.h"
 #include "application/queues.h"
 #include "protocols/mac.h"
+#include "protocols/messages.h"
+#include "system/tasks.h"
 
-#define APP_PEERS_TASK_PRIORITY_HEARTBEAT 3
+// housekeeping, a heartbeat a few ms late changes nothing
+#define APP_PEERS_TASK_PRIORITY_HEARTBEAT 2
+#define APP_PEERS_TASK_CORE_HEARTBEAT SYSTEM_TASKS_CORE_ANY
 #define APP_PEERS_TASK_STACK_DEPTH_HEARTBEAT (1024 * 4)
 
-#define APP_PEERS_PRUNE_INTERVAL_MS 60000 // 1 minute
-#define APP_PEERS_HEARTBEAT_INTERVAL_MS 10000
-#define APP_PEERS_HEARTBEAT_INIT_INTERVAL_MS 1000
-#define APP_PEERS_HEARTBEAT_WAIT_MAX_MS (APP_PEERS_PRUNE_INTERVAL_MS / 2)
+// only the latest heartbeats matter, older ones are dropped when this is full
+#define APP_PEERS_HEARTBEAT_QUEUE_DEPTH 8
+
+// names longer than this are cut short by `app_peers_copy`
+#define APP_PEERS_NAME_LENGTH 32
+// each extension's own bytes, and how many can ride on one heartbeat
+#define APP_PEERS_EXTENSION_MAX_LENGTH 64
+#define APP_PEERS_EXTENSIONS_MAX 4
+// A peer is asked for its table at most this often, so two stations that
+// keep disagreeing, say because one can't hear a third, don't keep trading
+// them.
+#define APP_PEERS_REQUEST_INTERVAL_MS 30000
+
+// The prune and heartbeat intervals are runtime settings, see
+// `storage/settings.h`.
 
 // This is a linked list of peers.
 typedef struct app_peer_t {
   protocol_mac_address_t mac_address;
+  // empty until its name is heard, its hash is of the name it has
   char *name;
+  uint32_t name_hash;
+  // Heard from directly, or through another station's table with however
+  // long ago that station heard from it, so tables passing a station
+  // around don't keep it alive once nobody hears it.
   int32_t last_heartbeat_ms;
+  // when we last asked it for its table
+  int32_t requested_ms;
   struct app_peer_t *next_peer;
 } app_peer_t;
 
 typedef app_peer_t *app_peer_handle_t;
 
+// A copy of a peer that doesn't need freeing.
+typedef struct app_peer_info_t {
+  protocol_mac_address_t mac_address;
+  char name[APP_PEERS_NAME_LENGTH];
+  int32_t last_heartbeat_ms;
+} app_peer_info_t;
+
+// Each extension is sent after our name as its tag, its length and its
+// bytes, so stations skip the ones they don't know. Adding one: give it a
+// tag here, then register it with `app_peers_add_heartbeat_extension`.
+typedef enum app_peers_extension_tag_t {
+  // who has the floor, see `application/session`
+  APP_PEERS_EXTENSION_FLOOR = 1,
+  // timestamps for a shared clock, see `application/clock`
+  APP_PEERS_EXTENSION_CLOCK = 2,
+  // our name's hash and a digest of who we know, see `app_peers_t`
+  APP_PEERS_EXTENSION_VIEW = 3,
+} app_peers_extension_tag_t;
+
+// Lets another module ride on the heartbeats. `fill` writes up to
+// `APP_PEERS_EXTENSION_MAX_LENGTH` bytes and returns how many, none sends
+// nothing. `receive` gets each peer's back, with the heartbeat it came on.
+// Both run on the heartbeat tasks.
+typedef int32_t (*app_peers_extension_fill_t)(uint8_t *buffer, void *ctx);
+typedef void (*app_peers_extension_receive_t)(
+    protocol_message_handle_t heartbeat, const uint8_t *extension,
+    int32_t length, void *ctx);
+
 typedef struct app_peers_list_t {
   app_peer_handle_t head;
   SemaphoreHandle_t mutex;
 } app_peers_list_t;
 
+// Heartbeats only carry our name while we announce ourselves, after that
+// just its hash, and a digest of every station we know (us included) with
+// its name's hash. A station whose view of the house disagrees with a
+// bigger one, or that doesn't know the name behind a hash, asks that peer
+// for its table (`MESSAGE_TYPE_PEERS`). The table has every station the
+// peer knows, with names and how long ago each was heard. A newcomer gets
+// one unasked from the lowest MAC address that hears it announce itself,
+// so it knows the whole house a round trip after its first heartbeat.
 typedef struct app_peers_t {
   app_peers_list_t list;
   struct {
@@ -39,6 +97,22 @@ typedef struct app_peers_t {
   } tasks;
   app_device_info_handle_t device_info;
   app_queues_handle_t queues;
+  app_router_subscriber_handle_t heartbeats;
+  struct {
+    app_peers_extension_tag_t tag;
+    app_peers_extension_fill_t fill;
+    app_peers_extension_receive_t receive;
+    void *ctx;
+  } extensions[APP_PEERS_EXTENSIONS_MAX];
+  int32_t extension_count;
+  struct {
+    system_metric_handle_t peers;
+    // each heartbeat's datagram, header included
+    system_metric_handle_t heartbeat_bytes;
+    system_metric_handle_t tables_sent;
+    // peers we first heard of in another station's table
+    system_metric_handle_t learned;
+  } metrics;
 } app_peers_t;
 
 typedef app_peers_t *app_peers_handle_t;
@@ -47,10 +121,21 @@ esp_err_t app_peers_init(app_peers_handle_t *peers_handle_ptr,
                          app_device_info_handle_t device_info_handle,
                          app_queues_handle_t queues_handle);
 
+// Adds the peer, or marks it heard. An empty name keeps the one it has.
 esp_err_t app_peers_add(app_peers_handle_t peers_handle,
                         protocol_mac_address_t mac_address, char *name);
 void app_peers_find(app_peers_handle_t peers_handle,
                     app_peer_handle_t *peer_handle_ptr,
                     protocol_mac_address_t mac_address, bool should_lock);
 int32_t app_peers_count(app_peers_handle_t peers_handle);
-void app_peer_free(app_peer_handle_t peer_handle);
\ No newline at end of file
+// Copies up to `max_peers` into `peers` without allocating, for readers that
+// mustn't hold the list lock for long. Returns how many were copied.
+int32_t app_peers_copy(app_peers_handle_t peers_handle, app_peer_info_t *peers,
+                       int32_t max_peers);
+void app_peer_free(app_peer_handle_t peer_handle);
+
+// Register during init, before the first heartbeat goes out.
+esp_err_t app_peers_add_heartbeat_extension(
+    app_peers_handle_t peers_handle, app_peers_extension_tag_t tag,
+    app_peers_extension_fill_t fill, app_peers_extension_receive_t receive,
+    void *ctx);
\ No newline at end of file
@@ -4,23 +4,38 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 
+#include "application/router.h"
 #include "protocols/messages.h"
+#include "system/metrics.h"
+
+// Takes a message too long for one datagram, like
+// `app_queues_add_outgoing_message`. See `application/fragments`.
+typedef esp_err_t (*app_queues_large_handler_t)(
+    protocol_message_handle_t *message_ptr, TickType_t ticks_to_wait,
+    void *ctx);
+
+// Given a reference to every reliable message as it's first queued, which it
+// keeps. See `application/reliable`.
+typedef void (*app_queues_reliable_handler_t)(protocol_message_handle_t message,
+                                              void *ctx);
 
-// unknown messages are dropped.
-// audio messages are processed differently.
 typedef struct app_queues_t {
   // This contains a pointer to a message.
   // Readers must free the message after use.
   // Writers must not interact with the message after writing.
   QueueHandle_t outgoing;
-  // This contains a pointer to a message.
-  // Readers must free the message after use.
-  // Writers must not interact with the message after writing.
-  QueueHandle_t incoming_heartbeat;
-  // This contains a pointer to a message.
-  // Readers must free the message after use.
-  // Writers must not interact with the message after writing.
-  QueueHandle_t incoming_text;
+  // Consumers subscribe to the types they want during init.
+  app_router_handle_t incoming;
+  // NULL refuses large messages
+  app_queues_large_handler_t large_handler;
+  void *large_handler_ctx;
+  // NULL sends reliable messages like any other
+  app_queues_reliable_handler_t reliable_handler;
+  void *reliable_handler_ctx;
+  struct {
+    system_metric_handle_t outgoing_high_water;
+    system_metric_handle_t outgoing_full;
+  } metrics;
 } app_queues_t;
 
 typedef app_queues_t *app_queues_handle_t;
@@ -37,11 +52,12 @@ app_queues_add_outgoing_message(app_queues_handle_t queues_handle,
                                 protocol_message_handle_t *message_ptr,
                                 TickType_t ticks_to_wait, bool send_to_front);
 
-esp_err_t app_queues_receive_incoming_message(
-    app_queues_handle_t queues_handle, protocol_message_handle_t *message_ptr,
-    protocol_message_type_t type, TickType_t ticks_to_wait);
-
-esp_err_t
-app_queues_add_incoming_message(app_queues_handle_t queues_handle,
-                                protocol_message_handle_t *message_ptr,
-                                TickType_t ticks_to_wait);
\ No newline at end of file
+// Messages longer than `PROTOCOL_MESSAGE_BODY_MAX_LENGTH` are handed to this
+// instead of the outgoing queue. Set during init.
+void app_queues_set_large_handler(app_queues_handle_t queues_handle,
+                                  app_queues_large_handler_t handler,
+                                  void *ctx);
+// Set during init.
+void app_queues_set_reliable_handler(app_queues_handle_t queues_handle,
+                                     app_queues_reliable_handler_t handler,
+                                     void *ctx);
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "application/device_info.h"
+#include "application/queues.h"
+#include "application/router.h"
+#include "protocols/mac.h"
+#include "protocols/messages.h"
+#include "system/metrics.h"
+#include "system/tasks.h"
+
+// a retransmission a few ms late changes nothing
+#define APP_RELIABLE_TASK_PRIORITY 2
+#define APP_RELIABLE_TASK_STACK_DEPTH (1024 * 3)
+#define APP_RELIABLE_TASK_CORE SYSTEM_TASKS_CORE_ANY
+// how often the retransmit and summary timers are checked
+#define APP_RELIABLE_TICK_MS 10
+
+// Messages waiting for an ACK or being summarised. Reliable messages sent
+// while they're all in use go out best-effort.
+#define APP_RELIABLE_SLOTS 16
+// an addressed message is given up after this many retransmissions
+#define APP_RELIABLE_MAX_RETRANSMITS 5
+// a broadcast is summarised this many times, each wait twice the last
+#define APP_RELIABLE_SUMMARIES 3
+
+// The retransmit timeout follows RFC 6298: the smoothed RTT plus four times
+// its variation, doubled after every timeout. Until a peer has been
+// measured it's the initial one.
+#define APP_RELIABLE_RTO_INITIAL_MS 300
+#define APP_RELIABLE_RTO_MIN_MS 40
+#define APP_RELIABLE_RTO_MAX_MS 3000
+
+// Peers whose RTT and recent reliable messages are kept, the least recently
+// heard is forgotten.
+#define APP_RELIABLE_PEERS 16
+// reliable messages remembered per peer, to drop duplicates
+#define APP_RELIABLE_SEEN 32
+
+// an ACK, NACK or summary lists at most this many messages
+#define APP_RELIABLE_LIST_MAX APP_RELIABLE_SLOTS
+
+// One message in an ACK. The attempt is echoed, so every ACK is an RTT
+// sample, even for a retransmission.
+typedef struct app_reliable_ack_t {
+  protocol_message_uuid_t uuid;
+  uint16_t attempt;
+} app_reliable_ack_t;
+
+typedef struct app_reliable_slot_t {
+  bool used;
+  protocol_message_handle_t message;
+  bool broadcast;
+  // of the last send
+  uint16_t attempt;
+  int64_t queued_us;
+  int64_t sent_us;
+  // the next retransmission or summary
+  int64_t deadline_us;
+  // backed off from the peer's, for this message only
+  int64_t rto_us;
+  int32_t summaries;
+} app_reliable_slot_t;
+
+typedef struct app_reliable_peer_t {
+  bool used;
+  protocol_mac_address_t mac_address;
+  // our clock, to pick one to forget
+  int64_t heard_us;
+  // 0 until the first sample
+  int64_t srtt_us;
+  int64_t rttvar_us;
+  int64_t rto_us;
+  int32_t seen_count;
+  int32_t seen_next;
+  protocol_message_uuid_t seen[APP_RELIABLE_SEEN];
+} app_reliable_peer_t;
+
+// Opt-in delivery for messages that mustn't be lost, like texts. Senders set
+// `PROTOCOL_MESSAGE_FLAG_RELIABLE` and queue the message as usual, everything
+// else stays best-effort, audio included. Only messages that fit in one
+// datagram are tracked.
+//
+// An addressed message is ACKed by its destination and retransmitted until it
+// is, at most `APP_RELIABLE_MAX_RETRANSMITS` times. ACKing every broadcast
+// would have every station answer at once, so instead the sender broadcasts
+// summaries of the UUIDs it recently sent, and receivers NACK the ones they
+// missed. Retransmissions keep the UUID and count up `attempt`, and receivers
+// drop the duplicates.
+typedef struct app_reliable_t {
+  app_device_info_handle_t device_info;
+  app_queues_handle_t queues;
+  TaskHandle_t task;
+  app_router_subscriber_handle_t subscriber;
+
+  // guards the slots and the peers, used by the UDP read task too
+  SemaphoreHandle_t mutex;
+  app_reliable_slot_t slots[APP_RELIABLE_SLOTS];
+  app_reliable_peer_t peers[APP_RELIABLE_PEERS];
+
+  struct {
+    system_metric_handle_t acked;
+    system_metric_handle_t failed;
+    system_metric_handle_t retransmits;
+    // sent best-effort, every slot was in use
+    system_metric_handle_t untracked;
+    system_metric_handle_t duplicates;
+    // from being queued to being ACKed, retransmissions included
+    system_metric_handle_t ack_us;
+  } metrics;
+} app_reliable_t;
+
+typedef app_reliable_t *app_reliable_handle_t;
+
+esp_err_t app_reliable_init(app_reliable_handle_t *reliable_handle_ptr,
+                            app_device_info_handle_t device_info_handle,
+                            app_queues_handle_t queues_handle);
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include <stdatomic.h>
+
+#include "protocols/mac.h"
+#include "protocols/messages.h"
+#include "system/metrics.h"
+
+#define APP_ROUTER_MAX_SUBSCRIBERS 8
+
+#define APP_ROUTER_TYPE_BIT(type) (1 << (type))
+
+typedef enum app_router_overflow_t {
+  // the message being published is dropped for this subscriber
+  APP_ROUTER_OVERFLOW_DROP_NEWEST = 0,
+  // the oldest queued message is dropped to make room
+  APP_ROUTER_OVERFLOW_DROP_OLDEST = 1,
+  // the publisher waits up to `block_ticks`, then drops the new message
+  APP_ROUTER_OVERFLOW_BLOCK = 2,
+} app_router_overflow_t;
+
+// Takes its own reference to the message when it returns `ESP_OK`. Runs on the
+// publishing task, so it must not block.
+typedef esp_err_t (*app_router_handler_t)(protocol_message_handle_t message,
+                                          void *ctx);
+
+// Sees every published message before any subscriber. Returning false means
+// it took care of the message, which is dropped. Runs on the publishing task,
+// so it must not block.
+typedef bool (*app_router_gate_t)(protocol_message_handle_t message,
+                                  void *ctx);
+
+typedef struct app_router_filter_t {
+  // `APP_ROUTER_TYPE_BIT`s of the types to receive
+  uint32_t types;
+  // only match one sender
+  bool match_from;
+  protocol_mac_address_t from_mac_address;
+  // only match one destination (can be the broadcast address)
+  bool match_to;
+  protocol_mac_address_t to_mac_address;
+} app_router_filter_t;
+
+typedef struct app_router_subscriber_config_t {
+  const char *name;
+  app_router_filter_t filter;
+  app_router_overflow_t overflow;
+  TickType_t block_ticks;
+  // a queue of this depth is created when there's no handler
+  uint32_t queue_depth;
+  app_router_handler_t handler;
+  void *handler_ctx;
+} app_router_subscriber_config_t;
+
+typedef struct app_router_subscriber_t {
+  const char *name;
+  app_router_filter_t filter;
+  app_router_overflow_t overflow;
+  TickType_t block_ticks;
+  // This contains a pointer to a message shared with other subscribers.
+  // Readers must free (unref) the message after use and must not modify it.
+  QueueHandle_t queue;
+  // Only when the filter takes both normal and high priority types. High
+  // priority messages wait here instead, and are read first. `pending`
+  // counts the messages in both, so readers can wait on either.
+  QueueHandle_t priority_queue;
+  SemaphoreHandle_t pending;
+  app_router_handler_t handler;
+  void *handler_ctx;
+  // labelled with the subscriber's name
+  struct {
+    system_metric_handle_t delivered;
+    system_metric_handle_t dropped;
+    system_metric_handle_t queue_high_water;
+  } metrics;
+} app_router_subscriber_t;
+
+typedef app_router_subscriber_t *app_router_subscriber_handle_t;
+
+typedef struct app_router_t {
+  // Only appended to, so publishers can read it without locking.
+  app_router_subscriber_handle_t subscribers[APP_ROUTER_MAX_SUBSCRIBERS];
+  atomic_int_fast32_t subscriber_count;
+  // union of every subscriber's `filter.types`
+  atomic_uint_fast32_t types;
+  // serializes subscribing
+  SemaphoreHandle_t mutex;
+  // NULL lets everything through
+  app_router_gate_t gate;
+  void *gate_ctx;
+} app_router_t;
+
+typedef app_router_t *app_router_handle_t;
+
+esp_err_t app_router_init(app_router_handle_t *router_handle_ptr);
+
+// Subscriptions are permanent, and are expected to be made during init.
+esp_err_t
+app_router_subscribe(app_router_handle_t router_handle,
+                     app_router_subscriber_handle_t *subscriber_handle_ptr,
+                     const app_router_subscriber_config_t *config);
+
+// Whether any subscriber wants this type. Lets receivers drop a datagram
+// before decoding it.
+bool app_router_has_subscribers(app_router_handle_t router_handle,
+                                protocol_message_type_t type);
+
+// Only one, set during init like the subscriptions.
+void app_router_set_gate(app_router_handle_t router_handle,
+                         app_router_gate_t gate, void *ctx);
+
+// Delivers the message to every matching subscriber without copying it.
+// Always takes the caller's reference and sets their pointer to NULL. Returns
+// `ESP_ERR_NOT_FOUND` if no subscriber got it, a message stopped by the gate
+// counts as delivered.
+esp_err_t app_router_publish(app_router_handle_t router_handle,
+                             protocol_message_handle_t *message_ptr);
+
+// If successful, the caller holds a reference and must free it. Otherwise, the
+// caller's pointer will be set to NULL. Messages of the same priority come
+// out in the order they were published, high priority ones first.
+esp_err_t app_router_receive(app_router_subscriber_handle_t subscriber_handle,
+                             protocol_message_handle_t *message_ptr,
+                             TickType_t ticks_to_wait);
+
+// Messages waiting for a queue subscriber.
+uint32_t app_router_waiting(app_router_subscriber_handle_t subscriber_handle);
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdbool.h>
+
+#include "application/device_info.h"
+#include "application/peers.h"
+#include "application/queues.h"
+#include "protocols/mac.h"
+#include "protocols/messages.h"
+#include "system/metrics.h"
+
+// While someone has the floor, they repeat a grant this often so stations
+// that missed the start (or just joined) catch up.
+#define APP_SESSION_ANNOUNCE_MS 1000
+// a talker not heard from for this long has lost the floor
+#define APP_SESSION_TALKER_TIMEOUT_MS 3000
+
+// Sent as is, the payload of every floor control message.
+typedef struct app_session_floor_t {
+  protocol_mac_address_t talker;
+  // the UUID of the talker's TALK_START
+  protocol_message_uuid_t talk_id;
+} app_session_floor_t;
+
+// Called when the floor changes hands. `floor` is NULL when it's free, `ours`
+// is true when we have it. We can lose the floor without releasing it, so
+// capture must stop whenever `ours` goes false.
+typedef void (*app_session_listener_t)(const app_session_floor_t *floor,
+                                       bool ours, void *ctx);
+
+// Floor control for push-to-talk. Talkers don't wait for permission: the
+// first syllable goes out with the TALK_START, and every station resolves
+// starts that collide the same way, without a coordinator. Starts within one
+// audio frame (`STORAGE_SETTING_AUDIO_FRAME_MS`) of each other are a
+// collision, and the lowest MAC address wins. MACs rather than UUID
+// timestamps, since stations don't share a clock. A start after that is
+// denied by the talker.
+typedef struct app_session_t {
+  // guards everything below it
+  SemaphoreHandle_t mutex;
+  bool held;
+  app_session_floor_t floor;
+  // our clock, when we saw the floor taken and last heard from the talker
+  int64_t taken_us;
+  int64_t heard_us;
+  // our own talk is past its collision window
+  bool confirmed;
+  // The last station heard talking first hand, until it stops. Another
+  // station's heartbeat only hands us a floor this backs up, it may not
+  // have heard the talker stop.
+  struct {
+    protocol_mac_address_t talker;
+    int64_t heard_us;
+  } direct;
+
+  // fires at the end of the collision window, then every announce interval
+  esp_timer_handle_t announce_timer;
+  app_session_listener_t listener;
+  void *listener_ctx;
+
+  app_router_subscriber_handle_t messages;
+  app_device_info_handle_t device_info;
+  app_queues_handle_t queues;
+  app_peers_handle_t peers;
+
+  struct {
+    // our presses that got the floor, and those refused locally
+    system_metric_handle_t talks;
+    system_metric_handle_t refused;
+    // starts that arrived inside another's collision window
+    system_metric_handle_t collisions;
+    // times we lost the floor to another station
+    system_metric_handle_t preempted;
+  } metrics;
+} app_session_t;
+
+typedef app_session_t *app_session_handle_t;
+
+esp_err_t app_session_init(app_session_handle_t *session_handle_ptr,
+                           app_device_info_handle_t device_info_handle,
+                           app_queues_handle_t queues_handle,
+                           app_peers_handle_t peers_handle);
+
+// Set before the first talk.
+void app_session_set_listener(app_session_handle_t session_handle,
+                              app_session_listener_t listener, void *ctx);
+
+// Takes the floor and announces it. Returns at once, `ESP_OK` means capture
+// can start now. `ESP_ERR_INVALID_STATE` if someone else is talking.
+esp_err_t app_session_talk_start(app_session_handle_t session_handle);
+// Releases the floor if we have it.
+void app_session_talk_stop(app_session_handle_t session_handle);
+
+// Whether audio from this station should be played. Audio also keeps its
+// sender's floor alive, and takes a free floor when the start was lost.
+bool app_session_accepts_audio(app_session_handle_t session_handle,
+                               const protocol_mac_address_t from_mac_address);
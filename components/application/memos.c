@@ -0,0 +1,274 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <string.h>
+
+#include "application/memos.h"
+#include "storage/settings.h"
+#include "system/memory.h"
+#include "system/trace.h"
+
+static const char *BASE_TAG = "APPLICATION:MEMOS";
+static const char *RECORDER_TAG = "APPLICATION:MEMOS:RECORDER";
+static const char *PLAYER_TAG = "APPLICATION:MEMOS:PLAYER";
+
+// // ----------------
+// // Recorder
+// // ----------------
+
+// Sectors to keep erased, enough for the longest memo at the current
+// bitrate.
+static int32_t app_memos_runway(void) {
+  uint32_t frame_ms = storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS);
+  uint32_t bitrate = storage_settings_get_u32(STORAGE_SETTING_AUDIO_BITRATE);
+  return storage_memos_runway_for(APP_MEMOS_LENGTH_MAX_S * 1000 / frame_ms,
+                                  (int32_t)(bitrate / 8 * frame_ms / 1000));
+}
+
+void app_memos_recorder_task(void *pvParameters) {
+  app_memos_handle_t memos = (app_memos_handle_t)pvParameters;
+  protocol_message_handle_t message = NULL;
+  protocol_mac_address_t from_mac_address = {0};
+  bool recording = false;
+  // the rest of the memo is dropped, until a new one starts
+  bool stopped = false;
+  bool collected = false;
+  uint32_t memo = 0;
+  int64_t started_us = 0;
+  int64_t heard_us = 0;
+  esp_err_t ret = ESP_OK;
+
+  while (true) {
+    if (app_router_receive(memos->subscriber, &message,
+                           pdMS_TO_TICKS(APP_MEMOS_IDLE_MS)) != ESP_OK) {
+      // quiet, a good time to stall the flash
+      if (collected) {
+        storage_memos_flush(memos->store);
+        collected = false;
+      } else {
+        storage_memos_prepare(memos->store, app_memos_runway());
+      }
+      continue;
+    }
+
+    // Playback, or someone talking over whoever has the floor. The floor
+    // takes audio from a talker whose start was lost.
+    if ((message->header.flags & PROTOCOL_MESSAGE_FLAG_MEMO) ||
+        !app_session_accepts_audio(memos->session,
+                                   message->header.from_mac_address)) {
+      goto app_memos_recorder_task_next;
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    if (!recording ||
+        memcmp(from_mac_address, message->header.from_mac_address,
+               sizeof(protocol_mac_address_t)) != 0 ||
+        now_us - heard_us > (int64_t)APP_MEMOS_GAP_MS * 1000) {
+      memcpy(from_mac_address, message->header.from_mac_address,
+             sizeof(protocol_mac_address_t));
+      recording = true;
+      stopped = false;
+      started_us = now_us;
+      ret = storage_memos_begin(
+          memos->store, from_mac_address,
+          storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS), &memo);
+      if (ret != ESP_OK) {
+        // the same run of audio isn't retried on every frame
+        stopped = true;
+        system_metrics_add(ret == ESP_ERR_NO_MEM ? memos->metrics.stopped
+                                                 : memos->metrics.failed,
+                           1);
+      } else {
+        system_metrics_add(memos->metrics.recorded, 1);
+        ESP_LOGD(RECORDER_TAG,
+                 "Recording memo %" PRIu32
+                 " from %02X:%02X:%02X:%02X:%02X:%02X",
+                 memo, from_mac_address[0], from_mac_address[1],
+                 from_mac_address[2], from_mac_address[3], from_mac_address[4],
+                 from_mac_address[5]);
+      }
+    }
+    heard_us = now_us;
+    if (stopped) {
+      goto app_memos_recorder_task_next;
+    }
+
+    // Too long, or out of runway. The memo stops rather than erase a sector
+    // mid-call, which would stall the flash for tens of ms.
+    ret = ESP_ERR_NO_MEM;
+    if (now_us - started_us <= (int64_t)APP_MEMOS_LENGTH_MAX_S * 1000000) {
+      ret = storage_memos_append(memos->store, memo, message->audio.value,
+                                 message->header.length);
+    }
+    if (ret == ESP_OK) {
+      collected = true;
+    } else if (ret == ESP_ERR_NO_MEM) {
+      stopped = true;
+      system_metrics_add(memos->metrics.stopped, 1);
+    } else {
+      system_metrics_add(memos->metrics.failed, 1);
+    }
+
+  app_memos_recorder_task_next:
+    protocol_message_free(message);
+    message = NULL;
+  }
+}
+
+// // ----------------
+// // Player
+// // ----------------
+
+static void app_memos_play_one(app_memos_handle_t memos, uint32_t memo) {
+  storage_memos_cursor_t *cursor = &memos->cursor;
+  protocol_message_handle_t message = NULL;
+  const uint8_t *frame = NULL;
+  int32_t length = 0;
+
+  if (storage_memos_open(memos->store, memo, cursor) != ESP_OK) {
+    ESP_LOGW(PLAYER_TAG, "Memo %" PRIu32 " is gone", memo);
+    return;
+  }
+  TickType_t frame_ticks = pdMS_TO_TICKS(cursor->frame_ms);
+  if (frame_ticks == 0) {
+    frame_ticks = 1;
+  }
+
+  system_metrics_add(memos->metrics.played, 1);
+  TickType_t wake = xTaskGetTickCount();
+  while (storage_memos_next_frame(memos->store, cursor, &frame, &length) ==
+         ESP_OK) {
+    if (protocol_message_init_audio(&message, (uint8_t *)frame, length,
+                                    cursor->from_mac_address,
+                                    memos->device_info->mac_address) !=
+        ESP_OK) {
+      break;
+    }
+    message->header.flags |= PROTOCOL_MESSAGE_FLAG_MEMO;
+    SYSTEM_TRACE(SYSTEM_TRACE_AUDIO_PLAYOUT, message->header.uuid);
+    // the router takes our reference either way
+    app_router_publish(memos->queues->incoming, &message);
+
+    vTaskDelayUntil(&wake, frame_ticks);
+  }
+}
+
+void app_memos_player_task(void *pvParameters) {
+  app_memos_handle_t memos = (app_memos_handle_t)pvParameters;
+  uint32_t memo = 0;
+
+  while (true) {
+    if (xQueueReceive(memos->requests, &memo, portMAX_DELAY) == pdPASS) {
+      app_memos_play_one(memos, memo);
+    }
+  }
+}
+
+// // ----------------
+// // API
+// // ----------------
+
+int32_t app_memos_list(app_memos_handle_t memos_handle, storage_memo_t *memos,
+                       int32_t max_memos) {
+  return storage_memos_list(memos_handle->store, memos, max_memos);
+}
+
+esp_err_t app_memos_play(app_memos_handle_t memos_handle, uint32_t memo) {
+  storage_memo_t found;
+
+  ESP_RETURN_ON_ERROR(storage_memos_get(memos_handle->store, memo, &found),
+                      BASE_TAG, "No memo %" PRIu32, memo);
+  return xQueueSendToBack(memos_handle->requests, &memo, 0) == pdPASS
+             ? ESP_OK
+             : ESP_ERR_NO_MEM;
+}
+
+static esp_err_t app_memos_metrics_init(app_memos_handle_t memos) {
+  system_metric_config_t configs[] = {
+      {"memos_recorded_total", "Memos recorded", SYSTEM_METRIC_COUNTER},
+      {"memos_played_total", "Memos played back", SYSTEM_METRIC_COUNTER},
+      {"memos_failed_total", "Memos and frames that couldn't be recorded",
+       SYSTEM_METRIC_COUNTER},
+      {"memos_stopped_total",
+       "Memos stopped short, too long or out of erased flash",
+       SYSTEM_METRIC_COUNTER},
+  };
+  system_metric_handle_t *handles[] = {
+      &memos->metrics.recorded,
+      &memos->metrics.played,
+      &memos->metrics.failed,
+      &memos->metrics.stopped,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]),
+                        BASE_TAG, "Failed to register '%s'", configs[i].name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t app_memos_init(app_memos_handle_t *memos_handle_ptr,
+                         app_device_info_handle_t device_info_handle,
+                         app_queues_handle_t queues_handle,
+                         app_session_handle_t session_handle) {
+  storage_memos_handle_t store = NULL;
+  esp_err_t ret = storage_memos_init(&store);
+  if (ret == ESP_ERR_NOT_FOUND) {
+    return ret;
+  }
+  ESP_RETURN_ON_ERROR(ret, BASE_TAG, "Failed to open the memo store");
+
+  // the cursor is only read by the player, off the message path
+  app_memos_handle_t memos = (app_memos_handle_t)system_memory_calloc(
+      1, sizeof(app_memos_t), SYSTEM_MEMORY_BULK);
+  ESP_RETURN_ON_FALSE(memos != NULL, ESP_ERR_NO_MEM, BASE_TAG,
+                      "Failed to allocate memos");
+
+  memos->store = store;
+  memos->device_info = device_info_handle;
+  memos->queues = queues_handle;
+  memos->session = session_handle;
+  memos->requests = xQueueCreate(APP_MEMOS_REQUESTS_DEPTH, sizeof(uint32_t));
+  ESP_RETURN_ON_FALSE(memos->requests != NULL, ESP_ERR_NO_MEM, BASE_TAG,
+                      "Failed to create requests queue");
+
+  ESP_RETURN_ON_ERROR(app_memos_metrics_init(memos), BASE_TAG,
+                      "Failed to register metrics");
+
+  app_router_subscriber_config_t subscriber_config = {
+      .name = "memos",
+      .filter =
+          {
+              .types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_AUDIO),
+              .match_to = true,
+          },
+      .overflow = APP_ROUTER_OVERFLOW_DROP_NEWEST,
+      .queue_depth = APP_MEMOS_QUEUE_DEPTH,
+  };
+  memcpy(subscriber_config.filter.to_mac_address,
+         device_info_handle->mac_address, sizeof(protocol_mac_address_t));
+  ESP_RETURN_ON_ERROR(app_router_subscribe(queues_handle->incoming,
+                                           &memos->subscriber,
+                                           &subscriber_config),
+                      BASE_TAG, "Failed to subscribe to audio");
+
+  ESP_RETURN_ON_FALSE(
+      system_tasks_create(app_memos_recorder_task, RECORDER_TAG,
+                          APP_MEMOS_RECORDER_TASK_STACK_DEPTH, memos,
+                          APP_MEMOS_RECORDER_TASK_PRIORITY,
+                          APP_MEMOS_RECORDER_TASK_CORE,
+                          &memos->tasks.recorder) == pdPASS,
+      ESP_ERR_NO_MEM, BASE_TAG, "Failed to create recorder task");
+  ESP_RETURN_ON_FALSE(
+      system_tasks_create(app_memos_player_task, PLAYER_TAG,
+                          APP_MEMOS_PLAYER_TASK_STACK_DEPTH, memos,
+                          APP_MEMOS_PLAYER_TASK_PRIORITY,
+                          APP_MEMOS_PLAYER_TASK_CORE,
+                          &memos->tasks.player) == pdPASS,
+      ESP_ERR_NO_MEM, BASE_TAG, "Failed to create player task");
+
+  *memos_handle_ptr = memos;
+
+  return ESP_OK;
+}
@@ -3,6 +3,8 @@
 
 #include "application/message_handler.h"
 #include "protocols/messages.h"
+#include "storage/settings.h"
+#include "system/trace.h"
 
 static const char *MESSAGE_HANDLER_TAG = "APPLICATION:MESSAGE_HANDLER";
 
@@ -13,9 +15,8 @@ void protocol_message_handler_task(void *pvParameters) {
   app_peer_handle_t peer_handle = NULL;
 
   while (1) {
-    if (app_queues_receive_incoming_message(
-            message_handler->queues, &message_incoming, MESSAGE_TYPE_TEXT,
-            portMAX_DELAY) != ESP_OK) {
+    if (app_router_receive(message_handler->texts, &message_incoming,
+                           portMAX_DELAY) != ESP_OK) {
       ESP_LOGE(MESSAGE_HANDLER_TAG, "Failed to receive text from queue");
       vTaskDelay(pdMS_TO_TICKS(15));
       continue;
@@ -37,6 +38,7 @@ void protocol_message_handler_task(void *pvParameters) {
                NETWORK_MESSAGE_BROADCAST_MAC_ADDRESS,
                sizeof(protocol_mac_address_t)) != 0) {
       ESP_LOGI(MESSAGE_HANDLER_TAG, "Message is not for me, skipping");
+      SYSTEM_TRACE(SYSTEM_TRACE_HANDLE, message_incoming->header.uuid);
       protocol_message_free(message_incoming);
       message_incoming = NULL;
       continue;
@@ -57,6 +59,7 @@ void protocol_message_handler_task(void *pvParameters) {
     // will need better logic here in the future.
     ESP_LOGI(MESSAGE_HANDLER_TAG, "%s\n", message_incoming->text.value);
 
+    SYSTEM_TRACE(SYSTEM_TRACE_HANDLE, message_incoming->header.uuid);
     protocol_message_free(message_incoming);
     message_incoming = NULL;
   }
@@ -77,11 +80,27 @@ esp_err_t protocol_message_handler_init(
   message_handler->queues = queues_handle;
   message_handler->device_info = device_info_handle;
 
+  app_router_subscriber_config_t texts_config = {
+      .name = "message_handler",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_TEXT)},
+      .overflow = APP_ROUTER_OVERFLOW_BLOCK,
+      .block_ticks = pdMS_TO_TICKS(PROTOCOL_MESSAGE_HANDLER_BLOCK_MS),
+      .queue_depth =
+          storage_settings_get_u32(STORAGE_SETTING_QUEUE_DEPTH_INCOMING),
+  };
+  esp_err_t ret = app_router_subscribe(
+      queues_handle->incoming, &message_handler->texts, &texts_config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
   message_handler->tasks.handler = NULL;
-  if (xTaskCreate(protocol_message_handler_task, MESSAGE_HANDLER_TAG,
-                  PROTOCOL_MESSAGE_HANDLER_TASK_STACK_DEPTH, message_handler,
-                  PROTOCOL_MESSAGE_HANDLER_TASK_PRIORITY,
-                  &message_handler->tasks.handler) != pdPASS) {
+  if (system_tasks_create(protocol_message_handler_task, MESSAGE_HANDLER_TAG,
+                          PROTOCOL_MESSAGE_HANDLER_TASK_STACK_DEPTH,
+                          message_handler,
+                          PROTOCOL_MESSAGE_HANDLER_TASK_PRIORITY,
+                          PROTOCOL_MESSAGE_HANDLER_TASK_CORE,
+                          &message_handler->tasks.handler) != pdPASS) {
     return ESP_ERR_NO_MEM;
   }
   if (message_handler->tasks.handler == NULL) {
@@ -0,0 +1,297 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include <string.h>
+
+#include "application/paging.h"
+#include "storage/settings.h"
+#include "system/trace.h"
+
+static const char *TAG = "APPLICATION:PAGING";
+
+static const protocol_message_type_info_t TYPE_PAGE = {
+    .name = "page",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = PROTOCOL_MESSAGE_BODY_MAX_LENGTH,
+    .priority = PROTOCOL_MESSAGE_PRIORITY_HIGH,
+};
+
+// Frames due sooner than this are waited for on the timer, ticks are too
+// coarse.
+#define APP_PAGING_TIMER_US (2000LL * portTICK_PERIOD_MS)
+
+static void app_paging_put(uint8_t *buffer, uint64_t value) {
+  for (int32_t i = APP_PAGING_PRESENTATION_LENGTH - 1; i >= 0; i--) {
+    buffer[i] = (uint8_t)value;
+    value >>= 8;
+  }
+}
+
+static uint64_t app_paging_get(const uint8_t *buffer) {
+  uint64_t value = 0;
+  for (int32_t i = 0; i < APP_PAGING_PRESENTATION_LENGTH; i++) {
+    value = (value << 8) | buffer[i];
+  }
+  return value;
+}
+
+// // ----------------
+// // Sender
+// // ----------------
+
+esp_err_t app_paging_send(app_paging_handle_t paging_handle, uint32_t zone,
+                          const uint8_t *audio, int32_t length) {
+  int32_t max_length =
+      PROTOCOL_MESSAGE_BODY_MAX_LENGTH - APP_PAGING_PRESENTATION_LENGTH;
+  ESP_RETURN_ON_FALSE(length > 0 && length <= max_length, ESP_ERR_INVALID_SIZE,
+                      TAG, "Frame too long to page");
+
+  bool synced = false;
+  int64_t shared_us = app_clock_shared_at(
+      paging_handle->clock, app_clock_local_us(paging_handle->clock), &synced);
+  if (!synced) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Frames are played back to back, so the next one follows on from the last
+  // rather than from when it was captured. After a pause, or once our crystal
+  // has drifted half a frame, the timeline starts again from now.
+  int64_t frame_us =
+      (int64_t)storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) * 1000;
+  int64_t presentation_us = shared_us + APP_PAGING_LEAD_MS * 1000LL;
+  int64_t error_us = paging_handle->next_us - presentation_us;
+  if (error_us < frame_us / 2 && error_us > -frame_us / 2) {
+    presentation_us = paging_handle->next_us;
+  }
+  paging_handle->next_us = presentation_us + frame_us;
+
+  protocol_message_handle_t message = NULL;
+  ESP_RETURN_ON_ERROR(
+      protocol_message_init(&message, MESSAGE_TYPE_PAGE,
+                            APP_PAGING_PRESENTATION_LENGTH + length,
+                            paging_handle->device_info->mac_address, NULL),
+      TAG, "Failed to create page");
+  uint8_t *body =
+      (uint8_t *)malloc(APP_PAGING_PRESENTATION_LENGTH + (size_t)length);
+  if (body == NULL) {
+    protocol_message_free(message);
+    return ESP_ERR_NO_MEM;
+  }
+  app_paging_put(body, (uint64_t)presentation_us);
+  memcpy(body + APP_PAGING_PRESENTATION_LENGTH, audio, length);
+  esp_err_t ret = protocol_message_adopt_payload(message, body);
+  if (ret != ESP_OK) {
+    free(body);
+    protocol_message_free(message);
+    return ret;
+  }
+  // only the zone's stations joined its group, the rest never get it
+  message->group = protocol_group_zone(zone);
+  SYSTEM_TRACE(SYSTEM_TRACE_AUDIO_CAPTURE, message->header.uuid);
+
+  // a frame that waits misses its time everywhere, so never wait
+  ret = app_queues_add_outgoing_message(paging_handle->queues, &message, 0,
+                                        false);
+  if (ret != ESP_OK) {
+    protocol_message_free(message);
+    return ret;
+  }
+  system_metrics_add(paging_handle->metrics.sent, 1);
+  return ESP_OK;
+}
+
+// // ----------------
+// // Player
+// // ----------------
+
+static void app_paging_timer_callback(void *arg) {
+  app_paging_handle_t paging = (app_paging_handle_t)arg;
+  xTaskNotifyGive(paging->player);
+}
+
+// Places a page on our timer, or drops it if its time has gone.
+static void app_paging_schedule(app_paging_handle_t paging,
+                                protocol_message_handle_t page) {
+  int64_t presentation_us = 0;
+  int64_t local_us = 0;
+
+  if (page->header.length <= APP_PAGING_PRESENTATION_LENGTH ||
+      memcmp(page->header.from_mac_address, paging->device_info->mac_address,
+             sizeof(protocol_mac_address_t)) == 0) {
+    protocol_message_free(page);
+    return;
+  }
+  presentation_us = (int64_t)app_paging_get(page->raw.value);
+  if (app_clock_shared_to_local(paging->clock, presentation_us, &local_us) !=
+      ESP_OK) {
+    system_metrics_add(paging->metrics.late, 1);
+    protocol_message_free(page);
+    return;
+  }
+
+  // our clock and the timer only part by ppm over the lead, which is nothing
+  int64_t now_us = esp_timer_get_time();
+  int64_t due_us = now_us + (local_us - app_clock_local_at(paging->clock,
+                                                           now_us));
+  if (due_us < now_us) {
+    system_metrics_add(paging->metrics.late, 1);
+    protocol_message_free(page);
+    return;
+  }
+
+  for (int32_t i = 0; i < APP_PAGING_SLOTS; i++) {
+    if (paging->slots[i].page == NULL) {
+      paging->slots[i].page = page;
+      paging->slots[i].due_us = due_us;
+      return;
+    }
+  }
+  system_metrics_add(paging->metrics.overflowed, 1);
+  protocol_message_free(page);
+}
+
+static app_paging_slot_t *app_paging_next(app_paging_handle_t paging) {
+  app_paging_slot_t *next = NULL;
+  for (int32_t i = 0; i < APP_PAGING_SLOTS; i++) {
+    app_paging_slot_t *slot = &paging->slots[i];
+    if (slot->page != NULL && (next == NULL || slot->due_us < next->due_us)) {
+      next = slot;
+    }
+  }
+  return next;
+}
+
+static void app_paging_release(app_paging_handle_t paging,
+                               app_paging_slot_t *slot) {
+  protocol_message_handle_t page = slot->page;
+  protocol_message_handle_t message = NULL;
+
+  slot->page = NULL;
+  system_metrics_observe(paging->metrics.release_us,
+                         (uint32_t)(esp_timer_get_time() - slot->due_us));
+
+  if (protocol_message_init_audio(
+          &message, page->raw.value + APP_PAGING_PRESENTATION_LENGTH,
+          page->header.length - APP_PAGING_PRESENTATION_LENGTH,
+          page->header.from_mac_address, page->header.to_mac_address) ==
+      ESP_OK) {
+    memcpy(message->header.uuid, page->header.uuid,
+           sizeof(protocol_message_uuid_t));
+    message->header.flags |= PROTOCOL_MESSAGE_FLAG_PAGED;
+    // the page's UUID, so the sender's capture lines up with it
+    SYSTEM_TRACE(SYSTEM_TRACE_AUDIO_PLAYOUT, message->header.uuid);
+    // the router takes our reference either way
+    app_router_publish(paging->queues->incoming, &message);
+    system_metrics_add(paging->metrics.played, 1);
+  }
+  protocol_message_free(page);
+}
+
+void app_paging_player_task(void *pvParameters) {
+  app_paging_handle_t paging = (app_paging_handle_t)pvParameters;
+  protocol_message_handle_t page = NULL;
+
+  while (true) {
+    app_paging_slot_t *next = app_paging_next(paging);
+    TickType_t wait = portMAX_DELAY;
+
+    if (next != NULL) {
+      int64_t until_us = next->due_us - esp_timer_get_time();
+      if (until_us <= APP_PAGING_TIMER_US) {
+        // pages arriving meanwhile wait in the queue, they're due later
+        if (until_us > 0) {
+          esp_timer_start_once(paging->timer, until_us);
+          ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        app_paging_release(paging, next);
+        continue;
+      }
+      wait = pdMS_TO_TICKS((until_us - APP_PAGING_TIMER_US) / 1000) + 1;
+    }
+
+    if (app_router_receive(paging->subscriber, &page, wait) == ESP_OK) {
+      app_paging_schedule(paging, page);
+      page = NULL;
+    }
+  }
+}
+
+// // ----------------
+// // API
+// // ----------------
+
+static esp_err_t app_paging_metrics_init(app_paging_handle_t paging) {
+  system_metric_config_t configs[] = {
+      {"paging_sent_total", "All-call frames sent", SYSTEM_METRIC_COUNTER},
+      {"paging_played_total", "All-call frames played at their time",
+       SYSTEM_METRIC_COUNTER},
+      {"paging_late_total", "All-call frames that missed their time",
+       SYSTEM_METRIC_COUNTER},
+      {"paging_overflowed_total", "All-call frames with no slot to wait in",
+       SYSTEM_METRIC_COUNTER},
+      {"paging_release_us", "How late an all-call frame was played",
+       SYSTEM_METRIC_HISTOGRAM},
+  };
+  system_metric_handle_t *handles[] = {
+      &paging->metrics.sent,       &paging->metrics.played,
+      &paging->metrics.late,       &paging->metrics.overflowed,
+      &paging->metrics.release_us,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]), TAG,
+                        "Failed to register '%s'", configs[i].name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t app_paging_init(app_paging_handle_t *paging_handle_ptr,
+                          app_device_info_handle_t device_info_handle,
+                          app_queues_handle_t queues_handle,
+                          app_clock_handle_t clock_handle) {
+  app_paging_handle_t paging =
+      (app_paging_handle_t)calloc(1, sizeof(app_paging_t));
+  ESP_RETURN_ON_FALSE(paging != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to allocate paging");
+
+  paging->device_info = device_info_handle;
+  paging->queues = queues_handle;
+  paging->clock = clock_handle;
+
+  ESP_RETURN_ON_ERROR(app_paging_metrics_init(paging), TAG,
+                      "Failed to register metrics");
+  ESP_RETURN_ON_ERROR(
+      protocol_message_type_register(MESSAGE_TYPE_PAGE, &TYPE_PAGE), TAG,
+      "Failed to register page");
+
+  esp_timer_create_args_t timer_args = {
+      .callback = app_paging_timer_callback,
+      .arg = paging,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "paging",
+  };
+  ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &paging->timer), TAG,
+                      "Failed to create paging timer");
+
+  app_router_subscriber_config_t subscriber_config = {
+      .name = "paging",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_PAGE)},
+      .overflow = APP_ROUTER_OVERFLOW_DROP_OLDEST,
+      .queue_depth = APP_PAGING_QUEUE_DEPTH,
+  };
+  ESP_RETURN_ON_ERROR(app_router_subscribe(queues_handle->incoming,
+                                           &paging->subscriber,
+                                           &subscriber_config),
+                      TAG, "Failed to subscribe to pages");
+
+  ESP_RETURN_ON_FALSE(
+      system_tasks_create(app_paging_player_task, TAG,
+                          APP_PAGING_PLAYER_TASK_STACK_DEPTH, paging,
+                          APP_PAGING_PLAYER_TASK_PRIORITY,
+                          APP_PAGING_PLAYER_TASK_CORE,
+                          &paging->player) == pdPASS,
+      ESP_ERR_NO_MEM, TAG, "Failed to create player task");
+
+  *paging_handle_ptr = paging;
+
+  return ESP_OK;
+}
@@ -4,16 +4,288 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include <stdio.h>
 #include <string.h>
 
 #include "application/peers.h"
 #include "protocols/messages.h"
+#include "storage/settings.h"
+#include "system/trace.h"
 
 // static const char *BASE_TAG = "APPLICATION:PEERS";
 static const char *PEERS_HB_SEND_TASK_TAG = "APPLICATION:PEERS:HB_SENDTASK";
 static const char *PEERS_HB_RECEIVE_TASK_TAG =
     "APPLICATION:PEERS:HB_RECEIVETASK";
 
+// A table message starts with which it is. A request is nothing else, a
+// table is an entry per station: its MAC, how many ms ago it was heard, the
+// length of its name and the name. Big-endian, like the UUID.
+#define APP_PEERS_TABLE_REQUEST 0
+#define APP_PEERS_TABLE_REPLY 1
+#define APP_PEERS_ENTRY_LENGTH (sizeof(protocol_mac_address_t) + 5)
+// our name's hash, how many stations we know and their digest
+#define APP_PEERS_VIEW_LENGTH 9
+
+#define APP_PEERS_HASH_START 2166136261u
+
+static const protocol_message_type_info_t TYPE_PEERS = {
+    .name = "peers",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = PROTOCOL_MESSAGE_BODY_MAX_LENGTH,
+    .priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL,
+};
+
+static void app_peers_put_u32(uint8_t *buffer, uint32_t value) {
+  buffer[0] = (uint8_t)(value >> 24);
+  buffer[1] = (uint8_t)(value >> 16);
+  buffer[2] = (uint8_t)(value >> 8);
+  buffer[3] = (uint8_t)value;
+}
+
+static uint32_t app_peers_get_u32(const uint8_t *buffer) {
+  return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) |
+         ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+// FNV-1a
+static uint32_t app_peers_hash(uint32_t hash, const uint8_t *bytes,
+                               size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t app_peers_name_hash(const char *name) {
+  return app_peers_hash(APP_PEERS_HASH_START, (const uint8_t *)name,
+                        strlen(name));
+}
+
+// One station's part of a view's digest. Mixed, since the parts are XORed
+// and FNV's last bytes barely reach its high bits.
+static uint32_t app_peers_entry_hash(const protocol_mac_address_t mac_address,
+                                     uint32_t name_hash) {
+  uint8_t name_hash_bytes[4];
+  app_peers_put_u32(name_hash_bytes, name_hash);
+  uint32_t hash = app_peers_hash(APP_PEERS_HASH_START, mac_address,
+                                 sizeof(protocol_mac_address_t));
+  hash = app_peers_hash(hash, name_hash_bytes, sizeof(name_hash_bytes));
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static bool app_peers_is_ours(app_peers_handle_t peers_handle,
+                              const protocol_mac_address_t mac_address) {
+  return memcmp(mac_address, peers_handle->device_info->mac_address,
+                sizeof(protocol_mac_address_t)) == 0;
+}
+
+static app_peer_handle_t
+app_peers_lookup_locked(app_peers_handle_t peers_handle,
+                        const protocol_mac_address_t mac_address) {
+  app_peer_handle_t current_peer = peers_handle->list.head;
+  while (current_peer != NULL &&
+         memcmp(current_peer->mac_address, mac_address,
+                sizeof(protocol_mac_address_t)) != 0) {
+    current_peer = current_peer->next_peer;
+  }
+  return current_peer;
+}
+
+// Adds the peer, or marks it heard at `heard_ms` unless it was heard later.
+// An empty name keeps the one it has. Returns NULL if it couldn't be added.
+static app_peer_handle_t
+app_peers_heard_locked(app_peers_handle_t peers_handle,
+                       const protocol_mac_address_t mac_address,
+                       const char *name, int32_t heard_ms, bool *added_ptr) {
+  app_peer_handle_t peer = app_peers_lookup_locked(peers_handle, mac_address);
+  *added_ptr = false;
+
+  if (peer == NULL) {
+    peer = (app_peer_handle_t)malloc(sizeof(app_peer_t));
+    if (peer == NULL) {
+      return NULL;
+    }
+    peer->name = strdup("");
+    if (peer->name == NULL) {
+      free(peer);
+      return NULL;
+    }
+    memcpy(peer->mac_address, mac_address, sizeof(protocol_mac_address_t));
+    peer->name_hash = app_peers_name_hash("");
+    peer->last_heartbeat_ms = heard_ms;
+    // so the first disagreement is asked about at once
+    peer->requested_ms = heard_ms - APP_PEERS_REQUEST_INTERVAL_MS;
+    peer->next_peer = peers_handle->list.head;
+    peers_handle->list.head = peer;
+    system_metrics_add(peers_handle->metrics.peers, 1);
+    *added_ptr = true;
+  } else if ((int32_t)((uint32_t)heard_ms -
+                       (uint32_t)peer->last_heartbeat_ms) > 0) {
+    peer->last_heartbeat_ms = heard_ms;
+  }
+
+  if (name[0] != '\0' && strcmp(name, peer->name) != 0) {
+    char *copy = strdup(name);
+    if (copy != NULL) {
+      free(peer->name);
+      peer->name = copy;
+      peer->name_hash = app_peers_name_hash(name);
+    }
+  }
+  return peer;
+}
+
+// Us and everyone we know, as a count and the XOR of each one's hash, so
+// the order they were heard in doesn't matter.
+static void app_peers_view_locked(app_peers_handle_t peers_handle,
+                                  int32_t *count_ptr, uint32_t *digest_ptr) {
+  app_device_info_handle_t device_info = peers_handle->device_info;
+  int32_t count = 1;
+  uint32_t name_hash = app_peers_name_hash(device_info->name);
+  uint32_t digest = app_peers_entry_hash(device_info->mac_address, name_hash);
+
+  for (app_peer_handle_t current_peer = peers_handle->list.head;
+       current_peer != NULL; current_peer = current_peer->next_peer) {
+    count++;
+    digest ^= app_peers_entry_hash(current_peer->mac_address,
+                                   current_peer->name_hash);
+  }
+
+  // sent as a byte
+  *count_ptr = count > UINT8_MAX ? UINT8_MAX : count;
+  *digest_ptr = digest;
+}
+
+// Whether we're the station that welcomes a newcomer: the lowest MAC among
+// those that knew each other before it came.
+static bool app_peers_welcomes_locked(app_peers_handle_t peers_handle,
+                                      const protocol_mac_address_t newcomer) {
+  for (app_peer_handle_t current_peer = peers_handle->list.head;
+       current_peer != NULL; current_peer = current_peer->next_peer) {
+    if (memcmp(current_peer->mac_address, newcomer,
+               sizeof(protocol_mac_address_t)) != 0 &&
+        memcmp(current_peer->mac_address,
+               peers_handle->device_info->mac_address,
+               sizeof(protocol_mac_address_t)) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int32_t app_peers_put_entry(uint8_t *buffer, int32_t at,
+                                   const protocol_mac_address_t mac_address,
+                                   uint32_t age_ms, const char *name) {
+  size_t name_length = strlen(name);
+  if (name_length > UINT8_MAX ||
+      at + APP_PEERS_ENTRY_LENGTH + name_length >
+          PROTOCOL_MESSAGE_BODY_MAX_LENGTH) {
+    return at;
+  }
+  memcpy(buffer + at, mac_address, sizeof(protocol_mac_address_t));
+  at += sizeof(protocol_mac_address_t);
+  app_peers_put_u32(buffer + at, age_ms);
+  buffer[at + 4] = (uint8_t)name_length;
+  memcpy(buffer + at + 5, name, name_length);
+  return at + 5 + name_length;
+}
+
+static esp_err_t app_peers_send_body(app_peers_handle_t peers_handle,
+                                     uint8_t *body, int32_t length,
+                                     protocol_mac_address_t to_mac_address) {
+  protocol_message_handle_t message = NULL;
+  esp_err_t ret =
+      protocol_message_init(&message, MESSAGE_TYPE_PEERS, length,
+                            peers_handle->device_info->mac_address,
+                            to_mac_address);
+  if (ret != ESP_OK) {
+    free(body);
+    return ret;
+  }
+  ret = protocol_message_adopt_payload(message, body);
+  if (ret != ESP_OK) {
+    free(body);
+    protocol_message_free(message);
+    return ret;
+  }
+  ret = app_queues_add_outgoing_message(peers_handle->queues, &message, 0,
+                                        false);
+  if (ret != ESP_OK) {
+    protocol_message_free(message);
+  }
+  return ret;
+}
+
+// Our table, or a request for theirs, to one station. A table too long for
+// one message is split, each part a table of its own, so every station is
+// sent.
+static esp_err_t app_peers_send_table(app_peers_handle_t peers_handle,
+                                      bool request,
+                                      protocol_mac_address_t to_mac_address) {
+  uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+  // peers in the parts already sent
+  int32_t sent = 0;
+  bool more = true;
+
+  while (more) {
+    uint8_t *body = (uint8_t *)malloc(PROTOCOL_MESSAGE_BODY_MAX_LENGTH);
+    if (body == NULL) {
+      return ESP_ERR_NO_MEM;
+    }
+
+    int32_t length = 1;
+    body[0] = request ? APP_PEERS_TABLE_REQUEST : APP_PEERS_TABLE_REPLY;
+    more = false;
+    if (!request) {
+      if (sent == 0) {
+        length = app_peers_put_entry(body, length,
+                                     peers_handle->device_info->mac_address,
+                                     0, peers_handle->device_info->name);
+      }
+      int32_t first = length;
+
+      xSemaphoreTake(peers_handle->list.mutex, portMAX_DELAY);
+      int32_t index = 0;
+      for (app_peer_handle_t current_peer = peers_handle->list.head;
+           current_peer != NULL;
+           current_peer = current_peer->next_peer, index++) {
+        if (index < sent) {
+          continue;
+        }
+        int32_t next = app_peers_put_entry(
+            body, length, current_peer->mac_address,
+            now_ms - (uint32_t)current_peer->last_heartbeat_ms,
+            current_peer->name);
+        // full, unless not even an empty part fits it
+        if (next == length && length > first) {
+          more = true;
+          break;
+        }
+        length = next;
+        sent = index + 1;
+      }
+      xSemaphoreGive(peers_handle->list.mutex);
+    }
+
+    esp_err_t ret =
+        app_peers_send_body(peers_handle, body, length, to_mac_address);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+
+  if (!request) {
+    system_metrics_add(peers_handle->metrics.tables_sent, 1);
+  }
+  return ESP_OK;
+}
+
 esp_err_t app_peers_remove(app_peers_handle_t peers_handle,
                            protocol_mac_address_t mac_address,
                            bool should_lock) {
@@ -35,6 +307,7 @@ esp_err_t app_peers_remove(app_peers_handle_t peers_handle,
 
       free(current_peer->name);
       free(current_peer);
+      system_metrics_add(peers_handle->metrics.peers, -1);
 
       if (should_lock) {
         xSemaphoreGive(peers_handle->list.mutex);
@@ -57,10 +330,12 @@ esp_err_t app_peers_prune(app_peers_handle_t peers_handle) {
   app_peer_handle_t current_peer = peers_handle->list.head;
   app_peer_handle_t previous_peer = NULL;
   uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+  uint32_t prune_interval_ms =
+      storage_settings_get_u32(STORAGE_SETTING_PEERS_PRUNE_INTERVAL_MS);
 
   while (current_peer != NULL) {
     uint32_t elapsed = now_ms - current_peer->last_heartbeat_ms;
-    if (elapsed > APP_PEERS_PRUNE_INTERVAL_MS) {
+    if (elapsed > prune_interval_ms) {
       if (previous_peer == NULL) {
         peers_handle->list.head = current_peer->next_peer;
       } else {
@@ -69,6 +344,7 @@ esp_err_t app_peers_prune(app_peers_handle_t peers_handle) {
 
       free(current_peer->name);
       free(current_peer);
+      system_metrics_add(peers_handle->metrics.peers, -1);
 
       if (previous_peer == NULL) {
         current_peer = peers_handle->list.head;
@@ -102,19 +378,47 @@ void app_peers_heartbeat_send_task(void *pvParameters) {
   // heartbeats, otherwise this will just send all heartbeats immediately.
   // ---------------------------------------------------------------------------
   uint8_t init_heartbeat_count = 10;
+  uint8_t extension[APP_PEERS_EXTENSIONS_MAX *
+                    (2 + APP_PEERS_EXTENSION_MAX_LENGTH)];
 
   while (true) {
+    int32_t extension_length = 0;
+    for (int32_t i = 0; i < app_peers_handle->extension_count; i++) {
+      uint8_t *record = extension + extension_length;
+      int32_t length = app_peers_handle->extensions[i].fill(
+          record + 2, app_peers_handle->extensions[i].ctx);
+      if (length <= 0 || length > APP_PEERS_EXTENSION_MAX_LENGTH) {
+        continue;
+      }
+      record[0] = (uint8_t)app_peers_handle->extensions[i].tag;
+      record[1] = (uint8_t)length;
+      extension_length += 2 + length;
+    }
+
+    // Our name goes out while we announce ourselves, after that only its
+    // hash, in the view.
     if (protocol_message_init_heartbeat(
-            &outgoing_message, app_peers_handle->device_info->name,
+            &outgoing_message,
+            init_heartbeat_count > 0 ? app_peers_handle->device_info->name
+                                     : "",
+            extension, extension_length,
             app_peers_handle->device_info->mac_address) != ESP_OK) {
       ESP_LOGE(PEERS_HB_SEND_TASK_TAG, "Failed to initialize message");
       vTaskDelay(pdMS_TO_TICKS(1000));
       continue;
     }
+    system_metrics_observe(app_peers_handle->metrics.heartbeat_bytes,
+                           sizeof(protocol_message_header_t) +
+                               outgoing_message->header.length);
 
+    // don't wait longer than half the prune interval, or peers will start
+    // dropping us.
     if (app_queues_add_outgoing_message(
             app_peers_handle->queues, &outgoing_message,
-            pdMS_TO_TICKS(APP_PEERS_HEARTBEAT_WAIT_MAX_MS), false) != ESP_OK) {
+            pdMS_TO_TICKS(storage_settings_get_u32(
+                              STORAGE_SETTING_PEERS_PRUNE_INTERVAL_MS) /
+                          2),
+            false) != ESP_OK) {
       ESP_LOGE(PEERS_HB_SEND_TASK_TAG, "Failed to send heartbeat to queue");
       protocol_message_free(outgoing_message);
       outgoing_message = NULL;
@@ -125,11 +429,146 @@ void app_peers_heartbeat_send_task(void *pvParameters) {
 
     if (init_heartbeat_count > 0) {
       init_heartbeat_count--;
-      vTaskDelay(pdMS_TO_TICKS(APP_PEERS_HEARTBEAT_INIT_INTERVAL_MS));
+      vTaskDelay(pdMS_TO_TICKS(storage_settings_get_u32(
+          STORAGE_SETTING_HEARTBEAT_INIT_INTERVAL_MS)));
     } else {
-      vTaskDelay(pdMS_TO_TICKS(APP_PEERS_HEARTBEAT_INTERVAL_MS));
+      vTaskDelay(pdMS_TO_TICKS(
+          storage_settings_get_u32(STORAGE_SETTING_HEARTBEAT_INTERVAL_MS)));
+    }
+  }
+}
+
+// Hands each record to the extension with its tag. Records with tags we
+// don't know are from newer stations, and skipped.
+static void app_peers_receive_extensions(app_peers_handle_t peers_handle,
+                                         protocol_message_handle_t heartbeat,
+                                         const uint8_t *extension,
+                                         int32_t length) {
+  while (length >= 2) {
+    uint8_t tag = extension[0];
+    int32_t record_length = extension[1];
+    if (record_length > length - 2) {
+      return;
+    }
+
+    for (int32_t i = 0; i < peers_handle->extension_count; i++) {
+      if (peers_handle->extensions[i].tag == tag) {
+        peers_handle->extensions[i].receive(heartbeat, extension + 2,
+                                            record_length,
+                                            peers_handle->extensions[i].ctx);
+        break;
+      }
+    }
+
+    extension += 2 + record_length;
+    length -= 2 + record_length;
+  }
+}
+
+// Stations we first hear of in a table are heard as long ago as the sender
+// heard them, so a station everyone lost is never kept alive second hand.
+static void app_peers_receive_table(app_peers_handle_t peers_handle,
+                                    protocol_message_handle_t message) {
+  const uint8_t *body = message->raw.value;
+  int32_t length = message->header.length;
+  if (length < 1 ||
+      !app_peers_is_ours(peers_handle, message->header.to_mac_address)) {
+    return;
+  }
+
+  if (body[0] == APP_PEERS_TABLE_REQUEST) {
+    if (app_peers_send_table(peers_handle, false,
+                             message->header.from_mac_address) != ESP_OK) {
+      ESP_LOGE(PEERS_HB_RECEIVE_TASK_TAG, "Failed to send peer table");
+    }
+    return;
+  }
+
+  int32_t now_ms = (int32_t)(esp_timer_get_time() / 1000);
+  uint32_t prune_ms =
+      storage_settings_get_u32(STORAGE_SETTING_PEERS_PRUNE_INTERVAL_MS);
+  char name[UINT8_MAX + 1];
+
+  xSemaphoreTake(peers_handle->list.mutex, portMAX_DELAY);
+  int32_t at = 1;
+  while (at + (int32_t)APP_PEERS_ENTRY_LENGTH <= length) {
+    const uint8_t *mac_address = body + at;
+    uint32_t age_ms = app_peers_get_u32(body + at + 6);
+    int32_t name_length = body[at + 10];
+    if (at + (int32_t)APP_PEERS_ENTRY_LENGTH + name_length > length) {
+      break;
+    }
+    memcpy(name, body + at + APP_PEERS_ENTRY_LENGTH, name_length);
+    name[name_length] = '\0';
+    at += APP_PEERS_ENTRY_LENGTH + name_length;
+
+    if (app_peers_is_ours(peers_handle, mac_address) || age_ms >= prune_ms) {
+      continue;
+    }
+    bool added = false;
+    app_peers_heard_locked(peers_handle, mac_address, name,
+                           now_ms - (int32_t)age_ms, &added);
+    if (added) {
+      system_metrics_add(peers_handle->metrics.learned, 1);
     }
   }
+  xSemaphoreGive(peers_handle->list.mutex);
+}
+
+static int32_t app_peers_view_fill(uint8_t *buffer, void *ctx) {
+  app_peers_handle_t peers_handle = (app_peers_handle_t)ctx;
+  int32_t count = 0;
+  uint32_t digest = 0;
+
+  xSemaphoreTake(peers_handle->list.mutex, portMAX_DELAY);
+  app_peers_view_locked(peers_handle, &count, &digest);
+  xSemaphoreGive(peers_handle->list.mutex);
+
+  app_peers_put_u32(buffer,
+                    app_peers_name_hash(peers_handle->device_info->name));
+  buffer[4] = (uint8_t)count;
+  app_peers_put_u32(buffer + 5, digest);
+  return APP_PEERS_VIEW_LENGTH;
+}
+
+// Asks for the peer's table if it knows more stations than we do, the same
+// number but not the same ones, or has a name we haven't heard.
+static void app_peers_view_receive(protocol_message_handle_t heartbeat,
+                                   const uint8_t *extension, int32_t length,
+                                   void *ctx) {
+  app_peers_handle_t peers_handle = (app_peers_handle_t)ctx;
+  if (length < APP_PEERS_VIEW_LENGTH) {
+    return;
+  }
+  uint32_t name_hash = app_peers_get_u32(extension);
+  int32_t their_count = extension[4];
+  uint32_t their_digest = app_peers_get_u32(extension + 5);
+  int32_t now_ms = (int32_t)(esp_timer_get_time() / 1000);
+  bool ask = false;
+
+  xSemaphoreTake(peers_handle->list.mutex, portMAX_DELAY);
+  app_peer_handle_t peer = app_peers_lookup_locked(
+      peers_handle, heartbeat->header.from_mac_address);
+  if (peer != NULL) {
+    int32_t count = 0;
+    uint32_t digest = 0;
+    app_peers_view_locked(peers_handle, &count, &digest);
+    bool behind = their_count > count ||
+                  (their_count == count && their_digest != digest);
+    ask = (peer->name_hash != name_hash || behind) &&
+          (uint32_t)now_ms - (uint32_t)peer->requested_ms >=
+              APP_PEERS_REQUEST_INTERVAL_MS;
+    if (ask) {
+      peer->requested_ms = now_ms;
+    }
+  }
+  xSemaphoreGive(peers_handle->list.mutex);
+
+  if (ask && app_peers_send_table(peers_handle, true,
+                                  heartbeat->header.from_mac_address) !=
+                 ESP_OK) {
+    ESP_LOGE(PEERS_HB_RECEIVE_TASK_TAG, "Failed to ask for peer table");
+  }
 }
 
 void app_peers_heartbeat_receive_task(void *pvParameters) {
@@ -137,24 +576,61 @@ void app_peers_heartbeat_receive_task(void *pvParameters) {
   protocol_message_handle_t incoming_message = NULL;
 
   while (true) {
-    if (app_queues_receive_incoming_message(
-            app_peers_handle->queues, &incoming_message, MESSAGE_TYPE_HEARTBEAT,
-            portMAX_DELAY) != ESP_OK) {
+    if (app_router_receive(app_peers_handle->heartbeats, &incoming_message,
+                           portMAX_DELAY) != ESP_OK) {
       ESP_LOGE(PEERS_HB_RECEIVE_TASK_TAG,
                "Failed to receive heartbeat from queue");
       vTaskDelay(pdMS_TO_TICKS(15));
       continue;
     }
 
-    // not handling the failure here. We'll catch it on the next heartbeat send.
-    app_peers_add(app_peers_handle, incoming_message->header.from_mac_address,
-                  incoming_message->heartbeat.from_name);
+    if (incoming_message->header.type == MESSAGE_TYPE_PEERS) {
+      app_peers_receive_table(app_peers_handle, incoming_message);
+      protocol_message_free(incoming_message);
+      incoming_message = NULL;
+      continue;
+    }
 
-    ESP_LOGI(PEERS_HB_RECEIVE_TASK_TAG, "Heartbeat from: %s",
-             incoming_message->heartbeat.from_name);
+    // A newcomer, still sending its name, gets our table unasked if we're
+    // the one to welcome it, rather than waiting to hear a heartbeat and ask.
+    bool added = false;
+    bool welcome = false;
+    xSemaphoreTake(app_peers_handle->list.mutex, portMAX_DELAY);
+    // not handling the failure here. We'll catch it on the next heartbeat.
+    app_peers_heard_locked(
+        app_peers_handle, incoming_message->header.from_mac_address,
+        incoming_message->heartbeat.from_name,
+        (int32_t)(esp_timer_get_time() / 1000), &added);
+    if (added && incoming_message->heartbeat.from_name[0] != '\0') {
+      welcome = app_peers_welcomes_locked(
+          app_peers_handle, incoming_message->header.from_mac_address);
+    }
+    xSemaphoreGive(app_peers_handle->list.mutex);
+    if (welcome &&
+        app_peers_send_table(app_peers_handle, false,
+                             incoming_message->header.from_mac_address) !=
+            ESP_OK) {
+      ESP_LOGE(PEERS_HB_RECEIVE_TASK_TAG, "Failed to send peer table");
+    }
+
+    const uint8_t *extension = NULL;
+    int32_t extension_length =
+        protocol_message_heartbeat_extension(incoming_message, &extension);
+    app_peers_receive_extensions(app_peers_handle, incoming_message, extension,
+                                 extension_length);
+
+    ESP_LOGI(PEERS_HB_RECEIVE_TASK_TAG,
+             "Heartbeat from: %02X:%02X:%02X:%02X:%02X:%02X",
+             incoming_message->header.from_mac_address[0],
+             incoming_message->header.from_mac_address[1],
+             incoming_message->header.from_mac_address[2],
+             incoming_message->header.from_mac_address[3],
+             incoming_message->header.from_mac_address[4],
+             incoming_message->header.from_mac_address[5]);
     ESP_LOGI(PEERS_HB_RECEIVE_TASK_TAG, "Number of peers: %d\n",
              app_peers_count(app_peers_handle));
 
+    SYSTEM_TRACE(SYSTEM_TRACE_HANDLE, incoming_message->header.uuid);
     protocol_message_free(incoming_message);
     incoming_message = NULL;
   }
@@ -171,17 +647,76 @@ esp_err_t app_peers_init(app_peers_handle_t *peers_handle_ptr,
 
   app_peers_handle->device_info = device_info_handle;
   app_peers_handle->queues = queues_handle;
+  app_peers_handle->extension_count = 0;
   app_peers_handle->list.head = NULL;
   app_peers_handle->list.mutex = xSemaphoreCreateMutex();
   if (app_peers_handle->list.mutex == NULL) {
     return ESP_ERR_NO_MEM;
   }
 
+  // stations sharing a process add up to one gauge
+  system_metric_config_t peers_config = {
+      .name = "peers",
+      .help = "Peers heard from within the prune interval",
+      .type = SYSTEM_METRIC_GAUGE,
+  };
+  esp_err_t ret = system_metrics_register(&app_peers_handle->metrics.peers,
+                                          &peers_config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  system_metric_config_t configs[] = {
+      {"peers_heartbeat_bytes", "Size of each heartbeat sent, header included",
+       SYSTEM_METRIC_HISTOGRAM},
+      {"peers_tables_sent_total", "Peer tables sent, asked for or not",
+       SYSTEM_METRIC_COUNTER},
+      {"peers_learned_total", "Peers first heard of in another's table",
+       SYSTEM_METRIC_COUNTER},
+  };
+  system_metric_handle_t *handles[] = {
+      &app_peers_handle->metrics.heartbeat_bytes,
+      &app_peers_handle->metrics.tables_sent,
+      &app_peers_handle->metrics.learned,
+  };
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ret = system_metrics_register(handles[i], &configs[i]);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+
+  ret = protocol_message_type_register(MESSAGE_TYPE_PEERS, &TYPE_PEERS);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  // first, so it rides on every heartbeat whatever else registers
+  ret = app_peers_add_heartbeat_extension(
+      app_peers_handle, APP_PEERS_EXTENSION_VIEW, app_peers_view_fill,
+      app_peers_view_receive, app_peers_handle);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  // Tables come in with the heartbeats, they only need handling in order.
+  app_router_subscriber_config_t heartbeats_config = {
+      .name = "peers",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_HEARTBEAT) |
+                          APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_PEERS)},
+      .overflow = APP_ROUTER_OVERFLOW_DROP_OLDEST,
+      .queue_depth = APP_PEERS_HEARTBEAT_QUEUE_DEPTH,
+  };
+  ret = app_router_subscribe(queues_handle->incoming,
+                             &app_peers_handle->heartbeats, &heartbeats_config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
   app_peers_handle->tasks.heartbeat_send = NULL;
-  if (xTaskCreate(app_peers_heartbeat_send_task, PEERS_HB_SEND_TASK_TAG,
-                  APP_PEERS_TASK_STACK_DEPTH_HEARTBEAT, app_peers_handle,
-                  APP_PEERS_TASK_PRIORITY_HEARTBEAT,
-                  &app_peers_handle->tasks.heartbeat_send) != pdPASS) {
+  if (system_tasks_create(
+          app_peers_heartbeat_send_task, PEERS_HB_SEND_TASK_TAG,
+          APP_PEERS_TASK_STACK_DEPTH_HEARTBEAT, app_peers_handle,
+          APP_PEERS_TASK_PRIORITY_HEARTBEAT, APP_PEERS_TASK_CORE_HEARTBEAT,
+          &app_peers_handle->tasks.heartbeat_send) != pdPASS) {
     return ESP_ERR_NO_MEM;
   }
   if (app_peers_handle->tasks.heartbeat_send == NULL) {
@@ -189,10 +724,11 @@ esp_err_t app_peers_init(app_peers_handle_t *peers_handle_ptr,
   }
 
   app_peers_handle->tasks.heartbeat_receive = NULL;
-  if (xTaskCreate(app_peers_heartbeat_receive_task, PEERS_HB_RECEIVE_TASK_TAG,
-                  APP_PEERS_TASK_STACK_DEPTH_HEARTBEAT, app_peers_handle,
-                  APP_PEERS_TASK_PRIORITY_HEARTBEAT,
-                  &app_peers_handle->tasks.heartbeat_receive) != pdPASS) {
+  if (system_tasks_create(
+          app_peers_heartbeat_receive_task, PEERS_HB_RECEIVE_TASK_TAG,
+          APP_PEERS_TASK_STACK_DEPTH_HEARTBEAT, app_peers_handle,
+          APP_PEERS_TASK_PRIORITY_HEARTBEAT, APP_PEERS_TASK_CORE_HEARTBEAT,
+          &app_peers_handle->tasks.heartbeat_receive) != pdPASS) {
     return ESP_ERR_NO_MEM;
   }
   if (app_peers_handle->tasks.heartbeat_receive == NULL) {
@@ -207,43 +743,12 @@ esp_err_t app_peers_init(app_peers_handle_t *peers_handle_ptr,
 esp_err_t app_peers_add(app_peers_handle_t peers_handle,
                         protocol_mac_address_t mac_address, char *name) {
   xSemaphoreTake(peers_handle->list.mutex, portMAX_DELAY);
-
-  esp_err_t ret = ESP_OK;
-  app_peer_handle_t new_peer = NULL;
-
-  // if the peer already exists, remove it first.
-  app_peers_find(peers_handle, &new_peer, mac_address, false);
-  if (new_peer != NULL) {
-    app_peer_free(new_peer);
-    ret = app_peers_remove(peers_handle, mac_address, false);
-    if (ret != ESP_OK) {
-      goto app_peers_add_end;
-    }
-  }
-
-  new_peer = NULL;
-  new_peer = (app_peer_handle_t)malloc(sizeof(app_peer_t));
-  if (new_peer == NULL) {
-    ret = ESP_ERR_NO_MEM;
-    goto app_peers_add_end;
-  }
-
-  new_peer->name = (char *)malloc((strlen(name) + 1) * sizeof(char));
-  if (new_peer->name == NULL) {
-    free(new_peer);
-    ret = ESP_ERR_NO_MEM;
-    goto app_peers_add_end;
-  }
-
-  memcpy(new_peer->mac_address, mac_address, sizeof(protocol_mac_address_t));
-  strcpy(new_peer->name, name);
-  new_peer->last_heartbeat_ms = (int32_t)(esp_timer_get_time() / 1000);
-  new_peer->next_peer = peers_handle->list.head;
-  peers_handle->list.head = new_peer;
-
-app_peers_add_end:
+  bool added = false;
+  app_peer_handle_t peer =
+      app_peers_heard_locked(peers_handle, mac_address, name,
+                             (int32_t)(esp_timer_get_time() / 1000), &added);
   xSemaphoreGive(peers_handle->list.mutex);
-  return ret;
+  return peer != NULL ? ESP_OK : ESP_ERR_NO_MEM;
 }
 
 void app_peers_find(app_peers_handle_t peers_handle,
@@ -307,6 +812,25 @@ int32_t app_peers_count(app_peers_handle_t peers_handle) {
   return count;
 }
 
+int32_t app_peers_copy(app_peers_handle_t peers_handle, app_peer_info_t *peers,
+                       int32_t max_peers) {
+  xSemaphoreTake(peers_handle->list.mutex, portMAX_DELAY);
+
+  int32_t count = 0;
+  app_peer_handle_t current_peer = peers_handle->list.head;
+  while (current_peer != NULL && count < max_peers) {
+    app_peer_info_t *peer = &peers[count++];
+    memcpy(peer->mac_address, current_peer->mac_address,
+           sizeof(protocol_mac_address_t));
+    snprintf(peer->name, sizeof(peer->name), "%s", current_peer->name);
+    peer->last_heartbeat_ms = current_peer->last_heartbeat_ms;
+    current_peer = current_peer->next_peer;
+  }
+
+  xSemaphoreGive(peers_handle->list.mutex);
+  return count;
+}
+
 void app_peer_free(app_peer_handle_t peer_handle) {
   if (peer_handle == NULL) {
     return;
@@ -314,4 +838,21 @@ void app_peer_free(app_peer_handle_t peer_handle) {
 
   free(peer_handle->name);
   free(peer_handle);
-}
\ No newline at end of file
+}
+
+esp_err_t app_peers_add_heartbeat_extension(
+    app_peers_handle_t peers_handle, app_peers_extension_tag_t tag,
+    app_peers_extension_fill_t fill, app_peers_extension_receive_t receive,
+    void *ctx) {
+  if (peers_handle->extension_count >= APP_PEERS_EXTENSIONS_MAX) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  int32_t i = peers_handle->extension_count;
+  peers_handle->extensions[i].tag = tag;
+  peers_handle->extensions[i].fill = fill;
+  peers_handle->extensions[i].receive = receive;
+  peers_handle->extensions[i].ctx = ctx;
+  peers_handle->extension_count++;
+  return ESP_OK;
+}
@@ -1,34 +1,59 @@
+#include "esp_check.h"
 #include "esp_err.h"
-#include "esp_log.h"
 
 #include "application/queues.h"
 #include "protocols/messages.h"
+#include "storage/settings.h"
+#include "system/trace.h"
+
+static const char *TAG = "APPLICATION:QUEUES";
+
+static esp_err_t app_queues_metrics_init(app_queues_handle_t queues_handle) {
+  system_metric_config_t high_water_config = {
+      .name = "queue_outgoing_high_water",
+      .help = "Most messages the outgoing queue has held",
+      .type = SYSTEM_METRIC_GAUGE,
+  };
+  ESP_RETURN_ON_ERROR(
+      system_metrics_register(&queues_handle->metrics.outgoing_high_water,
+                              &high_water_config),
+      TAG, "Failed to register '%s'", high_water_config.name);
+
+  system_metric_config_t full_config = {
+      .name = "queue_outgoing_full_total",
+      .help = "Messages that didn't fit in the outgoing queue in time",
+      .type = SYSTEM_METRIC_COUNTER,
+  };
+  ESP_RETURN_ON_ERROR(
+      system_metrics_register(&queues_handle->metrics.outgoing_full,
+                              &full_config),
+      TAG, "Failed to register '%s'", full_config.name);
 
-static const char *BASE_TAG = "NETWORK:QUEUES";
+  return ESP_OK;
+}
 
 esp_err_t app_queues_init(app_queues_handle_t *handle_ptr) {
   app_queues_handle_t app_queues_handle =
-      (app_queues_handle_t)malloc(sizeof(app_queues_t));
+      (app_queues_handle_t)calloc(1, sizeof(app_queues_t));
   if (app_queues_handle == NULL) {
     return ESP_ERR_NO_MEM;
   }
 
-  app_queues_handle->outgoing =
-      xQueueCreate(10, sizeof(protocol_message_handle_t));
+  app_queues_handle->outgoing = xQueueCreate(
+      storage_settings_get_u32(STORAGE_SETTING_QUEUE_DEPTH_OUTGOING),
+      sizeof(protocol_message_handle_t));
   if (app_queues_handle->outgoing == NULL) {
     return ESP_ERR_NO_MEM;
   }
 
-  app_queues_handle->incoming_heartbeat =
-      xQueueCreate(10, sizeof(protocol_message_handle_t));
-  if (app_queues_handle->incoming_heartbeat == NULL) {
-    return ESP_ERR_NO_MEM;
+  esp_err_t ret = app_router_init(&app_queues_handle->incoming);
+  if (ret != ESP_OK) {
+    return ret;
   }
 
-  app_queues_handle->incoming_text =
-      xQueueCreate(10, sizeof(protocol_message_handle_t));
-  if (app_queues_handle->incoming_text == NULL) {
-    return ESP_ERR_NO_MEM;
+  ret = app_queues_metrics_init(app_queues_handle);
+  if (ret != ESP_OK) {
+    return ret;
   }
 
   *handle_ptr = app_queues_handle;
@@ -50,6 +75,7 @@ app_queues_receive_outgoing_message(app_queues_handle_t queues_handle,
     return ESP_ERR_TIMEOUT;
   }
 
+  SYSTEM_TRACE(SYSTEM_TRACE_OUTGOING_DEQUEUE, (*message_ptr)->header.uuid);
   return ESP_OK;
 }
 
@@ -59,6 +85,27 @@ app_queues_receive_outgoing_message(app_queues_handle_t queues_handle,
 esp_err_t app_queues_add_outgoing_message(
     app_queues_handle_t queues_handle, protocol_message_handle_t *message_ptr,
     TickType_t ticks_to_wait, bool should_send_to_front) {
+  // split up and sent at their own pace
+  if ((*message_ptr)->header.length > PROTOCOL_MESSAGE_BODY_MAX_LENGTH) {
+    if (queues_handle->large_handler == NULL) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    return queues_handle->large_handler(message_ptr, ticks_to_wait,
+                                        queues_handle->large_handler_ctx);
+  }
+
+  // recorded first, once queued the message may already be freed
+  SYSTEM_TRACE(SYSTEM_TRACE_OUTGOING_ENQUEUE, (*message_ptr)->header.uuid);
+
+  // retransmissions are already tracked
+  protocol_message_handle_t reliable = NULL;
+  if (queues_handle->reliable_handler != NULL &&
+      ((*message_ptr)->header.flags & PROTOCOL_MESSAGE_FLAG_RELIABLE) &&
+      (*message_ptr)->header.attempt == 0) {
+    reliable = *message_ptr;
+    protocol_message_ref(reliable);
+  }
+
   BaseType_t xReturned = pdPASS;
   if (should_send_to_front) {
     xReturned =
@@ -69,72 +116,34 @@ esp_err_t app_queues_add_outgoing_message(
   }
 
   if (xReturned != pdPASS) {
+    system_metrics_add(queues_handle->metrics.outgoing_full, 1);
+    if (reliable != NULL) {
+      protocol_message_free(reliable);
+    }
     return ESP_ERR_TIMEOUT;
   }
 
-  *message_ptr = NULL;
-  return ESP_OK;
-}
-
-// If successful, the caller will own the message and is responsible for freeing
-// it. Otherwise, the caller's pointer will be set to NULL and they can choose
-// to retry or not.
-esp_err_t app_queues_receive_incoming_message(
-    app_queues_handle_t queues_handle, protocol_message_handle_t *message_ptr,
-    protocol_message_type_t type, TickType_t ticks_to_wait) {
-  QueueHandle_t queue_to_receive_from = NULL;
-  switch (type) {
-  case MESSAGE_TYPE_HEARTBEAT:
-    queue_to_receive_from = queues_handle->incoming_heartbeat;
-    break;
-  case MESSAGE_TYPE_TEXT:
-    queue_to_receive_from = queues_handle->incoming_text;
-    break;
-  default:
-    ESP_LOGE(BASE_TAG, "Unsupported message type: %d", type);
-    *message_ptr = NULL;
-    return ESP_ERR_INVALID_ARG;
-  }
-
-  BaseType_t xReturned =
-      xQueueReceive(queue_to_receive_from, message_ptr, ticks_to_wait);
-  if (xReturned != pdPASS) {
-    *message_ptr = NULL;
-    return ESP_ERR_TIMEOUT;
+  if (reliable != NULL) {
+    queues_handle->reliable_handler(reliable,
+                                    queues_handle->reliable_handler_ctx);
   }
 
+  system_metrics_max(queues_handle->metrics.outgoing_high_water,
+                     uxQueueMessagesWaiting(queues_handle->outgoing));
+  *message_ptr = NULL;
   return ESP_OK;
 }
 
-// If successful, the queue will own the message and the caller's pointer will
-// be set to NULL. Otherwise, the caller's pointer will not be modified and they
-// can choose to retry or not.
-esp_err_t
-app_queues_add_incoming_message(app_queues_handle_t queues_handle,
-                                protocol_message_handle_t *message_ptr,
-                                TickType_t ticks_to_wait) {
-  BaseType_t xReturned = pdPASS;
-  switch ((*message_ptr)->header.type) {
-  case MESSAGE_TYPE_HEARTBEAT:
-    xReturned = xQueueSendToBack(queues_handle->incoming_heartbeat, message_ptr,
-                                 ticks_to_wait);
-    break;
-  case MESSAGE_TYPE_TEXT:
-    xReturned = xQueueSendToBack(queues_handle->incoming_text, message_ptr,
-                                 ticks_to_wait);
-    break;
-  default:
-    xReturned = pdPASS;
-    ESP_LOGE(BASE_TAG, "Unsupported message type: %d",
-             (*message_ptr)->header.type);
-    protocol_message_free(*message_ptr);
-    break;
-  }
-
-  if (xReturned != pdPASS) {
-    return ESP_ERR_TIMEOUT;
-  }
+void app_queues_set_large_handler(app_queues_handle_t queues_handle,
+                                  app_queues_large_handler_t handler,
+                                  void *ctx) {
+  queues_handle->large_handler_ctx = ctx;
+  queues_handle->large_handler = handler;
+}
 
-  *message_ptr = NULL;
-  return ESP_OK;
-}
\ No newline at end of file
+void app_queues_set_reliable_handler(app_queues_handle_t queues_handle,
+                                     app_queues_reliable_handler_t handler,
+                                     void *ctx) {
+  queues_handle->reliable_handler_ctx = ctx;
+  queues_handle->reliable_handler = handler;
+}
@@ -0,0 +1,535 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <string.h>
+
+#include "application/reliable.h"
+
+static const char *BASE_TAG = "APPLICATION:RELIABLE";
+static const char *TASK_TAG = "APPLICATION:RELIABLE:TASK";
+
+static const protocol_message_type_info_t TYPE_ACK = {
+    .name = "ack",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = APP_RELIABLE_LIST_MAX * sizeof(app_reliable_ack_t),
+    .priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL,
+};
+
+static const protocol_message_type_info_t TYPE_NACK = {
+    .name = "nack",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = APP_RELIABLE_LIST_MAX * sizeof(protocol_message_uuid_t),
+    .priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL,
+};
+
+static const protocol_message_type_info_t TYPE_SUMMARY = {
+    .name = "summary",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = APP_RELIABLE_LIST_MAX * sizeof(protocol_message_uuid_t),
+    .priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL,
+};
+
+static bool app_reliable_mac_equal(const protocol_mac_address_t a,
+                                   const protocol_mac_address_t b) {
+  return memcmp(a, b, sizeof(protocol_mac_address_t)) == 0;
+}
+
+// // ----------------
+// // Peers
+// // ----------------
+
+static app_reliable_peer_t *
+app_reliable_peer_locked(app_reliable_handle_t reliable,
+                         const protocol_mac_address_t mac_address) {
+  app_reliable_peer_t *oldest = NULL;
+
+  for (int32_t i = 0; i < APP_RELIABLE_PEERS; i++) {
+    app_reliable_peer_t *peer = &reliable->peers[i];
+    if (!peer->used) {
+      oldest = peer;
+      break;
+    }
+    if (app_reliable_mac_equal(peer->mac_address, mac_address)) {
+      return peer;
+    }
+    if (oldest == NULL || peer->heard_us < oldest->heard_us) {
+      oldest = peer;
+    }
+  }
+
+  // a forgotten peer's duplicates get through once more
+  memset(oldest, 0, sizeof(app_reliable_peer_t));
+  oldest->used = true;
+  memcpy(oldest->mac_address, mac_address, sizeof(protocol_mac_address_t));
+  oldest->heard_us = esp_timer_get_time();
+  return oldest;
+}
+
+static int64_t app_reliable_clamp_rto(int64_t rto_us) {
+  if (rto_us < APP_RELIABLE_RTO_MIN_MS * 1000LL) {
+    return APP_RELIABLE_RTO_MIN_MS * 1000LL;
+  }
+  if (rto_us > APP_RELIABLE_RTO_MAX_MS * 1000LL) {
+    return APP_RELIABLE_RTO_MAX_MS * 1000LL;
+  }
+  return rto_us;
+}
+
+static int64_t app_reliable_peer_rto(const app_reliable_peer_t *peer) {
+  return peer->rto_us > 0 ? peer->rto_us : APP_RELIABLE_RTO_INITIAL_MS * 1000LL;
+}
+
+// Every receiver NACKs on its own, so a broadcast waits for the slowest
+// peer we've measured.
+static int64_t
+app_reliable_broadcast_rto_locked(app_reliable_handle_t reliable) {
+  int64_t rto_us = 0;
+
+  for (int32_t i = 0; i < APP_RELIABLE_PEERS; i++) {
+    if (reliable->peers[i].used && reliable->peers[i].rto_us > rto_us) {
+      rto_us = reliable->peers[i].rto_us;
+    }
+  }
+  return rto_us > 0 ? rto_us : APP_RELIABLE_RTO_INITIAL_MS * 1000LL;
+}
+
+static void app_reliable_rtt_sample_locked(app_reliable_peer_t *peer,
+                                           int64_t rtt_us) {
+  if (peer->srtt_us == 0) {
+    peer->srtt_us = rtt_us;
+    peer->rttvar_us = rtt_us / 2;
+  } else {
+    int64_t error_us = peer->srtt_us - rtt_us;
+    error_us = error_us < 0 ? -error_us : error_us;
+    peer->rttvar_us = (3 * peer->rttvar_us + error_us) / 4;
+    peer->srtt_us = (7 * peer->srtt_us + rtt_us) / 8;
+  }
+  peer->rto_us = app_reliable_clamp_rto(peer->srtt_us + 4 * peer->rttvar_us);
+}
+
+// Returns whether the peer sent this message before, and remembers it if
+// asked to.
+static bool app_reliable_seen_locked(app_reliable_peer_t *peer,
+                                     const protocol_message_uuid_t uuid,
+                                     bool remember) {
+  for (int32_t i = 0; i < peer->seen_count; i++) {
+    if (memcmp(peer->seen[i], uuid, sizeof(protocol_message_uuid_t)) == 0) {
+      return true;
+    }
+  }
+
+  if (remember) {
+    memcpy(peer->seen[peer->seen_next], uuid, sizeof(protocol_message_uuid_t));
+    peer->seen_next = (peer->seen_next + 1) % APP_RELIABLE_SEEN;
+    if (peer->seen_count < APP_RELIABLE_SEEN) {
+      peer->seen_count++;
+    }
+  }
+  return false;
+}
+
+// // ----------------
+// // Sending
+// // ----------------
+
+// ACKs, NACKs and summaries are best-effort themselves, a lost one is
+// covered by the next retransmission or summary.
+static void app_reliable_send_list(app_reliable_handle_t reliable,
+                                   protocol_message_type_t type,
+                                   protocol_mac_address_t to_mac_address,
+                                   const void *entries, int32_t length) {
+  protocol_message_handle_t message = NULL;
+
+  if (protocol_message_init(&message, type, length,
+                            reliable->device_info->mac_address,
+                            to_mac_address) != ESP_OK) {
+    ESP_LOGW(BASE_TAG, "Failed to create %s",
+             protocol_message_type_get(type)->name);
+    return;
+  }
+  if (protocol_message_set_payload(message, (void *)entries) != ESP_OK ||
+      app_queues_add_outgoing_message(reliable->queues, &message, 0, false) !=
+          ESP_OK) {
+    protocol_message_free(message);
+  }
+}
+
+// A copy with the next attempt, the tracked message is shared and can't be
+// changed.
+static void app_reliable_retransmit_locked(app_reliable_handle_t reliable,
+                                           app_reliable_slot_t *slot,
+                                           int64_t now_us) {
+  protocol_message_handle_t original = slot->message;
+  protocol_message_handle_t message = NULL;
+
+  if (protocol_message_init(&message, original->header.type,
+                            original->header.length,
+                            original->header.from_mac_address,
+                            original->header.to_mac_address) != ESP_OK) {
+    return;
+  }
+  memcpy(message->header.uuid, original->header.uuid,
+         sizeof(protocol_message_uuid_t));
+  message->header.flags = original->header.flags;
+  message->header.attempt = slot->attempt + 1;
+  message->group = original->group;
+
+  if (protocol_message_set_payload(message, original->raw.value) != ESP_OK ||
+      app_queues_add_outgoing_message(reliable->queues, &message, 0, false) !=
+          ESP_OK) {
+    // tried again at the next deadline
+    protocol_message_free(message);
+    return;
+  }
+
+  slot->attempt++;
+  slot->sent_us = now_us;
+  system_metrics_add(reliable->metrics.retransmits, 1);
+}
+
+static void app_reliable_release_locked(app_reliable_slot_t *slot) {
+  protocol_message_free(slot->message);
+  memset(slot, 0, sizeof(app_reliable_slot_t));
+}
+
+static void app_reliable_track(protocol_message_handle_t message, void *ctx) {
+  app_reliable_handle_t reliable = (app_reliable_handle_t)ctx;
+  int64_t now_us = esp_timer_get_time();
+  app_reliable_slot_t *slot = NULL;
+
+  xSemaphoreTake(reliable->mutex, portMAX_DELAY);
+  for (int32_t i = 0; i < APP_RELIABLE_SLOTS; i++) {
+    if (!reliable->slots[i].used) {
+      slot = &reliable->slots[i];
+      break;
+    }
+  }
+
+  if (slot != NULL) {
+    slot->used = true;
+    slot->message = message;
+    slot->broadcast = app_reliable_mac_equal(
+        message->header.to_mac_address, NETWORK_MESSAGE_BROADCAST_MAC_ADDRESS);
+    slot->queued_us = now_us;
+    slot->sent_us = now_us;
+    slot->rto_us =
+        slot->broadcast
+            ? app_reliable_broadcast_rto_locked(reliable)
+            : app_reliable_peer_rto(app_reliable_peer_locked(
+                  reliable, message->header.to_mac_address));
+    slot->deadline_us = now_us + slot->rto_us;
+  }
+  xSemaphoreGive(reliable->mutex);
+
+  if (slot == NULL) {
+    ESP_LOGW(BASE_TAG, "No room to track type %d, sent best-effort",
+             message->header.type);
+    system_metrics_add(reliable->metrics.untracked, 1);
+    protocol_message_free(message);
+  }
+}
+
+void app_reliable_task(void *pvParameters) {
+  app_reliable_handle_t reliable = (app_reliable_handle_t)pvParameters;
+  protocol_message_uuid_t summary[APP_RELIABLE_LIST_MAX];
+
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(APP_RELIABLE_TICK_MS));
+
+    int64_t now_us = esp_timer_get_time();
+    int32_t summary_count = 0;
+
+    xSemaphoreTake(reliable->mutex, portMAX_DELAY);
+    for (int32_t i = 0; i < APP_RELIABLE_SLOTS; i++) {
+      app_reliable_slot_t *slot = &reliable->slots[i];
+      if (!slot->used || now_us < slot->deadline_us) {
+        continue;
+      }
+
+      if (!slot->broadcast &&
+          slot->attempt >= APP_RELIABLE_MAX_RETRANSMITS) {
+        const uint8_t *to = slot->message->header.to_mac_address;
+        ESP_LOGW(TASK_TAG,
+                 "Type %d to %02X:%02X:%02X:%02X:%02X:%02X wasn't ACKed, "
+                 "giving up",
+                 slot->message->header.type, to[0], to[1], to[2], to[3],
+                 to[4], to[5]);
+        system_metrics_add(reliable->metrics.failed, 1);
+        app_reliable_release_locked(slot);
+        continue;
+      }
+      // the last summary's NACKs have had their time
+      if (slot->broadcast && slot->summaries >= APP_RELIABLE_SUMMARIES) {
+        app_reliable_release_locked(slot);
+        continue;
+      }
+
+      if (slot->broadcast) {
+        memcpy(summary[summary_count++], slot->message->header.uuid,
+               sizeof(protocol_message_uuid_t));
+        slot->summaries++;
+      } else {
+        app_reliable_retransmit_locked(reliable, slot, now_us);
+      }
+      slot->rto_us = app_reliable_clamp_rto(slot->rto_us * 2);
+      slot->deadline_us = now_us + slot->rto_us;
+    }
+    xSemaphoreGive(reliable->mutex);
+
+    if (summary_count > 0) {
+      app_reliable_send_list(reliable, MESSAGE_TYPE_SUMMARY, NULL, summary,
+                             summary_count * sizeof(protocol_message_uuid_t));
+    }
+  }
+}
+
+// // ----------------
+// // Receiving
+// // ----------------
+
+// ACKs reliable messages for us and drops the duplicates. Runs on the UDP
+// read task.
+static bool app_reliable_gate(protocol_message_handle_t message, void *ctx) {
+  app_reliable_handle_t reliable = (app_reliable_handle_t)ctx;
+
+  if (!(message->header.flags & PROTOCOL_MESSAGE_FLAG_RELIABLE)) {
+    return true;
+  }
+  bool to_us = app_reliable_mac_equal(message->header.to_mac_address,
+                                      reliable->device_info->mac_address);
+  bool broadcast = app_reliable_mac_equal(
+      message->header.to_mac_address, NETWORK_MESSAGE_BROADCAST_MAC_ADDRESS);
+  if (!to_us && !broadcast) {
+    // someone else's, and skipped by whoever handles it
+    return true;
+  }
+
+  xSemaphoreTake(reliable->mutex, portMAX_DELAY);
+  app_reliable_peer_t *peer =
+      app_reliable_peer_locked(reliable, message->header.from_mac_address);
+  peer->heard_us = esp_timer_get_time();
+  bool duplicate = app_reliable_seen_locked(peer, message->header.uuid, true);
+  xSemaphoreGive(reliable->mutex);
+
+  // a duplicate means our ACK was lost, so it's sent again
+  if (to_us) {
+    app_reliable_ack_t ack = {.attempt = message->header.attempt};
+    memcpy(ack.uuid, message->header.uuid, sizeof(protocol_message_uuid_t));
+    app_reliable_send_list(reliable, MESSAGE_TYPE_ACK,
+                           message->header.from_mac_address, &ack,
+                           sizeof(ack));
+  }
+
+  if (duplicate) {
+    system_metrics_add(reliable->metrics.duplicates, 1);
+    return false;
+  }
+  return true;
+}
+
+static void app_reliable_handle_ack(app_reliable_handle_t reliable,
+                                    protocol_message_handle_t message) {
+  int32_t count = message->header.length / sizeof(app_reliable_ack_t);
+  int64_t now_us = esp_timer_get_time();
+
+  xSemaphoreTake(reliable->mutex, portMAX_DELAY);
+  for (int32_t i = 0; i < count; i++) {
+    app_reliable_ack_t ack;
+    memcpy(&ack, message->raw.value + i * sizeof(app_reliable_ack_t),
+           sizeof(ack));
+
+    for (int32_t j = 0; j < APP_RELIABLE_SLOTS; j++) {
+      app_reliable_slot_t *slot = &reliable->slots[j];
+      if (!slot->used || slot->broadcast ||
+          memcmp(slot->message->header.uuid, ack.uuid,
+                 sizeof(protocol_message_uuid_t)) != 0 ||
+          !app_reliable_mac_equal(slot->message->header.to_mac_address,
+                                  message->header.from_mac_address)) {
+        continue;
+      }
+
+      // an ACK for an earlier attempt can't be timed
+      if (ack.attempt == slot->attempt) {
+        app_reliable_peer_t *peer = app_reliable_peer_locked(
+            reliable, message->header.from_mac_address);
+        peer->heard_us = now_us;
+        app_reliable_rtt_sample_locked(peer, now_us - slot->sent_us);
+      }
+      system_metrics_add(reliable->metrics.acked, 1);
+      system_metrics_observe(reliable->metrics.ack_us,
+                             (uint32_t)(now_us - slot->queued_us));
+      app_reliable_release_locked(slot);
+      break;
+    }
+  }
+  xSemaphoreGive(reliable->mutex);
+}
+
+static void app_reliable_handle_nack(app_reliable_handle_t reliable,
+                                     protocol_message_handle_t message) {
+  int32_t count = message->header.length / sizeof(protocol_message_uuid_t);
+  int64_t now_us = esp_timer_get_time();
+
+  xSemaphoreTake(reliable->mutex, portMAX_DELAY);
+  for (int32_t i = 0; i < count; i++) {
+    const uint8_t *uuid =
+        message->raw.value + i * sizeof(protocol_message_uuid_t);
+
+    for (int32_t j = 0; j < APP_RELIABLE_SLOTS; j++) {
+      app_reliable_slot_t *slot = &reliable->slots[j];
+      if (!slot->used || !slot->broadcast ||
+          memcmp(slot->message->header.uuid, uuid,
+                 sizeof(protocol_message_uuid_t)) != 0) {
+        continue;
+      }
+      // Every receiver that missed it NACKs the same summary, one
+      // retransmission answers them all.
+      if (now_us - slot->sent_us >= slot->rto_us / 4) {
+        app_reliable_retransmit_locked(reliable, slot, now_us);
+      }
+      break;
+    }
+  }
+  xSemaphoreGive(reliable->mutex);
+}
+
+static void app_reliable_handle_summary(app_reliable_handle_t reliable,
+                                        protocol_message_handle_t message) {
+  int32_t count = message->header.length / sizeof(protocol_message_uuid_t);
+  protocol_message_uuid_t missing[APP_RELIABLE_LIST_MAX];
+  int32_t missing_count = 0;
+
+  xSemaphoreTake(reliable->mutex, portMAX_DELAY);
+  app_reliable_peer_t *peer =
+      app_reliable_peer_locked(reliable, message->header.from_mac_address);
+  peer->heard_us = esp_timer_get_time();
+  for (int32_t i = 0; i < count; i++) {
+    const uint8_t *uuid =
+        message->raw.value + i * sizeof(protocol_message_uuid_t);
+    if (!app_reliable_seen_locked(peer, uuid, false)) {
+      memcpy(missing[missing_count++], uuid, sizeof(protocol_message_uuid_t));
+    }
+  }
+  xSemaphoreGive(reliable->mutex);
+
+  if (missing_count > 0) {
+    ESP_LOGD(BASE_TAG, "Missed %" PRId32 " of %" PRId32 " broadcasts",
+             missing_count, count);
+    app_reliable_send_list(reliable, MESSAGE_TYPE_NACK,
+                           message->header.from_mac_address, missing,
+                           missing_count * sizeof(protocol_message_uuid_t));
+  }
+}
+
+static esp_err_t app_reliable_handle_message(protocol_message_handle_t message,
+                                             void *ctx) {
+  app_reliable_handle_t reliable = (app_reliable_handle_t)ctx;
+
+  bool to_us = app_reliable_mac_equal(message->header.to_mac_address,
+                                      reliable->device_info->mac_address);
+  switch (message->header.type) {
+  case MESSAGE_TYPE_ACK:
+    if (to_us) {
+      app_reliable_handle_ack(reliable, message);
+    }
+    break;
+  case MESSAGE_TYPE_NACK:
+    if (to_us) {
+      app_reliable_handle_nack(reliable, message);
+    }
+    break;
+  case MESSAGE_TYPE_SUMMARY:
+    app_reliable_handle_summary(reliable, message);
+    break;
+  default:
+    break;
+  }
+
+  protocol_message_free(message);
+  return ESP_OK;
+}
+
+static esp_err_t app_reliable_metrics_init(app_reliable_handle_t reliable) {
+  system_metric_config_t configs[] = {
+      {"reliable_acked_total", "Addressed reliable messages ACKed",
+       SYSTEM_METRIC_COUNTER},
+      {"reliable_failed_total",
+       "Addressed reliable messages given up without an ACK",
+       SYSTEM_METRIC_COUNTER},
+      {"reliable_retransmits_total", "Reliable messages sent again",
+       SYSTEM_METRIC_COUNTER},
+      {"reliable_untracked_total",
+       "Reliable messages sent best-effort, there was no room to track them",
+       SYSTEM_METRIC_COUNTER},
+      {"reliable_duplicates_total", "Reliable messages received again",
+       SYSTEM_METRIC_COUNTER},
+      {"reliable_ack_us", "From queueing a reliable message to its ACK",
+       SYSTEM_METRIC_HISTOGRAM},
+  };
+  system_metric_handle_t *handles[] = {
+      &reliable->metrics.acked,       &reliable->metrics.failed,
+      &reliable->metrics.retransmits, &reliable->metrics.untracked,
+      &reliable->metrics.duplicates,  &reliable->metrics.ack_us,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]),
+                        BASE_TAG, "Failed to register '%s'", configs[i].name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t app_reliable_init(app_reliable_handle_t *reliable_handle_ptr,
+                            app_device_info_handle_t device_info_handle,
+                            app_queues_handle_t queues_handle) {
+  app_reliable_handle_t reliable =
+      (app_reliable_handle_t)calloc(1, sizeof(app_reliable_t));
+  ESP_RETURN_ON_FALSE(reliable != NULL, ESP_ERR_NO_MEM, BASE_TAG,
+                      "Failed to allocate reliable");
+
+  reliable->device_info = device_info_handle;
+  reliable->queues = queues_handle;
+  reliable->mutex = xSemaphoreCreateMutex();
+  ESP_RETURN_ON_FALSE(reliable->mutex != NULL, ESP_ERR_NO_MEM, BASE_TAG,
+                      "Failed to create reliable mutex");
+
+  ESP_RETURN_ON_ERROR(app_reliable_metrics_init(reliable), BASE_TAG,
+                      "Failed to register metrics");
+  ESP_RETURN_ON_ERROR(protocol_message_type_register(MESSAGE_TYPE_ACK,
+                                                     &TYPE_ACK),
+                      BASE_TAG, "Failed to register ACK");
+  ESP_RETURN_ON_ERROR(protocol_message_type_register(MESSAGE_TYPE_NACK,
+                                                     &TYPE_NACK),
+                      BASE_TAG, "Failed to register NACK");
+  ESP_RETURN_ON_ERROR(
+      protocol_message_type_register(MESSAGE_TYPE_SUMMARY, &TYPE_SUMMARY),
+      BASE_TAG, "Failed to register summary");
+
+  app_router_subscriber_config_t subscriber_config = {
+      .name = "reliable",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_ACK) |
+                          APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_NACK) |
+                          APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_SUMMARY)},
+      .handler = app_reliable_handle_message,
+      .handler_ctx = reliable,
+  };
+  ESP_RETURN_ON_ERROR(app_router_subscribe(queues_handle->incoming,
+                                           &reliable->subscriber,
+                                           &subscriber_config),
+                      BASE_TAG, "Failed to subscribe to ACKs");
+
+  ESP_RETURN_ON_FALSE(
+      system_tasks_create(app_reliable_task, TASK_TAG,
+                          APP_RELIABLE_TASK_STACK_DEPTH, reliable,
+                          APP_RELIABLE_TASK_PRIORITY, APP_RELIABLE_TASK_CORE,
+                          &reliable->task) == pdPASS,
+      ESP_ERR_NO_MEM, BASE_TAG, "Failed to create reliable task");
+
+  app_router_set_gate(queues_handle->incoming, app_reliable_gate, reliable);
+  app_queues_set_reliable_handler(queues_handle, app_reliable_track, reliable);
+
+  *reliable_handle_ptr = reliable;
+
+  return ESP_OK;
+}
@@ -0,0 +1,345 @@
+#include "esp_check.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "application/router.h"
+#include "system/trace.h"
+
+static const char *TAG = "APPLICATION:ROUTER";
+
+esp_err_t app_router_init(app_router_handle_t *router_handle_ptr) {
+  app_router_handle_t router_handle =
+      (app_router_handle_t)calloc(1, sizeof(app_router_t));
+  if (router_handle == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  atomic_init(&router_handle->subscriber_count, 0);
+  atomic_init(&router_handle->types, 0);
+
+  router_handle->mutex = xSemaphoreCreateMutex();
+  if (router_handle->mutex == NULL) {
+    free(router_handle);
+    return ESP_ERR_NO_MEM;
+  }
+
+  *router_handle_ptr = router_handle;
+
+  return ESP_OK;
+}
+
+static esp_err_t
+app_router_metrics_init(app_router_subscriber_handle_t subscriber) {
+  char labels[SYSTEM_METRICS_LABELS_LENGTH];
+  snprintf(labels, sizeof(labels), "subscriber=\"%s\"", subscriber->name);
+
+  system_metric_config_t configs[] = {
+      {"router_delivered_total", "Messages given to a subscriber",
+       SYSTEM_METRIC_COUNTER, labels},
+      {"router_dropped_total", "Messages a full subscriber lost",
+       SYSTEM_METRIC_COUNTER, labels},
+      {"router_queue_high_water", "Most messages a subscriber has had queued",
+       SYSTEM_METRIC_GAUGE, labels},
+  };
+  system_metric_handle_t *handles[] = {
+      &subscriber->metrics.delivered,
+      &subscriber->metrics.dropped,
+      &subscriber->metrics.queue_high_water,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]), TAG,
+                        "Failed to register '%s'", configs[i].name);
+  }
+
+  return ESP_OK;
+}
+
+static bool app_router_is_high(protocol_message_type_t type) {
+  const protocol_message_type_info_t *info = protocol_message_type_get(type);
+  return info != NULL && info->priority == PROTOCOL_MESSAGE_PRIORITY_HIGH;
+}
+
+static uint32_t app_router_high_types(uint32_t types) {
+  uint32_t high_types = 0;
+  for (int32_t type = 0; type < PROTOCOL_MESSAGE_TYPE_MAX; type++) {
+    if ((types & APP_ROUTER_TYPE_BIT(type)) && app_router_is_high(type)) {
+      high_types |= APP_ROUTER_TYPE_BIT(type);
+    }
+  }
+  return high_types;
+}
+
+esp_err_t
+app_router_subscribe(app_router_handle_t router_handle,
+                     app_router_subscriber_handle_t *subscriber_handle_ptr,
+                     const app_router_subscriber_config_t *config) {
+  esp_err_t ret = ESP_OK;
+  app_router_subscriber_handle_t subscriber = NULL;
+
+  ESP_RETURN_ON_FALSE(config->filter.types != 0, ESP_ERR_INVALID_ARG, TAG,
+                      "Subscriber '%s' has no types", config->name);
+  ESP_RETURN_ON_FALSE(config->handler != NULL || config->queue_depth > 0,
+                      ESP_ERR_INVALID_ARG, TAG,
+                      "Subscriber '%s' needs a handler or a queue",
+                      config->name);
+
+  xSemaphoreTake(router_handle->mutex, portMAX_DELAY);
+
+  int32_t count = atomic_load(&router_handle->subscriber_count);
+  ESP_GOTO_ON_FALSE(count < APP_ROUTER_MAX_SUBSCRIBERS, ESP_ERR_NO_MEM,
+                    app_router_subscribe_end, TAG,
+                    "Too many subscribers, can't add '%s'", config->name);
+
+  subscriber = (app_router_subscriber_handle_t)calloc(
+      1, sizeof(app_router_subscriber_t));
+  ESP_GOTO_ON_FALSE(subscriber != NULL, ESP_ERR_NO_MEM,
+                    app_router_subscribe_end, TAG,
+                    "Failed to allocate subscriber '%s'", config->name);
+
+  subscriber->name = config->name;
+  subscriber->filter = config->filter;
+  subscriber->overflow = config->overflow;
+  subscriber->block_ticks = config->block_ticks;
+  subscriber->handler = config->handler;
+  subscriber->handler_ctx = config->handler_ctx;
+
+  ESP_GOTO_ON_ERROR(app_router_metrics_init(subscriber),
+                    app_router_subscribe_end, TAG,
+                    "Failed to register metrics for '%s'", config->name);
+
+  if (subscriber->handler == NULL) {
+    subscriber->queue =
+        xQueueCreate(config->queue_depth, sizeof(protocol_message_handle_t));
+    ESP_GOTO_ON_FALSE(subscriber->queue != NULL, ESP_ERR_NO_MEM,
+                      app_router_subscribe_end, TAG,
+                      "Failed to create queue for '%s'", config->name);
+  }
+
+  uint32_t high_types = app_router_high_types(subscriber->filter.types);
+  if (subscriber->handler == NULL && high_types != 0 &&
+      high_types != subscriber->filter.types) {
+    subscriber->priority_queue =
+        xQueueCreate(config->queue_depth, sizeof(protocol_message_handle_t));
+    // both queues full, and the count a reader took for a dropped message
+    subscriber->pending =
+        xSemaphoreCreateCounting(2 * config->queue_depth + 1, 0);
+    ESP_GOTO_ON_FALSE(subscriber->priority_queue != NULL &&
+                          subscriber->pending != NULL,
+                      ESP_ERR_NO_MEM, app_router_subscribe_end, TAG,
+                      "Failed to create priority queue for '%s'",
+                      config->name);
+  }
+
+  // publishers read the count without the lock, so the slot must be filled in
+  // before the count covers it.
+  router_handle->subscribers[count] = subscriber;
+  atomic_store_explicit(&router_handle->subscriber_count, count + 1,
+                        memory_order_release);
+  atomic_fetch_or(&router_handle->types, subscriber->filter.types);
+
+  *subscriber_handle_ptr = subscriber;
+
+app_router_subscribe_end:
+  if (ret != ESP_OK) {
+    free(subscriber);
+  }
+  xSemaphoreGive(router_handle->mutex);
+  return ret;
+}
+
+bool app_router_has_subscribers(app_router_handle_t router_handle,
+                                protocol_message_type_t type) {
+  if ((uint32_t)type >= PROTOCOL_MESSAGE_TYPE_MAX) {
+    return false;
+  }
+
+  return (atomic_load_explicit(&router_handle->types, memory_order_relaxed) &
+          APP_ROUTER_TYPE_BIT(type)) != 0;
+}
+
+static bool app_router_matches(app_router_subscriber_handle_t subscriber,
+                               protocol_message_handle_t message) {
+  if (!(subscriber->filter.types & APP_ROUTER_TYPE_BIT(message->header.type))) {
+    return false;
+  }
+
+  if (subscriber->filter.match_from &&
+      memcmp(subscriber->filter.from_mac_address,
+             message->header.from_mac_address,
+             sizeof(protocol_mac_address_t)) != 0) {
+    return false;
+  }
+
+  if (subscriber->filter.match_to &&
+      memcmp(subscriber->filter.to_mac_address, message->header.to_mac_address,
+             sizeof(protocol_mac_address_t)) != 0) {
+    return false;
+  }
+
+  return true;
+}
+
+static void app_router_queued(app_router_subscriber_handle_t subscriber) {
+  if (subscriber->pending != NULL) {
+    xSemaphoreGive(subscriber->pending);
+  }
+  system_metrics_max(subscriber->metrics.queue_high_water,
+                     app_router_waiting(subscriber));
+}
+
+// The subscriber gets its own reference. Returns false if it was dropped.
+// Every message lost here counts as exactly one drop.
+static bool app_router_deliver(app_router_subscriber_handle_t subscriber,
+                               protocol_message_handle_t message,
+                               bool high) {
+  protocol_message_ref(message);
+
+  if (subscriber->handler != NULL) {
+    if (subscriber->handler(message, subscriber->handler_ctx) == ESP_OK) {
+      return true;
+    }
+    protocol_message_free(message);
+    system_metrics_add(subscriber->metrics.dropped, 1);
+    return false;
+  }
+
+  // always to the back, so each queue stays in the order of publishing
+  QueueHandle_t queue = subscriber->queue;
+  if (high && subscriber->priority_queue != NULL) {
+    queue = subscriber->priority_queue;
+  }
+
+  TickType_t ticks_to_wait = 0;
+  if (subscriber->overflow == APP_ROUTER_OVERFLOW_BLOCK) {
+    ticks_to_wait = subscriber->block_ticks;
+  }
+  if (xQueueSendToBack(queue, &message, ticks_to_wait) == pdPASS) {
+    app_router_queued(subscriber);
+    return true;
+  }
+
+  if (subscriber->overflow == APP_ROUTER_OVERFLOW_DROP_OLDEST) {
+    // the oldest of the same priority, the other queue may not be full
+    protocol_message_handle_t oldest = NULL;
+    if (xQueueReceive(queue, &oldest, 0) == pdPASS) {
+      if (subscriber->pending != NULL) {
+        // if the reader already took its count, it finds nothing and waits
+        // again
+        xSemaphoreTake(subscriber->pending, 0);
+      }
+      protocol_message_free(oldest);
+      system_metrics_add(subscriber->metrics.dropped, 1);
+    }
+    // the reader may have made room too, either way try once more
+    if (xQueueSendToBack(queue, &message, 0) == pdPASS) {
+      app_router_queued(subscriber);
+      return true;
+    }
+  }
+
+  protocol_message_free(message);
+  system_metrics_add(subscriber->metrics.dropped, 1);
+  return false;
+}
+
+void app_router_set_gate(app_router_handle_t router_handle,
+                         app_router_gate_t gate, void *ctx) {
+  router_handle->gate_ctx = ctx;
+  router_handle->gate = gate;
+}
+
+esp_err_t app_router_publish(app_router_handle_t router_handle,
+                             protocol_message_handle_t *message_ptr) {
+  protocol_message_handle_t message = *message_ptr;
+  *message_ptr = NULL;
+
+  if (router_handle->gate != NULL &&
+      !router_handle->gate(message, router_handle->gate_ctx)) {
+    protocol_message_free(message);
+    return ESP_OK;
+  }
+
+  bool high = app_router_is_high(message->header.type);
+
+  int32_t count = atomic_load_explicit(&router_handle->subscriber_count,
+                                       memory_order_acquire);
+  int32_t delivered = 0;
+
+  for (int32_t i = 0; i < count; i++) {
+    app_router_subscriber_handle_t subscriber = router_handle->subscribers[i];
+    if (!app_router_matches(subscriber, message)) {
+      continue;
+    }
+
+    if (app_router_deliver(subscriber, message, high)) {
+      SYSTEM_TRACE(SYSTEM_TRACE_ROUTER_PUBLISH, message->header.uuid);
+      system_metrics_add(subscriber->metrics.delivered, 1);
+      delivered++;
+    } else {
+      SYSTEM_TRACE(SYSTEM_TRACE_ROUTER_DROP, message->header.uuid);
+      ESP_LOGW(TAG, "'%s' is full, dropped message type %d", subscriber->name,
+               message->header.type);
+    }
+  }
+
+  // drop the publisher's reference
+  protocol_message_free(message);
+
+  return delivered > 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t app_router_receive(app_router_subscriber_handle_t subscriber_handle,
+                             protocol_message_handle_t *message_ptr,
+                             TickType_t ticks_to_wait) {
+  if (subscriber_handle->queue == NULL) {
+    *message_ptr = NULL;
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if (subscriber_handle->pending == NULL) {
+    if (xQueueReceive(subscriber_handle->queue, message_ptr, ticks_to_wait) !=
+        pdPASS) {
+      *message_ptr = NULL;
+      return ESP_ERR_TIMEOUT;
+    }
+    SYSTEM_TRACE(SYSTEM_TRACE_ROUTER_RECEIVE, (*message_ptr)->header.uuid);
+    return ESP_OK;
+  }
+
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  while (true) {
+    if (xSemaphoreTake(subscriber_handle->pending, ticks_to_wait) != pdTRUE) {
+      *message_ptr = NULL;
+      return ESP_ERR_TIMEOUT;
+    }
+    if (xQueueReceive(subscriber_handle->priority_queue, message_ptr, 0) ==
+            pdPASS ||
+        xQueueReceive(subscriber_handle->queue, message_ptr, 0) == pdPASS) {
+      SYSTEM_TRACE(SYSTEM_TRACE_ROUTER_RECEIVE, (*message_ptr)->header.uuid);
+      return ESP_OK;
+    }
+    // what it counted was dropped to make room, wait for the rest of the time
+    if (xTaskCheckForTimeOut(&timeout, &ticks_to_wait) != pdFALSE) {
+      *message_ptr = NULL;
+      return ESP_ERR_TIMEOUT;
+    }
+  }
+}
+
+uint32_t app_router_waiting(app_router_subscriber_handle_t subscriber_handle) {
+  if (subscriber_handle->queue == NULL) {
+    return 0;
+  }
+
+  uint32_t waiting = uxQueueMessagesWaiting(subscriber_handle->queue);
+  if (subscriber_handle->priority_queue != NULL) {
+    waiting += uxQueueMessagesWaiting(subscriber_handle->priority_queue);
+  }
+  return waiting;
+}
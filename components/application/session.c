@@ -0,0 +1,506 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include <string.h>
+
+#include "application/session.h"
+#include "storage/settings.h"
+
+static const char *TAG = "APPLICATION:SESSION";
+
+// audio's priority, so floor control never waits behind texts
+#define APP_SESSION_TYPE(type_name)                                            \
+  {                                                                            \
+      .name = type_name,                                                       \
+      .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,                                 \
+      .max_length = sizeof(app_session_floor_t),                               \
+      .priority = PROTOCOL_MESSAGE_PRIORITY_HIGH,                              \
+  }
+
+static const protocol_message_type_info_t TYPE_TALK_START =
+    APP_SESSION_TYPE("talk_start");
+static const protocol_message_type_info_t TYPE_TALK_STOP =
+    APP_SESSION_TYPE("talk_stop");
+static const protocol_message_type_info_t TYPE_FLOOR_GRANT =
+    APP_SESSION_TYPE("floor_grant");
+static const protocol_message_type_info_t TYPE_FLOOR_DENY =
+    APP_SESSION_TYPE("floor_deny");
+
+// what the listener is told once the lock is released
+typedef struct app_session_change_t {
+  bool changed;
+  bool held;
+  bool ours;
+  app_session_floor_t floor;
+} app_session_change_t;
+
+static bool app_session_mac_equal(const protocol_mac_address_t a,
+                                  const protocol_mac_address_t b) {
+  return memcmp(a, b, sizeof(protocol_mac_address_t)) == 0;
+}
+
+static bool app_session_is_ours(app_session_handle_t session,
+                                const protocol_mac_address_t mac_address) {
+  return app_session_mac_equal(mac_address, session->device_info->mac_address);
+}
+
+// the order every station agrees on
+static bool app_session_outranks(const protocol_mac_address_t a,
+                                 const protocol_mac_address_t b) {
+  return memcmp(a, b, sizeof(protocol_mac_address_t)) < 0;
+}
+
+static int64_t app_session_window_us() {
+  return (int64_t)storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) *
+         1000;
+}
+
+// A TALK_START's `talk_id` is filled in with the message's own UUID.
+static esp_err_t app_session_send(app_session_handle_t session,
+                                  protocol_message_type_t type,
+                                  protocol_mac_address_t to_mac_address,
+                                  app_session_floor_t *floor) {
+  protocol_message_handle_t message = NULL;
+  esp_err_t ret = protocol_message_init(
+      &message, type, sizeof(app_session_floor_t),
+      session->device_info->mac_address, to_mac_address);
+  ESP_RETURN_ON_ERROR(ret, TAG, "Failed to create floor message");
+
+  if (type == MESSAGE_TYPE_TALK_START) {
+    memcpy(floor->talk_id, message->header.uuid,
+           sizeof(protocol_message_uuid_t));
+  }
+  ret = protocol_message_set_payload(message, floor);
+  if (ret == ESP_OK) {
+    // never waits, a lost floor message is repaired by the announcements
+    ret = app_queues_add_outgoing_message(session->queues, &message, 0, true);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to send floor message type %d", type);
+    protocol_message_free(message);
+  }
+  return ret;
+}
+
+static void app_session_changed_locked(app_session_handle_t session,
+                                       app_session_change_t *change) {
+  change->changed = true;
+  change->held = session->held;
+  change->ours = session->held && app_session_is_ours(session,
+                                                      session->floor.talker);
+  change->floor = session->floor;
+}
+
+static void app_session_notify(app_session_handle_t session,
+                               const app_session_change_t *change) {
+  if (!change->changed || session->listener == NULL) {
+    return;
+  }
+  session->listener(change->held ? &change->floor : NULL, change->ours,
+                    session->listener_ctx);
+}
+
+static void app_session_take_locked(app_session_handle_t session,
+                                    const app_session_floor_t *floor,
+                                    int64_t now_us,
+                                    app_session_change_t *change) {
+  bool same_talker =
+      session->held &&
+      app_session_mac_equal(session->floor.talker, floor->talker);
+  session->heard_us = now_us;
+  if (same_talker) {
+    memcpy(session->floor.talk_id, floor->talk_id,
+           sizeof(protocol_message_uuid_t));
+    return;
+  }
+
+  if (session->held && app_session_is_ours(session, session->floor.talker)) {
+    esp_timer_stop(session->announce_timer);
+    system_metrics_add(session->metrics.preempted, 1);
+    ESP_LOGI(TAG, "Lost the floor to %02X:%02X:%02X:%02X:%02X:%02X",
+             floor->talker[0], floor->talker[1], floor->talker[2],
+             floor->talker[3], floor->talker[4], floor->talker[5]);
+  }
+
+  session->held = true;
+  session->floor = *floor;
+  session->taken_us = now_us;
+  session->confirmed = false;
+  app_session_changed_locked(session, change);
+}
+
+static void app_session_release_locked(app_session_handle_t session,
+                                       app_session_change_t *change) {
+  if (!session->held) {
+    return;
+  }
+  if (app_session_is_ours(session, session->floor.talker)) {
+    esp_timer_stop(session->announce_timer);
+  }
+  session->held = false;
+  app_session_changed_locked(session, change);
+}
+
+static void app_session_heard_locked(app_session_handle_t session,
+                                     const protocol_mac_address_t talker,
+                                     int64_t now_us) {
+  memcpy(session->direct.talker, talker, sizeof(protocol_mac_address_t));
+  session->direct.heard_us = now_us;
+}
+
+// Someone else's floor ends when they go quiet, ours when we stop.
+static void app_session_expire_locked(app_session_handle_t session,
+                                      int64_t now_us,
+                                      app_session_change_t *change) {
+  if (session->held && !app_session_is_ours(session, session->floor.talker) &&
+      now_us - session->heard_us > APP_SESSION_TALKER_TIMEOUT_MS * 1000LL) {
+    ESP_LOGI(TAG, "Talker timed out");
+    app_session_release_locked(session, change);
+  }
+}
+
+// A station says it has the floor, with a TALK_START or FLOOR_GRANT.
+static void app_session_claim_locked(app_session_handle_t session,
+                                     app_session_floor_t *floor, bool grant,
+                                     int64_t now_us,
+                                     app_session_change_t *change) {
+  if (!session->held ||
+      app_session_mac_equal(session->floor.talker, floor->talker)) {
+    app_session_take_locked(session, floor, now_us, change);
+    return;
+  }
+
+  // A grant comes from a station that thinks it won, so it's always a
+  // collision. Resolving it the same way everywhere converges on one talker.
+  if (grant || now_us - session->taken_us < app_session_window_us()) {
+    system_metrics_add(session->metrics.collisions, 1);
+    if (app_session_outranks(floor->talker, session->floor.talker)) {
+      app_session_take_locked(session, floor, now_us, change);
+      return;
+    }
+  }
+
+  // The talker keeps the floor, and tells the other station in case it
+  // missed the start.
+  if (app_session_is_ours(session, session->floor.talker)) {
+    app_session_send(session, MESSAGE_TYPE_FLOOR_DENY, floor->talker,
+                     &session->floor);
+  }
+}
+
+// Runs on the UDP read task, so it only ever waits on the session lock.
+static esp_err_t app_session_handle_message(protocol_message_handle_t message,
+                                            void *ctx) {
+  app_session_handle_t session = (app_session_handle_t)ctx;
+  app_session_change_t change = {0};
+  app_session_floor_t floor;
+  int64_t now_us = esp_timer_get_time();
+
+  if (message->header.length != sizeof(app_session_floor_t) ||
+      app_session_is_ours(session, message->header.from_mac_address)) {
+    protocol_message_free(message);
+    return ESP_OK;
+  }
+  memcpy(&floor, message->raw.value, sizeof(app_session_floor_t));
+  bool from_talker =
+      app_session_mac_equal(floor.talker, message->header.from_mac_address);
+
+  xSemaphoreTake(session->mutex, portMAX_DELAY);
+  app_session_expire_locked(session, now_us, &change);
+
+  switch (message->header.type) {
+  case MESSAGE_TYPE_TALK_START:
+  case MESSAGE_TYPE_FLOOR_GRANT:
+    if (from_talker) {
+      app_session_heard_locked(session, floor.talker, now_us);
+      app_session_claim_locked(session, &floor,
+                               message->header.type ==
+                                   MESSAGE_TYPE_FLOOR_GRANT,
+                               now_us, &change);
+    }
+    break;
+  case MESSAGE_TYPE_TALK_STOP:
+    if (from_talker &&
+        app_session_mac_equal(session->direct.talker, floor.talker)) {
+      session->direct.heard_us = 0;
+    }
+    if (from_talker && session->held &&
+        app_session_mac_equal(session->floor.talker, floor.talker)) {
+      app_session_release_locked(session, &change);
+    }
+    break;
+  case MESSAGE_TYPE_FLOOR_DENY:
+    // only the talker denies, and only to the station it's denying
+    if (from_talker &&
+        app_session_is_ours(session, message->header.to_mac_address) &&
+        session->held &&
+        app_session_is_ours(session, session->floor.talker)) {
+      app_session_take_locked(session, &floor, now_us, &change);
+    }
+    break;
+  default:
+    break;
+  }
+
+  xSemaphoreGive(session->mutex);
+  app_session_notify(session, &change);
+
+  protocol_message_free(message);
+  return ESP_OK;
+}
+
+// Ends our collision window, then repeats the grant while we talk.
+static void app_session_announce_callback(void *arg) {
+  app_session_handle_t session = (app_session_handle_t)arg;
+
+  xSemaphoreTake(session->mutex, portMAX_DELAY);
+  if (session->held && app_session_is_ours(session, session->floor.talker)) {
+    session->confirmed = true;
+    app_session_send(session, MESSAGE_TYPE_FLOOR_GRANT, NULL, &session->floor);
+    esp_timer_start_once(session->announce_timer,
+                         APP_SESSION_ANNOUNCE_MS * 1000);
+  }
+  xSemaphoreGive(session->mutex);
+}
+
+esp_err_t app_session_talk_start(app_session_handle_t session_handle) {
+  app_session_change_t change = {0};
+  int64_t now_us = esp_timer_get_time();
+  esp_err_t ret = ESP_OK;
+
+  xSemaphoreTake(session_handle->mutex, portMAX_DELAY);
+  app_session_expire_locked(session_handle, now_us, &change);
+
+  // inside someone's collision window we'd win anyway
+  if (session_handle->held &&
+      !app_session_is_ours(session_handle, session_handle->floor.talker) &&
+      !(now_us - session_handle->taken_us < app_session_window_us() &&
+        app_session_outranks(session_handle->device_info->mac_address,
+                             session_handle->floor.talker))) {
+    system_metrics_add(session_handle->metrics.refused, 1);
+    ret = ESP_ERR_INVALID_STATE;
+    goto app_session_talk_start_end;
+  }
+
+  app_session_floor_t floor;
+  memcpy(floor.talker, session_handle->device_info->mac_address,
+         sizeof(protocol_mac_address_t));
+  ESP_GOTO_ON_ERROR(app_session_send(session_handle, MESSAGE_TYPE_TALK_START,
+                                     NULL, &floor),
+                    app_session_talk_start_end, TAG,
+                    "Failed to announce the talk");
+
+  // a press while already talking starts a new talk
+  session_handle->held = false;
+  app_session_take_locked(session_handle, &floor, now_us, &change);
+  system_metrics_add(session_handle->metrics.talks, 1);
+
+  esp_timer_stop(session_handle->announce_timer);
+  esp_timer_start_once(session_handle->announce_timer,
+                       app_session_window_us());
+
+app_session_talk_start_end:
+  xSemaphoreGive(session_handle->mutex);
+  app_session_notify(session_handle, &change);
+  return ret;
+}
+
+void app_session_talk_stop(app_session_handle_t session_handle) {
+  app_session_change_t change = {0};
+
+  xSemaphoreTake(session_handle->mutex, portMAX_DELAY);
+  if (session_handle->held &&
+      app_session_is_ours(session_handle, session_handle->floor.talker)) {
+    app_session_send(session_handle, MESSAGE_TYPE_TALK_STOP, NULL,
+                     &session_handle->floor);
+    app_session_release_locked(session_handle, &change);
+  }
+  xSemaphoreGive(session_handle->mutex);
+  app_session_notify(session_handle, &change);
+}
+
+bool app_session_accepts_audio(app_session_handle_t session_handle,
+                               const protocol_mac_address_t from_mac_address) {
+  app_session_change_t change = {0};
+  int64_t now_us = esp_timer_get_time();
+  bool accepted = true;
+
+  xSemaphoreTake(session_handle->mutex, portMAX_DELAY);
+  app_session_expire_locked(session_handle, now_us, &change);
+  app_session_heard_locked(session_handle, from_mac_address, now_us);
+
+  if (!session_handle->held) {
+    // the start was lost, the talk wasn't
+    app_session_floor_t floor = {0};
+    memcpy(floor.talker, from_mac_address, sizeof(protocol_mac_address_t));
+    app_session_take_locked(session_handle, &floor, now_us, &change);
+  } else if (app_session_mac_equal(session_handle->floor.talker,
+                                   from_mac_address)) {
+    session_handle->heard_us = now_us;
+  } else {
+    accepted = false;
+  }
+
+  xSemaphoreGive(session_handle->mutex);
+  app_session_notify(session_handle, &change);
+  return accepted;
+}
+
+// Every heartbeat carries the sender's view of the floor, so a station that
+// joins mid-talk knows who's talking before the next announcement.
+static int32_t app_session_extension_fill(uint8_t *buffer, void *ctx) {
+  app_session_handle_t session = (app_session_handle_t)ctx;
+  int32_t length = 0;
+
+  xSemaphoreTake(session->mutex, portMAX_DELAY);
+  if (session->held) {
+    memcpy(buffer, &session->floor, sizeof(app_session_floor_t));
+    length = sizeof(app_session_floor_t);
+  }
+  xSemaphoreGive(session->mutex);
+  return length;
+}
+
+static void app_session_extension_receive(protocol_message_handle_t heartbeat,
+                                          const uint8_t *extension,
+                                          int32_t length, void *ctx) {
+  app_session_handle_t session = (app_session_handle_t)ctx;
+  const uint8_t *from_mac_address = heartbeat->header.from_mac_address;
+  app_session_change_t change = {0};
+  app_session_floor_t floor;
+  int64_t now_us = esp_timer_get_time();
+
+  if (length < (int32_t)sizeof(app_session_floor_t)) {
+    return;
+  }
+  memcpy(&floor, extension, sizeof(app_session_floor_t));
+
+  bool from_talker = app_session_mac_equal(floor.talker, from_mac_address);
+
+  xSemaphoreTake(session->mutex, portMAX_DELAY);
+  app_session_expire_locked(session, now_us, &change);
+  if (from_talker) {
+    app_session_heard_locked(session, floor.talker, now_us);
+  }
+  // Never our own floor, a peer that missed our TALK_STOP still names us.
+  // Anyone else's only while we've heard them talk ourselves lately.
+  bool adopt = !app_session_is_ours(session, floor.talker) &&
+               app_session_mac_equal(session->direct.talker, floor.talker) &&
+               session->direct.heard_us != 0 &&
+               now_us - session->direct.heard_us <=
+                   APP_SESSION_TALKER_TIMEOUT_MS * 1000LL;
+  if (!session->held && adopt) {
+    app_session_take_locked(session, &floor, now_us, &change);
+    // heard second hand, so nothing to collide with
+    session->taken_us -= app_session_window_us();
+    // only the talker itself keeps its floor alive
+    session->heard_us = session->direct.heard_us;
+  } else if (session->held && from_talker &&
+             app_session_mac_equal(session->floor.talker, floor.talker)) {
+    session->heard_us = now_us;
+  }
+  xSemaphoreGive(session->mutex);
+  app_session_notify(session, &change);
+}
+
+void app_session_set_listener(app_session_handle_t session_handle,
+                              app_session_listener_t listener, void *ctx) {
+  session_handle->listener_ctx = ctx;
+  session_handle->listener = listener;
+}
+
+static esp_err_t app_session_metrics_init(app_session_handle_t session) {
+  struct {
+    system_metric_handle_t *metric;
+    system_metric_config_t config;
+  } counters[] = {
+      {&session->metrics.talks,
+       {"session_talks_total", "Talk presses that got the floor",
+        SYSTEM_METRIC_COUNTER, NULL}},
+      {&session->metrics.refused,
+       {"session_refused_total", "Talk presses while someone else talked",
+        SYSTEM_METRIC_COUNTER, NULL}},
+      {&session->metrics.collisions,
+       {"session_collisions_total",
+        "Talk starts inside another's collision window",
+        SYSTEM_METRIC_COUNTER, NULL}},
+      {&session->metrics.preempted,
+       {"session_preempted_total", "Times another station took our floor",
+        SYSTEM_METRIC_COUNTER, NULL}},
+  };
+
+  for (int32_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+    ESP_RETURN_ON_ERROR(
+        system_metrics_register(counters[i].metric, &counters[i].config), TAG,
+        "Failed to register '%s'", counters[i].config.name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t app_session_init(app_session_handle_t *session_handle_ptr,
+                           app_device_info_handle_t device_info_handle,
+                           app_queues_handle_t queues_handle,
+                           app_peers_handle_t peers_handle) {
+  app_session_handle_t session =
+      (app_session_handle_t)calloc(1, sizeof(app_session_t));
+  ESP_RETURN_ON_FALSE(session != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to allocate session");
+
+  session->device_info = device_info_handle;
+  session->queues = queues_handle;
+  session->peers = peers_handle;
+  session->mutex = xSemaphoreCreateMutex();
+  ESP_RETURN_ON_FALSE(session->mutex != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to create session mutex");
+
+  ESP_RETURN_ON_ERROR(app_session_metrics_init(session), TAG,
+                      "Failed to register metrics");
+
+  ESP_RETURN_ON_ERROR(
+      protocol_message_type_register(MESSAGE_TYPE_TALK_START, &TYPE_TALK_START),
+      TAG, "Failed to register talk_start");
+  ESP_RETURN_ON_ERROR(
+      protocol_message_type_register(MESSAGE_TYPE_TALK_STOP, &TYPE_TALK_STOP),
+      TAG, "Failed to register talk_stop");
+  ESP_RETURN_ON_ERROR(protocol_message_type_register(MESSAGE_TYPE_FLOOR_GRANT,
+                                                     &TYPE_FLOOR_GRANT),
+                      TAG, "Failed to register floor_grant");
+  ESP_RETURN_ON_ERROR(
+      protocol_message_type_register(MESSAGE_TYPE_FLOOR_DENY, &TYPE_FLOOR_DENY),
+      TAG, "Failed to register floor_deny");
+
+  esp_timer_create_args_t announce_args = {
+      .callback = app_session_announce_callback,
+      .arg = session,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "session_announce",
+  };
+  ESP_RETURN_ON_ERROR(
+      esp_timer_create(&announce_args, &session->announce_timer), TAG,
+      "Failed to create announce timer");
+
+  // handled on the receiving task, a queue hop would cost more than the
+  // arbitration itself
+  app_router_subscriber_config_t messages_config = {
+      .name = "session",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_TALK_START) |
+                          APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_TALK_STOP) |
+                          APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_FLOOR_GRANT) |
+                          APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_FLOOR_DENY)},
+      .handler = app_session_handle_message,
+      .handler_ctx = session,
+  };
+  ESP_RETURN_ON_ERROR(app_router_subscribe(queues_handle->incoming,
+                                           &session->messages,
+                                           &messages_config),
+                      TAG, "Failed to subscribe to floor messages");
+
+  ESP_RETURN_ON_ERROR(app_peers_add_heartbeat_extension(
+                          peers_handle, APP_PEERS_EXTENSION_FLOOR,
+                          app_session_extension_fill,
+                          app_session_extension_receive, session),
+                      TAG, "Failed to extend heartbeats");
+
+  *session_handle_ptr = session;
+
+  return ESP_OK;
+}
@@ -0,0 +1,190 @@
+#include <math.h>
+#include <string.h>
+
+#include "audio/comfort_noise.h"
+
+// the mean square of a full scale square wave, 0 dBov
+#define AUDIO_COMFORT_NOISE_FULL_SCALE (32767.0f * 32767.0f)
+// Added to lag 0, like a faint white noise floor. Keeps Levinson-Durbin
+// stable on very quiet or very tonal frames.
+#define AUDIO_COMFORT_NOISE_WHITE_FLOOR 1.0001f
+// keeps the synthesis filter stable after quantization
+#define AUDIO_COMFORT_NOISE_REFLECTION_MAX 0.99f
+
+// // ----------------
+// // Analysis
+// // ----------------
+
+void audio_comfort_noise_analyzer_reset(
+    audio_comfort_noise_analyzer_t *analyzer) {
+  memset(analyzer, 0, sizeof(audio_comfort_noise_analyzer_t));
+}
+
+void audio_comfort_noise_analyze(audio_comfort_noise_analyzer_t *analyzer,
+                                 const int16_t *samples, int32_t count) {
+  float autocorrelation[AUDIO_COMFORT_NOISE_ORDER + 1] = {0};
+
+  if (count <= AUDIO_COMFORT_NOISE_ORDER) {
+    return;
+  }
+
+  for (int32_t lag = 0; lag <= AUDIO_COMFORT_NOISE_ORDER; lag++) {
+    float sum = 0;
+    for (int32_t i = lag; i < count; i++) {
+      sum += (float)samples[i] * (float)samples[i - lag];
+    }
+    autocorrelation[lag] = sum / (float)count;
+  }
+
+  for (int32_t lag = 0; lag <= AUDIO_COMFORT_NOISE_ORDER; lag++) {
+    if (analyzer->primed) {
+      analyzer->autocorrelation[lag] +=
+          AUDIO_COMFORT_NOISE_SMOOTHING *
+          (autocorrelation[lag] - analyzer->autocorrelation[lag]);
+    } else {
+      analyzer->autocorrelation[lag] = autocorrelation[lag];
+    }
+  }
+  analyzer->primed = true;
+}
+
+static uint8_t audio_comfort_noise_level_of(float mean_square) {
+  if (mean_square <= 0) {
+    return AUDIO_COMFORT_NOISE_LEVEL_MAX;
+  }
+
+  float level = -10.0f * log10f(mean_square / AUDIO_COMFORT_NOISE_FULL_SCALE);
+  if (level < 0) {
+    return 0;
+  }
+  if (level > AUDIO_COMFORT_NOISE_LEVEL_MAX) {
+    return AUDIO_COMFORT_NOISE_LEVEL_MAX;
+  }
+  return (uint8_t)(level + 0.5f);
+}
+
+uint8_t
+audio_comfort_noise_level(const audio_comfort_noise_analyzer_t *analyzer) {
+  return audio_comfort_noise_level_of(analyzer->autocorrelation[0]);
+}
+
+static uint8_t audio_comfort_noise_quantize(float reflection) {
+  int32_t value = 127 + (int32_t)lroundf(reflection * 128.0f);
+  if (value < 0) {
+    return 0;
+  }
+  if (value > 254) {
+    return 254;
+  }
+  return (uint8_t)value;
+}
+
+// Levinson-Durbin, keeping only the reflection coefficients.
+void audio_comfort_noise_describe(
+    const audio_comfort_noise_analyzer_t *analyzer,
+    audio_comfort_noise_descriptor_t *descriptor) {
+  const float *r = analyzer->autocorrelation;
+  float predictor[AUDIO_COMFORT_NOISE_ORDER + 1] = {0};
+  float previous[AUDIO_COMFORT_NOISE_ORDER + 1];
+  float error = r[0] * AUDIO_COMFORT_NOISE_WHITE_FLOOR;
+
+  descriptor->level = audio_comfort_noise_level_of(r[0]);
+
+  for (int32_t i = 1; i <= AUDIO_COMFORT_NOISE_ORDER; i++) {
+    float reflection = 0;
+    if (error > 0) {
+      float acc = r[i];
+      for (int32_t j = 1; j < i; j++) {
+        acc += predictor[j] * r[i - j];
+      }
+      reflection = -acc / error;
+    }
+    if (reflection > AUDIO_COMFORT_NOISE_REFLECTION_MAX) {
+      reflection = AUDIO_COMFORT_NOISE_REFLECTION_MAX;
+    } else if (reflection < -AUDIO_COMFORT_NOISE_REFLECTION_MAX) {
+      reflection = -AUDIO_COMFORT_NOISE_REFLECTION_MAX;
+    }
+
+    memcpy(previous, predictor, sizeof(predictor));
+    for (int32_t j = 1; j < i; j++) {
+      predictor[j] = previous[j] + reflection * previous[i - j];
+    }
+    predictor[i] = reflection;
+    error *= 1.0f - reflection * reflection;
+
+    descriptor->reflection[i - 1] = audio_comfort_noise_quantize(reflection);
+  }
+}
+
+// // ----------------
+// // Synthesis
+// // ----------------
+
+void audio_comfort_noise_init(audio_comfort_noise_t *noise, uint32_t seed) {
+  memset(noise, 0, sizeof(audio_comfort_noise_t));
+  // xorshift never leaves 0
+  noise->seed = seed != 0 ? seed : 1;
+}
+
+void audio_comfort_noise_set(
+    audio_comfort_noise_t *noise,
+    const audio_comfort_noise_descriptor_t *descriptor) {
+  // the filter's gain is 1 / prod(1 - k^2), so the excitation is scaled down
+  // by that much for the output to have the descriptor's level
+  float gain = 1.0f;
+  for (int32_t i = 0; i < AUDIO_COMFORT_NOISE_ORDER; i++) {
+    float reflection = ((float)descriptor->reflection[i] - 127.0f) / 128.0f;
+    if (reflection > AUDIO_COMFORT_NOISE_REFLECTION_MAX) {
+      reflection = AUDIO_COMFORT_NOISE_REFLECTION_MAX;
+    } else if (reflection < -AUDIO_COMFORT_NOISE_REFLECTION_MAX) {
+      reflection = -AUDIO_COMFORT_NOISE_REFLECTION_MAX;
+    }
+    noise->reflection[i] = reflection;
+    gain *= 1.0f - reflection * reflection;
+  }
+
+  if (descriptor->level >= AUDIO_COMFORT_NOISE_LEVEL_MAX) {
+    noise->gain = 0;
+    return;
+  }
+  float mean_square = AUDIO_COMFORT_NOISE_FULL_SCALE *
+                      powf(10.0f, -(float)descriptor->level / 10.0f);
+  // the excitation is uniform in [-1, 1), a mean square of 1/3
+  noise->gain = sqrtf(3.0f * mean_square * gain);
+}
+
+static float audio_comfort_noise_random(audio_comfort_noise_t *noise) {
+  uint32_t x = noise->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  noise->seed = x;
+  return (float)(int32_t)x / 2147483648.0f;
+}
+
+void audio_comfort_noise_generate(audio_comfort_noise_t *noise,
+                                  int16_t *samples, int32_t count) {
+  float *b = noise->backward;
+  const float *k = noise->reflection;
+
+  if (noise->gain == 0) {
+    memset(samples, 0, count * sizeof(int16_t));
+    return;
+  }
+
+  for (int32_t n = 0; n < count; n++) {
+    float f = noise->gain * audio_comfort_noise_random(noise);
+    for (int32_t m = AUDIO_COMFORT_NOISE_ORDER; m >= 1; m--) {
+      f -= k[m - 1] * b[m - 1];
+      b[m] = k[m - 1] * f + b[m - 1];
+    }
+    b[0] = f;
+
+    if (f > 32767.0f) {
+      f = 32767.0f;
+    } else if (f < -32768.0f) {
+      f = -32768.0f;
+    }
+    samples[n] = (int16_t)f;
+  }
+}
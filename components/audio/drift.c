@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "audio/drift.h"
+#include "system/memory.h"
+
+esp_err_t audio_drift_init(audio_drift_handle_t *drift_handle_ptr) {
+  audio_drift_handle_t drift_handle =
+      (audio_drift_handle_t)system_memory_calloc(1, sizeof(audio_drift_t),
+                                                 SYSTEM_MEMORY_FAST);
+  if (drift_handle == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  audio_drift_reset(drift_handle);
+
+  *drift_handle_ptr = drift_handle;
+
+  return ESP_OK;
+}
+
+void audio_drift_reset(audio_drift_handle_t drift_handle) {
+  memset(drift_handle, 0, sizeof(audio_drift_t));
+  drift_handle->bucket_start_us = -1;
+}
+
+static double audio_drift_slope(audio_drift_handle_t drift) {
+  double denominator = drift->weight * drift->sum_xx -
+                       drift->sum_x * drift->sum_x;
+  if (denominator <= 0) {
+    return 0;
+  }
+  return (drift->weight * drift->sum_xy - drift->sum_x * drift->sum_y) /
+         denominator;
+}
+
+// false when the group is too far off the line to be the same sender
+static bool audio_drift_fit(audio_drift_handle_t drift) {
+  double x = (drift->bucket_arrival_us - drift->first_arrival_us) / 1e6;
+  double y = (double)(drift->bucket_delay_us - drift->origin_delay_us);
+
+  if (drift->buckets >= AUDIO_DRIFT_MIN_BUCKETS) {
+    // where the line says this group's delay should be
+    double slope = audio_drift_slope(drift);
+    double intercept = (drift->sum_y - slope * drift->sum_x) / drift->weight;
+    double error = y - (intercept + slope * x);
+    if (error > AUDIO_DRIFT_RESET_MS * 1000.0 ||
+        error < -AUDIO_DRIFT_RESET_MS * 1000.0) {
+      return false;
+    }
+  }
+
+  double keep = 1.0 - (double)AUDIO_DRIFT_BUCKET_MS /
+                          (AUDIO_DRIFT_WINDOW_S * 1000.0);
+  drift->weight = keep * drift->weight + 1.0;
+  drift->sum_x = keep * drift->sum_x + x;
+  drift->sum_y = keep * drift->sum_y + y;
+  drift->sum_xx = keep * drift->sum_xx + x * x;
+  drift->sum_xy = keep * drift->sum_xy + x * y;
+  drift->buckets++;
+
+  if (drift->buckets < AUDIO_DRIFT_MIN_BUCKETS) {
+    return true;
+  }
+
+  // the delay grows as the sender falls behind us, at a us per s per ppm
+  double ppm = -audio_drift_slope(drift);
+  if (ppm > AUDIO_DRIFT_PPM_MAX) {
+    ppm = AUDIO_DRIFT_PPM_MAX;
+  } else if (ppm < -AUDIO_DRIFT_PPM_MAX) {
+    ppm = -AUDIO_DRIFT_PPM_MAX;
+  }
+  drift->drift_ppm = (float)ppm;
+  return true;
+}
+
+void audio_drift_update(audio_drift_handle_t drift_handle, int64_t sent_us,
+                        int64_t arrival_us) {
+  int64_t delay_us = arrival_us - sent_us;
+
+  if (drift_handle->bucket_start_us >= 0 &&
+      arrival_us - drift_handle->bucket_start_us <
+          AUDIO_DRIFT_BUCKET_MS * 1000LL) {
+    if (delay_us < drift_handle->bucket_delay_us) {
+      drift_handle->bucket_delay_us = delay_us;
+      drift_handle->bucket_arrival_us = arrival_us;
+    }
+    return;
+  }
+
+  if (drift_handle->bucket_start_us >= 0 && !audio_drift_fit(drift_handle)) {
+    audio_drift_reset(drift_handle);
+  }
+
+  if (drift_handle->bucket_start_us < 0) {
+    drift_handle->first_arrival_us = arrival_us;
+    drift_handle->origin_delay_us = delay_us;
+  }
+  drift_handle->bucket_start_us = arrival_us;
+  drift_handle->bucket_delay_us = delay_us;
+  drift_handle->bucket_arrival_us = arrival_us;
+}
+
+float audio_drift_ppm(audio_drift_handle_t drift_handle) {
+  return drift_handle->drift_ppm;
+}
+
+bool audio_drift_valid(audio_drift_handle_t drift_handle) {
+  return drift_handle->buckets >= AUDIO_DRIFT_MIN_BUCKETS;
+}
+
+float audio_drift_playout_ppm(audio_drift_handle_t drift_handle,
+                              float depth_ms, float target_ms) {
+  if (!drift_handle->depth_valid) {
+    drift_handle->depth_ms = depth_ms;
+    drift_handle->depth_valid = true;
+  } else {
+    drift_handle->depth_ms +=
+        AUDIO_DRIFT_DEPTH_SMOOTHING * (depth_ms - drift_handle->depth_ms);
+  }
+
+  // more buffered than wanted, so play it a little faster
+  float pull = AUDIO_DRIFT_DEPTH_PPM_PER_MS *
+               (drift_handle->depth_ms - target_ms);
+  if (pull > AUDIO_DRIFT_DEPTH_PPM_MAX) {
+    pull = AUDIO_DRIFT_DEPTH_PPM_MAX;
+  } else if (pull < -AUDIO_DRIFT_DEPTH_PPM_MAX) {
+    pull = -AUDIO_DRIFT_DEPTH_PPM_MAX;
+  }
+
+  return drift_handle->drift_ppm + pull;
+}
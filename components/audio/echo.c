@@ -0,0 +1,423 @@
+#include <math.h>
+#include <string.h>
+
+#include "audio/echo.h"
+#include "system/memory.h"
+
+// the playback, background filter and foreground filter spectra
+#define AUDIO_ECHO_SPECTRA 6
+
+// playback quieter than this mean square, about -60dBov, doesn't train the
+// filter before it has adapted
+#define AUDIO_ECHO_PLAYBACK_MIN 1000.0f
+// the playback spectrum's average moves by this over the partitions
+#define AUDIO_ECHO_POWER_SMOOTHING 0.35f
+// keeps the step finite on silent bins
+#define AUDIO_ECHO_POWER_MIN 10.0f
+// about the best attenuation to hope for, 33dB
+#define AUDIO_ECHO_LEAK_MIN 0.005f
+// the most of the error taken to be echo, the rest is the near end
+#define AUDIO_ECHO_RESIDUAL_MAX 0.5f
+// An output this much louder, mean square above the capture's, for this
+// many blocks in a row resets the filters.
+#define AUDIO_ECHO_DIVERGED_MIN 10000.0f
+#define AUDIO_ECHO_DIVERGED_BLOCKS 50
+// How sure the foreground has to be that the background went wrong before
+// copying itself back, against how sure the background has to be that it's
+// better. Going back is cheap, so it needs less.
+#define AUDIO_ECHO_FAST_CONFIDENCE 0.5f
+#define AUDIO_ECHO_SLOW_CONFIDENCE 0.25f
+#define AUDIO_ECHO_BACKTRACK 4.0f
+
+esp_err_t audio_echo_init(audio_echo_handle_t *echo_handle_ptr,
+                          uint32_t sample_rate_hz) {
+  if (sample_rate_hz < 1000) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  int32_t tail = sample_rate_hz * AUDIO_ECHO_TAIL_MS / 1000;
+  int32_t partitions =
+      (tail + AUDIO_ECHO_BLOCK_LENGTH - 1) / AUDIO_ECHO_BLOCK_LENGTH;
+  int32_t spectra = partitions * AUDIO_ECHO_BINS;
+
+  audio_echo_handle_t echo_handle = (audio_echo_handle_t)system_memory_calloc(
+      1,
+      sizeof(audio_echo_t) +
+          (AUDIO_ECHO_SPECTRA * spectra + partitions) * sizeof(float),
+      SYSTEM_MEMORY_FAST);
+  if (echo_handle == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  echo_handle->partitions = partitions;
+  echo_handle->block_s = (float)AUDIO_ECHO_BLOCK_LENGTH / sample_rate_hz;
+  echo_handle->playback_real = echo_handle->data;
+  echo_handle->playback_imag = echo_handle->playback_real + spectra;
+  echo_handle->filter_real = echo_handle->playback_imag + spectra;
+  echo_handle->filter_imag = echo_handle->filter_real + spectra;
+  echo_handle->foreground_real = echo_handle->filter_imag + spectra;
+  echo_handle->foreground_imag = echo_handle->foreground_real + spectra;
+  echo_handle->proportion = echo_handle->foreground_imag + spectra;
+  audio_fft_init(&echo_handle->fft, AUDIO_ECHO_FFT_LENGTH);
+  audio_echo_reset(echo_handle);
+
+  *echo_handle_ptr = echo_handle;
+
+  return ESP_OK;
+}
+
+void audio_echo_reset(audio_echo_handle_t echo_handle) {
+  int32_t spectra = echo_handle->partitions * AUDIO_ECHO_BINS;
+
+  memset(echo_handle->last_playback, 0, sizeof(echo_handle->last_playback));
+  echo_handle->adapted = false;
+  echo_handle->adapted_sum = 0;
+  echo_handle->leak = 0;
+  echo_handle->error_echo = 1;
+  echo_handle->echo_echo = 1;
+  memset(echo_handle->power, 0, sizeof(echo_handle->power));
+  memset(echo_handle->echo_average, 0, sizeof(echo_handle->echo_average));
+  memset(echo_handle->error_average, 0, sizeof(echo_handle->error_average));
+  echo_handle->difference_fast = 0;
+  echo_handle->difference_slow = 0;
+  echo_handle->variance_fast = 0;
+  echo_handle->variance_slow = 0;
+  echo_handle->diverged = 0;
+  echo_handle->newest = 0;
+  echo_handle->constrained = 1;
+  memset(echo_handle->data, 0, AUDIO_ECHO_SPECTRA * spectra * sizeof(float));
+}
+
+// The echo a filter expects in this block, into the second half of `time`.
+static void audio_echo_estimate(audio_echo_handle_t echo,
+                                const float *filter_real,
+                                const float *filter_imag) {
+  memset(echo->echo_real, 0, sizeof(echo->echo_real));
+  memset(echo->echo_imag, 0, sizeof(echo->echo_imag));
+
+  for (int32_t p = 0; p < echo->partitions; p++) {
+    int32_t slot = (echo->newest + p) % echo->partitions;
+    const float *x_real = echo->playback_real + slot * AUDIO_ECHO_BINS;
+    const float *x_imag = echo->playback_imag + slot * AUDIO_ECHO_BINS;
+    const float *w_real = filter_real + p * AUDIO_ECHO_BINS;
+    const float *w_imag = filter_imag + p * AUDIO_ECHO_BINS;
+    for (int32_t k = 0; k < AUDIO_ECHO_BINS; k++) {
+      echo->echo_real[k] += w_real[k] * x_real[k] - w_imag[k] * x_imag[k];
+      echo->echo_imag[k] += w_real[k] * x_imag[k] + w_imag[k] * x_real[k];
+    }
+  }
+
+  audio_fft_inverse(&echo->fft, echo->echo_real, echo->echo_imag,
+                    echo->time);
+}
+
+// Only the first half of a partition's impulse response is real, the second
+// wraps around the block. Zeroing it keeps the filter a linear convolution.
+static void audio_echo_constrain(audio_echo_handle_t echo, int32_t partition) {
+  float *real = echo->filter_real + partition * AUDIO_ECHO_BINS;
+  float *imag = echo->filter_imag + partition * AUDIO_ECHO_BINS;
+
+  audio_fft_inverse(&echo->fft, real, imag, echo->time);
+  memset(echo->time + AUDIO_ECHO_BLOCK_LENGTH, 0,
+         AUDIO_ECHO_BLOCK_LENGTH * sizeof(float));
+  audio_fft_forward(&echo->fft, echo->time, real, imag);
+}
+
+// Partitions holding more of the echo path get more of the step, so the
+// direct path converges first.
+static void audio_echo_proportion(audio_echo_handle_t echo) {
+  float largest = 1;
+  float sum = 0;
+
+  for (int32_t p = 0; p < echo->partitions; p++) {
+    const float *real = echo->filter_real + p * AUDIO_ECHO_BINS;
+    const float *imag = echo->filter_imag + p * AUDIO_ECHO_BINS;
+    float energy = 1;
+    for (int32_t k = 0; k < AUDIO_ECHO_BINS; k++) {
+      energy += real[k] * real[k] + imag[k] * imag[k];
+    }
+    echo->proportion[p] = sqrtf(energy);
+    if (echo->proportion[p] > largest) {
+      largest = echo->proportion[p];
+    }
+  }
+  for (int32_t p = 0; p < echo->partitions; p++) {
+    echo->proportion[p] += 0.1f * largest;
+    sum += echo->proportion[p];
+  }
+  for (int32_t p = 0; p < echo->partitions; p++) {
+    echo->proportion[p] = 0.99f * echo->proportion[p] / sum;
+  }
+}
+
+// Whether the background filter should replace the foreground, or the
+// other way around. `difference` is the energy of the difference between
+// their outputs, what either could be wrong by.
+static void audio_echo_choose(audio_echo_handle_t echo,
+                              float foreground_energy, float *error_energy,
+                              float difference) {
+  const int32_t spectra = echo->partitions * AUDIO_ECHO_BINS;
+  float gain = foreground_energy - *error_energy;
+  float spread = foreground_energy * difference;
+
+  echo->difference_fast = 0.6f * echo->difference_fast + 0.4f * gain;
+  echo->difference_slow = 0.85f * echo->difference_slow + 0.15f * gain;
+  echo->variance_fast = 0.36f * echo->variance_fast + 0.16f * spread;
+  echo->variance_slow = 0.7225f * echo->variance_slow + 0.0225f * spread;
+
+  float fast = echo->difference_fast;
+  float slow = echo->difference_slow;
+  if (gain * fabsf(gain) > spread ||
+      fast * fabsf(fast) > AUDIO_ECHO_FAST_CONFIDENCE * echo->variance_fast ||
+      slow * fabsf(slow) > AUDIO_ECHO_SLOW_CONFIDENCE * echo->variance_slow) {
+    memcpy(echo->foreground_real, echo->filter_real,
+           2 * spectra * sizeof(float));
+  } else if (-gain * fabsf(gain) > AUDIO_ECHO_BACKTRACK * spread ||
+             -fast * fabsf(fast) >
+                 AUDIO_ECHO_BACKTRACK * echo->variance_fast ||
+             -slow * fabsf(slow) >
+                 AUDIO_ECHO_BACKTRACK * echo->variance_slow) {
+    memcpy(echo->filter_real, echo->foreground_real,
+           2 * spectra * sizeof(float));
+    // the background now leaves what the foreground did
+    for (int32_t i = 0; i < AUDIO_ECHO_BLOCK_LENGTH; i++) {
+      echo->estimate[i] = echo->capture[i] - echo->error[i];
+    }
+    *error_energy = foreground_energy;
+  } else {
+    return;
+  }
+
+  echo->difference_fast = 0;
+  echo->difference_slow = 0;
+  echo->variance_fast = 0;
+  echo->variance_slow = 0;
+}
+
+// The step per bin, from how much of the error is likely echo the filter
+// hasn't removed yet. Near end speech is error that isn't, so it slows the
+// filter down instead of pulling it off the echo path.
+static void audio_echo_steps(audio_echo_handle_t echo, float playback_energy,
+                             float error_energy, float echo_energy,
+                             float cross_energy) {
+  const int32_t block = AUDIO_ECHO_BLOCK_LENGTH;
+  float error_change = 0;
+  float echo_change = 0;
+
+  // how the error's spectrum moves with the estimate's gives the leak
+  for (int32_t k = 0; k < AUDIO_ECHO_BINS; k++) {
+    float error = echo->error_real[k] * echo->error_real[k] +
+                  echo->error_imag[k] * echo->error_imag[k];
+    float estimate = echo->echo_real[k] * echo->echo_real[k] +
+                     echo->echo_imag[k] * echo->echo_imag[k];
+    float error_delta = error - echo->error_average[k];
+    float echo_delta = estimate - echo->echo_average[k];
+    error_change += error_delta * echo_delta;
+    echo_change += echo_delta * echo_delta;
+    echo->error_average[k] += echo->block_s * error_delta;
+    echo->echo_average[k] += echo->block_s * echo_delta;
+    // kept as the powers for the steps below
+    echo->step[k] = error;
+    echo->echo_real[k] = estimate;
+  }
+  // each block's regression counts the same however loud it was
+  echo_change = sqrtf(echo_change);
+  if (echo_change > 0) {
+    error_change /= echo_change;
+  }
+
+  float smoothing = 2.0f * echo->block_s * echo_energy / (error_energy + 1);
+  if (smoothing > 0.5f * echo->block_s) {
+    smoothing = 0.5f * echo->block_s;
+  }
+  echo->error_echo += smoothing * (error_change - echo->error_echo);
+  echo->echo_echo += smoothing * (echo_change - echo->echo_echo);
+  if (echo->echo_echo < 1) {
+    echo->echo_echo = 1;
+  }
+  if (echo->error_echo < AUDIO_ECHO_LEAK_MIN * echo->echo_echo) {
+    echo->error_echo = AUDIO_ECHO_LEAK_MIN * echo->echo_echo;
+  }
+  if (echo->error_echo > echo->echo_echo) {
+    echo->error_echo = echo->echo_echo;
+  }
+  // halved, the regression overestimates, unless the error is all echo
+  echo->leak = echo->error_echo < echo->echo_echo
+                   ? 0.5f * echo->error_echo / echo->echo_echo
+                   : 1.0f;
+
+  // the share of the error that's echo left over
+  float residual = (0.0001f * playback_energy + 3 * echo->leak * echo_energy) /
+                   (error_energy + 1);
+  float correlated =
+      cross_energy * cross_energy / (1 + error_energy * echo_energy);
+  if (residual < correlated) {
+    residual = correlated;
+  }
+  if (residual > AUDIO_ECHO_RESIDUAL_MAX) {
+    residual = AUDIO_ECHO_RESIDUAL_MAX;
+  }
+
+  if (!echo->adapted) {
+    float rate = 0;
+    if (playback_energy > block * AUDIO_ECHO_PLAYBACK_MIN) {
+      rate = playback_energy < error_energy ? playback_energy : error_energy;
+      rate = 0.25f * rate / (error_energy + 1);
+    }
+    for (int32_t k = 0; k < AUDIO_ECHO_BINS; k++) {
+      echo->step[k] = rate / (echo->power[k] + AUDIO_ECHO_POWER_MIN);
+    }
+    echo->adapted_sum += rate;
+    echo->adapted = echo->adapted_sum > echo->partitions / 2;
+    return;
+  }
+
+  for (int32_t k = 0; k < AUDIO_ECHO_BINS; k++) {
+    float error = echo->step[k] + 1;
+    float left = echo->leak * echo->echo_real[k];
+    if (left > 0.5f * error) {
+      left = 0.5f * error;
+    }
+    left = 0.7f * left + 0.3f * residual * error;
+    echo->step[k] = left / (error * (echo->power[k] + AUDIO_ECHO_POWER_MIN));
+  }
+}
+
+// Moves every background partition against the error, by its playback.
+static void audio_echo_adapt(audio_echo_handle_t echo) {
+  const float *error_real = echo->error_real;
+  const float *error_imag = echo->error_imag;
+
+  for (int32_t p = 0; p < echo->partitions; p++) {
+    int32_t slot = (echo->newest + p) % echo->partitions;
+    const float *x_real = echo->playback_real + slot * AUDIO_ECHO_BINS;
+    const float *x_imag = echo->playback_imag + slot * AUDIO_ECHO_BINS;
+    float *w_real = echo->filter_real + p * AUDIO_ECHO_BINS;
+    float *w_imag = echo->filter_imag + p * AUDIO_ECHO_BINS;
+    float proportion = echo->proportion[p];
+    for (int32_t k = 0; k < AUDIO_ECHO_BINS; k++) {
+      float step = proportion * echo->step[k];
+      w_real[k] +=
+          step * (x_real[k] * error_real[k] + x_imag[k] * error_imag[k]);
+      w_imag[k] +=
+          step * (x_real[k] * error_imag[k] - x_imag[k] * error_real[k]);
+    }
+  }
+
+  // constraining every partition every block would double the cost, the
+  // first holds the direct path so it's always done, the rest take turns
+  audio_echo_constrain(echo, 0);
+  if (echo->partitions > 1) {
+    audio_echo_constrain(echo, echo->constrained);
+    echo->constrained = echo->constrained % (echo->partitions - 1) + 1;
+  }
+}
+
+static void audio_echo_block(audio_echo_handle_t echo) {
+  const int32_t block = AUDIO_ECHO_BLOCK_LENGTH;
+  const int32_t partitions = echo->partitions;
+
+  // the newest playback spectrum, over the last block and this one
+  echo->newest = (echo->newest + partitions - 1) % partitions;
+  float *playback_real = echo->playback_real + echo->newest * AUDIO_ECHO_BINS;
+  float *playback_imag = echo->playback_imag + echo->newest * AUDIO_ECHO_BINS;
+  memcpy(echo->time, echo->last_playback, block * sizeof(float));
+  memcpy(echo->time + block, echo->playback, block * sizeof(float));
+  memcpy(echo->last_playback, echo->playback, block * sizeof(float));
+  audio_fft_forward(&echo->fft, echo->time, playback_real, playback_imag);
+
+  float power_smoothing = AUDIO_ECHO_POWER_SMOOTHING / partitions;
+  for (int32_t k = 0; k < AUDIO_ECHO_BINS; k++) {
+    float power = playback_real[k] * playback_real[k] +
+                  playback_imag[k] * playback_imag[k];
+    echo->power[k] += power_smoothing * (power - echo->power[k]);
+  }
+
+  // what's heard is the capture less the foreground's estimate
+  audio_echo_estimate(echo, echo->foreground_real, echo->foreground_imag);
+  float playback_energy = 0;
+  float capture_energy = 0;
+  float foreground_energy = 0;
+  for (int32_t i = 0; i < block; i++) {
+    float error = echo->capture[i] - echo->time[block + i];
+
+    echo->error[i] = error;
+    if (error > 32767.0f) {
+      echo->output[i] = 32767;
+    } else if (error < -32768.0f) {
+      echo->output[i] = -32768;
+    } else {
+      echo->output[i] = (int16_t)lrintf(error);
+    }
+
+    playback_energy += echo->playback[i] * echo->playback[i];
+    capture_energy += echo->capture[i] * echo->capture[i];
+    foreground_energy += error * error;
+  }
+
+  // an output that stays well above what was captured is a filter that
+  // diverged, adding echo instead of removing it
+  if (foreground_energy > capture_energy + block * AUDIO_ECHO_DIVERGED_MIN) {
+    echo->diverged++;
+  } else {
+    echo->diverged = 0;
+  }
+  if (echo->diverged >= AUDIO_ECHO_DIVERGED_BLOCKS) {
+    audio_echo_reset(echo);
+    return;
+  }
+
+  audio_echo_estimate(echo, echo->filter_real, echo->filter_imag);
+  float error_energy = 0;
+  float difference = 0;
+  for (int32_t i = 0; i < block; i++) {
+    float estimate = echo->time[block + i];
+    float error = echo->capture[i] - estimate;
+    float apart = error - echo->error[i];
+
+    echo->estimate[i] = estimate;
+    error_energy += error * error;
+    difference += apart * apart;
+  }
+  audio_echo_choose(echo, foreground_energy, &error_energy, difference);
+
+  float echo_energy = 0;
+  float cross_energy = 0;
+  memset(echo->time, 0, block * sizeof(float));
+  for (int32_t i = 0; i < block; i++) {
+    float estimate = echo->estimate[i];
+    float error = echo->capture[i] - estimate;
+    echo_energy += estimate * estimate;
+    cross_energy += error * estimate;
+    echo->time[block + i] = error;
+  }
+
+  // the error's spectrum, and the estimate's alone for the step control,
+  // both as the second half of a block like the filter's output
+  audio_fft_forward(&echo->fft, echo->time, echo->error_real,
+                    echo->error_imag);
+  memcpy(echo->time + block, echo->estimate, block * sizeof(float));
+  audio_fft_forward(&echo->fft, echo->time, echo->echo_real, echo->echo_imag);
+
+  audio_echo_steps(echo, playback_energy, error_energy, echo_energy,
+                   cross_energy);
+  audio_echo_proportion(echo);
+  audio_echo_adapt(echo);
+}
+
+void audio_echo_process(audio_echo_handle_t echo_handle,
+                        const int16_t *playback, const int16_t *capture,
+                        int16_t *output, int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    int32_t at = echo_handle->filled;
+    echo_handle->playback[at] = (float)playback[i];
+    echo_handle->capture[at] = (float)capture[i];
+    output[i] = echo_handle->output[at];
+
+    echo_handle->filled++;
+    if (echo_handle->filled == AUDIO_ECHO_BLOCK_LENGTH) {
+      audio_echo_block(echo_handle);
+      echo_handle->filled = 0;
+    }
+  }
+}
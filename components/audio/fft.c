@@ -0,0 +1,128 @@
+#include <math.h>
+#include <string.h>
+
+#include "audio/fft.h"
+
+#define AUDIO_FFT_PI 3.14159265358979f
+
+esp_err_t audio_fft_init(audio_fft_t *fft, int32_t length) {
+  if (length < 4 || length > AUDIO_FFT_LENGTH_MAX ||
+      (length & (length - 1)) != 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  memset(fft, 0, sizeof(audio_fft_t));
+  fft->length = length;
+
+  int32_t half = length / 2;
+  int32_t bits = 0;
+  while ((1 << bits) < half) {
+    bits++;
+  }
+  for (int32_t k = 0; k < half; k++) {
+    fft->cos[k] = cosf(2.0f * AUDIO_FFT_PI * (float)k / (float)length);
+    fft->sin[k] = sinf(2.0f * AUDIO_FFT_PI * (float)k / (float)length);
+
+    int32_t reversed = 0;
+    for (int32_t bit = 0; bit < bits; bit++) {
+      reversed |= ((k >> bit) & 1) << (bits - 1 - bit);
+    }
+    fft->reversed[k] = reversed;
+  }
+
+  return ESP_OK;
+}
+
+// In place on the scratch space, radix 2 decimation in time. `sign` is -1
+// forward and 1 inverse.
+static void audio_fft_complex(audio_fft_t *fft, float sign) {
+  int32_t count = fft->length / 2;
+  float *re = fft->real;
+  float *im = fft->imag;
+
+  for (int32_t i = 0; i < count; i++) {
+    int32_t j = fft->reversed[i];
+    if (j > i) {
+      float t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+
+  for (int32_t span = 1; span < count; span *= 2) {
+    // the table is of the full length, a butterfly of 2 * span needs every
+    // length / (2 * span)th entry
+    int32_t stride = fft->length / (2 * span);
+    for (int32_t start = 0; start < count; start += 2 * span) {
+      for (int32_t k = 0; k < span; k++) {
+        float wr = fft->cos[k * stride];
+        float wi = sign * fft->sin[k * stride];
+        int32_t a = start + k;
+        int32_t b = a + span;
+        float tr = wr * re[b] - wi * im[b];
+        float ti = wr * im[b] + wi * re[b];
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+// Even samples in the real part and odd in the imaginary, then the two
+// interleaved spectra are pulled apart.
+void audio_fft_forward(audio_fft_t *fft, const float *samples, float *real,
+                       float *imag) {
+  int32_t half = fft->length / 2;
+
+  for (int32_t i = 0; i < half; i++) {
+    fft->real[i] = samples[2 * i];
+    fft->imag[i] = samples[2 * i + 1];
+  }
+  audio_fft_complex(fft, -1.0f);
+
+  for (int32_t k = 0; k <= half; k++) {
+    int32_t a = k % half;
+    int32_t b = (half - k) % half;
+    // the even samples' spectrum, and the odd's
+    float even_re = 0.5f * (fft->real[a] + fft->real[b]);
+    float even_im = 0.5f * (fft->imag[a] - fft->imag[b]);
+    float odd_re = 0.5f * (fft->imag[a] + fft->imag[b]);
+    float odd_im = -0.5f * (fft->real[a] - fft->real[b]);
+    float wr = k < half ? fft->cos[k] : -1.0f;
+    float wi = k < half ? -fft->sin[k] : 0.0f;
+    real[k] = even_re + wr * odd_re - wi * odd_im;
+    imag[k] = even_im + wr * odd_im + wi * odd_re;
+  }
+}
+
+void audio_fft_inverse(audio_fft_t *fft, const float *real, const float *imag,
+                       float *samples) {
+  int32_t half = fft->length / 2;
+
+  for (int32_t k = 0; k < half; k++) {
+    int32_t b = half - k;
+    float even_re = 0.5f * (real[k] + real[b]);
+    float even_im = 0.5f * (imag[k] - imag[b]);
+    float diff_re = 0.5f * (real[k] - real[b]);
+    float diff_im = 0.5f * (imag[k] + imag[b]);
+    // undo the twiddle, e^(2 pi i k / length)
+    float wr = fft->cos[k];
+    float wi = fft->sin[k];
+    float odd_re = wr * diff_re - wi * diff_im;
+    float odd_im = wr * diff_im + wi * diff_re;
+    fft->real[k] = even_re - odd_im;
+    fft->imag[k] = even_im + odd_re;
+  }
+  audio_fft_complex(fft, 1.0f);
+
+  float scale = 1.0f / (float)half;
+  for (int32_t i = 0; i < half; i++) {
+    samples[2 * i] = fft->real[i] * scale;
+    samples[2 * i + 1] = fft->imag[i] * scale;
+  }
+}
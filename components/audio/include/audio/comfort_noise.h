@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Reflection coefficients per descriptor. Four are enough for the tilt and
+// the broad hump of room noise.
+#define AUDIO_COMFORT_NOISE_ORDER 4
+// the level, then a byte per coefficient
+#define AUDIO_COMFORT_NOISE_DESCRIPTOR_LENGTH (1 + AUDIO_COMFORT_NOISE_ORDER)
+// descriptor levels are -dBov, quieter than this is silence
+#define AUDIO_COMFORT_NOISE_LEVEL_MAX 127
+// How much each silent frame moves the analysis. Descriptors describe the
+// noise of the last few hundred ms, not of one frame.
+#define AUDIO_COMFORT_NOISE_SMOOTHING 0.2f
+
+// Describes background noise in as few bytes as possible, laid out like an
+// RFC 3389 payload: the level in -dBov, then reflection coefficients `k`
+// quantized linearly as `127 + 128 * k`. Sent as is.
+typedef struct audio_comfort_noise_descriptor_t {
+  uint8_t level;
+  uint8_t reflection[AUDIO_COMFORT_NOISE_ORDER];
+} audio_comfort_noise_descriptor_t;
+
+// The sending side: averages the spectrum of silent frames.
+typedef struct audio_comfort_noise_analyzer_t {
+  bool primed;
+  // autocorrelation per sample, lags 0 to the order
+  float autocorrelation[AUDIO_COMFORT_NOISE_ORDER + 1];
+} audio_comfort_noise_analyzer_t;
+
+// The receiving side: white noise through an all-pole lattice filter.
+typedef struct audio_comfort_noise_t {
+  float reflection[AUDIO_COMFORT_NOISE_ORDER];
+  // the lattice's backward errors from the last sample
+  float backward[AUDIO_COMFORT_NOISE_ORDER + 1];
+  // scales the excitation, 0 until a descriptor is set
+  float gain;
+  uint32_t seed;
+} audio_comfort_noise_t;
+
+void audio_comfort_noise_analyzer_reset(
+    audio_comfort_noise_analyzer_t *analyzer);
+void audio_comfort_noise_analyze(audio_comfort_noise_analyzer_t *analyzer,
+                                 const int16_t *samples, int32_t count);
+// the averaged level in -dBov, without working out the rest
+uint8_t
+audio_comfort_noise_level(const audio_comfort_noise_analyzer_t *analyzer);
+void audio_comfort_noise_describe(
+    const audio_comfort_noise_analyzer_t *analyzer,
+    audio_comfort_noise_descriptor_t *descriptor);
+
+// Starts silent. `seed` only needs to differ between streams mixed together.
+void audio_comfort_noise_init(audio_comfort_noise_t *noise, uint32_t seed);
+// Takes effect from the next sample, the filter state is kept so changes
+// don't click.
+void audio_comfort_noise_set(
+    audio_comfort_noise_t *noise,
+    const audio_comfort_noise_descriptor_t *descriptor);
+// Fills a frame with noise like the descriptor's.
+void audio_comfort_noise_generate(audio_comfort_noise_t *noise,
+                                  int16_t *samples, int32_t count);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Arrivals are grouped this long, only the quickest of each is kept: the
+// network only ever adds delay, so the quickest shows the clocks best.
+#define AUDIO_DRIFT_BUCKET_MS 1000
+// groups weigh less the older they are, by this time constant
+#define AUDIO_DRIFT_WINDOW_S 120
+// groups before there's an estimate, until then it's nothing
+#define AUDIO_DRIFT_MIN_BUCKETS 10
+// a delay this far from the fitted line means the sender restarted, or its
+// clock was stepped, so the estimate starts over
+#define AUDIO_DRIFT_RESET_MS 500
+// the estimate is kept within this, a crystal is a few tens of ppm off
+#define AUDIO_DRIFT_PPM_MAX 500
+
+// The playout buffer is pulled towards its target by this much per ms it's
+// off, on top of the drift, so an error in the estimate can't pile up...
+#define AUDIO_DRIFT_DEPTH_PPM_PER_MS 2.0f
+// ...but never faster than this, so the pitch doesn't audibly change
+#define AUDIO_DRIFT_DEPTH_PPM_MAX 100.0f
+// how much each call moves the buffer depth it's pulling by
+#define AUDIO_DRIFT_DEPTH_SMOOTHING 0.02f
+
+// How much faster a sender's sample clock runs than ours, from the capture
+// timestamps in its message UUIDs against when they got here. The delays'
+// lower envelope is fitted with a line, whose slope is the drift. The
+// sender's timestamps are assumed to come from the same crystal as its
+// sample clock, as they do on the ESP32.
+//
+// Not thread safe, one playback stream per instance.
+typedef struct audio_drift_t {
+  int64_t first_arrival_us;
+  // the quickest delay seen in the current group, and when
+  int64_t bucket_start_us;
+  int64_t bucket_delay_us;
+  int64_t bucket_arrival_us;
+  // the delay's offset from the first group, so the sums stay small
+  int64_t origin_delay_us;
+  int32_t buckets;
+
+  // weighted least squares of delay (us) on arrival (s)
+  double weight;
+  double sum_x;
+  double sum_y;
+  double sum_xx;
+  double sum_xy;
+  float drift_ppm;
+
+  float depth_ms;
+  bool depth_valid;
+} audio_drift_t;
+
+typedef audio_drift_t *audio_drift_handle_t;
+
+esp_err_t audio_drift_init(audio_drift_handle_t *drift_handle_ptr);
+// forgets the sender, for a new stream
+void audio_drift_reset(audio_drift_handle_t drift_handle);
+
+// `sent_us` is from `protocol_message_uuid_timestamp`, `arrival_us` from
+// `esp_timer_get_time` when the message got here.
+void audio_drift_update(audio_drift_handle_t drift_handle, int64_t sent_us,
+                        int64_t arrival_us);
+// Positive when the sender's clock is fast. Zero until there's enough to go
+// on.
+float audio_drift_ppm(audio_drift_handle_t drift_handle);
+bool audio_drift_valid(audio_drift_handle_t drift_handle);
+
+// What to resample at, see `audio_resampler_set_drift_ppm`: the drift, and
+// a slow pull of `depth_ms` of buffered audio towards `target_ms`. Call
+// once per frame played.
+float audio_drift_playout_ppm(audio_drift_handle_t drift_handle,
+                              float depth_ms, float target_ms);
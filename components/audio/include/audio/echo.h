@@ -0,0 +1,103 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio/fft.h"
+
+// Samples per block. Frames of any length are cut into blocks, delaying the
+// output by one block.
+#define AUDIO_ECHO_BLOCK_LENGTH 64
+// How long after playback its echo can still be cancelled. Enough for a
+// speaker a few cm from the microphone and the room's early reflections,
+// the late ones are quieter than the room's noise.
+#define AUDIO_ECHO_TAIL_MS 64
+
+// a block of the previous playback and a block of the current
+#define AUDIO_ECHO_FFT_LENGTH (2 * AUDIO_ECHO_BLOCK_LENGTH)
+#define AUDIO_ECHO_BINS (AUDIO_ECHO_BLOCK_LENGTH + 1)
+
+// Acoustic echo cancellation for one hands-free station: what the speaker
+// played is filtered through an estimate of the path to the microphone and
+// subtracted from what was captured. The estimate is a partitioned block
+// frequency domain adaptive filter (multidelay, MDF) in two copies. The
+// background one adapts, with a step that follows how much of what's left
+// is echo. The foreground one is what's subtracted, and only takes the
+// background's place when that clearly cancels more, so talk from both ends
+// at once can't pull the output off the echo path.
+//
+// Not thread safe, one capture task per instance.
+typedef struct audio_echo_t {
+  int32_t partitions;
+  // a block's length in seconds, the step control's smoothing scales with it
+  float block_s;
+  audio_fft_t fft;
+
+  // a block of capture and playback, and the output of the last one
+  int32_t filled;
+  float capture[AUDIO_ECHO_BLOCK_LENGTH];
+  float playback[AUDIO_ECHO_BLOCK_LENGTH];
+  int16_t output[AUDIO_ECHO_BLOCK_LENGTH];
+  float last_playback[AUDIO_ECHO_BLOCK_LENGTH];
+
+  // Step control. Until `adapted` the step only follows how loud playback
+  // is against the error, then how much of the error is echo left over,
+  // which is the estimate's power times `leak`.
+  bool adapted;
+  float adapted_sum;
+  float leak;
+  float error_echo;
+  float echo_echo;
+  float power[AUDIO_ECHO_BINS];
+  float echo_average[AUDIO_ECHO_BINS];
+  float error_average[AUDIO_ECHO_BINS];
+
+  // how much more the foreground leaves than the background, averaged
+  // quickly and slowly, and how much that varies
+  float difference_fast;
+  float difference_slow;
+  float variance_fast;
+  float variance_slow;
+  // blocks in a row the output was louder than the capture
+  int32_t diverged;
+
+  // the partition holding the newest playback spectrum
+  int32_t newest;
+  // the partition whose filter is constrained next
+  int32_t constrained;
+
+  // scratch
+  float time[AUDIO_ECHO_FFT_LENGTH];
+  float estimate[AUDIO_ECHO_BLOCK_LENGTH];
+  float error[AUDIO_ECHO_BLOCK_LENGTH];
+  float echo_real[AUDIO_ECHO_BINS];
+  float echo_imag[AUDIO_ECHO_BINS];
+  float error_real[AUDIO_ECHO_BINS];
+  float error_imag[AUDIO_ECHO_BINS];
+  float step[AUDIO_ECHO_BINS];
+
+  // per partition, bins after bins
+  float *playback_real;
+  float *playback_imag;
+  float *filter_real;
+  float *filter_imag;
+  float *foreground_real;
+  float *foreground_imag;
+  // one each, how much of the step goes to it
+  float *proportion;
+  float data[];
+} audio_echo_t;
+
+typedef audio_echo_t *audio_echo_handle_t;
+
+esp_err_t audio_echo_init(audio_echo_handle_t *echo_handle_ptr,
+                          uint32_t sample_rate_hz);
+// forgets the echo path, for a new call or a moved station
+void audio_echo_reset(audio_echo_handle_t echo_handle);
+
+// `playback` is what the speaker played while `capture` was recorded, sample
+// for sample. `output` may be `capture`.
+void audio_echo_process(audio_echo_handle_t echo_handle,
+                        const int16_t *playback, const int16_t *capture,
+                        int16_t *output, int32_t count);
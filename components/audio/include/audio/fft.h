@@ -0,0 +1,26 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdint.h>
+
+#define AUDIO_FFT_LENGTH_MAX 256
+
+// Transforms of real signals, `length` samples to `length / 2 + 1` bins and
+// back, by a complex transform of half the length. Unnormalized forward, the
+// inverse divides by `length`. Not thread safe, it keeps its scratch space.
+typedef struct audio_fft_t {
+  int32_t length;
+  // e^(-2 pi i k / length) for k below half the length
+  float cos[AUDIO_FFT_LENGTH_MAX / 2];
+  float sin[AUDIO_FFT_LENGTH_MAX / 2];
+  uint16_t reversed[AUDIO_FFT_LENGTH_MAX / 2];
+  float real[AUDIO_FFT_LENGTH_MAX / 2];
+  float imag[AUDIO_FFT_LENGTH_MAX / 2];
+} audio_fft_t;
+
+// `length` is a power of two, 4 to `AUDIO_FFT_LENGTH_MAX`.
+esp_err_t audio_fft_init(audio_fft_t *fft, int32_t length);
+void audio_fft_forward(audio_fft_t *fft, const float *samples, float *real,
+                       float *imag);
+void audio_fft_inverse(audio_fft_t *fft, const float *real, const float *imag,
+                       float *samples);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdint.h>
+
+// Filter phases between two input samples, the ones in between are
+// interpolated
+#define AUDIO_RESAMPLER_PHASES 64
+// taps per phase when not downsampling, more when the cutoff is lower
+#define AUDIO_RESAMPLER_TAPS 16
+// of the lower Nyquist frequency, leaving room for the filter to fall off
+#define AUDIO_RESAMPLER_CUTOFF 0.92f
+// input samples taken at once, longer frames are split
+#define AUDIO_RESAMPLER_CHUNK 256
+// how far the ratio can be pulled from the nominal one, see
+// `audio_resampler_set_drift_ppm`
+#define AUDIO_RESAMPLER_DRIFT_PPM_MAX 2000
+
+// Converts a stream from one sample rate to another, at a ratio that can be
+// nudged while running to follow a sender's clock. A windowed sinc,
+// evaluated by polyphase lookup with linear interpolation between phases.
+// Delays the stream by half the taps.
+//
+// Not thread safe, one playback stream per instance.
+typedef struct audio_resampler_t {
+  uint32_t input_rate_hz;
+  uint32_t output_rate_hz;
+  int32_t taps;
+  // input samples per output sample, 32.32 fixed point
+  int64_t step;
+  // the next output's position past the first buffered sample, 32.32
+  int64_t position;
+  // the filter's history followed by the input not yet used
+  int32_t buffered;
+  float *buffer;
+  // `AUDIO_RESAMPLER_PHASES + 1` rows of `taps`, the last row is the first
+  // shifted by a sample, so every phase has a neighbour to interpolate with
+  float *coefficients;
+  float data[];
+} audio_resampler_t;
+
+typedef audio_resampler_t *audio_resampler_handle_t;
+
+esp_err_t audio_resampler_init(audio_resampler_handle_t *resampler_handle_ptr,
+                               uint32_t input_rate_hz,
+                               uint32_t output_rate_hz);
+// Positive when the sender's clock runs fast, so more input is used per
+// output sample. Takes effect from the next output sample.
+void audio_resampler_set_drift_ppm(audio_resampler_handle_t resampler_handle,
+                                   float drift_ppm);
+// Upper bound on the output of `count` input samples, for sizing `output`.
+int32_t audio_resampler_output_max(audio_resampler_handle_t resampler_handle,
+                                   int32_t count);
+// Uses all of `input` and returns how many samples were written to
+// `output`, which must hold `audio_resampler_output_max(count)`.
+int32_t audio_resampler_process(audio_resampler_handle_t resampler_handle,
+                                const int16_t *input, int32_t count,
+                                int16_t *output);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio/comfort_noise.h"
+
+// Frames this far above the noise floor are speech...
+#define AUDIO_VAD_ONSET_DB 9.0f
+// ...and so are quieter ones whose zero-crossing rate is unlike the noise's,
+// the fricatives and breathy starts of words
+#define AUDIO_VAD_UNVOICED_DB 4.0f
+#define AUDIO_VAD_UNVOICED_ZCR_DELTA 0.12f
+// The floor starts at the first frame's level and falls quickly to quieter
+// frames, so talking straight away only costs the first few frames. While
+// frames are speech it rises this fast, so a room that got louder is noise
+// again after a few seconds.
+#define AUDIO_VAD_FLOOR_RISE_DB_PER_S 6.0f
+// how much each frame of noise moves the floor, and each quieter frame
+#define AUDIO_VAD_FLOOR_SMOOTHING 0.05f
+#define AUDIO_VAD_FLOOR_FALL 0.3f
+// Speech is kept going this long after the last frame that sounded like it,
+// so word endings and short pauses aren't cut.
+#define AUDIO_VAD_HANGOVER_MS 200
+
+// While silent, a descriptor is sent this often, so stations that join late
+// hear the noise too...
+#define AUDIO_VAD_DESCRIPTOR_INTERVAL_MS 500
+// ...and sooner when the noise gets this much louder or quieter
+#define AUDIO_VAD_DESCRIPTOR_CHANGE_DB 3
+
+typedef enum audio_vad_decision_t {
+  // send the frame
+  AUDIO_VAD_SPEECH = 0,
+  // silence, send the descriptor instead
+  AUDIO_VAD_DESCRIPTOR = 1,
+  // silence, send nothing, receivers keep playing the last descriptor
+  AUDIO_VAD_SILENT = 2,
+} audio_vad_decision_t;
+
+// Voice activity detection for one captured stream, after capture and before
+// encoding. Each frame is classified by its energy against a tracked noise
+// floor and by its zero-crossing rate. Silent frames aren't sent, instead
+// the noise is described now and then for receivers to synthesize, see
+// `audio/comfort_noise`.
+//
+// Frames are 16-bit mono PCM of `frame_ms`, any sample rate. Not thread
+// safe, one capture task per instance.
+typedef struct audio_vad_t {
+  int32_t hangover_frames;
+  int32_t descriptor_interval_frames;
+  float floor_rise_db;
+
+  bool trained;
+  float floor_db;
+  float noise_zcr;
+  // frames of hangover left
+  int32_t hangover;
+  bool speaking;
+  int32_t since_descriptor;
+  uint8_t descriptor_level;
+
+  audio_comfort_noise_analyzer_t analyzer;
+} audio_vad_t;
+
+typedef audio_vad_t *audio_vad_handle_t;
+
+esp_err_t audio_vad_init(audio_vad_handle_t *vad_handle_ptr,
+                         uint32_t frame_ms);
+// back to how it was after init, for a new talk
+void audio_vad_reset(audio_vad_handle_t vad_handle);
+
+// Fills `descriptor` when it returns `AUDIO_VAD_DESCRIPTOR`.
+audio_vad_decision_t
+audio_vad_process(audio_vad_handle_t vad_handle, const int16_t *samples,
+                  int32_t count, audio_comfort_noise_descriptor_t *descriptor);
@@ -0,0 +1,191 @@
+#include <math.h>
+#include <string.h>
+
+#include "audio/resampler.h"
+#include "system/memory.h"
+
+#define AUDIO_RESAMPLER_PI 3.14159265358979
+#define AUDIO_RESAMPLER_ONE (1LL << 32)
+
+static float audio_resampler_prototype(double t, double cutoff,
+                                       double half_width) {
+  if (fabs(t) >= half_width) {
+    return 0;
+  }
+  double sinc = t == 0 ? 1.0
+                       : sin(AUDIO_RESAMPLER_PI * cutoff * t) /
+                             (AUDIO_RESAMPLER_PI * cutoff * t);
+  // Blackman, about 58dB down outside the passband
+  double x = AUDIO_RESAMPLER_PI * (t / half_width + 1.0);
+  double window = 0.42 - 0.5 * cos(x) + 0.08 * cos(2.0 * x);
+  return (float)(cutoff * sinc * window);
+}
+
+esp_err_t audio_resampler_init(audio_resampler_handle_t *resampler_handle_ptr,
+                               uint32_t input_rate_hz,
+                               uint32_t output_rate_hz) {
+  if (input_rate_hz == 0 || output_rate_hz == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  // downsampling lowers the cutoff, and widens the filter to keep its slope
+  double cutoff = AUDIO_RESAMPLER_CUTOFF;
+  int32_t taps = AUDIO_RESAMPLER_TAPS;
+  if (output_rate_hz < input_rate_hz) {
+    double ratio = (double)output_rate_hz / input_rate_hz;
+    cutoff *= ratio;
+    taps = (int32_t)ceil(AUDIO_RESAMPLER_TAPS / ratio);
+    taps += taps % 2;
+  }
+
+  int32_t buffer_length = taps + AUDIO_RESAMPLER_CHUNK;
+  int32_t coefficients = (AUDIO_RESAMPLER_PHASES + 1) * taps;
+  audio_resampler_handle_t resampler_handle =
+      (audio_resampler_handle_t)system_memory_calloc(
+          1,
+          sizeof(audio_resampler_t) +
+              (buffer_length + coefficients) * sizeof(float),
+          SYSTEM_MEMORY_FAST);
+  if (resampler_handle == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  resampler_handle->input_rate_hz = input_rate_hz;
+  resampler_handle->output_rate_hz = output_rate_hz;
+  resampler_handle->taps = taps;
+  resampler_handle->buffer = resampler_handle->data;
+  resampler_handle->coefficients = resampler_handle->data + buffer_length;
+  // starts with a history of silence
+  resampler_handle->buffered = taps - 1;
+  audio_resampler_set_drift_ppm(resampler_handle, 0);
+
+  // Row `phase` is the output `phase / PHASES` of a sample past the
+  // filter's centre, between taps `taps / 2 - 1` and `taps / 2`. Each row
+  // is normalized, so a constant comes out unchanged.
+  double half_width = taps / 2.0;
+  for (int32_t phase = 0; phase <= AUDIO_RESAMPLER_PHASES; phase++) {
+    float *row = resampler_handle->coefficients + phase * taps;
+    double offset = (double)phase / AUDIO_RESAMPLER_PHASES;
+    float sum = 0;
+    for (int32_t k = 0; k < taps; k++) {
+      row[k] = audio_resampler_prototype(k - (taps / 2 - 1) - offset, cutoff,
+                                         half_width);
+      sum += row[k];
+    }
+    for (int32_t k = 0; k < taps; k++) {
+      row[k] /= sum;
+    }
+  }
+
+  *resampler_handle_ptr = resampler_handle;
+
+  return ESP_OK;
+}
+
+void audio_resampler_set_drift_ppm(audio_resampler_handle_t resampler_handle,
+                                   float drift_ppm) {
+  if (drift_ppm > AUDIO_RESAMPLER_DRIFT_PPM_MAX) {
+    drift_ppm = AUDIO_RESAMPLER_DRIFT_PPM_MAX;
+  } else if (drift_ppm < -AUDIO_RESAMPLER_DRIFT_PPM_MAX) {
+    drift_ppm = -AUDIO_RESAMPLER_DRIFT_PPM_MAX;
+  }
+
+  double step = (double)resampler_handle->input_rate_hz /
+                resampler_handle->output_rate_hz * (1.0 + drift_ppm * 1e-6);
+  resampler_handle->step = (int64_t)(step * AUDIO_RESAMPLER_ONE);
+}
+
+int32_t audio_resampler_output_max(audio_resampler_handle_t resampler_handle,
+                                   int32_t count) {
+  // the slowest the ratio can go, and one for the position carried over
+  double step = (double)resampler_handle->input_rate_hz /
+                resampler_handle->output_rate_hz *
+                (1.0 - AUDIO_RESAMPLER_DRIFT_PPM_MAX * 1e-6);
+  return (int32_t)ceil(count / step) + 1;
+}
+
+// Four sums, so the compiler can keep them in registers or vector lanes.
+static inline float audio_resampler_dot(const float *a, const float *b,
+                                        int32_t count) {
+  float sum0 = 0;
+  float sum1 = 0;
+  float sum2 = 0;
+  float sum3 = 0;
+  int32_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    sum0 += a[i] * b[i];
+    sum1 += a[i + 1] * b[i + 1];
+    sum2 += a[i + 2] * b[i + 2];
+    sum3 += a[i + 3] * b[i + 3];
+  }
+  for (; i < count; i++) {
+    sum0 += a[i] * b[i];
+  }
+  return (sum0 + sum1) + (sum2 + sum3);
+}
+
+static int32_t audio_resampler_chunk(audio_resampler_handle_t resampler,
+                                     const int16_t *input, int32_t count,
+                                     int16_t *output) {
+  const int32_t taps = resampler->taps;
+  float *buffer = resampler->buffer;
+  int32_t written = 0;
+
+  for (int32_t i = 0; i < count; i++) {
+    buffer[resampler->buffered + i] = (float)input[i];
+  }
+  resampler->buffered += count;
+
+  // every output needs `taps` samples from where its position starts
+  while ((resampler->position >> 32) + taps <= resampler->buffered) {
+    int32_t start = (int32_t)(resampler->position >> 32);
+    uint32_t fraction = (uint32_t)resampler->position;
+    // the phase, and how far it is towards the next one, of 2^26
+    uint32_t scaled = fraction >> 6;
+    int32_t phase = (int32_t)(scaled >> 20);
+    float blend = (float)(scaled & 0xFFFFF) / (float)(1 << 20);
+
+    const float *row = resampler->coefficients + phase * taps;
+    float a = audio_resampler_dot(buffer + start, row, taps);
+    float b = audio_resampler_dot(buffer + start, row + taps, taps);
+    float sample = a + blend * (b - a);
+
+    if (sample > 32767.0f) {
+      output[written++] = 32767;
+    } else if (sample < -32768.0f) {
+      output[written++] = -32768;
+    } else {
+      output[written++] = (int16_t)lrintf(sample);
+    }
+    resampler->position += resampler->step;
+  }
+
+  // keep what the next outputs still need
+  int32_t used = (int32_t)(resampler->position >> 32);
+  if (used > resampler->buffered) {
+    used = resampler->buffered;
+  }
+  memmove(buffer, buffer + used,
+          (resampler->buffered - used) * sizeof(float));
+  resampler->buffered -= used;
+  resampler->position -= (int64_t)used << 32;
+
+  return written;
+}
+
+int32_t audio_resampler_process(audio_resampler_handle_t resampler_handle,
+                                const int16_t *input, int32_t count,
+                                int16_t *output) {
+  int32_t written = 0;
+
+  while (count > 0) {
+    int32_t chunk = count < AUDIO_RESAMPLER_CHUNK ? count
+                                                  : AUDIO_RESAMPLER_CHUNK;
+    written += audio_resampler_chunk(resampler_handle, input, chunk,
+                                     output + written);
+    input += chunk;
+    count -= chunk;
+  }
+
+  return written;
+}
@@ -0,0 +1,136 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio/vad.h"
+
+// keeps log10f finite on digital silence
+#define AUDIO_VAD_ENERGY_MIN 1e-3f
+#define AUDIO_VAD_FULL_SCALE (32767.0f * 32767.0f)
+
+esp_err_t audio_vad_init(audio_vad_handle_t *vad_handle_ptr,
+                         uint32_t frame_ms) {
+  if (frame_ms == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  audio_vad_handle_t vad_handle =
+      (audio_vad_handle_t)calloc(1, sizeof(audio_vad_t));
+  if (vad_handle == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  vad_handle->hangover_frames =
+      (AUDIO_VAD_HANGOVER_MS + frame_ms - 1) / frame_ms;
+  vad_handle->descriptor_interval_frames =
+      (AUDIO_VAD_DESCRIPTOR_INTERVAL_MS + frame_ms - 1) / frame_ms;
+  vad_handle->floor_rise_db =
+      AUDIO_VAD_FLOOR_RISE_DB_PER_S * (float)frame_ms / 1000.0f;
+  audio_vad_reset(vad_handle);
+
+  *vad_handle_ptr = vad_handle;
+
+  return ESP_OK;
+}
+
+void audio_vad_reset(audio_vad_handle_t vad_handle) {
+  vad_handle->trained = false;
+  vad_handle->hangover = 0;
+  // the first silent frame sends a descriptor
+  vad_handle->speaking = true;
+  vad_handle->since_descriptor = 0;
+  vad_handle->descriptor_level = AUDIO_COMFORT_NOISE_LEVEL_MAX;
+  audio_comfort_noise_analyzer_reset(&vad_handle->analyzer);
+}
+
+// Energy in dBov and the zero-crossing rate, both around the frame's mean so
+// a microphone's DC offset doesn't count.
+static void audio_vad_measure(const int16_t *samples, int32_t count,
+                              float *energy_db_ptr, float *zcr_ptr) {
+  int32_t sum = 0;
+  for (int32_t i = 0; i < count; i++) {
+    sum += samples[i];
+  }
+  float mean = (float)sum / (float)count;
+
+  float energy = 0;
+  int32_t crossings = 0;
+  bool negative = (float)samples[0] < mean;
+  for (int32_t i = 0; i < count; i++) {
+    float sample = (float)samples[i] - mean;
+    energy += sample * sample;
+    if ((sample < 0) != negative) {
+      negative = sample < 0;
+      crossings++;
+    }
+  }
+
+  energy = energy / (float)count + AUDIO_VAD_ENERGY_MIN;
+  *energy_db_ptr = 10.0f * log10f(energy / AUDIO_VAD_FULL_SCALE);
+  *zcr_ptr = count > 1 ? (float)crossings / (float)(count - 1) : 0;
+}
+
+static bool audio_vad_active(audio_vad_handle_t vad, float energy_db,
+                             float zcr) {
+  float above = energy_db - vad->floor_db;
+  bool active = above > AUDIO_VAD_ONSET_DB ||
+                (above > AUDIO_VAD_UNVOICED_DB &&
+                 fabsf(zcr - vad->noise_zcr) > AUDIO_VAD_UNVOICED_ZCR_DELTA);
+
+  if (active) {
+    vad->floor_db += vad->floor_rise_db;
+  } else {
+    vad->floor_db += AUDIO_VAD_FLOOR_SMOOTHING * (energy_db - vad->floor_db);
+    vad->noise_zcr += AUDIO_VAD_FLOOR_SMOOTHING * (zcr - vad->noise_zcr);
+  }
+  // quickly but not at once, or it would sit in the dips of the noise
+  if (energy_db < vad->floor_db) {
+    vad->floor_db += AUDIO_VAD_FLOOR_FALL * (energy_db - vad->floor_db);
+  }
+
+  return active;
+}
+
+audio_vad_decision_t
+audio_vad_process(audio_vad_handle_t vad_handle, const int16_t *samples,
+                  int32_t count, audio_comfort_noise_descriptor_t *descriptor) {
+  float energy_db = 0;
+  float zcr = 0;
+
+  if (count <= 0) {
+    return AUDIO_VAD_SILENT;
+  }
+
+  audio_vad_measure(samples, count, &energy_db, &zcr);
+  if (!vad_handle->trained) {
+    vad_handle->floor_db = energy_db;
+    vad_handle->noise_zcr = zcr;
+    vad_handle->trained = true;
+  }
+  if (audio_vad_active(vad_handle, energy_db, zcr)) {
+    vad_handle->hangover = vad_handle->hangover_frames;
+  } else if (vad_handle->hangover > 0) {
+    vad_handle->hangover--;
+  }
+  if (vad_handle->hangover > 0) {
+    vad_handle->speaking = true;
+    return AUDIO_VAD_SPEECH;
+  }
+
+  audio_comfort_noise_analyze(&vad_handle->analyzer, samples, count);
+  uint8_t level = audio_comfort_noise_level(&vad_handle->analyzer);
+  vad_handle->since_descriptor++;
+
+  if (vad_handle->speaking ||
+      vad_handle->since_descriptor >= vad_handle->descriptor_interval_frames ||
+      abs((int32_t)level - (int32_t)vad_handle->descriptor_level) >=
+          AUDIO_VAD_DESCRIPTOR_CHANGE_DB) {
+    audio_comfort_noise_describe(&vad_handle->analyzer, descriptor);
+    vad_handle->speaking = false;
+    vad_handle->since_descriptor = 0;
+    vad_handle->descriptor_level = descriptor->level;
+    return AUDIO_VAD_DESCRIPTOR;
+  }
+
+  return AUDIO_VAD_SILENT;
+}
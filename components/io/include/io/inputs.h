@@ -1,29 +1,74 @@
 #pragma once
 
 #include "esp_err.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 #include "freertos/task.h"
+#include <stdbool.h>
 
 #include "application/device_info.h"
 #include "application/queues.h"
+#include "network/power.h"
+#include "system/tasks.h"
 
 #define IO_INPUTS_TASK_PRIORITY_INPUTS 4
+#define IO_INPUTS_TASK_CORE_INPUTS SYSTEM_TASKS_CORE_REALTIME
 
 #define IO_INPUTS_TASK_STACK_DEPTH_INPUTS 1024 * 2
 
+// The first edge is acted on at once, then the pin is ignored until it has
+// had this long to settle. Mechanical buttons bounce for up to ~10ms.
+#define IO_INPUTS_DEBOUNCE_MS 20
+// held this long, a press is push-to-talk rather than a tap
+#define IO_INPUTS_HOLD_MS 400
+
+// task notification bits
+#define IO_INPUTS_NOTIFY_EDGE (1 << 0)
+#define IO_INPUTS_NOTIFY_SETTLED (1 << 1)
+#define IO_INPUTS_NOTIFY_HOLD (1 << 2)
+
+typedef enum io_inputs_event_t {
+  IO_INPUTS_PRESS = 0,
+  IO_INPUTS_RELEASE = 1,
+  // still pressed `IO_INPUTS_HOLD_MS` after the press
+  IO_INPUTS_HOLD = 2,
+} io_inputs_event_t;
+
+// Called on the inputs task. `edge_us` is when the interrupt saw the edge,
+// for a hold it's the press's.
+typedef void (*io_inputs_talk_handler_t)(io_inputs_event_t event,
+                                         int64_t edge_us, void *ctx);
+
 typedef struct io_inputs_t {
   struct {
     TaskHandle_t inputs_task;
   } tasks;
   struct {
-    QueueHandle_t inputs_queue;
-  } queues;
+    esp_timer_handle_t debounce;
+    esp_timer_handle_t hold;
+  } timers;
   struct {
     int32_t talk_btn;
   } pins;
+  // written by the ISR, read by the task once notified
+  volatile int64_t edge_us;
+  // only touched by the task
+  bool pressed;
+  int64_t pressed_us;
+
+  io_inputs_talk_handler_t talk_handler;
+  void *talk_handler_ctx;
+
+  struct {
+    // from the edge interrupt to the press reaching the talk handler
+    system_metric_handle_t press_latency_us;
+    // edges that didn't change the debounced state
+    system_metric_handle_t bounces;
+  } metrics;
+
   app_device_info_handle_t device_info;
   app_queues_handle_t app_queues;
+  network_power_handle_t power;
 } io_inputs_t;
 
 typedef io_inputs_t *io_inputs_handle_t;
@@ -31,4 +76,9 @@ typedef io_inputs_t *io_inputs_handle_t;
 esp_err_t io_inputs_init(io_inputs_handle_t *io_inputs_handle_ptr,
                          int32_t talk_btn_pin,
                          app_device_info_handle_t device_info_handle,
-                         app_queues_handle_t app_queues_handle);
\ No newline at end of file
+                         app_queues_handle_t app_queues_handle,
+                         network_power_handle_t power_handle);
+
+// Audio capture hooks in here. Must be set before the button is first used.
+void io_inputs_set_talk_handler(io_inputs_handle_t io_inputs_handle,
+                                io_inputs_talk_handler_t handler, void *ctx);
@@ -1,55 +1,178 @@
 #include "driver/gpio.h"
+#include "esp_check.h"
 #include "esp_log.h"
+#include <inttypes.h>
 
 #include "io/inputs.h"
 #include "protocols/messages.h"
+#include "system/memory.h"
 
 static const char *BASE_TAG = "IO:INPUTS";
 static const char *TASK_TAG = "IO:INPUTS:TASK";
 
+// Stays disabled until the debounce timer fires, so a bouncing contact costs
+// one interrupt rather than dozens.
 void IRAM_ATTR io_inputs_talk_btn_isr(void *arg) {
   io_inputs_handle_t io_inputs_handle = (io_inputs_handle_t)arg;
-  xQueueSendFromISR(io_inputs_handle->queues.inputs_queue,
-                    &io_inputs_handle->pins.talk_btn, NULL);
+  BaseType_t woken = pdFALSE;
+
+  gpio_intr_disable(io_inputs_handle->pins.talk_btn);
+  io_inputs_handle->edge_us = esp_timer_get_time();
+  xTaskNotifyFromISR(io_inputs_handle->tasks.inputs_task,
+                     IO_INPUTS_NOTIFY_EDGE, eSetBits, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+static void io_inputs_debounce_callback(void *arg) {
+  io_inputs_handle_t io_inputs_handle = (io_inputs_handle_t)arg;
+  xTaskNotify(io_inputs_handle->tasks.inputs_task, IO_INPUTS_NOTIFY_SETTLED,
+              eSetBits);
+}
+
+static void io_inputs_hold_callback(void *arg) {
+  io_inputs_handle_t io_inputs_handle = (io_inputs_handle_t)arg;
+  xTaskNotify(io_inputs_handle->tasks.inputs_task, IO_INPUTS_NOTIFY_HOLD,
+              eSetBits);
+}
+
+static void io_inputs_send_text(io_inputs_handle_t io_inputs_handle) {
+  protocol_message_handle_t outgoing_message;
+
+  if (protocol_message_init_text(&outgoing_message, "Button pressed!",
+                                 io_inputs_handle->device_info->mac_address,
+                                 NULL) != ESP_OK) {
+    ESP_LOGE(TASK_TAG, "Failed to initialize message");
+    return;
+  }
+  // a doorbell that's lost on a bad link is worse than one that's late
+  outgoing_message->header.flags |= PROTOCOL_MESSAGE_FLAG_RELIABLE;
+
+  if (app_queues_add_outgoing_message(io_inputs_handle->app_queues,
+                                      &outgoing_message, pdMS_TO_TICKS(500),
+                                      false) != ESP_OK) {
+    ESP_LOGE(TASK_TAG, "Failed to send button message to queue");
+    protocol_message_free(outgoing_message);
+  }
+}
+
+static void io_inputs_talk_event(io_inputs_handle_t io_inputs_handle,
+                                 io_inputs_event_t event, int64_t edge_us) {
+  // keeps the radio awake for the whole press, and a while after
+  network_power_talk_activity(io_inputs_handle->power);
+
+  if (event == IO_INPUTS_PRESS) {
+    system_metrics_observe(io_inputs_handle->metrics.press_latency_us,
+                           (uint32_t)(esp_timer_get_time() - edge_us));
+  }
+  if (io_inputs_handle->talk_handler != NULL) {
+    io_inputs_handle->talk_handler(event, edge_us,
+                                   io_inputs_handle->talk_handler_ctx);
+  }
+
+  switch (event) {
+  case IO_INPUTS_PRESS:
+    ESP_LOGI(TASK_TAG, "Talk button pressed");
+    io_inputs_send_text(io_inputs_handle);
+    break;
+  case IO_INPUTS_RELEASE:
+    ESP_LOGI(TASK_TAG, "Talk button released after %" PRId64 "ms",
+             (edge_us - io_inputs_handle->pressed_us) / 1000);
+    break;
+  case IO_INPUTS_HOLD:
+    ESP_LOGI(TASK_TAG, "Talk button held");
+    break;
+  }
+}
+
+// Compares the pin with the debounced state and reports a change, returning
+// whether there was one. The pin is active low.
+static bool io_inputs_sample(io_inputs_handle_t io_inputs_handle,
+                             int64_t edge_us) {
+  bool pressed = gpio_get_level(io_inputs_handle->pins.talk_btn) == 0;
+  if (pressed == io_inputs_handle->pressed) {
+    return false;
+  }
+  io_inputs_handle->pressed = pressed;
+
+  if (pressed) {
+    io_inputs_handle->pressed_us = edge_us;
+    esp_timer_start_once(io_inputs_handle->timers.hold,
+                         IO_INPUTS_HOLD_MS * 1000);
+    io_inputs_talk_event(io_inputs_handle, IO_INPUTS_PRESS, edge_us);
+  } else {
+    esp_timer_stop(io_inputs_handle->timers.hold);
+    io_inputs_talk_event(io_inputs_handle, IO_INPUTS_RELEASE, edge_us);
+  }
+  return true;
 }
 
 void io_inputs_task(void *pvParameters) {
   io_inputs_handle_t io_inputs_handle = (io_inputs_handle_t)pvParameters;
-  uint32_t io_num;
-  protocol_message_handle_t outgoing_message;
+  uint32_t bits = 0;
 
   while (1) {
-    xQueueReceive(io_inputs_handle->queues.inputs_queue, &io_num,
-                  portMAX_DELAY);
-    if (io_num != io_inputs_handle->pins.talk_btn) {
-      continue;
+    xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+
+    if (bits & IO_INPUTS_NOTIFY_EDGE) {
+      if (!io_inputs_sample(io_inputs_handle, io_inputs_handle->edge_us)) {
+        system_metrics_add(io_inputs_handle->metrics.bounces, 1);
+      }
+      esp_timer_start_once(io_inputs_handle->timers.debounce,
+                           IO_INPUTS_DEBOUNCE_MS * 1000);
     }
 
-    ESP_LOGI(TASK_TAG, "Talk button pressed");
-
-    if (protocol_message_init_text(&outgoing_message, "Button pressed!",
-                                   io_inputs_handle->device_info->mac_address,
-                                   NULL) != ESP_OK) {
-      ESP_LOGE(TASK_TAG, "Failed to initialize message");
-      continue;
+    if (bits & IO_INPUTS_NOTIFY_SETTLED) {
+      // Enabled before sampling, so a change after the sample still
+      // interrupts. A change during the bounce window is caught here.
+      gpio_intr_enable(io_inputs_handle->pins.talk_btn);
+      io_inputs_sample(io_inputs_handle, esp_timer_get_time());
     }
 
-    if (app_queues_add_outgoing_message(io_inputs_handle->app_queues,
-                                        &outgoing_message, pdMS_TO_TICKS(500),
-                                        false) != ESP_OK) {
-      ESP_LOGE(TASK_TAG, "Failed to send button message to queue");
-      protocol_message_free(outgoing_message);
-      outgoing_message = NULL;
+    // a release since the timer fired stopped it too late
+    if ((bits & IO_INPUTS_NOTIFY_HOLD) && io_inputs_handle->pressed) {
+      io_inputs_talk_event(io_inputs_handle, IO_INPUTS_HOLD,
+                           io_inputs_handle->pressed_us);
     }
   }
 }
 
+void io_inputs_set_talk_handler(io_inputs_handle_t io_inputs_handle,
+                                io_inputs_talk_handler_t handler, void *ctx) {
+  io_inputs_handle->talk_handler_ctx = ctx;
+  io_inputs_handle->talk_handler = handler;
+}
+
+static esp_err_t io_inputs_metrics_init(io_inputs_handle_t io_inputs_handle) {
+  system_metric_config_t latency_config = {
+      .name = "talk_press_latency_us",
+      .help = "From the talk button's edge interrupt to its press handler",
+      .type = SYSTEM_METRIC_HISTOGRAM,
+  };
+  ESP_RETURN_ON_ERROR(
+      system_metrics_register(&io_inputs_handle->metrics.press_latency_us,
+                              &latency_config),
+      BASE_TAG, "Failed to register '%s'", latency_config.name);
+
+  system_metric_config_t bounces_config = {
+      .name = "talk_bounces_total",
+      .help = "Talk button edges that didn't change its debounced state",
+      .type = SYSTEM_METRIC_COUNTER,
+  };
+  ESP_RETURN_ON_ERROR(system_metrics_register(
+                          &io_inputs_handle->metrics.bounces, &bounces_config),
+                      BASE_TAG, "Failed to register '%s'", bounces_config.name);
+
+  return ESP_OK;
+}
+
 esp_err_t io_inputs_init(io_inputs_handle_t *io_inputs_handle_ptr,
                          int32_t talk_btn_pin,
                          app_device_info_handle_t device_info_handle,
-                         app_queues_handle_t app_queues_handle) {
-  io_inputs_handle_t io_inputs_handle =
-      (io_inputs_handle_t)malloc(sizeof(io_inputs_t));
+                         app_queues_handle_t app_queues_handle,
+                         network_power_handle_t power_handle) {
+  // read from the ISR
+  io_inputs_handle_t io_inputs_handle = (io_inputs_handle_t)
+      system_memory_calloc(1, sizeof(io_inputs_t), SYSTEM_MEMORY_FAST);
   if (io_inputs_handle == NULL) {
     ESP_LOGE(BASE_TAG, "Failed to allocate memory for io inputs handle");
     return ESP_ERR_NO_MEM;
@@ -57,18 +180,53 @@ esp_err_t io_inputs_init(io_inputs_handle_t *io_inputs_handle_ptr,
 
   io_inputs_handle->device_info = device_info_handle;
   io_inputs_handle->app_queues = app_queues_handle;
+  io_inputs_handle->power = power_handle;
+  io_inputs_handle->pins.talk_btn = talk_btn_pin;
+
+  ESP_RETURN_ON_ERROR(io_inputs_metrics_init(io_inputs_handle), BASE_TAG,
+                      "Failed to register metrics");
+
+  esp_timer_create_args_t debounce_args = {
+      .callback = io_inputs_debounce_callback,
+      .arg = io_inputs_handle,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "talk_debounce",
+  };
+  ESP_RETURN_ON_ERROR(
+      esp_timer_create(&debounce_args, &io_inputs_handle->timers.debounce),
+      BASE_TAG, "Failed to create debounce timer");
+
+  esp_timer_create_args_t hold_args = {
+      .callback = io_inputs_hold_callback,
+      .arg = io_inputs_handle,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "talk_hold",
+  };
+  ESP_RETURN_ON_ERROR(
+      esp_timer_create(&hold_args, &io_inputs_handle->timers.hold), BASE_TAG,
+      "Failed to create hold timer");
+
+  // the ISR notifies the task, so it has to exist first
+  BaseType_t xReturned =
+      system_tasks_create(io_inputs_task, TASK_TAG,
+                          IO_INPUTS_TASK_STACK_DEPTH_INPUTS, io_inputs_handle,
+                          IO_INPUTS_TASK_PRIORITY_INPUTS,
+                          IO_INPUTS_TASK_CORE_INPUTS,
+                          &io_inputs_handle->tasks.inputs_task);
 
-  io_inputs_handle->queues.inputs_queue = xQueueCreate(10, sizeof(uint32_t));
-  if (io_inputs_handle->queues.inputs_queue == NULL) {
-    ESP_LOGE(BASE_TAG, "Failed to create inputs queue");
+  if (xReturned != pdPASS) {
+    ESP_LOGE(BASE_TAG, "Failed to create inputs task");
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (io_inputs_handle->tasks.inputs_task == NULL) {
+    ESP_LOGE(BASE_TAG, "Failed to create inputs task");
     return ESP_ERR_NO_MEM;
   }
 
-  io_inputs_handle->pins.talk_btn = talk_btn_pin;
-
   // zero-initialize the config structure.
   gpio_config_t io_conf = {};
-  io_conf.intr_type = GPIO_INTR_NEGEDGE;
+  // presses and releases both matter for push-to-talk
+  io_conf.intr_type = GPIO_INTR_ANYEDGE;
   io_conf.mode = GPIO_MODE_INPUT;
   io_conf.pin_bit_mask = (1ULL << io_inputs_handle->pins.talk_btn);
   io_conf.pull_down_en = 0;
@@ -85,21 +243,7 @@ esp_err_t io_inputs_init(io_inputs_handle_t *io_inputs_handle_ptr,
   gpio_isr_handler_add(io_inputs_handle->pins.talk_btn, io_inputs_talk_btn_isr,
                        io_inputs_handle);
 
-  BaseType_t xReturned =
-      xTaskCreate(io_inputs_task, TASK_TAG, IO_INPUTS_TASK_STACK_DEPTH_INPUTS,
-                  io_inputs_handle, IO_INPUTS_TASK_PRIORITY_INPUTS,
-                  &io_inputs_handle->tasks.inputs_task);
-
-  if (xReturned != pdPASS) {
-    ESP_LOGE(BASE_TAG, "Failed to create inputs task");
-    return ESP_ERR_INVALID_STATE;
-  }
-  if (io_inputs_handle->tasks.inputs_task == NULL) {
-    ESP_LOGE(BASE_TAG, "Failed to create inputs task");
-    return ESP_ERR_NO_MEM;
-  }
-
   *io_inputs_handle_ptr = io_inputs_handle;
 
   return ESP_OK;
-}
\ No newline at end of file
+}
@@ -0,0 +1,618 @@
+#include "esp_check.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#else
+#include "lwip/sockets.h"
+#endif
+
+#include "network/diagnostics.h"
+#include "storage/nvs.h"
+#include "storage/settings.h"
+#include "system/memory.h"
+#include "system/metrics.h"
+
+static const char *TAG = "NETWORK:DIAGNOSTICS";
+
+#if CONFIG_NETWORK_DIAGNOSTICS
+
+static const char *RESPONSE_OK = "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Connection: close\r\n\r\n";
+static const char *RESPONSE_BAD_REQUEST = "HTTP/1.0 400 Bad Request\r\n"
+                                          "Connection: close\r\n\r\n";
+static const char *RESPONSE_NOT_FOUND = "HTTP/1.0 404 Not Found\r\n"
+                                        "Connection: close\r\n\r\n";
+static const char *RESPONSE_UNAUTHORIZED = "HTTP/1.0 401 Unauthorized\r\n"
+                                           "WWW-Authenticate: Bearer\r\n"
+                                           "Connection: close\r\n\r\n";
+
+// // ----------------
+// // Response
+// // ----------------
+
+static void network_diagnostics_flush(network_diagnostics_handle_t handle) {
+  int32_t offset = 0;
+
+  while (!handle->response.failed && offset < handle->response.length) {
+    int32_t sent = send(handle->response.socket,
+                        handle->response.buffer + offset,
+                        handle->response.length - offset, 0);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      // the scraper went away or stalled, drop the rest of the response
+      handle->response.failed = true;
+      break;
+    }
+    offset += sent;
+  }
+
+  handle->response.length = 0;
+}
+
+// lines longer than the buffer are cut short
+static void network_diagnostics_printf(network_diagnostics_handle_t handle,
+                                       const char *format, ...) {
+  va_list args;
+
+  for (int32_t attempt = 0; attempt < 2; attempt++) {
+    int32_t available =
+        NETWORK_DIAGNOSTICS_BUFFER_LENGTH - handle->response.length;
+    va_start(args, format);
+    int32_t length = vsnprintf(
+        handle->response.buffer + handle->response.length, available, format,
+        args);
+    va_end(args);
+
+    if (length < available) {
+      handle->response.length += length;
+      return;
+    }
+    if (handle->response.length == 0) {
+      handle->response.length = NETWORK_DIAGNOSTICS_BUFFER_LENGTH - 1;
+      return;
+    }
+    // didn't fit, send what's there and write it again at the start
+    network_diagnostics_flush(handle);
+  }
+}
+
+// label values are quoted, so quotes, backslashes and newlines are escaped
+static void network_diagnostics_escape(char *escaped, int32_t size,
+                                       const char *value) {
+  int32_t length = 0;
+
+  for (; *value != '\0' && length < size - 2; value++) {
+    if (*value == '"' || *value == '\\') {
+      escaped[length++] = '\\';
+      escaped[length++] = *value;
+    } else if (*value == '\n') {
+      escaped[length++] = '\\';
+      escaped[length++] = 'n';
+    } else {
+      escaped[length++] = *value;
+    }
+  }
+
+  escaped[length] = '\0';
+}
+
+static void network_diagnostics_type(network_diagnostics_handle_t handle,
+                                     const char *name, const char *help,
+                                     const char *type) {
+  if (handle->response.type_name != NULL &&
+      strcmp(handle->response.type_name, name) == 0) {
+    return;
+  }
+
+  handle->response.type_name = name;
+  network_diagnostics_printf(handle, "# HELP %s %s\n# TYPE %s %s\n", name,
+                             help, name, type);
+}
+
+// // ----------------
+// // Metrics
+// // ----------------
+
+static void network_diagnostics_write_metric(const system_metric_t *metric,
+                                             const system_metric_value_t *value,
+                                             void *ctx) {
+  network_diagnostics_handle_t handle = (network_diagnostics_handle_t)ctx;
+  static const char *TYPES[] = {
+      [SYSTEM_METRIC_COUNTER] = "counter",
+      [SYSTEM_METRIC_GAUGE] = "gauge",
+      [SYSTEM_METRIC_HISTOGRAM] = "histogram",
+  };
+  bool has_labels = metric->labels[0] != '\0';
+
+  network_diagnostics_type(handle, metric->name, metric->help,
+                           TYPES[metric->type]);
+
+  if (metric->type == SYSTEM_METRIC_COUNTER) {
+    network_diagnostics_printf(handle, "%s%s%s%s %" PRIu32 "\n", metric->name,
+                               has_labels ? "{" : "", metric->labels,
+                               has_labels ? "}" : "", (uint32_t)value->value);
+    return;
+  }
+
+  if (metric->type == SYSTEM_METRIC_GAUGE) {
+    network_diagnostics_printf(handle, "%s%s%s%s %" PRId32 "\n", metric->name,
+                               has_labels ? "{" : "", metric->labels,
+                               has_labels ? "}" : "", value->value);
+    return;
+  }
+
+  // Prometheus buckets are cumulative and inclusive, bucket `i` holds values
+  // below `2^i`
+  uint32_t cumulative = 0;
+  for (int32_t i = 0; i < SYSTEM_METRICS_HISTOGRAM_BUCKETS; i++) {
+    cumulative += value->buckets[i];
+    if (i == SYSTEM_METRICS_HISTOGRAM_BUCKETS - 1) {
+      network_diagnostics_printf(handle,
+                                 "%s_bucket{%s%sle=\"+Inf\"} %" PRIu32 "\n",
+                                 metric->name, metric->labels,
+                                 has_labels ? "," : "", cumulative);
+    } else {
+      network_diagnostics_printf(
+          handle, "%s_bucket{%s%sle=\"%" PRIu32 "\"} %" PRIu32 "\n",
+          metric->name, metric->labels, has_labels ? "," : "",
+          ((uint32_t)1 << i) - 1, cumulative);
+    }
+  }
+  network_diagnostics_printf(handle, "%s_sum%s%s%s %" PRIu32 "\n",
+                             metric->name, has_labels ? "{" : "",
+                             metric->labels, has_labels ? "}" : "", value->sum);
+  // the total of the buckets rather than `count`, so they agree
+  network_diagnostics_printf(handle, "%s_count%s%s%s %" PRIu32 "\n",
+                             metric->name, has_labels ? "{" : "",
+                             metric->labels, has_labels ? "}" : "",
+                             cumulative);
+}
+
+static void network_diagnostics_write_station(
+    network_diagnostics_handle_t handle) {
+  char name[APP_PEERS_NAME_LENGTH * 2];
+  uint8_t *mac = handle->device_info->mac_address;
+
+  network_diagnostics_escape(name, sizeof(name), handle->device_info->name);
+  network_diagnostics_type(handle, "station_info", "This station", "gauge");
+  network_diagnostics_printf(
+      handle,
+      "station_info{name=\"%s\",mac=\"%02x:%02x:%02x:%02x:%02x:%02x\"} 1\n",
+      name, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  network_diagnostics_type(handle, "uptime_seconds", "Time since boot",
+                           "gauge");
+  network_diagnostics_printf(handle, "uptime_seconds %" PRId64 "\n",
+                             esp_timer_get_time() / 1000000);
+}
+
+static void
+network_diagnostics_write_peers(network_diagnostics_handle_t handle) {
+  char name[APP_PEERS_NAME_LENGTH * 2];
+  int32_t now_ms = (int32_t)(esp_timer_get_time() / 1000);
+  int32_t count = app_peers_copy(handle->peers, handle->peers_copy,
+                                 NETWORK_DIAGNOSTICS_MAX_PEERS);
+
+  network_diagnostics_type(handle, "peer_heartbeat_age_ms",
+                           "Time since each peer's last heartbeat", "gauge");
+  for (int32_t i = 0; i < count; i++) {
+    app_peer_info_t *peer = &handle->peers_copy[i];
+    network_diagnostics_escape(name, sizeof(name), peer->name);
+    network_diagnostics_printf(
+        handle,
+        "peer_heartbeat_age_ms{name=\"%s\",mac=\"%02x:%02x:%02x:%02x:%02x:"
+        "%02x\"} %" PRId32 "\n",
+        name, peer->mac_address[0], peer->mac_address[1],
+        peer->mac_address[2], peer->mac_address[3], peer->mac_address[4],
+        peer->mac_address[5], now_ms - peer->last_heartbeat_ms);
+  }
+}
+
+// the high-water marks are in the registry, these are the depths right now
+static void
+network_diagnostics_write_queues(network_diagnostics_handle_t handle) {
+  app_router_handle_t router = handle->queues->incoming;
+
+  network_diagnostics_type(handle, "queue_outgoing_depth",
+                           "Messages waiting to be sent", "gauge");
+  network_diagnostics_printf(handle, "queue_outgoing_depth %" PRIu32 "\n",
+                             (uint32_t)uxQueueMessagesWaiting(
+                                 handle->queues->outgoing));
+
+  network_diagnostics_type(handle, "router_queue_depth",
+                           "Messages waiting for each subscriber", "gauge");
+  int32_t count =
+      atomic_load_explicit(&router->subscriber_count, memory_order_acquire);
+  for (int32_t i = 0; i < count; i++) {
+    app_router_subscriber_handle_t subscriber = router->subscribers[i];
+    if (subscriber->queue == NULL) {
+      continue;
+    }
+    network_diagnostics_printf(
+        handle, "router_queue_depth{subscriber=\"%s\"} %" PRIu32 "\n",
+        subscriber->name, app_router_waiting(subscriber));
+  }
+}
+
+// // ----------------
+// // Memos
+// // ----------------
+
+static void
+network_diagnostics_write_memos(network_diagnostics_handle_t handle) {
+  int32_t count = app_memos_list(handle->memos, handle->memos_copy,
+                                 STORAGE_MEMOS_INDEX_MAX);
+
+  network_diagnostics_type(
+      handle, "memo_duration_ms",
+      "Each recorded memo, play with POST /memos/<id>/play", "gauge");
+  for (int32_t i = 0; i < count; i++) {
+    storage_memo_t *memo = &handle->memos_copy[i];
+    uint8_t *mac = memo->from_mac_address;
+    network_diagnostics_printf(
+        handle,
+        "memo_duration_ms{id=\"%" PRIu32 "\",from=\"%02x:%02x:%02x:%02x:"
+        "%02x:%02x\",recorded_s=\"%" PRId64 "\",bytes=\"%" PRIu32
+        "\"} %" PRIu32 "\n",
+        memo->id, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+        memo->recorded_s, memo->bytes, memo->frames * memo->frame_ms);
+  }
+}
+
+// `request` is past "POST /memos/"
+static bool network_diagnostics_play_memo(network_diagnostics_handle_t handle,
+                                          const char *request) {
+  char *end = NULL;
+  uint32_t memo = strtoul(request, &end, 10);
+
+  return end != request && strncmp(end, "/play ", 6) == 0 &&
+         app_memos_play(handle->memos, memo) == ESP_OK;
+}
+
+// `request` is past "POST /settings/", the body is the new value. Picked up
+// like any other change, some only on the next reconnect.
+static const char *
+network_diagnostics_set_setting(const char *request, const char *body) {
+  // NVS keys are at most 15 characters
+  char key[16];
+  const char *end = strchr(request, ' ');
+  if (end == NULL || end == request || end - request >= sizeof(key)) {
+    return RESPONSE_NOT_FOUND;
+  }
+  memcpy(key, request, end - request);
+  key[end - request] = '\0';
+
+  storage_setting_id_t id;
+  storage_setting_type_t type;
+  if (storage_settings_find(key, &id, &type) != ESP_OK) {
+    return RESPONSE_NOT_FOUND;
+  }
+
+  // `echo` and friends end the value with a newline
+  char *value = (char *)body;
+  size_t length = strlen(value);
+  while (length > 0 && strchr("\r\n", value[length - 1]) != NULL) {
+    value[--length] = '\0';
+  }
+
+  esp_err_t ret = ESP_ERR_INVALID_ARG;
+  if (type == STORAGE_SETTING_TYPE_U32) {
+    char *value_end = NULL;
+    uint32_t number = strtoul(value, &value_end, 10);
+    if (length > 0 && *value_end == '\0') {
+      ret = storage_settings_set_u32(id, number);
+    }
+  } else {
+    ret = storage_settings_set_str(id, value);
+  }
+  if (ret != ESP_OK) {
+    return RESPONSE_BAD_REQUEST;
+  }
+
+  ESP_LOGI(TAG, "Setting '%s' changed", key);
+  return RESPONSE_OK;
+}
+
+// // ----------------
+// // Requests
+// // ----------------
+
+// The value of the header `name`, up to the end of its line. NULL if the
+// request doesn't have it.
+static const char *network_diagnostics_header(const char *request,
+                                              const char *name,
+                                              int32_t *length_ptr) {
+  size_t name_length = strlen(name);
+  const char *line = strstr(request, "\r\n");
+
+  while (line != NULL && strncmp(line, "\r\n\r\n", 4) != 0) {
+    line += 2;
+    const char *end = strstr(line, "\r\n");
+    if (end == NULL) {
+      return NULL;
+    }
+    if (strncasecmp(line, name, name_length) == 0 &&
+        line[name_length] == ':') {
+      const char *value = line + name_length + 1;
+      while (*value == ' ') {
+        value++;
+      }
+      *length_ptr = end - value;
+      return value;
+    }
+    line = end;
+  }
+  return NULL;
+}
+
+// Reads the request into the response buffer, up to the end of its body,
+// and returns the body. Headers that don't fit are cut short, but a body
+// that doesn't fit, or a client that goes away first, gets NULL.
+static char *network_diagnostics_read(network_diagnostics_handle_t handle,
+                                      int32_t client) {
+  char *buffer = handle->response.buffer;
+  char *body = NULL;
+  int32_t wanted = NETWORK_DIAGNOSTICS_BUFFER_LENGTH - 1;
+  int32_t length = 0;
+
+  while (length < wanted) {
+    int32_t received = recv(client, buffer + length,
+                            NETWORK_DIAGNOSTICS_BUFFER_LENGTH - 1 - length, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return NULL;
+    }
+    length += received;
+    buffer[length] = '\0';
+
+    char *headers_end = body == NULL ? strstr(buffer, "\r\n\r\n") : NULL;
+    if (headers_end != NULL) {
+      body = headers_end + 4;
+      int32_t content_length = 0;
+      const char *value =
+          network_diagnostics_header(buffer, "Content-Length", &content_length);
+      content_length = value != NULL ? (int32_t)strtol(value, NULL, 10) : 0;
+      if (content_length < 0 ||
+          content_length > NETWORK_DIAGNOSTICS_BUFFER_LENGTH - 1 -
+                               (body - buffer)) {
+        return NULL;
+      }
+      wanted = (body - buffer) + content_length;
+    }
+  }
+
+  return body != NULL ? body : buffer + length;
+}
+
+static bool
+network_diagnostics_authorized(network_diagnostics_handle_t handle,
+                               const char *request) {
+  static const char *SCHEME = "Bearer ";
+  size_t scheme_length = strlen(SCHEME);
+  size_t token_length = strlen(handle->token);
+  int32_t length = 0;
+  const char *value =
+      network_diagnostics_header(request, "Authorization", &length);
+
+  if (token_length == 0 || value == NULL ||
+      (size_t)length != scheme_length + token_length ||
+      strncmp(value, SCHEME, scheme_length) != 0) {
+    return false;
+  }
+
+  // every byte is compared, so how long it takes doesn't tell how many
+  // matched
+  uint8_t difference = 0;
+  for (size_t i = 0; i < token_length; i++) {
+    difference |= value[scheme_length + i] ^ handle->token[i];
+  }
+  return difference == 0;
+}
+
+// // ----------------
+// // Server
+// // ----------------
+
+static void network_diagnostics_serve(network_diagnostics_handle_t handle,
+                                      int32_t client) {
+  struct timeval timeout = {
+      .tv_sec = NETWORK_DIAGNOSTICS_TIMEOUT_MS / 1000,
+      .tv_usec = (NETWORK_DIAGNOSTICS_TIMEOUT_MS % 1000) * 1000,
+  };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  handle->response.socket = client;
+  handle->response.length = 0;
+  handle->response.failed = false;
+  handle->response.type_name = NULL;
+
+  // the response is written over the request, so it's handled first
+  char *body = network_diagnostics_read(handle, client);
+  if (body == NULL) {
+    return;
+  }
+
+  const char *request = handle->response.buffer;
+  if (strncmp(request, "GET /metrics ", 13) == 0 ||
+      strncmp(request, "GET / ", 6) == 0) {
+    network_diagnostics_printf(handle, "%s", RESPONSE_OK);
+    network_diagnostics_write_station(handle);
+    network_diagnostics_write_peers(handle);
+    network_diagnostics_write_queues(handle);
+    system_metrics_snapshot(network_diagnostics_write_metric, handle);
+  } else if (handle->memos != NULL &&
+             strncmp(request, "GET /memos ", 11) == 0) {
+    network_diagnostics_printf(handle, "%s", RESPONSE_OK);
+    network_diagnostics_write_memos(handle);
+  } else if (strncmp(request, "POST ", 5) == 0 &&
+             !network_diagnostics_authorized(handle, request)) {
+    network_diagnostics_printf(handle, "%s", RESPONSE_UNAUTHORIZED);
+  } else if (handle->memos != NULL &&
+             strncmp(request, "POST /memos/", 12) == 0 &&
+             network_diagnostics_play_memo(handle, request + 12)) {
+    network_diagnostics_printf(handle, "%splaying\n", RESPONSE_OK);
+  } else if (strncmp(request, "POST /settings/", 15) == 0) {
+    network_diagnostics_printf(
+        handle, "%s", network_diagnostics_set_setting(request + 15, body));
+  } else {
+    network_diagnostics_printf(handle, "%s", RESPONSE_NOT_FOUND);
+  }
+  network_diagnostics_flush(handle);
+}
+
+static esp_err_t
+network_diagnostics_listen(network_diagnostics_handle_t handle) {
+  esp_err_t ret = ESP_OK;
+  struct sockaddr_in saddr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(CONFIG_NETWORK_DIAGNOSTICS_PORT),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+
+  handle->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  ESP_GOTO_ON_FALSE(handle->socket >= 0, ESP_ERR_INVALID_STATE,
+                    network_diagnostics_listen_end, TAG,
+                    "Failed to create socket: %d", errno);
+
+  int32_t reuse = 1;
+  setsockopt(handle->socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  ESP_GOTO_ON_FALSE(bind(handle->socket, (struct sockaddr *)&saddr,
+                         sizeof(saddr)) >= 0,
+                    ESP_ERR_INVALID_STATE, network_diagnostics_listen_end, TAG,
+                    "Failed to bind port %d: %d",
+                    CONFIG_NETWORK_DIAGNOSTICS_PORT, errno);
+
+  // scrapes are served one at a time
+  ESP_GOTO_ON_FALSE(listen(handle->socket, 1) >= 0, ESP_ERR_INVALID_STATE,
+                    network_diagnostics_listen_end, TAG,
+                    "Failed to listen: %d", errno);
+
+  ESP_LOGI(TAG, "Serving metrics on port %d", CONFIG_NETWORK_DIAGNOSTICS_PORT);
+
+network_diagnostics_listen_end:
+  if (ret != ESP_OK && handle->socket >= 0) {
+    close(handle->socket);
+    handle->socket = -1;
+  }
+  return ret;
+}
+
+void network_diagnostics_server_task(void *pvParameters) {
+  network_diagnostics_handle_t handle =
+      (network_diagnostics_handle_t)pvParameters;
+
+  while (true) {
+    // nothing to serve until there's an address
+    xEventGroupWaitBits(handle->events->group_handle,
+                        NETWORK_EVENT_SOCKET_READY, pdFALSE, pdFALSE,
+                        portMAX_DELAY);
+
+    if (handle->socket < 0 && network_diagnostics_listen(handle) != ESP_OK) {
+      vTaskDelay(pdMS_TO_TICKS(NETWORK_DIAGNOSTICS_RETRY_MS));
+      continue;
+    }
+
+    int32_t client = accept(handle->socket, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // the interface may have gone away, start over
+      ESP_LOGE(TAG, "accept failed: errno %d", errno);
+      close(handle->socket);
+      handle->socket = -1;
+      vTaskDelay(pdMS_TO_TICKS(NETWORK_DIAGNOSTICS_RETRY_MS));
+      continue;
+    }
+
+    network_diagnostics_serve(handle, client);
+    close(client);
+  }
+}
+
+esp_err_t
+network_diagnostics_init(network_diagnostics_handle_t *diagnostics_handle_ptr,
+                         network_events_handle_t events_handle,
+                         app_device_info_handle_t device_info_handle,
+                         app_peers_handle_t peers_handle,
+                         app_queues_handle_t queues_handle) {
+  // scrapes are rare and slow anyway, keep the buffers out of internal RAM
+  network_diagnostics_handle_t handle =
+      (network_diagnostics_handle_t)system_memory_calloc(
+          1, sizeof(network_diagnostics_t), SYSTEM_MEMORY_BULK);
+  if (handle == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  handle->socket = -1;
+  handle->events = events_handle;
+  handle->device_info = device_info_handle;
+  handle->peers = peers_handle;
+  handle->queues = queues_handle;
+
+  size_t token_length = sizeof(handle->token);
+  if (storage_nvs_get_diagnostics_token(handle->token, &token_length) !=
+      ESP_OK) {
+    handle->token[0] = '\0';
+    ESP_LOGI(TAG, "No diag_token provisioned, POST requests are refused");
+  }
+
+  if (system_tasks_create(network_diagnostics_server_task, TAG,
+                          NETWORK_DIAGNOSTICS_TASK_STACK_DEPTH, handle,
+                          NETWORK_DIAGNOSTICS_TASK_PRIORITY,
+                          NETWORK_DIAGNOSTICS_TASK_CORE,
+                          &handle->tasks.server) != pdPASS) {
+    free(handle);
+    return ESP_ERR_NO_MEM;
+  }
+
+  *diagnostics_handle_ptr = handle;
+
+  return ESP_OK;
+}
+
+void network_diagnostics_set_memos(
+    network_diagnostics_handle_t diagnostics_handle,
+    app_memos_handle_t memos_handle) {
+  diagnostics_handle->memos = memos_handle;
+}
+
+#else
+
+esp_err_t
+network_diagnostics_init(network_diagnostics_handle_t *diagnostics_handle_ptr,
+                         network_events_handle_t events_handle,
+                         app_device_info_handle_t device_info_handle,
+                         app_peers_handle_t peers_handle,
+                         app_queues_handle_t queues_handle) {
+  ESP_LOGI(TAG, "Diagnostics are disabled, see CONFIG_NETWORK_DIAGNOSTICS");
+  *diagnostics_handle_ptr = NULL;
+  return ESP_OK;
+}
+
+void network_diagnostics_set_memos(
+    network_diagnostics_handle_t diagnostics_handle,
+    app_memos_handle_t memos_handle) {}
+
+#endif
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "network/events.h"
 
 esp_err_t network_events_init(network_events_handle_t *handle_ptr) {
@@ -12,9 +14,11 @@ esp_err_t network_events_init(network_events_handle_t *handle_ptr) {
     return ESP_ERR_NO_MEM;
   }
 
+  memset(&events_handle->ip_info, 0, sizeof(esp_netif_ip_info_t));
+
   xEventGroupClearBits(events_handle->group_handle,
                        NETWORK_EVENT_GOT_NEW_IP | NETWORK_EVENT_SOCKET_READY |
-                           NETWORK_EVENT_LOST_IP);
+                           NETWORK_EVENT_LOST_IP | NETWORK_EVENT_TALK_ACTIVITY);
 
   *handle_ptr = events_handle;
 
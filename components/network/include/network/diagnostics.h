@@ -0,0 +1,82 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+
+#include "application/device_info.h"
+#include "application/memos.h"
+#include "application/peers.h"
+#include "application/queues.h"
+#include "network/events.h"
+#include "system/tasks.h"
+
+// below everything on the message path, scrapes wait their turn
+#define NETWORK_DIAGNOSTICS_TASK_PRIORITY 1
+#define NETWORK_DIAGNOSTICS_TASK_CORE SYSTEM_TASKS_CORE_ANY
+#define NETWORK_DIAGNOSTICS_TASK_STACK_DEPTH (1024 * 4)
+
+// the response is written through this, a flush per fill
+#define NETWORK_DIAGNOSTICS_BUFFER_LENGTH 512
+#define NETWORK_DIAGNOSTICS_MAX_PEERS 16
+// a scraper that stalls longer than this is hung up on
+#define NETWORK_DIAGNOSTICS_TIMEOUT_MS 2000
+// the `diag_token` provisioned in NVS, terminator included
+#define NETWORK_DIAGNOSTICS_TOKEN_LENGTH 65
+#define NETWORK_DIAGNOSTICS_RETRY_MS 1000
+
+typedef struct network_diagnostics_t {
+  // listening socket
+  int32_t socket;
+
+  struct {
+    TaskHandle_t server;
+  } tasks;
+
+  network_events_handle_t events;
+  app_device_info_handle_t device_info;
+  app_peers_handle_t peers;
+  app_queues_handle_t queues;
+  // NULL without a memos partition
+  app_memos_handle_t memos;
+  // empty when none was provisioned, then nothing that acts on the station
+  // is served
+  char token[NETWORK_DIAGNOSTICS_TOKEN_LENGTH];
+
+  // Everything a scrape needs is allocated here once, nothing is allocated
+  // while serving.
+  struct {
+    int32_t socket;
+    char buffer[NETWORK_DIAGNOSTICS_BUFFER_LENGTH];
+    int32_t length;
+    bool failed;
+    // the metric name the last `# TYPE` line was written for
+    const char *type_name;
+  } response;
+  app_peer_info_t peers_copy[NETWORK_DIAGNOSTICS_MAX_PEERS];
+  storage_memo_t memos_copy[STORAGE_MEMOS_INDEX_MAX];
+} network_diagnostics_t;
+
+typedef network_diagnostics_t *network_diagnostics_handle_t;
+
+// Serves Prometheus text on `CONFIG_NETWORK_DIAGNOSTICS_PORT` over plain
+// HTTP: the metrics registry, the peer table and the current queue depths.
+// See `tools/diagnostics/scrape.py`. With memos, `/memos` lists them and a
+// POST to `/memos/<id>/play` plays one. A POST to `/settings/<key>` sets
+// the setting with that NVS key to the body.
+//
+// Reading is open to the LAN. A POST acts on the station, so it must carry
+// `Authorization: Bearer <token>` with the `diag_token` provisioned in the
+// `security` NVS namespace, and is refused when there's none.
+esp_err_t
+network_diagnostics_init(network_diagnostics_handle_t *diagnostics_handle_ptr,
+                         network_events_handle_t events_handle,
+                         app_device_info_handle_t device_info_handle,
+                         app_peers_handle_t peers_handle,
+                         app_queues_handle_t queues_handle);
+
+// Set before the first scrape.
+void network_diagnostics_set_memos(
+    network_diagnostics_handle_t diagnostics_handle,
+    app_memos_handle_t memos_handle);
@@ -1,14 +1,19 @@
 #pragma once
 
+#include "esp_netif_types.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 
 #define NETWORK_EVENT_GOT_NEW_IP (1 << 0)
 #define NETWORK_EVENT_LOST_IP (1 << 1)
 #define NETWORK_EVENT_SOCKET_READY (1 << 2)
+#define NETWORK_EVENT_TALK_ACTIVITY (1 << 3)
 
 typedef struct network_events_t {
   EventGroupHandle_t group_handle;
+  // written by WiFi on `NETWORK_EVENT_GOT_NEW_IP`, read by UDP when creating
+  // the socket.
+  esp_netif_ip_info_t ip_info;
 } network_events_t;
 
 typedef network_events_t *network_events_handle_t;
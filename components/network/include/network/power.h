@@ -0,0 +1,88 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "application/peers.h"
+#include "network/events.h"
+#include "protocols/messages.h"
+#include "system/tasks.h"
+
+#define NETWORK_POWER_TASK_PRIORITY 2
+#define NETWORK_POWER_TASK_CORE SYSTEM_TASKS_CORE_ANY
+#define NETWORK_POWER_TASK_STACK_DEPTH (1024 * 3)
+
+// how often the policy is re-evaluated when nothing else wakes it up
+#define NETWORK_POWER_EVALUATE_INTERVAL_MS 1000
+// stay in the talk mode this long after the last talk activity so that a
+// conversation doesn't flip the radio in and out of power save between turns
+#define NETWORK_POWER_TALK_HOLD_MS 5000
+#define NETWORK_POWER_REPORT_INTERVAL_MS 300000 // 5 minutes
+
+// Number of senders we keep a latency baseline for. A new one replaces the
+// one heard from longest ago.
+#define NETWORK_POWER_LATENCY_MAX_SENDERS 8
+
+typedef enum network_power_mode_t {
+  // no peers. `WIFI_PS_MAX_MODEM`, wake every listen interval.
+  NETWORK_POWER_MODE_IDLE = 0,
+  // peers exist. `WIFI_PS_MIN_MODEM`, wake every DTIM.
+  NETWORK_POWER_MODE_PEERS = 1,
+  // talk session active. `WIFI_PS_NONE`, radio always on.
+  NETWORK_POWER_MODE_TALK = 2,
+  NETWORK_POWER_MODE_COUNT,
+} network_power_mode_t;
+
+typedef struct network_power_mode_stats_t {
+  int64_t residency_us;
+  uint32_t entries;
+  // multicast latency, measured as the delay above the fastest delivery seen
+  // from the same sender. Clocks are not shared, so this is relative.
+  uint32_t latency_samples;
+  int64_t latency_sum_us;
+  int64_t latency_max_us;
+} network_power_mode_stats_t;
+
+typedef struct network_power_sender_t {
+  protocol_mac_address_t mac_address;
+  // smallest `arrival - sent` seen from this sender
+  int64_t min_delta_us;
+  int64_t heard_us;
+  bool in_use;
+} network_power_sender_t;
+
+typedef struct network_power_t {
+  network_power_mode_t mode;
+  int64_t mode_entered_us;
+  int64_t last_talk_activity_us;
+  int64_t last_report_us;
+  network_power_mode_stats_t stats[NETWORK_POWER_MODE_COUNT];
+  network_power_sender_t senders[NETWORK_POWER_LATENCY_MAX_SENDERS];
+  // guards `mode`, `stats` and `senders`
+  SemaphoreHandle_t mutex;
+  struct {
+    TaskHandle_t policy;
+  } tasks;
+  network_events_handle_t events;
+  app_peers_handle_t peers;
+} network_power_t;
+
+typedef network_power_t *network_power_handle_t;
+
+esp_err_t network_power_init(network_power_handle_t *power_handle_ptr,
+                             network_events_handle_t events_handle,
+                             app_peers_handle_t peers_handle);
+
+// Marks talk activity (talk button, outgoing or incoming audio). Safe to call
+// from any task.
+void network_power_talk_activity(network_power_handle_t power_handle);
+
+// Called for every received message once it's opened and decoded, so only
+// authentic ones count. Records the multicast latency for the current mode
+// and treats incoming audio as talk activity.
+void network_power_record_rx(network_power_handle_t power_handle,
+                             const protocol_message_header_t *header);
+
+void network_power_report(network_power_handle_t power_handle);
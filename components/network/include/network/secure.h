@@ -0,0 +1,147 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/gcm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocols/mac.h"
+#include "protocols/messages.h"
+#include "system/metrics.h"
+#include "system/tasks.h"
+
+// AES-128, -192 or -256, by the length of the group key
+#define NETWORK_SECURE_KEY_MAX_LENGTH 32
+
+#define NETWORK_SECURE_EPOCH_LENGTH 4
+#define NETWORK_SECURE_TAG_LENGTH 16
+// the sender's epoch, then the tag
+#define NETWORK_SECURE_TRAILER_LENGTH                                          \
+  (NETWORK_SECURE_EPOCH_LENGTH + NETWORK_SECURE_TAG_LENGTH)
+_Static_assert(NETWORK_SECURE_TRAILER_LENGTH <=
+                   PROTOCOL_MESSAGE_TRAILER_MAX_LENGTH,
+               "the trailer doesn't fit in a datagram");
+
+// only writes the replay floors to NVS
+#define NETWORK_SECURE_TASK_PRIORITY 1
+#define NETWORK_SECURE_TASK_CORE SYSTEM_TASKS_CORE_ANY
+#define NETWORK_SECURE_TASK_STACK_DEPTH (1024 * 3)
+
+// Senders whose replay state is kept, the least recently heard is forgotten.
+#define NETWORK_SECURE_SENDERS 16
+// Recent datagrams remembered per sender. Anything older than all of them is
+// rejected, so this is also how far datagrams can be reordered.
+#define NETWORK_SECURE_HISTORY 32
+// and anything this much older than the sender's newest datagram
+#define NETWORK_SECURE_REORDER_WINDOW_MS 2000
+// Retransmissions keep their message's UUID, so they're remembered apart,
+// the most recent few per sender. They're accepted until the sender's newest
+// UUID is this much younger, which covers every retransmission
+// `application/reliable` makes.
+#define NETWORK_SECURE_RETRANSMITS 16
+#define NETWORK_SECURE_RETRANSMIT_WINDOW_MS 10000
+// A floor outlives the sender's replay state, it's only forgotten when more
+// stations than this are heard. The epochs are kept in NVS, and written this
+// long after the last one moved.
+#define NETWORK_SECURE_FLOORS 64
+#define NETWORK_SECURE_FLOORS_FLUSH_DELAY_MS 2000
+// a floor in NVS: the MAC address, then the epoch big-endian
+#define NETWORK_SECURE_FLOOR_RECORD_LENGTH                                     \
+  (sizeof(protocol_mac_address_t) + NETWORK_SECURE_EPOCH_LENGTH)
+
+typedef struct network_secure_retransmit_t {
+  protocol_message_uuid_t uuid;
+  uint16_t attempt;
+} network_secure_retransmit_t;
+
+// Nothing older than this is accepted from the sender again.
+typedef struct network_secure_floor_t {
+  protocol_mac_address_t mac_address;
+  uint32_t epoch;
+  // the sender's clock, the newest UUID in `epoch`. Not kept in NVS.
+  int64_t timestamp;
+  // our clock, to pick one to forget
+  int64_t heard_us;
+} network_secure_floor_t;
+
+typedef struct network_secure_sender_t {
+  network_secure_floor_t *floor;
+  // our clock, to pick one to forget
+  int64_t heard_us;
+  // the floor's timestamp when this state was made, anything up to it was
+  // accepted before and forgotten
+  int64_t forgotten_timestamp;
+  int32_t history_count;
+  protocol_message_uuid_t history[NETWORK_SECURE_HISTORY];
+  int32_t retransmit_count;
+  network_secure_retransmit_t retransmits[NETWORK_SECURE_RETRANSMITS];
+} network_secure_sender_t;
+
+// Authenticated encryption of whole datagrams with a pre-shared group key.
+// The header stays readable, so it can be routed before it's decrypted, and
+// is authenticated with the body. The nonce is the sender's MAC address,
+// the message UUID, the sender's boot epoch and the attempt. The MAC address
+// keeps stations sharing the key apart, a datagram only opens under the MAC
+// address in its header. The epoch is a counter kept in NVS, since UUID
+// timestamps start again at every boot. It also orders a sender's boots, so
+// datagrams replayed from an earlier boot are rejected.
+//
+// Each sender's newest epoch is its floor, kept apart from the rest of its
+// replay state and in NVS, so neither forgetting a sender nor rebooting
+// lets its earlier boots be replayed. Within its current boot, forgetting a
+// sender keeps its newest timestamp, but a reboot of ours doesn't: until
+// its next datagram reaches us, ones it sent earlier in the same boot could
+// be accepted once more.
+//
+// On device, mbedtls does AES on the crypto accelerator
+// (`CONFIG_MBEDTLS_HARDWARE_AES`). On the linux target it's all software.
+typedef struct network_secure_t {
+  // only used by the sending task
+  mbedtls_gcm_context seal;
+  protocol_mac_address_t mac_address;
+  uint32_t epoch;
+
+  // guards `open` and the senders, datagrams are opened on any task
+  SemaphoreHandle_t mutex;
+  mbedtls_gcm_context open;
+  network_secure_sender_t senders[NETWORK_SECURE_SENDERS];
+  int32_t floor_count;
+  network_secure_floor_t floors[NETWORK_SECURE_FLOORS];
+  // set when an epoch moves, cleared once the floors are written
+  bool floors_dirty;
+  TaskHandle_t floors_task;
+
+  struct {
+    system_metric_handle_t auth_failures;
+    system_metric_handle_t replays;
+    system_metric_handle_t floors_forgotten;
+    system_metric_handle_t seal_us;
+    system_metric_handle_t open_us;
+  } metrics;
+} network_secure_t;
+
+typedef network_secure_t *network_secure_handle_t;
+
+// `mac_address` is ours, only datagrams from it can be sealed. `epoch` must
+// be higher than at any earlier boot with the same key, see
+// `storage_nvs_next_epoch`.
+esp_err_t network_secure_init(network_secure_handle_t *secure_handle_ptr,
+                              const uint8_t *key, size_t key_length,
+                              const protocol_mac_address_t mac_address,
+                              uint32_t epoch);
+
+// Encrypts an encoded datagram's body in place and appends the trailer, it
+// must be from our MAC address. `buffer` must have room for
+// `NETWORK_SECURE_TRAILER_LENGTH` more bytes.
+// Not thread safe, only one task may seal.
+esp_err_t network_secure_seal(network_secure_handle_t secure_handle,
+                              uint8_t *buffer, int32_t *length_ptr);
+
+// Authenticates and decrypts a sealed datagram in place, then strips the
+// trailer. `ESP_ERR_INVALID_SIZE` if it isn't sealed, `ESP_ERR_INVALID_CRC`
+// if it fails authentication and `ESP_ERR_INVALID_STATE` for a replay.
+// Safe to call from any task.
+esp_err_t network_secure_open(network_secure_handle_t secure_handle,
+                              uint8_t *buffer, int32_t *length_ptr);
@@ -1,26 +1,80 @@
 #pragma once
 
 #include "esp_err.h"
-#include "esp_netif_types.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 #include "application/device_info.h"
 #include "application/queues.h"
 #include "network/events.h"
+#include "network/power.h"
+#include "network/secure.h"
+#include "system/metrics.h"
+#include "system/tasks.h"
 
 #define NETWORK_UDP_TASK_PRIORITY_SOCKET 6
 #define NETWORK_UDP_TASK_PRIORITY_MULTICAST 5
+// with Wi-Fi and lwIP
+#define NETWORK_UDP_TASK_CORE SYSTEM_TASKS_CORE_NETWORK
 
-#define NETWORK_UDP_TASK_STACK_DEPTH_SOCKET                                    \
-  ((1024 * 5) + PROTOCOL_MESSAGE_MAX_LENGTH)
-#define NETWORK_UDP_TASK_STACK_DEPTH_MULTICAST                                 \
-  ((1024 * 7) + PROTOCOL_MESSAGE_MAX_LENGTH)
+// the datagram buffers live in the handle, not on these stacks
+#define NETWORK_UDP_TASK_STACK_DEPTH_SOCKET (1024 * 5)
+#define NETWORK_UDP_TASK_STACK_DEPTH_MULTICAST (1024 * 7)
 
+// Groups joined at once besides the control group. lwIP's default
+// `MEMP_NUM_IGMP_GROUP` is 8 per interface, and all-systems is one of them.
+#define NETWORK_UDP_MEMBERSHIPS_MAX 6
+
+// Sees every received datagram before it's handled. Returning false drops it,
+// a hook that delays datagrams hands them back later with
+// `network_udp_receive_datagram`. Used by the host simulator to impair the
+// network, see `tools/simulator`.
+typedef bool (*network_udp_rx_hook_t)(const uint8_t *buffer, int32_t length,
+                                      void *ctx);
+
+// why a datagram was dropped, each is counted in `udp_dropped_total`
+typedef enum network_udp_drop_t {
+  NETWORK_UDP_DROP_RX_SOCKET = 0,
+  NETWORK_UDP_DROP_RX_LENGTH,
+  // the rx hook dropped it
+  NETWORK_UDP_DROP_RX_HOOK,
+  // no subscriber wants the type
+  NETWORK_UDP_DROP_RX_UNWANTED,
+  // not sealed, forged, or replayed
+  NETWORK_UDP_DROP_RX_OPEN,
+  NETWORK_UDP_DROP_RX_DECODE,
+  // every matching subscriber was full
+  NETWORK_UDP_DROP_RX_UNROUTED,
+  NETWORK_UDP_DROP_TX_ENCODE,
+  NETWORK_UDP_DROP_TX_SEAL,
+  NETWORK_UDP_DROP_TX_SOCKET,
+  // the socket closed and the outgoing queue was full
+  NETWORK_UDP_DROP_TX_NOT_READY,
+  NETWORK_UDP_DROP_MAX,
+} network_udp_drop_t;
+
+// A group joined on top of the control group, and how many asked for it.
+typedef struct network_udp_membership_t {
+  uint16_t group;
+  int32_t holders;
+} network_udp_membership_t;
+
+// Every station joins the control group, and everything is sent to it
+// unless the message says otherwise (`protocol_message_t.group`). Zones and
+// calls are joined and left at runtime, so on networks that snoop IGMP a
+// station only gets the audio of the zones it's in and the calls it's on.
+// Memberships outlive the socket: a new one joins them all again.
 typedef struct network_udp_t {
   int32_t socket;
+  // the control group's address, the other groups follow it
   struct addrinfo *multicast_addr_info;
-  esp_netif_ip_info_t *ip_info;
+
+  // guards the memberships and the socket's, taken by whoever joins or
+  // leaves and by the socket task
+  SemaphoreHandle_t groups_mutex;
+  network_udp_membership_t memberships[NETWORK_UDP_MEMBERSHIPS_MAX];
+  int32_t membership_count;
 
   struct {
     TaskHandle_t socket;
@@ -29,13 +83,60 @@ typedef struct network_udp_t {
   } tasks;
 
   network_events_handle_t events;
+  network_power_handle_t power;
   app_queues_handle_t queues;
   app_device_info_handle_t device_info;
+
+  network_udp_rx_hook_t rx_hook;
+  void *rx_hook_ctx;
+  // NULL sends and accepts datagrams in the clear
+  network_secure_handle_t secure;
+
+  // one datagram each way, only touched by the read and write tasks. One
+  // more byte than the max is read to detect datagrams that are too long.
+  uint8_t rx_buffer[PROTOCOL_MESSAGE_MAX_LENGTH + 1];
+  uint8_t tx_buffer[PROTOCOL_MESSAGE_MAX_LENGTH];
+
+  struct {
+    system_metric_handle_t rx_packets;
+    system_metric_handle_t rx_bytes;
+    system_metric_handle_t tx_packets;
+    system_metric_handle_t tx_bytes;
+    system_metric_handle_t dropped[NETWORK_UDP_DROP_MAX];
+    // from the socket read to the last subscriber getting it
+    system_metric_handle_t rx_process_us;
+    // from the message being created (its UUID timestamp) to `sendto`
+    system_metric_handle_t tx_latency_us;
+    // joined besides the control group
+    system_metric_handle_t groups;
+  } metrics;
 } network_udp_t;
 
 typedef network_udp_t *network_udp_handle_t;
 
 esp_err_t network_udp_init(network_udp_handle_t *network_udp_handle_ptr,
                            network_events_handle_t events_handle,
+                           network_power_handle_t power_handle,
                            app_queues_handle_t queues_handle,
-                           app_device_info_handle_t device_info_handle);
\ No newline at end of file
+                           app_device_info_handle_t device_info_handle);
+
+// Must be set before the socket is ready.
+void network_udp_set_rx_hook(network_udp_handle_t network_udp_handle,
+                             network_udp_rx_hook_t hook, void *ctx);
+// Seals every datagram sent and drops any received that don't open. Must be
+// set before the socket is ready.
+void network_udp_set_secure(network_udp_handle_t network_udp_handle,
+                            network_secure_handle_t secure_handle);
+
+// Joins a group (`protocol_group_zone`, `protocol_group_call`) until it's
+// left as many times. Safe to call from any task, whether the socket is up
+// or not. `ESP_ERR_NO_MEM` past `NETWORK_UDP_MEMBERSHIPS_MAX` groups.
+esp_err_t network_udp_join(network_udp_handle_t network_udp_handle,
+                           uint16_t group);
+esp_err_t network_udp_leave(network_udp_handle_t network_udp_handle,
+                            uint16_t group);
+
+// Decodes one datagram and publishes it to the incoming router. A sealed
+// datagram is decrypted in place. Safe to call from any task.
+void network_udp_receive_datagram(network_udp_handle_t network_udp_handle,
+                                  uint8_t *buffer, int32_t length);
@@ -0,0 +1,270 @@
+// Useful docs:
+// https://docs.espressif.com/projects/esp-idf/en/stable/esp32/api-guides/wifi.html#station-sleep
+
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <string.h>
+
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_wifi.h"
+#endif
+
+#include "network/power.h"
+
+static const char *TAG = "NETWORK:POWER";
+
+static const char *MODE_NAMES[NETWORK_POWER_MODE_COUNT] = {
+    [NETWORK_POWER_MODE_IDLE] = "idle",
+    [NETWORK_POWER_MODE_PEERS] = "peers",
+    [NETWORK_POWER_MODE_TALK] = "talk",
+};
+
+#if CONFIG_IDF_TARGET_LINUX
+// no radio on the host, only the bookkeeping runs
+static esp_err_t network_power_set_ps(network_power_mode_t mode) {
+  return ESP_OK;
+}
+#else
+static const wifi_ps_type_t MODE_PS_TYPES[NETWORK_POWER_MODE_COUNT] = {
+    [NETWORK_POWER_MODE_IDLE] = WIFI_PS_MAX_MODEM,
+    [NETWORK_POWER_MODE_PEERS] = WIFI_PS_MIN_MODEM,
+    [NETWORK_POWER_MODE_TALK] = WIFI_PS_NONE,
+};
+
+static esp_err_t network_power_set_ps(network_power_mode_t mode) {
+  return esp_wifi_set_ps(MODE_PS_TYPES[mode]);
+}
+#endif
+
+// bench-measured average current per mode, only used for the report
+static const int32_t MODE_CURRENT_MA[NETWORK_POWER_MODE_COUNT] = {
+    [NETWORK_POWER_MODE_IDLE] = CONFIG_NETWORK_POWER_CURRENT_MA_IDLE,
+    [NETWORK_POWER_MODE_PEERS] = CONFIG_NETWORK_POWER_CURRENT_MA_PEERS,
+    [NETWORK_POWER_MODE_TALK] = CONFIG_NETWORK_POWER_CURRENT_MA_TALK,
+};
+
+// must be called with the mutex held
+static void network_power_close_residency(network_power_handle_t power_handle,
+                                          int64_t now_us) {
+  power_handle->stats[power_handle->mode].residency_us +=
+      now_us - power_handle->mode_entered_us;
+  power_handle->mode_entered_us = now_us;
+}
+
+static network_power_mode_t
+network_power_select_mode(network_power_handle_t power_handle, int64_t now_us) {
+  if (power_handle->last_talk_activity_us != 0 &&
+      now_us - power_handle->last_talk_activity_us <
+          (int64_t)NETWORK_POWER_TALK_HOLD_MS * 1000) {
+    return NETWORK_POWER_MODE_TALK;
+  }
+
+  if (app_peers_count(power_handle->peers) > 0) {
+    return NETWORK_POWER_MODE_PEERS;
+  }
+
+  return NETWORK_POWER_MODE_IDLE;
+}
+
+static esp_err_t network_power_apply(network_power_handle_t power_handle,
+                                     network_power_mode_t mode) {
+  esp_err_t ret = network_power_set_ps(mode);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to set power save for mode '%s': %s",
+             MODE_NAMES[mode], esp_err_to_name(ret));
+    return ret;
+  }
+
+  int64_t now_us = esp_timer_get_time();
+
+  xSemaphoreTake(power_handle->mutex, portMAX_DELAY);
+  network_power_close_residency(power_handle, now_us);
+  power_handle->mode = mode;
+  power_handle->stats[mode].entries++;
+  xSemaphoreGive(power_handle->mutex);
+
+  ESP_LOGI(TAG, "Power mode: %s", MODE_NAMES[mode]);
+
+  return ESP_OK;
+}
+
+void network_power_report(network_power_handle_t power_handle) {
+  network_power_mode_stats_t stats[NETWORK_POWER_MODE_COUNT];
+  int64_t now_us = esp_timer_get_time();
+
+  xSemaphoreTake(power_handle->mutex, portMAX_DELAY);
+  network_power_close_residency(power_handle, now_us);
+  memcpy(stats, power_handle->stats, sizeof(stats));
+  xSemaphoreGive(power_handle->mutex);
+
+  int64_t total_us = 0;
+  int64_t charge_ma_us = 0;
+  for (int32_t i = 0; i < NETWORK_POWER_MODE_COUNT; i++) {
+    total_us += stats[i].residency_us;
+    charge_ma_us += stats[i].residency_us * MODE_CURRENT_MA[i];
+  }
+  if (total_us == 0) {
+    return;
+  }
+
+  for (int32_t i = 0; i < NETWORK_POWER_MODE_COUNT; i++) {
+    int64_t latency_avg_us =
+        stats[i].latency_samples > 0
+            ? stats[i].latency_sum_us / stats[i].latency_samples
+            : 0;
+    ESP_LOGI(TAG,
+             "%-5s: %3d%% of %" PRId64 "s, %" PRIu32 " entries, ~%" PRId32
+             "mA, latency avg %" PRId64 "us max %" PRId64 "us (%" PRIu32
+             " samples)",
+             MODE_NAMES[i], (int)((stats[i].residency_us * 100) / total_us),
+             total_us / 1000000, stats[i].entries, MODE_CURRENT_MA[i],
+             latency_avg_us, stats[i].latency_max_us,
+             stats[i].latency_samples);
+  }
+  ESP_LOGI(TAG, "Estimated average current: %" PRId64 "mA",
+           charge_ma_us / total_us);
+}
+
+void network_power_policy_task(void *pvParameters) {
+  network_power_handle_t power_handle = (network_power_handle_t)pvParameters;
+
+  // power save can only be changed once the WiFi driver is up
+  xEventGroupWaitBits(power_handle->events->group_handle,
+                      NETWORK_EVENT_SOCKET_READY, pdFALSE, pdFALSE,
+                      portMAX_DELAY);
+
+  // force the first apply, whatever the driver default is
+  bool applied = false;
+
+  while (true) {
+    EventBits_t bits = xEventGroupWaitBits(
+        power_handle->events->group_handle, NETWORK_EVENT_TALK_ACTIVITY, pdTRUE,
+        pdFALSE, pdMS_TO_TICKS(NETWORK_POWER_EVALUATE_INTERVAL_MS));
+
+    int64_t now_us = esp_timer_get_time();
+    if (bits & NETWORK_EVENT_TALK_ACTIVITY) {
+      power_handle->last_talk_activity_us = now_us;
+    }
+
+    network_power_mode_t mode = network_power_select_mode(power_handle, now_us);
+    if (!applied || mode != power_handle->mode) {
+      applied = network_power_apply(power_handle, mode) == ESP_OK;
+    }
+
+    if (now_us - power_handle->last_report_us >
+        (int64_t)NETWORK_POWER_REPORT_INTERVAL_MS * 1000) {
+      power_handle->last_report_us = now_us;
+      network_power_report(power_handle);
+    }
+  }
+}
+
+void network_power_talk_activity(network_power_handle_t power_handle) {
+  xEventGroupSetBits(power_handle->events->group_handle,
+                     NETWORK_EVENT_TALK_ACTIVITY);
+}
+
+void network_power_record_rx(network_power_handle_t power_handle,
+                             const protocol_message_header_t *header) {
+  // a talker's silence is still a talk
+  if (header->type == MESSAGE_TYPE_AUDIO ||
+      header->type == MESSAGE_TYPE_COMFORT_NOISE ||
+      header->type == MESSAGE_TYPE_PAGE) {
+    network_power_talk_activity(power_handle);
+  }
+
+  int64_t now_us = esp_timer_get_time();
+  int64_t delta_us = now_us - protocol_message_uuid_timestamp(header->uuid);
+  network_power_sender_t *sender = NULL;
+  // a free slot, or else the one heard from longest ago
+  network_power_sender_t *replaced = NULL;
+
+  xSemaphoreTake(power_handle->mutex, portMAX_DELAY);
+
+  for (int32_t i = 0; i < NETWORK_POWER_LATENCY_MAX_SENDERS; i++) {
+    network_power_sender_t *slot = &power_handle->senders[i];
+    if (!slot->in_use) {
+      if (replaced == NULL || replaced->in_use) {
+        replaced = slot;
+      }
+      continue;
+    }
+    if (memcmp(slot->mac_address, header->from_mac_address,
+               sizeof(protocol_mac_address_t)) == 0) {
+      sender = slot;
+      break;
+    }
+    if (replaced == NULL ||
+        (replaced->in_use && slot->heard_us < replaced->heard_us)) {
+      replaced = slot;
+    }
+  }
+
+  if (sender == NULL) {
+    // first message from this sender only sets the baseline
+    memcpy(replaced->mac_address, header->from_mac_address,
+           sizeof(protocol_mac_address_t));
+    replaced->min_delta_us = delta_us;
+    replaced->heard_us = now_us;
+    replaced->in_use = true;
+    goto network_power_record_rx_end;
+  }
+
+  sender->heard_us = now_us;
+  if (delta_us < sender->min_delta_us) {
+    sender->min_delta_us = delta_us;
+  }
+
+  network_power_mode_stats_t *stats = &power_handle->stats[power_handle->mode];
+  int64_t latency_us = delta_us - sender->min_delta_us;
+  stats->latency_samples++;
+  stats->latency_sum_us += latency_us;
+  if (latency_us > stats->latency_max_us) {
+    stats->latency_max_us = latency_us;
+  }
+
+network_power_record_rx_end:
+  xSemaphoreGive(power_handle->mutex);
+}
+
+esp_err_t network_power_init(network_power_handle_t *power_handle_ptr,
+                             network_events_handle_t events_handle,
+                             app_peers_handle_t peers_handle) {
+  esp_err_t ret = ESP_OK;
+
+  network_power_handle_t power_handle =
+      (network_power_handle_t)calloc(1, sizeof(network_power_t));
+  ESP_GOTO_ON_FALSE(power_handle != NULL, ESP_ERR_NO_MEM,
+                    network_power_init_error, TAG,
+                    "Failed to allocate memory for power handle");
+
+  power_handle->events = events_handle;
+  power_handle->peers = peers_handle;
+  // the driver starts in `WIFI_PS_MIN_MODEM`
+  power_handle->mode = NETWORK_POWER_MODE_PEERS;
+  power_handle->mode_entered_us = esp_timer_get_time();
+  power_handle->last_report_us = power_handle->mode_entered_us;
+
+  power_handle->mutex = xSemaphoreCreateMutex();
+  ESP_GOTO_ON_FALSE(power_handle->mutex != NULL, ESP_ERR_NO_MEM,
+                    network_power_init_error, TAG,
+                    "Failed to create power mutex");
+
+  ESP_GOTO_ON_FALSE(system_tasks_create(network_power_policy_task, TAG,
+                                        NETWORK_POWER_TASK_STACK_DEPTH,
+                                        power_handle,
+                                        NETWORK_POWER_TASK_PRIORITY,
+                                        NETWORK_POWER_TASK_CORE,
+                                        &power_handle->tasks.policy) == pdPASS,
+                    ESP_ERR_NO_MEM, network_power_init_error, TAG,
+                    "Failed to create power policy task");
+
+  *power_handle_ptr = power_handle;
+  return ESP_OK;
+
+network_power_init_error:
+  return ret;
+}
@@ -0,0 +1,460 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <string.h>
+
+#include "network/secure.h"
+#include "storage/nvs.h"
+#include "system/memory.h"
+
+static const char *TAG = "NETWORK:SECURE";
+
+// The sealing station's MAC address, since every station has the group key
+// and their UUIDs and epochs can collide, then the UUID, the epoch and the
+// attempt, since a retransmission keeps the UUID. Longer than GCM's usual 12
+// bytes, mbedtls hashes it down.
+#define NETWORK_SECURE_NONCE_LENGTH                                            \
+  (sizeof(protocol_mac_address_t) + sizeof(protocol_message_uuid_t) +         \
+   NETWORK_SECURE_EPOCH_LENGTH + sizeof(uint16_t))
+
+static void network_secure_nonce(uint8_t *nonce,
+                                 const protocol_mac_address_t mac_address,
+                                 const protocol_message_header_t *header,
+                                 const uint8_t *epoch) {
+  memcpy(nonce, mac_address, sizeof(protocol_mac_address_t));
+  nonce += sizeof(protocol_mac_address_t);
+  memcpy(nonce, header->uuid, sizeof(protocol_message_uuid_t));
+  nonce += sizeof(protocol_message_uuid_t);
+  memcpy(nonce, epoch, NETWORK_SECURE_EPOCH_LENGTH);
+  nonce += NETWORK_SECURE_EPOCH_LENGTH;
+  nonce[0] = (uint8_t)(header->attempt >> 8);
+  nonce[1] = (uint8_t)header->attempt;
+}
+
+esp_err_t network_secure_seal(network_secure_handle_t secure_handle,
+                              uint8_t *buffer, int32_t *length_ptr) {
+  int64_t start_us = esp_timer_get_time();
+  protocol_message_header_t header;
+  uint8_t nonce[NETWORK_SECURE_NONCE_LENGTH];
+
+  int32_t length = *length_ptr - sizeof(protocol_message_header_t);
+  ESP_RETURN_ON_FALSE(length >= 0, ESP_ERR_INVALID_SIZE, TAG,
+                      "Datagram shorter than its header");
+  memcpy(&header, buffer, sizeof(protocol_message_header_t));
+  // it would never open, see `network_secure_open`
+  ESP_RETURN_ON_FALSE(memcmp(header.from_mac_address,
+                             secure_handle->mac_address,
+                             sizeof(protocol_mac_address_t)) == 0,
+                      ESP_ERR_INVALID_ARG, TAG,
+                      "Only our own datagrams can be sealed");
+
+  // big-endian, like the UUID
+  uint8_t *trailer = buffer + *length_ptr;
+  trailer[0] = (uint8_t)(secure_handle->epoch >> 24);
+  trailer[1] = (uint8_t)(secure_handle->epoch >> 16);
+  trailer[2] = (uint8_t)(secure_handle->epoch >> 8);
+  trailer[3] = (uint8_t)secure_handle->epoch;
+  network_secure_nonce(nonce, secure_handle->mac_address, &header, trailer);
+
+  uint8_t *body = buffer + sizeof(protocol_message_header_t);
+  int rc = mbedtls_gcm_crypt_and_tag(
+      &secure_handle->seal, MBEDTLS_GCM_ENCRYPT, length, nonce, sizeof(nonce),
+      buffer, sizeof(protocol_message_header_t), body, body,
+      NETWORK_SECURE_TAG_LENGTH, trailer + NETWORK_SECURE_EPOCH_LENGTH);
+  ESP_RETURN_ON_FALSE(rc == 0, ESP_FAIL, TAG, "Failed to seal: -0x%04x", -rc);
+
+  *length_ptr += NETWORK_SECURE_TRAILER_LENGTH;
+  system_metrics_observe(secure_handle->metrics.seal_us,
+                         (uint32_t)(esp_timer_get_time() - start_us));
+  return ESP_OK;
+}
+
+// Floors are only forgotten when more stations are heard than there are
+// floors, the one heard longest ago goes.
+static network_secure_floor_t *
+network_secure_floor_locked(network_secure_handle_t secure_handle,
+                            const protocol_mac_address_t mac_address) {
+  network_secure_floor_t *oldest = NULL;
+
+  for (int32_t i = 0; i < secure_handle->floor_count; i++) {
+    network_secure_floor_t *floor = &secure_handle->floors[i];
+    if (memcmp(floor->mac_address, mac_address,
+               sizeof(protocol_mac_address_t)) == 0) {
+      return floor;
+    }
+    if (oldest == NULL || floor->heard_us < oldest->heard_us) {
+      oldest = floor;
+    }
+  }
+
+  if (secure_handle->floor_count < NETWORK_SECURE_FLOORS) {
+    oldest = &secure_handle->floors[secure_handle->floor_count++];
+  } else {
+    system_metrics_add(secure_handle->metrics.floors_forgotten, 1);
+    // its replay state goes with it
+    for (int32_t i = 0; i < NETWORK_SECURE_SENDERS; i++) {
+      if (secure_handle->senders[i].floor == oldest) {
+        secure_handle->senders[i].floor = NULL;
+      }
+    }
+  }
+  memset(oldest, 0, sizeof(network_secure_floor_t));
+  memcpy(oldest->mac_address, mac_address, sizeof(protocol_mac_address_t));
+  return oldest;
+}
+
+static network_secure_sender_t *
+network_secure_sender_locked(network_secure_handle_t secure_handle,
+                             network_secure_floor_t *floor) {
+  network_secure_sender_t *oldest = NULL;
+
+  for (int32_t i = 0; i < NETWORK_SECURE_SENDERS; i++) {
+    network_secure_sender_t *sender = &secure_handle->senders[i];
+    if (sender->floor == NULL) {
+      oldest = sender;
+      break;
+    }
+    if (sender->floor == floor) {
+      return sender;
+    }
+    if (oldest == NULL || sender->heard_us < oldest->heard_us) {
+      oldest = sender;
+    }
+  }
+
+  // a forgotten sender's history is lost, but its floor isn't, so nothing
+  // it sent before is accepted again
+  memset(oldest, 0, sizeof(network_secure_sender_t));
+  oldest->floor = floor;
+  oldest->forgotten_timestamp = floor->timestamp;
+  return oldest;
+}
+
+static bool network_secure_accept_retransmit_locked(
+    network_secure_sender_t *sender, const protocol_message_header_t *header,
+    int64_t timestamp) {
+  if (timestamp < sender->floor->timestamp -
+                      NETWORK_SECURE_RETRANSMIT_WINDOW_MS * 1000LL) {
+    return false;
+  }
+
+  // like the history, anything older than all of them was pushed out
+  int32_t oldest = 0;
+  int64_t oldest_timestamp = INT64_MAX;
+  for (int32_t i = 0; i < sender->retransmit_count; i++) {
+    if (sender->retransmits[i].attempt == header->attempt &&
+        memcmp(sender->retransmits[i].uuid, header->uuid,
+               sizeof(protocol_message_uuid_t)) == 0) {
+      return false;
+    }
+    int64_t retransmit_timestamp =
+        protocol_message_uuid_timestamp(sender->retransmits[i].uuid);
+    if (retransmit_timestamp < oldest_timestamp) {
+      oldest = i;
+      oldest_timestamp = retransmit_timestamp;
+    }
+  }
+
+  if (sender->retransmit_count < NETWORK_SECURE_RETRANSMITS) {
+    oldest = sender->retransmit_count++;
+  } else if (timestamp < oldest_timestamp) {
+    return false;
+  }
+  memcpy(sender->retransmits[oldest].uuid, header->uuid,
+         sizeof(protocol_message_uuid_t));
+  sender->retransmits[oldest].attempt = header->attempt;
+  return true;
+}
+
+static bool network_secure_accept_history_locked(
+    network_secure_sender_t *sender, const protocol_message_header_t *header,
+    int64_t timestamp) {
+  if (timestamp < sender->floor->timestamp -
+                      NETWORK_SECURE_REORDER_WINDOW_MS * 1000LL) {
+    return false;
+  }
+
+  // The history keeps the newest datagrams, so anything that's been pushed
+  // out is older than all of them.
+  int32_t oldest = 0;
+  int64_t oldest_timestamp = INT64_MAX;
+  for (int32_t i = 0; i < sender->history_count; i++) {
+    if (memcmp(sender->history[i], header->uuid,
+               sizeof(protocol_message_uuid_t)) == 0) {
+      return false;
+    }
+    int64_t history_timestamp =
+        protocol_message_uuid_timestamp(sender->history[i]);
+    if (history_timestamp < oldest_timestamp) {
+      oldest = i;
+      oldest_timestamp = history_timestamp;
+    }
+  }
+
+  if (sender->history_count < NETWORK_SECURE_HISTORY) {
+    oldest = sender->history_count++;
+  } else if (timestamp <= oldest_timestamp) {
+    return false;
+  }
+  memcpy(sender->history[oldest], header->uuid,
+         sizeof(protocol_message_uuid_t));
+  return true;
+}
+
+// Only for authenticated datagrams, returns false for a replay.
+static bool
+network_secure_accept_locked(network_secure_handle_t secure_handle,
+                             const protocol_message_header_t *header,
+                             uint32_t epoch) {
+  network_secure_floor_t *floor =
+      network_secure_floor_locked(secure_handle, header->from_mac_address);
+  if (epoch < floor->epoch) {
+    return false;
+  }
+
+  network_secure_sender_t *sender =
+      network_secure_sender_locked(secure_handle, floor);
+  if (epoch > floor->epoch) {
+    // rebooted, its UUIDs start again
+    floor->epoch = epoch;
+    floor->timestamp = 0;
+    memset(sender, 0, sizeof(network_secure_sender_t));
+    sender->floor = floor;
+    secure_handle->floors_dirty = true;
+  }
+
+  int64_t timestamp = protocol_message_uuid_timestamp(header->uuid);
+  if (timestamp <= sender->forgotten_timestamp) {
+    return false;
+  }
+  bool accepted =
+      header->attempt > 0
+          ? network_secure_accept_retransmit_locked(sender, header, timestamp)
+          : network_secure_accept_history_locked(sender, header, timestamp);
+  if (!accepted) {
+    return false;
+  }
+
+  if (timestamp > floor->timestamp) {
+    floor->timestamp = timestamp;
+  }
+  sender->heard_us = esp_timer_get_time();
+  floor->heard_us = sender->heard_us;
+  return true;
+}
+
+esp_err_t network_secure_open(network_secure_handle_t secure_handle,
+                              uint8_t *buffer, int32_t *length_ptr) {
+  int64_t start_us = esp_timer_get_time();
+  protocol_message_header_t header;
+  uint8_t nonce[NETWORK_SECURE_NONCE_LENGTH];
+
+  int32_t length = *length_ptr - sizeof(protocol_message_header_t) -
+                   NETWORK_SECURE_TRAILER_LENGTH;
+  if (length < 0) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  // unauthenticated until the tag is checked, only the length is used
+  memcpy(&header, buffer, sizeof(protocol_message_header_t));
+  if (header.length != length) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  uint8_t *body = buffer + sizeof(protocol_message_header_t);
+  const uint8_t *trailer = body + length;
+  // The nonce takes the MAC address from the header, so a datagram whose
+  // header names another station than the one that sealed it fails
+  // authentication, and its replay state is never touched.
+  network_secure_nonce(nonce, header.from_mac_address, &header, trailer);
+  uint32_t epoch = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) |
+                   ((uint32_t)trailer[2] << 8) | (uint32_t)trailer[3];
+
+  esp_err_t ret = ESP_OK;
+  xSemaphoreTake(secure_handle->mutex, portMAX_DELAY);
+  int rc = mbedtls_gcm_auth_decrypt(
+      &secure_handle->open, length, nonce, sizeof(nonce), buffer,
+      sizeof(protocol_message_header_t), trailer + NETWORK_SECURE_EPOCH_LENGTH,
+      NETWORK_SECURE_TAG_LENGTH, body, body);
+  if (rc != 0) {
+    system_metrics_add(secure_handle->metrics.auth_failures, 1);
+    ret = ESP_ERR_INVALID_CRC;
+  } else if (!network_secure_accept_locked(secure_handle, &header, epoch)) {
+    system_metrics_add(secure_handle->metrics.replays, 1);
+    ret = ESP_ERR_INVALID_STATE;
+  }
+  bool floors_dirty = secure_handle->floors_dirty;
+  xSemaphoreGive(secure_handle->mutex);
+
+  if (floors_dirty) {
+    xTaskNotifyGive(secure_handle->floors_task);
+  }
+
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  *length_ptr = sizeof(protocol_message_header_t) + length;
+  system_metrics_observe(secure_handle->metrics.open_us,
+                         (uint32_t)(esp_timer_get_time() - start_us));
+  return ESP_OK;
+}
+
+static esp_err_t
+network_secure_floors_flush(network_secure_handle_t secure_handle) {
+  uint8_t records[NETWORK_SECURE_FLOORS * NETWORK_SECURE_FLOOR_RECORD_LENGTH];
+  uint8_t *record = records;
+
+  xSemaphoreTake(secure_handle->mutex, portMAX_DELAY);
+  for (int32_t i = 0; i < secure_handle->floor_count; i++) {
+    const network_secure_floor_t *floor = &secure_handle->floors[i];
+    memcpy(record, floor->mac_address, sizeof(protocol_mac_address_t));
+    record += sizeof(protocol_mac_address_t);
+    record[0] = (uint8_t)(floor->epoch >> 24);
+    record[1] = (uint8_t)(floor->epoch >> 16);
+    record[2] = (uint8_t)(floor->epoch >> 8);
+    record[3] = (uint8_t)floor->epoch;
+    record += NETWORK_SECURE_EPOCH_LENGTH;
+  }
+  secure_handle->floors_dirty = false;
+  xSemaphoreGive(secure_handle->mutex);
+
+  esp_err_t ret = storage_nvs_set_replay_floors(records, record - records);
+  if (ret != ESP_OK) {
+    // try again with the next batch
+    xSemaphoreTake(secure_handle->mutex, portMAX_DELAY);
+    secure_handle->floors_dirty = true;
+    xSemaphoreGive(secure_handle->mutex);
+  }
+  return ret;
+}
+
+void network_secure_floors_task(void *pvParameters) {
+  network_secure_handle_t secure_handle = (network_secure_handle_t)pvParameters;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // a group booting together moves a lot of epochs at once
+    while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(
+                                        NETWORK_SECURE_FLOORS_FLUSH_DELAY_MS)) >
+           0) {
+    }
+
+    if (network_secure_floors_flush(secure_handle) != ESP_OK) {
+      vTaskDelay(pdMS_TO_TICKS(NETWORK_SECURE_FLOORS_FLUSH_DELAY_MS));
+      xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+    }
+  }
+}
+
+// Only the epochs were saved, the timestamps start again at 0.
+static void network_secure_floors_load(network_secure_handle_t secure_handle) {
+  uint8_t records[NETWORK_SECURE_FLOORS * NETWORK_SECURE_FLOOR_RECORD_LENGTH];
+  size_t length = sizeof(records);
+
+  esp_err_t ret = storage_nvs_get_replay_floors(records, &length);
+  if (ret != ESP_OK) {
+    // a new group, or floors from a bigger build, senders start at epoch 0
+    if (ret != ESP_ERR_NOT_FOUND) {
+      ESP_LOGW(TAG, "Failed to load replay floors, starting without");
+    }
+    return;
+  }
+
+  const uint8_t *record = records;
+  int32_t count = length / NETWORK_SECURE_FLOOR_RECORD_LENGTH;
+  for (int32_t i = 0; i < count; i++) {
+    network_secure_floor_t *floor = &secure_handle->floors[i];
+    memcpy(floor->mac_address, record, sizeof(protocol_mac_address_t));
+    record += sizeof(protocol_mac_address_t);
+    floor->epoch = ((uint32_t)record[0] << 24) | ((uint32_t)record[1] << 16) |
+                   ((uint32_t)record[2] << 8) | (uint32_t)record[3];
+    record += NETWORK_SECURE_EPOCH_LENGTH;
+  }
+  secure_handle->floor_count = count;
+  ESP_LOGI(TAG, "Loaded %" PRId32 " replay floors", count);
+}
+
+static esp_err_t
+network_secure_metrics_init(network_secure_handle_t secure_handle) {
+  system_metric_config_t configs[] = {
+      {"secure_auth_failures_total",
+       "Datagrams that failed authentication, forged or with the wrong key",
+       SYSTEM_METRIC_COUNTER},
+      {"secure_replays_total", "Authentic datagrams that were seen before",
+       SYSTEM_METRIC_COUNTER},
+      {"secure_floors_forgotten_total",
+       "Senders whose replay floor was dropped to make room for another",
+       SYSTEM_METRIC_COUNTER},
+      {"secure_seal_us", "Encrypting a datagram", SYSTEM_METRIC_HISTOGRAM},
+      {"secure_open_us", "Authenticating and decrypting a datagram",
+       SYSTEM_METRIC_HISTOGRAM},
+  };
+  system_metric_handle_t *handles[] = {
+      &secure_handle->metrics.auth_failures,
+      &secure_handle->metrics.replays,
+      &secure_handle->metrics.floors_forgotten,
+      &secure_handle->metrics.seal_us,
+      &secure_handle->metrics.open_us,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]), TAG,
+                        "Failed to register '%s'", configs[i].name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t network_secure_init(network_secure_handle_t *secure_handle_ptr,
+                              const uint8_t *key, size_t key_length,
+                              const protocol_mac_address_t mac_address,
+                              uint32_t epoch) {
+  ESP_RETURN_ON_FALSE(key_length == 16 || key_length == 24 || key_length == 32,
+                      ESP_ERR_INVALID_ARG, TAG,
+                      "Group key must be 16, 24 or 32 bytes, not %d",
+                      (int)key_length);
+
+  // read for every datagram
+  network_secure_handle_t secure_handle = (network_secure_handle_t)
+      system_memory_calloc(1, sizeof(network_secure_t), SYSTEM_MEMORY_FAST);
+  ESP_RETURN_ON_FALSE(secure_handle != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to allocate secure handle");
+
+  memcpy(secure_handle->mac_address, mac_address,
+         sizeof(protocol_mac_address_t));
+  secure_handle->epoch = epoch;
+  secure_handle->mutex = xSemaphoreCreateMutex();
+  ESP_RETURN_ON_FALSE(secure_handle->mutex != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to create secure mutex");
+
+  mbedtls_gcm_init(&secure_handle->seal);
+  mbedtls_gcm_init(&secure_handle->open);
+  int rc = mbedtls_gcm_setkey(&secure_handle->seal, MBEDTLS_CIPHER_ID_AES, key,
+                              key_length * 8);
+  if (rc == 0) {
+    rc = mbedtls_gcm_setkey(&secure_handle->open, MBEDTLS_CIPHER_ID_AES, key,
+                            key_length * 8);
+  }
+  ESP_RETURN_ON_FALSE(rc == 0, ESP_FAIL, TAG, "Failed to set key: -0x%04x",
+                      -rc);
+
+  ESP_RETURN_ON_ERROR(network_secure_metrics_init(secure_handle), TAG,
+                      "Failed to register metrics");
+
+  network_secure_floors_load(secure_handle);
+  ESP_RETURN_ON_FALSE(system_tasks_create(network_secure_floors_task, TAG,
+                                          NETWORK_SECURE_TASK_STACK_DEPTH,
+                                          secure_handle,
+                                          NETWORK_SECURE_TASK_PRIORITY,
+                                          NETWORK_SECURE_TASK_CORE,
+                                          &secure_handle->floors_task) ==
+                          pdPASS,
+                      ESP_ERR_NO_MEM, TAG, "Failed to create floors task");
+
+  ESP_LOGI(TAG, "AES-%d-GCM, epoch %lu", (int)key_length * 8,
+           (unsigned long)epoch);
+  *secure_handle_ptr = secure_handle;
+
+  return ESP_OK;
+}
@@ -4,21 +4,91 @@
 #include "esp_check.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#if CONFIG_IDF_TARGET_LINUX
+// the host's own network stack, see `tools/simulator`
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define IP_MULTICAST(addr) IN_MULTICAST(addr)
+#else
 #include "lwip/sockets.h"
 #include <lwip/netdb.h>
+#endif
 
 #include "network/udp.h"
 #include "protocols/messages.h"
+#include "storage/settings.h"
+#include "system/memory.h"
+#include "system/trace.h"
 
 static const char *BASE_TAG = "NETWORK:UDP";
 static const char *SOCKET_TAG = "NETWORK:UDP:SOCKET";
 static const char *MULTICAST_WRITE_TAG = "NETWORK:UDP:MULTICAST:WRITE";
 static const char *MULTICAST_READ_TAG = "NETWORK:UDP:MULTICAST:READ";
 
+// the `reason` label of each `network_udp_drop_t`
+static const char *DROP_LABELS[NETWORK_UDP_DROP_MAX] = {
+    [NETWORK_UDP_DROP_RX_SOCKET] = "reason=\"rx_socket\"",
+    [NETWORK_UDP_DROP_RX_LENGTH] = "reason=\"rx_length\"",
+    [NETWORK_UDP_DROP_RX_HOOK] = "reason=\"rx_hook\"",
+    [NETWORK_UDP_DROP_RX_UNWANTED] = "reason=\"rx_unwanted\"",
+    [NETWORK_UDP_DROP_RX_OPEN] = "reason=\"rx_open\"",
+    [NETWORK_UDP_DROP_RX_DECODE] = "reason=\"rx_decode\"",
+    [NETWORK_UDP_DROP_RX_UNROUTED] = "reason=\"rx_unrouted\"",
+    [NETWORK_UDP_DROP_TX_ENCODE] = "reason=\"tx_encode\"",
+    [NETWORK_UDP_DROP_TX_SEAL] = "reason=\"tx_seal\"",
+    [NETWORK_UDP_DROP_TX_SOCKET] = "reason=\"tx_socket\"",
+    [NETWORK_UDP_DROP_TX_NOT_READY] = "reason=\"tx_not_ready\"",
+};
+
 // // ----------------
 // // Socket Stuff
 // // ----------------
 
+// Groups follow the control group's address, one each.
+static struct in_addr
+network_udp_group_address(network_udp_handle_t network_udp_handle,
+                          uint16_t group) {
+  struct in_addr address =
+      ((struct sockaddr_in *)network_udp_handle->multicast_addr_info->ai_addr)
+          ->sin_addr;
+  address.s_addr = htonl(ntohl(address.s_addr) + group);
+  return address;
+}
+
+// Joins or leaves on the socket, with the groups mutex held. Without a
+// socket there's nothing to do, the next one joins whatever is held then.
+static esp_err_t
+network_udp_membership_locked(network_udp_handle_t network_udp_handle,
+                              uint16_t group, bool join) {
+  if (network_udp_handle->socket < 0 ||
+      network_udp_handle->multicast_addr_info == NULL) {
+    return ESP_OK;
+  }
+
+  struct ip_mreq imreq = {0};
+  imreq.imr_multiaddr = network_udp_group_address(network_udp_handle, group);
+  imreq.imr_interface.s_addr = network_udp_handle->events->ip_info.ip.addr;
+  if (setsockopt(network_udp_handle->socket, IPPROTO_IP,
+                 join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP, &imreq,
+                 sizeof(struct ip_mreq)) < 0) {
+    ESP_LOGE(SOCKET_TAG, "Failed to %s group %u: %d", join ? "join" : "leave",
+             group, errno);
+    return ESP_ERR_INVALID_STATE;
+  }
+  return ESP_OK;
+}
+
 esp_err_t udp_socket_create(network_udp_handle_t network_udp_handle) {
   if (network_udp_handle->socket >= 0) {
     ESP_LOGW(SOCKET_TAG,
@@ -30,6 +100,12 @@ esp_err_t udp_socket_create(network_udp_handle_t network_udp_handle) {
   struct ip_mreq imreq = {0};
   struct in_addr iaddr = {0};
   esp_err_t ret = ESP_OK;
+  // changed settings are picked up the next time the socket is created
+  storage_settings_t settings;
+  storage_settings_get(&settings);
+
+  // joins and leaves wait until the groups can be joined on the new socket
+  xSemaphoreTake(network_udp_handle->groups_mutex, portMAX_DELAY);
 
   // Create the socket
   network_udp_handle->socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
@@ -37,9 +113,25 @@ esp_err_t udp_socket_create(network_udp_handle_t network_udp_handle) {
                     udp_multicast_socket_create_end, SOCKET_TAG,
                     "Failed to create socket: %d", errno);
 
+#if CONFIG_IDF_TARGET_LINUX
+  // simulated stations share the port on one host
+  int32_t reuse = 1;
+  ESP_GOTO_ON_FALSE(setsockopt(network_udp_handle->socket, SOL_SOCKET,
+                               SO_REUSEADDR, &reuse, sizeof(reuse)) >= 0,
+                    ESP_ERR_INVALID_STATE, udp_multicast_socket_create_end,
+                    SOCKET_TAG, "Failed to set SO_REUSEADDR: %d", errno);
+  // only the groups this station joined, not those of every station here
+  int32_t multicast_all = 0;
+  ESP_GOTO_ON_FALSE(setsockopt(network_udp_handle->socket, IPPROTO_IP,
+                               IP_MULTICAST_ALL, &multicast_all,
+                               sizeof(multicast_all)) >= 0,
+                    ESP_ERR_INVALID_STATE, udp_multicast_socket_create_end,
+                    SOCKET_TAG, "Failed to set IP_MULTICAST_ALL: %d", errno);
+#endif
+
   // Bind the socket to the multicast port on any address
   saddr.sin_family = PF_INET;
-  saddr.sin_port = htons(CONFIG_MULTICAST_PORT);
+  saddr.sin_port = htons(settings.multicast_port);
   saddr.sin_addr.s_addr = htonl(INADDR_ANY);
   ESP_GOTO_ON_FALSE(bind(network_udp_handle->socket, (struct sockaddr *)&saddr,
                          sizeof(struct sockaddr_in)) >= 0,
@@ -47,29 +139,30 @@ esp_err_t udp_socket_create(network_udp_handle_t network_udp_handle) {
                     SOCKET_TAG, "Failed to bind socket: %d", errno);
 
   // Assign multicast TTL (set separately from normal interface TTL)
-  uint8_t ttl = CONFIG_MULTICAST_TTL;
+  uint8_t ttl = (uint8_t)settings.multicast_ttl;
   ESP_GOTO_ON_FALSE(setsockopt(network_udp_handle->socket, IPPROTO_IP,
                                IP_MULTICAST_TTL, &ttl, sizeof(uint8_t)) >= 0,
                     ESP_ERR_INVALID_STATE, udp_multicast_socket_create_end,
                     SOCKET_TAG, "Failed to set IP_MULTICAST_TTL: %d", errno);
 
-  // Configure the multicast source interface address
-  inet_addr_from_ip4addr(&iaddr, &network_udp_handle->ip_info->ip);
+  // Configure the multicast source interface address, both are in network
+  // byte order
+  iaddr.s_addr = network_udp_handle->events->ip_info.ip.addr;
 
   // Configure the address for multicast membership
   ESP_GOTO_ON_FALSE(
-      inet_aton(CONFIG_MULTICAST_ADDR, &imreq.imr_multiaddr.s_addr) == 1,
+      inet_aton(settings.multicast_addr, &imreq.imr_multiaddr) == 1,
       ESP_ERR_INVALID_ARG, udp_multicast_socket_create_end, SOCKET_TAG,
-      "Multicast address '%s' is invalid", CONFIG_MULTICAST_ADDR);
+      "Multicast address '%s' is invalid", settings.multicast_addr);
 
   // Check if the multicast address is valid
   ESP_GOTO_ON_FALSE(!!IP_MULTICAST(ntohl(imreq.imr_multiaddr.s_addr)),
                     ESP_ERR_INVALID_ARG, udp_multicast_socket_create_end,
                     SOCKET_TAG, "Address '%s' is not a valid multicast address",
-                    CONFIG_MULTICAST_ADDR);
+                    settings.multicast_addr);
 
   ESP_LOGD(SOCKET_TAG, "Configured multicast address %s",
-           inet_ntoa(imreq.imr_multiaddr.s_addr));
+           inet_ntoa(imreq.imr_multiaddr));
 
   // Assign the multicast source interface address
   ESP_GOTO_ON_FALSE(setsockopt(network_udp_handle->socket, IPPROTO_IP,
@@ -78,7 +171,8 @@ esp_err_t udp_socket_create(network_udp_handle_t network_udp_handle) {
                     ESP_ERR_INVALID_STATE, udp_multicast_socket_create_end,
                     SOCKET_TAG, "Failed to set IP_MULTICAST_IF: %d", errno);
 
-  // Add the multicast group to the socket
+  // Add the multicast group to the socket, on the same interface we send from
+  imreq.imr_interface = iaddr;
   ESP_GOTO_ON_FALSE(setsockopt(network_udp_handle->socket, IPPROTO_IP,
                                IP_ADD_MEMBERSHIP, &imreq,
                                sizeof(struct ip_mreq)) >= 0,
@@ -96,7 +190,7 @@ esp_err_t udp_socket_create(network_udp_handle_t network_udp_handle) {
     network_udp_handle->multicast_addr_info = NULL;
   }
 
-  ESP_GOTO_ON_FALSE(getaddrinfo(CONFIG_MULTICAST_ADDR, NULL, &hints,
+  ESP_GOTO_ON_FALSE(getaddrinfo(settings.multicast_addr, NULL, &hints,
                                 &network_udp_handle->multicast_addr_info) >= 0,
                     ESP_ERR_INVALID_STATE, udp_multicast_socket_create_end,
                     SOCKET_TAG, "Failed to get multicast address info");
@@ -106,7 +200,24 @@ esp_err_t udp_socket_create(network_udp_handle_t network_udp_handle) {
                     SOCKET_TAG, "getaddrinfo() did not return any addresses");
 
   ((struct sockaddr_in *)network_udp_handle->multicast_addr_info->ai_addr)
-      ->sin_port = htons(CONFIG_MULTICAST_PORT);
+      ->sin_port = htons(settings.multicast_port);
+
+  struct in_addr last_address = network_udp_group_address(
+      network_udp_handle, PROTOCOL_GROUP_COUNT - 1);
+  ESP_GOTO_ON_FALSE(!!IP_MULTICAST(ntohl(last_address.s_addr)),
+                    ESP_ERR_INVALID_ARG, udp_multicast_socket_create_end,
+                    SOCKET_TAG, "No room for %d groups after '%s'",
+                    PROTOCOL_GROUP_COUNT, settings.multicast_addr);
+
+  // zones and calls held across the reconnect
+  for (int32_t i = 0; i < network_udp_handle->membership_count; i++) {
+    ESP_GOTO_ON_ERROR(network_udp_membership_locked(
+                          network_udp_handle,
+                          network_udp_handle->memberships[i].group, true),
+                      udp_multicast_socket_create_end, SOCKET_TAG,
+                      "Failed to join group %u again",
+                      network_udp_handle->memberships[i].group);
+  }
 
 udp_multicast_socket_create_end:
   if (ret != ESP_OK) {
@@ -115,11 +226,13 @@ udp_multicast_socket_create_end:
       network_udp_handle->socket = -1;
     }
   }
+  xSemaphoreGive(network_udp_handle->groups_mutex);
 
   return ret;
 }
 
 void network_udp_socket_close(network_udp_handle_t network_udp_handle) {
+  xSemaphoreTake(network_udp_handle->groups_mutex, portMAX_DELAY);
   if (network_udp_handle->socket >= 0) {
     shutdown(network_udp_handle->socket, SHUT_RDWR);
     close(network_udp_handle->socket);
@@ -129,6 +242,7 @@ void network_udp_socket_close(network_udp_handle_t network_udp_handle) {
   xEventGroupClearBits(network_udp_handle->events->group_handle,
                        NETWORK_EVENT_SOCKET_READY);
   network_udp_handle->socket = -1;
+  xSemaphoreGive(network_udp_handle->groups_mutex);
 }
 
 void udp_socket_task(void *pvParameters) {
@@ -174,14 +288,17 @@ void udp_socket_task(void *pvParameters) {
 // // Multicast Stuff
 // // ----------------
 
-esp_err_t socket_receive_message(int32_t socket,
-                                 protocol_message_handle_t message) {
+// Reads one datagram into `buffer`, which must hold at least
+// `PROTOCOL_MESSAGE_MAX_LENGTH + 1` bytes.
+esp_err_t socket_receive_datagram(int32_t socket, uint8_t *buffer,
+                                  int32_t *length_ptr) {
   // increase by 1 to check if the incoming message was longer than the max size
   // so that we can detect invalid messages easily by checking the length.
-  uint8_t buffer[PROTOCOL_MESSAGE_MAX_LENGTH + 1];
   int32_t length = 0;
-
-  length = recv(socket, buffer, PROTOCOL_MESSAGE_MAX_LENGTH + 1, 0);
+  // on the linux target, signals used by the scheduler interrupt syscalls
+  do {
+    length = recv(socket, buffer, PROTOCOL_MESSAGE_MAX_LENGTH + 1, 0);
+  } while (length < 0 && errno == EINTR);
 
   if (length < 0) {
     ESP_LOGE(MULTICAST_READ_TAG, "multicast recvfrom failed: errno %d", errno);
@@ -189,80 +306,135 @@ esp_err_t socket_receive_message(int32_t socket,
   }
 
   if (length < sizeof(protocol_message_header_t)) {
-    ESP_LOGE(MULTICAST_READ_TAG, "Message length too short: %d", length);
-    return ESP_ERR_INVALID_STATE;
+    ESP_LOGE(MULTICAST_READ_TAG, "Message length too short: %" PRId32, length);
+    return ESP_ERR_INVALID_SIZE;
   }
 
   if (length > PROTOCOL_MESSAGE_MAX_LENGTH) {
-    ESP_LOGE(MULTICAST_READ_TAG, "Message length too long: %d", length);
-    return ESP_ERR_INVALID_STATE;
+    ESP_LOGE(MULTICAST_READ_TAG, "Message length too long: %" PRId32, length);
+    return ESP_ERR_INVALID_SIZE;
   }
 
-  memcpy(&message->header, buffer, sizeof(protocol_message_header_t));
+  *length_ptr = length;
+  return ESP_OK;
+}
+
+esp_err_t socket_send_message(network_udp_handle_t network_udp_handle,
+                              protocol_message_handle_t message) {
+  struct addrinfo *addr_info = network_udp_handle->multicast_addr_info;
+  uint8_t *buffer = network_udp_handle->tx_buffer;
+  int32_t length = 0;
 
-  int32_t payload_len = length - sizeof(protocol_message_header_t);
-  if (payload_len != message->header.length) {
-    ESP_LOGE(MULTICAST_READ_TAG, "Payload length mismatch: expected %d, got %d",
-             message->header.length, payload_len);
-    return ESP_ERR_INVALID_STATE;
+  esp_err_t ret = protocol_message_encode(message, buffer, &length);
+  if (ret != ESP_OK) {
+    system_metrics_add(
+        network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_TX_ENCODE], 1);
+    return ret;
   }
 
-  if (protocol_message_set_payload(
-          message, buffer + sizeof(protocol_message_header_t)) != ESP_OK) {
-    ESP_LOGE(MULTICAST_READ_TAG, "Failed to set payload");
-    return ESP_ERR_INVALID_STATE;
+  // encoding left room for the trailer
+  if (network_udp_handle->secure != NULL) {
+    ret = network_secure_seal(network_udp_handle->secure, buffer, &length);
+    if (ret != ESP_OK) {
+      system_metrics_add(
+          network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_TX_SEAL], 1);
+      return ret;
+    }
   }
 
-  return ESP_OK;
-}
+  // the control group's port, and a group out of range goes to everyone
+  struct sockaddr_in destination;
+  memcpy(&destination, addr_info->ai_addr, sizeof(struct sockaddr_in));
+  if (message->group < PROTOCOL_GROUP_COUNT) {
+    destination.sin_addr =
+        network_udp_group_address(network_udp_handle, message->group);
+  }
 
-esp_err_t socket_send_message(int32_t socket, protocol_message_handle_t message,
-                              struct addrinfo *addr_info) {
-  uint8_t buffer[PROTOCOL_MESSAGE_MAX_LENGTH];
-  int32_t length = sizeof(protocol_message_header_t) + message->header.length;
+  int32_t sent = 0;
+  do {
+    sent = sendto(network_udp_handle->socket, buffer, length, 0,
+                  (struct sockaddr *)&destination, sizeof(struct sockaddr_in));
+  } while (sent < 0 && errno == EINTR);
 
-  if (length > PROTOCOL_MESSAGE_MAX_LENGTH) {
-    ESP_LOGE(MULTICAST_WRITE_TAG, "Message length too long: %d", length);
-    return ESP_ERR_INVALID_ARG;
-  }
-
-  // first copy just the header data
-  memcpy(buffer, &message->header, sizeof(protocol_message_header_t));
-
-  // Then copy the body based on the type.
-  // The body comes immediately after the header in the raw buffer.
-  switch (message->header.type) {
-  case MESSAGE_TYPE_TEXT:
-    memcpy(buffer + sizeof(protocol_message_header_t), message->text.value,
-           message->header.length);
-    break;
-  case MESSAGE_TYPE_AUDIO:
-    memcpy(buffer + sizeof(protocol_message_header_t), message->audio.value,
-           message->header.length);
-    break;
-  case MESSAGE_TYPE_HEARTBEAT:
-    memcpy(buffer + sizeof(protocol_message_header_t),
-           message->heartbeat.from_name, message->header.length);
-    break;
-  default:
-    ESP_LOGE(MULTICAST_WRITE_TAG, "Unknown message type: %d",
-             message->header.type);
-    return ESP_ERR_INVALID_ARG;
-  }
-
-  if (sendto(socket, buffer, length, 0, addr_info->ai_addr,
-             addr_info->ai_addrlen) < 0) {
+  if (sent < 0) {
     ESP_LOGE(MULTICAST_WRITE_TAG, "sendto failed: errno %d", errno);
+    system_metrics_add(
+        network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_TX_SOCKET], 1);
     return ESP_ERR_INVALID_STATE;
   }
 
+  SYSTEM_TRACE(SYSTEM_TRACE_UDP_SEND, message->header.uuid);
+  system_metrics_add(network_udp_handle->metrics.tx_packets, 1);
+  system_metrics_add(network_udp_handle->metrics.tx_bytes, sent);
+  // only our own messages carry our clock, and only they are sent
+  system_metrics_observe(
+      network_udp_handle->metrics.tx_latency_us,
+      (uint32_t)(esp_timer_get_time() -
+                 protocol_message_uuid_timestamp(message->header.uuid)));
+
   return ESP_OK;
 }
 
+void network_udp_receive_datagram(network_udp_handle_t network_udp_handle,
+                                  uint8_t *buffer, int32_t length) {
+  protocol_message_handle_t message_incoming = NULL;
+  protocol_message_header_t header;
+  int64_t start_us = esp_timer_get_time();
+
+  // the buffer has no alignment guarantees, so copy the header out
+  memcpy(&header, buffer, sizeof(protocol_message_header_t));
+
+  // one bit test decides if anything wants this, before we allocate
+  if (!app_router_has_subscribers(network_udp_handle->queues->incoming,
+                                  header.type)) {
+    ESP_LOGD(MULTICAST_READ_TAG, "No subscribers for type %d, dropping",
+             header.type);
+    system_metrics_add(
+        network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_RX_UNWANTED], 1);
+    return;
+  }
+
+  // after the type check, so unwanted datagrams aren't decrypted
+  if (network_udp_handle->secure != NULL &&
+      network_secure_open(network_udp_handle->secure, buffer, &length) !=
+          ESP_OK) {
+    ESP_LOGD(MULTICAST_READ_TAG, "Failed to open datagram");
+    system_metrics_add(
+        network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_RX_OPEN], 1);
+    return;
+  }
+
+  if (protocol_message_decode(&message_incoming, buffer, length) != ESP_OK) {
+    ESP_LOGE(MULTICAST_READ_TAG, "Failed to decode message");
+    system_metrics_add(
+        network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_RX_DECODE], 1);
+    message_incoming = NULL;
+    return;
+  }
+  message_incoming->received_us = start_us;
+
+  // only once it's authentic, a forged datagram mustn't wake the radio
+  network_power_record_rx(network_udp_handle->power,
+                          &message_incoming->header);
+
+  // the router takes our reference either way
+  if (app_router_publish(network_udp_handle->queues->incoming,
+                         &message_incoming) != ESP_OK) {
+    ESP_LOGW(MULTICAST_READ_TAG, "No subscriber took the message");
+    system_metrics_add(
+        network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_RX_UNROUTED], 1);
+    return;
+  }
+
+  system_metrics_observe(network_udp_handle->metrics.rx_process_us,
+                         (uint32_t)(esp_timer_get_time() - start_us));
+}
+
 void udp_multicast_read_task(void *pvParameters) {
   network_udp_handle_t network_udp_handle = (network_udp_handle_t)pvParameters;
   fd_set rfds;
-  protocol_message_handle_t message_incoming = NULL;
+  int32_t length = 0;
+  uint8_t *buffer = network_udp_handle->rx_buffer;
 
   while (true) {
     xEventGroupWaitBits(network_udp_handle->events->group_handle,
@@ -284,6 +456,9 @@ void udp_multicast_read_task(void *pvParameters) {
     }
 
     if (s < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
       ESP_LOGE(MULTICAST_READ_TAG, "Select failed: errno %d", errno);
       continue;
     }
@@ -299,49 +474,31 @@ void udp_multicast_read_task(void *pvParameters) {
       continue;
     }
 
-    // TODO: If we can remove this usage of `device_info` then we don't need to
-    // depend on `device_info` at all
-    if (protocol_message_init(&message_incoming, MESSAGE_TYPE_UNKNOWN, 0,
-                              network_udp_handle->device_info->mac_address,
-                              NULL) != ESP_OK) {
-      ESP_LOGE(MULTICAST_READ_TAG, "Failed to initialize message");
-      message_incoming = NULL;
+    esp_err_t ret =
+        socket_receive_datagram(network_udp_handle->socket, buffer, &length);
+    if (ret != ESP_OK) {
+      ESP_LOGE(MULTICAST_READ_TAG, "Failed to receive message");
+      network_udp_drop_t reason = ret == ESP_ERR_INVALID_SIZE
+                                      ? NETWORK_UDP_DROP_RX_LENGTH
+                                      : NETWORK_UDP_DROP_RX_SOCKET;
+      system_metrics_add(network_udp_handle->metrics.dropped[reason], 1);
       continue;
     }
 
-    if (socket_receive_message(network_udp_handle->socket, message_incoming) !=
-        ESP_OK) {
-      ESP_LOGE(MULTICAST_READ_TAG, "Failed to receive message");
-      protocol_message_free(message_incoming);
-      message_incoming = NULL;
+    SYSTEM_TRACE(SYSTEM_TRACE_UDP_RECEIVE,
+                 buffer + offsetof(protocol_message_header_t, uuid));
+    system_metrics_add(network_udp_handle->metrics.rx_packets, 1);
+    system_metrics_add(network_udp_handle->metrics.rx_bytes, length);
+
+    if (network_udp_handle->rx_hook != NULL &&
+        !network_udp_handle->rx_hook(buffer, length,
+                                     network_udp_handle->rx_hook_ctx)) {
+      system_metrics_add(
+          network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_RX_HOOK], 1);
       continue;
     }
 
-    ESP_LOGD(
-        MULTICAST_READ_TAG, "UUID: %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X",
-        message_incoming->header.uuid[0], message_incoming->header.uuid[1],
-        message_incoming->header.uuid[2], message_incoming->header.uuid[3],
-        message_incoming->header.uuid[4], message_incoming->header.uuid[5],
-        message_incoming->header.uuid[6], message_incoming->header.uuid[7]);
-    ESP_LOGD(MULTICAST_READ_TAG,
-             "FROM MAC address: %02X:%02X:%02X:%02X:%02X:%02X",
-             message_incoming->header.from_mac_address[0],
-             message_incoming->header.from_mac_address[1],
-             message_incoming->header.from_mac_address[2],
-             message_incoming->header.from_mac_address[3],
-             message_incoming->header.from_mac_address[4],
-             message_incoming->header.from_mac_address[5]);
-    ESP_LOGD(MULTICAST_READ_TAG, "Message type: %d\n",
-             message_incoming->header.type);
-
-    if (app_queues_add_incoming_message(network_udp_handle->queues,
-                                        &message_incoming,
-                                        pdMS_TO_TICKS(5)) != ESP_OK) {
-      ESP_LOGE(MULTICAST_READ_TAG,
-               "Failed to add message to incoming queue. Dropping message.");
-      protocol_message_free(message_incoming);
-      message_incoming = NULL;
-    }
+    network_udp_receive_datagram(network_udp_handle, buffer, length);
   }
 }
 
@@ -380,30 +537,14 @@ void udp_multicast_write_task(void *pvParameters) {
       } else {
         ESP_LOGE(MULTICAST_WRITE_TAG,
                  "Failed to return message to queue, dropping message.");
+        system_metrics_add(
+            network_udp_handle->metrics.dropped[NETWORK_UDP_DROP_TX_NOT_READY],
+            1);
         goto udp_multicast_write_task_end;
       }
     }
 
-    ESP_LOGD(
-        MULTICAST_WRITE_TAG, "UUID: %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X",
-        outgoing_message->header.uuid[0], outgoing_message->header.uuid[1],
-        outgoing_message->header.uuid[2], outgoing_message->header.uuid[3],
-        outgoing_message->header.uuid[4], outgoing_message->header.uuid[5],
-        outgoing_message->header.uuid[6], outgoing_message->header.uuid[7]);
-    ESP_LOGD(MULTICAST_WRITE_TAG,
-             "TO MAC address: %02X:%02X:%02X:%02X:%02X:%02X",
-             outgoing_message->header.to_mac_address[0],
-             outgoing_message->header.to_mac_address[1],
-             outgoing_message->header.to_mac_address[2],
-             outgoing_message->header.to_mac_address[3],
-             outgoing_message->header.to_mac_address[4],
-             outgoing_message->header.to_mac_address[5]);
-    ESP_LOGD(MULTICAST_WRITE_TAG, "Message type: %d\n",
-             outgoing_message->header.type);
-
-    if (socket_send_message(network_udp_handle->socket, outgoing_message,
-                            network_udp_handle->multicast_addr_info) !=
-        ESP_OK) {
+    if (socket_send_message(network_udp_handle, outgoing_message) != ESP_OK) {
       ESP_LOGE(MULTICAST_WRITE_TAG, "Failed to send message");
     }
 
@@ -417,15 +558,147 @@ void udp_multicast_write_task(void *pvParameters) {
 // Setup Stuff
 // ----------------
 
+void network_udp_set_rx_hook(network_udp_handle_t network_udp_handle,
+                             network_udp_rx_hook_t hook, void *ctx) {
+  network_udp_handle->rx_hook_ctx = ctx;
+  network_udp_handle->rx_hook = hook;
+}
+
+void network_udp_set_secure(network_udp_handle_t network_udp_handle,
+                            network_secure_handle_t secure_handle) {
+  network_udp_handle->secure = secure_handle;
+}
+
+static network_udp_membership_t *
+network_udp_membership_find(network_udp_handle_t network_udp_handle,
+                            uint16_t group) {
+  for (int32_t i = 0; i < network_udp_handle->membership_count; i++) {
+    if (network_udp_handle->memberships[i].group == group) {
+      return &network_udp_handle->memberships[i];
+    }
+  }
+  return NULL;
+}
+
+esp_err_t network_udp_join(network_udp_handle_t network_udp_handle,
+                           uint16_t group) {
+  ESP_RETURN_ON_FALSE(group != PROTOCOL_GROUP_CONTROL &&
+                          group < PROTOCOL_GROUP_COUNT,
+                      ESP_ERR_INVALID_ARG, BASE_TAG, "No group %u to join",
+                      group);
+  esp_err_t ret = ESP_OK;
+  xSemaphoreTake(network_udp_handle->groups_mutex, portMAX_DELAY);
+
+  network_udp_membership_t *membership =
+      network_udp_membership_find(network_udp_handle, group);
+  if (membership != NULL) {
+    membership->holders++;
+    goto network_udp_join_end;
+  }
+
+  ESP_GOTO_ON_FALSE(
+      network_udp_handle->membership_count < NETWORK_UDP_MEMBERSHIPS_MAX,
+      ESP_ERR_NO_MEM, network_udp_join_end, BASE_TAG,
+      "Too many groups to join %u", group);
+  ESP_GOTO_ON_ERROR(
+      network_udp_membership_locked(network_udp_handle, group, true),
+      network_udp_join_end, BASE_TAG, "Failed to join group %u", group);
+
+  membership =
+      &network_udp_handle->memberships[network_udp_handle->membership_count++];
+  membership->group = group;
+  membership->holders = 1;
+  system_metrics_add(network_udp_handle->metrics.groups, 1);
+
+network_udp_join_end:
+  xSemaphoreGive(network_udp_handle->groups_mutex);
+  return ret;
+}
+
+esp_err_t network_udp_leave(network_udp_handle_t network_udp_handle,
+                            uint16_t group) {
+  esp_err_t ret = ESP_OK;
+  xSemaphoreTake(network_udp_handle->groups_mutex, portMAX_DELAY);
+
+  network_udp_membership_t *membership =
+      network_udp_membership_find(network_udp_handle, group);
+  ESP_GOTO_ON_FALSE(membership != NULL, ESP_ERR_NOT_FOUND,
+                    network_udp_leave_end, BASE_TAG,
+                    "Group %u was never joined", group);
+  membership->holders--;
+  if (membership->holders > 0) {
+    goto network_udp_leave_end;
+  }
+
+  // forgotten even if the socket refuses, the next one won't join it
+  ret = network_udp_membership_locked(network_udp_handle, group, false);
+  *membership =
+      network_udp_handle->memberships[--network_udp_handle->membership_count];
+  system_metrics_add(network_udp_handle->metrics.groups, -1);
+
+network_udp_leave_end:
+  xSemaphoreGive(network_udp_handle->groups_mutex);
+  return ret;
+}
+
+static esp_err_t
+network_udp_metrics_init(network_udp_handle_t network_udp_handle) {
+  system_metric_config_t configs[] = {
+      {"udp_rx_packets_total", "Datagrams read from the socket",
+       SYSTEM_METRIC_COUNTER},
+      {"udp_rx_bytes_total", "Bytes read from the socket",
+       SYSTEM_METRIC_COUNTER},
+      {"udp_tx_packets_total", "Datagrams sent", SYSTEM_METRIC_COUNTER},
+      {"udp_tx_bytes_total", "Bytes sent", SYSTEM_METRIC_COUNTER},
+      {"udp_rx_process_us", "Decoding and routing a received datagram",
+       SYSTEM_METRIC_HISTOGRAM},
+      {"udp_tx_latency_us", "Creating a message to sending it",
+       SYSTEM_METRIC_HISTOGRAM},
+      {"udp_groups", "Multicast groups joined besides the control group",
+       SYSTEM_METRIC_GAUGE},
+  };
+  system_metric_handle_t *handles[] = {
+      &network_udp_handle->metrics.rx_packets,
+      &network_udp_handle->metrics.rx_bytes,
+      &network_udp_handle->metrics.tx_packets,
+      &network_udp_handle->metrics.tx_bytes,
+      &network_udp_handle->metrics.rx_process_us,
+      &network_udp_handle->metrics.tx_latency_us,
+      &network_udp_handle->metrics.groups,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]),
+                        BASE_TAG, "Failed to register '%s'", configs[i].name);
+  }
+
+  for (int32_t i = 0; i < NETWORK_UDP_DROP_MAX; i++) {
+    system_metric_config_t config = {
+        .name = "udp_dropped_total",
+        .help = "Datagrams dropped, by reason",
+        .type = SYSTEM_METRIC_COUNTER,
+        .labels = DROP_LABELS[i],
+    };
+    ESP_RETURN_ON_ERROR(system_metrics_register(
+                            &network_udp_handle->metrics.dropped[i], &config),
+                        BASE_TAG, "Failed to register '%s'", config.name);
+  }
+
+  return ESP_OK;
+}
+
 esp_err_t network_udp_init(network_udp_handle_t *network_udp_handle_ptr,
                            network_events_handle_t events_handle,
+                           network_power_handle_t power_handle,
                            app_queues_handle_t queues_handle,
                            app_device_info_handle_t device_info_handle) {
   esp_err_t ret = ESP_OK;
   BaseType_t xReturned;
 
+  // the datagram buffers are on the message path
   network_udp_handle_t network_udp_handle =
-      (network_udp_handle_t)malloc(sizeof(network_udp_t));
+      (network_udp_handle_t)system_memory_alloc(sizeof(network_udp_t),
+                                                SYSTEM_MEMORY_FAST);
   ESP_GOTO_ON_FALSE(network_udp_handle != NULL, ESP_ERR_NO_MEM,
                     network_udp_init_error, BASE_TAG,
                     "Failed to allocate memory for network UDP handle");
@@ -433,20 +706,27 @@ esp_err_t network_udp_init(network_udp_handle_t *network_udp_handle_ptr,
   network_udp_handle->socket = -1;
   network_udp_handle->multicast_addr_info = NULL;
   network_udp_handle->events = events_handle;
+  network_udp_handle->power = power_handle;
   network_udp_handle->queues = queues_handle;
   network_udp_handle->device_info = device_info_handle;
+  network_udp_handle->rx_hook = NULL;
+  network_udp_handle->rx_hook_ctx = NULL;
+  network_udp_handle->secure = NULL;
+  network_udp_handle->membership_count = 0;
+  network_udp_handle->groups_mutex = xSemaphoreCreateMutex();
+  ESP_GOTO_ON_FALSE(network_udp_handle->groups_mutex != NULL, ESP_ERR_NO_MEM,
+                    network_udp_init_error, BASE_TAG,
+                    "Failed to create groups mutex");
 
-  network_udp_handle->ip_info =
-      (esp_netif_ip_info_t *)malloc(sizeof(esp_netif_ip_info_t));
-  ESP_GOTO_ON_FALSE(network_udp_handle->ip_info != NULL, ESP_ERR_NO_MEM,
+  ESP_GOTO_ON_ERROR(network_udp_metrics_init(network_udp_handle),
                     network_udp_init_error, BASE_TAG,
-                    "Failed to allocate memory for network UDP IP info");
+                    "Failed to register metrics");
 
-  xReturned =
-      xTaskCreate(udp_multicast_write_task, MULTICAST_WRITE_TAG,
-                  NETWORK_UDP_TASK_STACK_DEPTH_MULTICAST, network_udp_handle,
-                  NETWORK_UDP_TASK_PRIORITY_MULTICAST,
-                  &network_udp_handle->tasks.multicast_write);
+  xReturned = system_tasks_create(
+      udp_multicast_write_task, MULTICAST_WRITE_TAG,
+      NETWORK_UDP_TASK_STACK_DEPTH_MULTICAST, network_udp_handle,
+      NETWORK_UDP_TASK_PRIORITY_MULTICAST, NETWORK_UDP_TASK_CORE,
+      &network_udp_handle->tasks.multicast_write);
 
   if (xReturned != pdPASS) {
     ESP_LOGE(BASE_TAG, "Failed to create multicast write task");
@@ -459,11 +739,11 @@ esp_err_t network_udp_init(network_udp_handle_t *network_udp_handle_ptr,
     goto network_udp_init_error;
   }
 
-  xReturned =
-      xTaskCreate(udp_multicast_read_task, MULTICAST_READ_TAG,
-                  NETWORK_UDP_TASK_STACK_DEPTH_MULTICAST, network_udp_handle,
-                  NETWORK_UDP_TASK_PRIORITY_MULTICAST,
-                  &network_udp_handle->tasks.multicast_read);
+  xReturned = system_tasks_create(
+      udp_multicast_read_task, MULTICAST_READ_TAG,
+      NETWORK_UDP_TASK_STACK_DEPTH_MULTICAST, network_udp_handle,
+      NETWORK_UDP_TASK_PRIORITY_MULTICAST, NETWORK_UDP_TASK_CORE,
+      &network_udp_handle->tasks.multicast_read);
 
   if (xReturned != pdPASS) {
     ESP_LOGE(BASE_TAG, "Failed to create multicast read task");
@@ -476,10 +756,10 @@ esp_err_t network_udp_init(network_udp_handle_t *network_udp_handle_ptr,
     goto network_udp_init_error;
   }
 
-  xReturned = xTaskCreate(udp_socket_task, SOCKET_TAG,
-                          NETWORK_UDP_TASK_STACK_DEPTH_SOCKET,
-                          network_udp_handle, NETWORK_UDP_TASK_PRIORITY_SOCKET,
-                          &network_udp_handle->tasks.socket);
+  xReturned = system_tasks_create(
+      udp_socket_task, SOCKET_TAG, NETWORK_UDP_TASK_STACK_DEPTH_SOCKET,
+      network_udp_handle, NETWORK_UDP_TASK_PRIORITY_SOCKET,
+      NETWORK_UDP_TASK_CORE, &network_udp_handle->tasks.socket);
 
   if (xReturned != pdPASS) {
     ESP_LOGE(BASE_TAG, "Failed to create socket task");
@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include "network/wifi.h"
+#include "storage/settings.h"
 
 static const char *TAG = "NETWORK:WIFI";
 
@@ -22,7 +23,7 @@ static void event_handler(void *arg, esp_event_base_t event_base,
       ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
       ESP_LOGD(TAG, "EVENT - IP_EVENT_STA_GOT_IP");
       ESP_LOGD(TAG, "IPV4 is: " IPSTR, IP2STR(&event->ip_info.ip));
-      memcpy(wifi_handle->udp->ip_info, &event->ip_info,
+      memcpy(&wifi_handle->events->ip_info, &event->ip_info,
              sizeof(esp_netif_ip_info_t));
       // signal that we've got a new IP so that the socket can be created
       xEventGroupSetBits(wifi_handle->events->group_handle,
@@ -34,9 +35,9 @@ static void event_handler(void *arg, esp_event_base_t event_base,
       // signal that we've lost our IP so that the socket can be closed
       xEventGroupSetBits(wifi_handle->events->group_handle,
                          NETWORK_EVENT_LOST_IP);
-      wifi_handle->udp->ip_info->ip = (esp_ip4_addr_t){0};
-      wifi_handle->udp->ip_info->netmask = (esp_ip4_addr_t){0};
-      wifi_handle->udp->ip_info->gw = (esp_ip4_addr_t){0};
+      wifi_handle->events->ip_info.ip = (esp_ip4_addr_t){0};
+      wifi_handle->events->ip_info.netmask = (esp_ip4_addr_t){0};
+      wifi_handle->events->ip_info.gw = (esp_ip4_addr_t){0};
       break;
     }
     default: {
@@ -77,8 +78,7 @@ static void event_handler(void *arg, esp_event_base_t event_base,
 // Using overview from:
 // https://docs.espressif.com/projects/esp-idf/en/stable/esp32/api-guides/wifi.html#esp32-wi-fi-station-general-scenario
 esp_err_t network_wifi_init(network_wifi_handle_t *wifi_handle_ptr,
-                            network_events_handle_t events,
-                            network_udp_handle_t udp) {
+                            network_events_handle_t events) {
   esp_err_t ret = ESP_OK;
 
   network_wifi_handle_t wifi_handle =
@@ -88,7 +88,6 @@ esp_err_t network_wifi_init(network_wifi_handle_t *wifi_handle_ptr,
                     "Failed to allocate memory for wifi handle");
 
   wifi_handle->events = events;
-  wifi_handle->udp = udp;
 
   ESP_GOTO_ON_ERROR(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
                                                &event_handler, wifi_handle),
@@ -119,21 +118,28 @@ esp_err_t network_wifi_init(network_wifi_handle_t *wifi_handle_ptr,
                       TAG, "Failed to set WiFi mode");
   }
 
+  storage_settings_t settings;
+  storage_settings_get(&settings);
+
   // get the current config from NVS. If not correct, set it
   wifi_config_t wifi_nvs_config;
   ret = esp_wifi_get_config(WIFI_IF_STA, &wifi_nvs_config);
   if (ret != ESP_OK ||
-      strcmp((char *)wifi_nvs_config.sta.ssid, CONFIG_WIFI_SSID) != 0 ||
-      strcmp((char *)wifi_nvs_config.sta.password, CONFIG_WIFI_PWD) != 0) {
+      strncmp((char *)wifi_nvs_config.sta.ssid, settings.wifi_ssid,
+              sizeof(wifi_nvs_config.sta.ssid)) != 0 ||
+      strncmp((char *)wifi_nvs_config.sta.password, settings.wifi_pwd,
+              sizeof(wifi_nvs_config.sta.password)) != 0 ||
+      wifi_nvs_config.sta.listen_interval !=
+          CONFIG_NETWORK_POWER_LISTEN_INTERVAL) {
     ret = ESP_OK; // reset to try more below
     ESP_LOGW(TAG, "WiFi NVS \"config\" not correct - setting");
     wifi_config_t wifi_config_new = {
         .sta =
             {
-                .ssid = CONFIG_WIFI_SSID,
-                .password = CONFIG_WIFI_PWD,
                 .scan_method = WIFI_ALL_CHANNEL_SCAN,
                 .sort_method = WIFI_CONNECT_AP_BY_SIGNAL,
+                // only used by `WIFI_PS_MAX_MODEM`, see `network/power.h`
+                .listen_interval = CONFIG_NETWORK_POWER_LISTEN_INTERVAL,
                 .threshold =
                     {
                         .rssi = 0,
@@ -142,6 +148,12 @@ esp_err_t network_wifi_init(network_wifi_handle_t *wifi_handle_ptr,
             },
     };
 
+    // not null terminated if they use the full length
+    memcpy(wifi_config_new.sta.ssid, settings.wifi_ssid,
+           strnlen(settings.wifi_ssid, sizeof(wifi_config_new.sta.ssid)));
+    memcpy(wifi_config_new.sta.password, settings.wifi_pwd,
+           strnlen(settings.wifi_pwd, sizeof(wifi_config_new.sta.password)));
+
     ESP_GOTO_ON_ERROR(esp_wifi_set_config(WIFI_IF_STA, &wifi_config_new),
                       network_wifi_init_error, TAG,
                       "Failed to set WiFi config");
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "esp_err.h"
+#include <stdatomic.h>
 
 #include "protocols/mac.h"
 
@@ -9,16 +10,75 @@
 // Riding on the back of giants with the same max as QUIC.
 // https://datatracker.ietf.org/doc/html/rfc9000#name-datagram-size
 #define PROTOCOL_MESSAGE_MAX_LENGTH 1200
+// Room kept at the end of every datagram for a trailer added after encoding,
+// see `network/secure`.
+#define PROTOCOL_MESSAGE_TRAILER_MAX_LENGTH 20
 #define PROTOCOL_MESSAGE_BODY_MAX_LENGTH                                       \
-  (PROTOCOL_MESSAGE_MAX_LENGTH - sizeof(protocol_message_header_t))
+  (PROTOCOL_MESSAGE_MAX_LENGTH - sizeof(protocol_message_header_t) -          \
+   PROTOCOL_MESSAGE_TRAILER_MAX_LENGTH)
+// Bodies longer than one datagram are split into fragments when sent, see
+// `application/fragments`. A type opts in with a larger `max_length`.
+#define PROTOCOL_MESSAGE_LARGE_MAX_LENGTH (64 * 1024)
 
+// Adding a type: add it here, then either add it to the built in table in
+// `messages.c` or call `protocol_message_type_register` before using it.
 typedef enum protocol_message_type_t {
   MESSAGE_TYPE_UNKNOWN = 0,
   MESSAGE_TYPE_HEARTBEAT = 1,
   MESSAGE_TYPE_TEXT = 2,
   MESSAGE_TYPE_AUDIO = 3,
+  // floor control, registered by `application/session`
+  MESSAGE_TYPE_TALK_START = 4,
+  MESSAGE_TYPE_TALK_STOP = 5,
+  MESSAGE_TYPE_FLOOR_GRANT = 6,
+  MESSAGE_TYPE_FLOOR_DENY = 7,
+  // part of a large message, registered by `application/fragments`
+  MESSAGE_TYPE_FRAGMENT = 8,
+  // reliable delivery, registered by `application/reliable`
+  MESSAGE_TYPE_ACK = 9,
+  MESSAGE_TYPE_NACK = 10,
+  MESSAGE_TYPE_SUMMARY = 11,
+  // stands in for audio while the talker is silent, see `audio/vad`
+  MESSAGE_TYPE_COMFORT_NOISE = 12,
+  // all-call audio with a presentation time, registered by
+  // `application/paging`
+  MESSAGE_TYPE_PAGE = 13,
+  // a request for, or a copy of, a station's peer table, registered by
+  // `application/peers`
+  MESSAGE_TYPE_PEERS = 14,
 } protocol_message_type_t;
 
+// types are used as table indexes, so they must stay below this
+#define PROTOCOL_MESSAGE_TYPE_MAX 16
+
+typedef enum protocol_message_layout_t {
+  // opaque bytes
+  PROTOCOL_MESSAGE_LAYOUT_BYTES = 0,
+  // null terminated string, the terminator is included in the length
+  PROTOCOL_MESSAGE_LAYOUT_STRING = 1,
+  // null terminated string, optionally followed by opaque bytes
+  PROTOCOL_MESSAGE_LAYOUT_STRING_PREFIX = 2,
+} protocol_message_layout_t;
+
+typedef enum protocol_message_priority_t {
+  PROTOCOL_MESSAGE_PRIORITY_NORMAL = 0,
+  // read before normal messages by subscribers that take both, see
+  // `application/router`
+  PROTOCOL_MESSAGE_PRIORITY_HIGH = 1,
+} protocol_message_priority_t;
+
+typedef struct protocol_message_type_info_t {
+  const char *name;
+  protocol_message_layout_t layout;
+  int32_t max_length;
+  protocol_message_priority_t priority;
+} protocol_message_type_info_t;
+
+// every payload is a single pointer, so `raw` can be used for any type.
+typedef struct protocol_message_payload_raw_t {
+  uint8_t *value;
+} protocol_message_payload_raw_t;
+
 typedef struct protocol_message_payload_text_t {
   char *value;
 } protocol_message_payload_text_t;
@@ -27,6 +87,8 @@ typedef struct protocol_message_payload_audio_t {
   uint8_t *value;
 } protocol_message_payload_audio_t;
 
+// The name can be followed by an extension, see
+// `protocol_message_heartbeat_extension`.
 typedef struct protocol_message_payload_heartbeat_t {
   char *from_name;
 } protocol_message_payload_heartbeat_t;
@@ -35,17 +97,44 @@ typedef struct protocol_message_payload_heartbeat_t {
 // hardware RNG. Globally unique in combination with from_mac_address.
 typedef uint8_t protocol_message_uuid_t[8];
 
+// `protocol_message_header_t.flags`
+typedef enum protocol_message_flag_t {
+  // Opts in to delivery being confirmed (addressed) or recovered (broadcast),
+  // see `application/reliable`. Set before the message is queued.
+  PROTOCOL_MESSAGE_FLAG_RELIABLE = 1 << 0,
+  // Audio played back from `application/memos`, so it isn't recorded again.
+  // Only ever published locally, never sent.
+  PROTOCOL_MESSAGE_FLAG_MEMO = 1 << 1,
+  // Audio released by `application/paging` at its presentation time, to be
+  // played at once rather than through a jitter buffer. Only ever published
+  // locally, never sent.
+  PROTOCOL_MESSAGE_FLAG_PAGED = 1 << 2,
+} protocol_message_flag_t;
+
 typedef struct protocol_message_header_t {
   protocol_message_type_t type;
   int32_t length;
   protocol_message_uuid_t uuid;
   protocol_mac_address_t from_mac_address;
   protocol_mac_address_t to_mac_address;
+  uint16_t flags;
+  // 0 when first sent, a retransmission keeps the UUID and counts up
+  uint16_t attempt;
 } protocol_message_header_t;
 
 typedef struct protocol_message_t {
   protocol_message_header_t header;
+  // Not sent. Messages start with one reference, every holder calls
+  // `protocol_message_free` once. Shared messages must not be modified.
+  atomic_int_fast32_t refcount;
+  // Not sent. Our `esp_timer_get_time()` when the datagram was read, 0 for
+  // messages we made.
+  int64_t received_us;
+  // Not sent. The multicast group it goes to, `PROTOCOL_GROUP_CONTROL`
+  // unless set before the message is queued.
+  uint16_t group;
   union {
+    protocol_message_payload_raw_t raw;
     protocol_message_payload_text_t text;
     protocol_message_payload_audio_t audio;
     protocol_message_payload_heartbeat_t heartbeat;
@@ -54,6 +143,24 @@ typedef struct protocol_message_t {
 
 typedef protocol_message_t *protocol_message_handle_t;
 
+// Multicast groups, each the address after the one before, starting from
+// the control group every station joins (`STORAGE_SETTING_MULTICAST_ADDR`).
+// A zone is the stations on one floor or in one wing, a call is the two
+// stations in it, and only stations that joined a group get what's sent to
+// it. See `network/udp`.
+#define PROTOCOL_GROUP_CONTROL 0
+#define PROTOCOL_GROUP_ZONES 15
+// calls share a group once there are more than this
+#define PROTOCOL_GROUP_CALLS 48
+#define PROTOCOL_GROUP_COUNT (1 + PROTOCOL_GROUP_ZONES + PROTOCOL_GROUP_CALLS)
+
+esp_err_t
+protocol_message_type_register(protocol_message_type_t type,
+                               const protocol_message_type_info_t *info);
+// returns NULL for unknown/unregistered types
+const protocol_message_type_info_t *
+protocol_message_type_get(protocol_message_type_t type);
+
 esp_err_t protocol_message_init(protocol_message_handle_t *message_ptr,
                                 protocol_message_type_t type, int32_t length,
                                 protocol_mac_address_t from_mac_address,
@@ -62,17 +169,57 @@ esp_err_t protocol_message_init_text(protocol_message_handle_t *message_ptr,
                                      char *value,
                                      protocol_mac_address_t from_mac_address,
                                      protocol_mac_address_t to_mac_address);
+// `extension` is appended after the name, it can be NULL.
 esp_err_t
 protocol_message_init_heartbeat(protocol_message_handle_t *message_ptr,
-                                char *from_name,
+                                char *from_name, const uint8_t *extension,
+                                int32_t extension_length,
                                 protocol_mac_address_t from_mac_address);
+// Returns the length of the bytes after a heartbeat's name and points
+// `extension_ptr` at them. Heartbeats from older stations have none.
+int32_t
+protocol_message_heartbeat_extension(protocol_message_handle_t message,
+                                     const uint8_t **extension_ptr);
 esp_err_t protocol_message_init_audio(protocol_message_handle_t *message_ptr,
                                       uint8_t *value, int32_t length,
                                       protocol_mac_address_t from_mac_address,
                                       protocol_mac_address_t to_mac_address);
+// `descriptor` is an `audio_comfort_noise_descriptor_t`, sent as is.
+esp_err_t protocol_message_init_comfort_noise(
+    protocol_message_handle_t *message_ptr, const uint8_t *descriptor,
+    int32_t length, protocol_mac_address_t from_mac_address,
+    protocol_mac_address_t to_mac_address);
 
 // it is expected that the message header length is already set
 esp_err_t protocol_message_set_payload(protocol_message_handle_t message,
                                        void *value);
+// Like `protocol_message_set_payload`, but takes ownership of `value`, which
+// must be heap allocated, instead of copying it. Saves a copy of large
+// messages. `value` is left to the caller on failure.
+esp_err_t protocol_message_adopt_payload(protocol_message_handle_t message,
+                                         uint8_t *value);
+
+// Writes the datagram (header followed by the payload) into `buffer`, which
+// must hold at least `PROTOCOL_MESSAGE_MAX_LENGTH` bytes. The datagram leaves
+// room for the trailer.
+esp_err_t protocol_message_encode(protocol_message_handle_t message,
+                                  uint8_t *buffer, int32_t *length_ptr);
+
+// Builds a message from a raw datagram (header followed by the payload).
+esp_err_t protocol_message_decode(protocol_message_handle_t *message_ptr,
+                                  const uint8_t *buffer, int32_t length);
+
+// adds a reference for another holder
+void protocol_message_ref(protocol_message_handle_t message);
+// drops a reference, freeing the message with the last one
+void protocol_message_free(protocol_message_handle_t message);
+
+// returns the sender's `esp_timer_get_time()` embedded in the UUID
+int64_t protocol_message_uuid_timestamp(const protocol_message_uuid_t uuid);
 
-void protocol_message_free(protocol_message_handle_t message);
\ No newline at end of file
+// Zone 1 to `PROTOCOL_GROUP_ZONES`, zone 0 is the whole house and anything
+// higher is treated as it.
+uint16_t protocol_group_zone(uint32_t zone);
+// A call's group, the same whichever end asks.
+uint16_t protocol_group_call(const protocol_mac_address_t mac_address,
+                             const protocol_mac_address_t other_mac_address);
\ No newline at end of file
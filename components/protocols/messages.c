@@ -2,12 +2,82 @@
 #include "esp_random.h"
 #include "esp_timer.h"
 #include <assert.h>
+#include <inttypes.h>
 #include <string.h>
 
 #include "protocols/messages.h"
 
 static const char *BASE_TAG = "NETWORK:MESSAGES";
 
+static const protocol_message_type_info_t TYPE_HEARTBEAT = {
+    .name = "heartbeat",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_STRING_PREFIX,
+    .max_length = PROTOCOL_MESSAGE_BODY_MAX_LENGTH,
+    .priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL,
+};
+
+// longer texts are sent in fragments
+static const protocol_message_type_info_t TYPE_TEXT = {
+    .name = "text",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_STRING,
+    .max_length = 4096,
+    .priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL,
+};
+
+static const protocol_message_type_info_t TYPE_AUDIO = {
+    .name = "audio",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = PROTOCOL_MESSAGE_BODY_MAX_LENGTH,
+    .priority = PROTOCOL_MESSAGE_PRIORITY_HIGH,
+};
+
+// a level and at most 15 coefficients, like RFC 3389 allows
+static const protocol_message_type_info_t TYPE_COMFORT_NOISE = {
+    .name = "comfort_noise",
+    .layout = PROTOCOL_MESSAGE_LAYOUT_BYTES,
+    .max_length = 16,
+    .priority = PROTOCOL_MESSAGE_PRIORITY_HIGH,
+};
+
+// indexed by type, NULL means unknown
+static const protocol_message_type_info_t
+    *message_types[PROTOCOL_MESSAGE_TYPE_MAX] = {
+        [MESSAGE_TYPE_HEARTBEAT] = &TYPE_HEARTBEAT,
+        [MESSAGE_TYPE_TEXT] = &TYPE_TEXT,
+        [MESSAGE_TYPE_AUDIO] = &TYPE_AUDIO,
+        [MESSAGE_TYPE_COMFORT_NOISE] = &TYPE_COMFORT_NOISE,
+};
+
+// Types should be registered during init, before any message of that type is
+// sent or received.
+esp_err_t
+protocol_message_type_register(protocol_message_type_t type,
+                               const protocol_message_type_info_t *info) {
+  if (type <= MESSAGE_TYPE_UNKNOWN || type >= PROTOCOL_MESSAGE_TYPE_MAX ||
+      info == NULL || info->max_length < 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if (message_types[type] != NULL && message_types[type] != info) {
+    ESP_LOGE(BASE_TAG, "Message type %d already registered as '%s'", type,
+             message_types[type]->name);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  message_types[type] = info;
+  return ESP_OK;
+}
+
+const protocol_message_type_info_t *
+protocol_message_type_get(protocol_message_type_t type) {
+  // the type comes straight off the wire, so bounds check it
+  if ((uint32_t)type >= PROTOCOL_MESSAGE_TYPE_MAX) {
+    return NULL;
+  }
+
+  return message_types[type];
+}
+
 // if the to mac address is not provided, it will be set to the
 // broadcast address.
 esp_err_t protocol_message_init(protocol_message_handle_t *message_ptr,
@@ -20,8 +90,16 @@ esp_err_t protocol_message_init(protocol_message_handle_t *message_ptr,
     return ESP_ERR_INVALID_ARG;
   }
 
+  // `MESSAGE_TYPE_UNKNOWN` is allowed as a placeholder to be filled in later
+  const protocol_message_type_info_t *info = protocol_message_type_get(type);
+  if (info == NULL && type != MESSAGE_TYPE_UNKNOWN) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
   // check that the input length doesn't exceed the allowed length
-  if (length < 0 || length > PROTOCOL_MESSAGE_BODY_MAX_LENGTH) {
+  int32_t max_length =
+      info != NULL ? info->max_length : PROTOCOL_MESSAGE_BODY_MAX_LENGTH;
+  if (length < 0 || length > max_length) {
     return ESP_ERR_INVALID_ARG;
   }
 
@@ -33,6 +111,11 @@ esp_err_t protocol_message_init(protocol_message_handle_t *message_ptr,
 
   message->header.type = type;
   message->header.length = length;
+  message->header.flags = 0;
+  message->header.attempt = 0;
+  atomic_init(&message->refcount, 1);
+  message->received_us = 0;
+  message->group = PROTOCOL_GROUP_CONTROL;
 
   // uuid: 48-bit microsecond timestamp + 16-bit hardware RNG
   // stored in big-endian for network byte order
@@ -59,21 +142,7 @@ esp_err_t protocol_message_init(protocol_message_handle_t *message_ptr,
            sizeof(protocol_mac_address_t));
   }
 
-  switch (type) {
-  case MESSAGE_TYPE_TEXT:
-    message->text.value = NULL;
-    break;
-  case MESSAGE_TYPE_AUDIO:
-    message->audio.value = NULL;
-    break;
-  case MESSAGE_TYPE_HEARTBEAT:
-    message->heartbeat.from_name = NULL;
-    break;
-  default:
-    // no op, default to all null pointers
-    message->text.value = NULL;
-    break;
-  }
+  message->raw.value = NULL;
 
   *message_ptr = message;
 
@@ -107,12 +176,17 @@ esp_err_t protocol_message_init_text(protocol_message_handle_t *message_ptr,
 
 esp_err_t
 protocol_message_init_heartbeat(protocol_message_handle_t *message_ptr,
-                                char *from_name,
+                                char *from_name, const uint8_t *extension,
+                                int32_t extension_length,
                                 protocol_mac_address_t from_mac_address) {
   esp_err_t ret = ESP_OK;
 
-  int32_t length = (strlen(from_name) + 1) * sizeof(char);
-  ret = protocol_message_init(message_ptr, MESSAGE_TYPE_HEARTBEAT, length,
+  if (extension == NULL) {
+    extension_length = 0;
+  }
+  int32_t name_length = (strlen(from_name) + 1) * sizeof(char);
+  ret = protocol_message_init(message_ptr, MESSAGE_TYPE_HEARTBEAT,
+                              name_length + extension_length,
                               from_mac_address, NULL);
   if (ret != ESP_OK) {
     return ret;
@@ -126,10 +200,23 @@ protocol_message_init_heartbeat(protocol_message_handle_t *message_ptr,
   }
 
   strcpy((*message_ptr)->heartbeat.from_name, from_name);
+  if (extension_length > 0) {
+    memcpy((*message_ptr)->heartbeat.from_name + name_length, extension,
+           extension_length);
+  }
 
   return ESP_OK;
 }
 
+int32_t
+protocol_message_heartbeat_extension(protocol_message_handle_t message,
+                                     const uint8_t **extension_ptr) {
+  // the terminator was checked when the payload was set
+  int32_t name_length = strlen(message->heartbeat.from_name) + 1;
+  *extension_ptr = (const uint8_t *)message->heartbeat.from_name + name_length;
+  return message->header.length - name_length;
+}
+
 esp_err_t protocol_message_init_audio(protocol_message_handle_t *message_ptr,
                                       uint8_t *value, int32_t length,
                                       protocol_mac_address_t from_mac_address,
@@ -153,65 +240,201 @@ esp_err_t protocol_message_init_audio(protocol_message_handle_t *message_ptr,
   return ESP_OK;
 }
 
+esp_err_t protocol_message_init_comfort_noise(
+    protocol_message_handle_t *message_ptr, const uint8_t *descriptor,
+    int32_t length, protocol_mac_address_t from_mac_address,
+    protocol_mac_address_t to_mac_address) {
+  esp_err_t ret = ESP_OK;
+
+  ret = protocol_message_init(message_ptr, MESSAGE_TYPE_COMFORT_NOISE, length,
+                              from_mac_address, to_mac_address);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  (*message_ptr)->raw.value = (uint8_t *)malloc(length);
+  if ((*message_ptr)->raw.value == NULL) {
+    protocol_message_free(*message_ptr);
+    return ESP_ERR_NO_MEM;
+  }
+
+  memcpy((*message_ptr)->raw.value, descriptor, length);
+
+  return ESP_OK;
+}
+
+static esp_err_t
+protocol_message_validate_payload(protocol_message_handle_t message,
+                                  const void *value) {
+  const protocol_message_type_info_t *info =
+      protocol_message_type_get(message->header.type);
+  if (info == NULL) {
+    ESP_LOGE(BASE_TAG, "Unknown message type: %d", message->header.type);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if (message->header.length < 0 ||
+      message->header.length > info->max_length) {
+    ESP_LOGE(BASE_TAG, "Invalid %s length: %" PRId32, info->name,
+             message->header.length);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // `message->header.length` accounts for the null terminator
+  if (info->layout == PROTOCOL_MESSAGE_LAYOUT_STRING &&
+      (message->header.length == 0 ||
+       ((const uint8_t *)value)[message->header.length - 1] != '\0')) {
+    ESP_LOGE(BASE_TAG, "%s payload is not null terminated", info->name);
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (info->layout == PROTOCOL_MESSAGE_LAYOUT_STRING_PREFIX &&
+      memchr(value, '\0', message->header.length) == NULL) {
+    ESP_LOGE(BASE_TAG, "%s payload has no null terminated prefix",
+             info->name);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  return ESP_OK;
+}
+
 esp_err_t protocol_message_set_payload(protocol_message_handle_t message,
                                        void *value) {
-  switch (message->header.type) {
-  case MESSAGE_TYPE_TEXT:
-    free(message->text.value);
+  esp_err_t ret = protocol_message_validate_payload(message, value);
+  if (ret != ESP_OK) {
+    return ret;
+  }
 
-    message->text.value = (char *)malloc(message->header.length);
-    if (message->text.value == NULL) {
-      return ESP_ERR_NO_MEM;
-    }
+  free(message->raw.value);
 
-    // `message->header.length` accounts for the null terminator
-    memcpy(message->text.value, (char *)value, message->header.length);
-    break;
-  case MESSAGE_TYPE_AUDIO:
-    free(message->audio.value);
+  message->raw.value = (uint8_t *)malloc(message->header.length);
+  if (message->raw.value == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
 
-    message->audio.value = (uint8_t *)malloc(message->header.length);
-    if (message->audio.value == NULL) {
-      return ESP_ERR_NO_MEM;
-    }
+  memcpy(message->raw.value, value, message->header.length);
 
-    memcpy(message->audio.value, value, message->header.length);
-    break;
-  case MESSAGE_TYPE_HEARTBEAT:
-    free(message->heartbeat.from_name);
+  return ESP_OK;
+}
 
-    message->heartbeat.from_name = (char *)malloc(message->header.length);
-    if (message->heartbeat.from_name == NULL) {
-      return ESP_ERR_NO_MEM;
-    }
+esp_err_t protocol_message_adopt_payload(protocol_message_handle_t message,
+                                         uint8_t *value) {
+  esp_err_t ret = protocol_message_validate_payload(message, value);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  free(message->raw.value);
+  message->raw.value = value;
 
-    memcpy(message->heartbeat.from_name, (char *)value, message->header.length);
-    break;
-  default:
+  return ESP_OK;
+}
+
+esp_err_t protocol_message_encode(protocol_message_handle_t message,
+                                  uint8_t *buffer, int32_t *length_ptr) {
+  int32_t length = sizeof(protocol_message_header_t) + message->header.length;
+  if (length >
+      PROTOCOL_MESSAGE_MAX_LENGTH - PROTOCOL_MESSAGE_TRAILER_MAX_LENGTH) {
+    ESP_LOGE(BASE_TAG, "Message length too long: %" PRId32, length);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  if (protocol_message_type_get(message->header.type) == NULL) {
     ESP_LOGE(BASE_TAG, "Unknown message type: %d", message->header.type);
     return ESP_ERR_INVALID_ARG;
   }
 
+  memcpy(buffer, &message->header, sizeof(protocol_message_header_t));
+  // the body comes immediately after the header
+  memcpy(buffer + sizeof(protocol_message_header_t), message->raw.value,
+         message->header.length);
+
+  *length_ptr = length;
   return ESP_OK;
 }
 
+esp_err_t protocol_message_decode(protocol_message_handle_t *message_ptr,
+                                  const uint8_t *buffer, int32_t length) {
+  if (length < (int32_t)sizeof(protocol_message_header_t)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  protocol_message_handle_t message =
+      (protocol_message_handle_t)malloc(sizeof(protocol_message_t));
+  if (message == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  memcpy(&message->header, buffer, sizeof(protocol_message_header_t));
+  atomic_init(&message->refcount, 1);
+  message->received_us = 0;
+  message->group = PROTOCOL_GROUP_CONTROL;
+  message->raw.value = NULL;
+
+  int32_t payload_len = length - sizeof(protocol_message_header_t);
+  if (payload_len != message->header.length) {
+    ESP_LOGE(BASE_TAG, "Payload length mismatch: expected %" PRId32
+             ", got %" PRId32,
+             message->header.length, payload_len);
+    free(message);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  esp_err_t ret = protocol_message_set_payload(
+      message, (void *)(buffer + sizeof(protocol_message_header_t)));
+  if (ret != ESP_OK) {
+    free(message);
+    return ret;
+  }
+
+  *message_ptr = message;
+  return ESP_OK;
+}
+
+void protocol_message_ref(protocol_message_handle_t message) {
+  atomic_fetch_add_explicit(&message->refcount, 1, memory_order_relaxed);
+}
+
 void protocol_message_free(protocol_message_handle_t message) {
-  switch (message->header.type) {
-  case MESSAGE_TYPE_TEXT:
-    free(message->text.value);
-    break;
-  case MESSAGE_TYPE_AUDIO:
-    free(message->audio.value);
-    break;
-  case MESSAGE_TYPE_HEARTBEAT:
-    free(message->heartbeat.from_name);
-    break;
-  default:
-    // no op, free all null pointers
-    // (null pointers are checked in free)
-    free(message->text.value);
-    break;
+  if (atomic_fetch_sub_explicit(&message->refcount, 1, memory_order_acq_rel) !=
+      1) {
+    return;
   }
 
+  // null pointers are checked in free
+  free(message->raw.value);
   free(message);
-}
\ No newline at end of file
+}
+
+int64_t protocol_message_uuid_timestamp(const protocol_message_uuid_t uuid) {
+  return ((int64_t)uuid[0] << 40) | ((int64_t)uuid[1] << 32) |
+         ((int64_t)uuid[2] << 24) | ((int64_t)uuid[3] << 16) |
+         ((int64_t)uuid[4] << 8) | (int64_t)uuid[5];
+}
+
+uint16_t protocol_group_zone(uint32_t zone) {
+  if (zone == 0 || zone > PROTOCOL_GROUP_ZONES) {
+    return PROTOCOL_GROUP_CONTROL;
+  }
+  return (uint16_t)zone;
+}
+
+uint16_t protocol_group_call(const protocol_mac_address_t mac_address,
+                             const protocol_mac_address_t other_mac_address) {
+  const uint8_t *low = mac_address;
+  const uint8_t *high = other_mac_address;
+  if (memcmp(low, high, sizeof(protocol_mac_address_t)) > 0) {
+    low = other_mac_address;
+    high = mac_address;
+  }
+
+  // FNV-1a over both, lowest first
+  const uint8_t *ends[] = {low, high};
+  uint32_t hash = 2166136261u;
+  for (int32_t end = 0; end < 2; end++) {
+    for (int32_t i = 0; i < sizeof(protocol_mac_address_t); i++) {
+      hash ^= ends[end][i];
+      hash *= 16777619u;
+    }
+  }
+  return (uint16_t)(1 + PROTOCOL_GROUP_ZONES + hash % PROTOCOL_GROUP_CALLS);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "system/metrics.h"
+
+// a data partition, see `partitions.csv`
+#define STORAGE_MEMOS_PARTITION_LABEL "memos"
+#define STORAGE_MEMOS_SECTOR_LENGTH 4096
+
+// Frames are collected in RAM and written as one record of up to this many
+// bytes, header included, two to a sector after its 8 byte header...
+#define STORAGE_MEMOS_RECORD_MAX_LENGTH 2044
+// ...a page at a time. The flash cache is off while a page is programmed, so
+// this bounds how long every other task can be stalled.
+#define STORAGE_MEMOS_WRITE_LENGTH 256
+// Erasing a sector stalls for tens of ms, so sectors are erased ahead while
+// nothing is being recorded, see `storage_memos_prepare`. Once that runway
+// runs out, records are refused rather than erasing mid-call. At most this
+// share of the ring is kept erased, the rest keeps memos.
+#define STORAGE_MEMOS_RUNWAY_MAX_PERCENT 50
+
+// memos the index keeps, the oldest are forgotten
+#define STORAGE_MEMOS_INDEX_MAX 64
+#define STORAGE_MEMOS_MAC_LENGTH 6
+
+typedef enum storage_memos_record_kind_t {
+  STORAGE_MEMOS_RECORD_START = 1,
+  STORAGE_MEMOS_RECORD_FRAMES = 2,
+} storage_memos_record_kind_t;
+
+// At the start of every sector that's been written, all 0xFF while erased.
+typedef struct storage_memos_sector_header_t {
+  uint32_t magic;
+  // counts up with every sector written, so the ring can be put back in
+  // order after a reboot
+  uint32_t sequence;
+} storage_memos_sector_header_t;
+
+// Records never cross a sector, the rest of a sector that doesn't fit the
+// next one is left erased.
+typedef struct storage_memos_record_header_t {
+  uint16_t magic;
+  uint8_t kind;
+  uint8_t reserved;
+  // of the payload
+  uint16_t length;
+  uint16_t frames;
+  uint32_t memo;
+  // of the payload
+  uint32_t crc;
+} storage_memos_record_header_t;
+
+typedef struct storage_memos_start_t {
+  uint8_t from_mac_address[STORAGE_MEMOS_MAC_LENGTH];
+  uint16_t frame_ms;
+  // the wall clock, seconds since boot until it's been set
+  int64_t recorded_s;
+} storage_memos_start_t;
+
+// A FRAMES record's payload is its frames, each a `uint16_t` length then the
+// bytes.
+#define STORAGE_MEMOS_FRAME_PREFIX_LENGTH sizeof(uint16_t)
+#define STORAGE_MEMOS_PAYLOAD_MAX_LENGTH                                       \
+  (STORAGE_MEMOS_RECORD_MAX_LENGTH - sizeof(storage_memos_record_header_t))
+
+typedef struct storage_memo_t {
+  uint32_t id;
+  uint8_t from_mac_address[STORAGE_MEMOS_MAC_LENGTH];
+  uint16_t frame_ms;
+  int64_t recorded_s;
+  uint32_t frames;
+  uint32_t bytes;
+  // where the START record is
+  uint32_t offset;
+} storage_memo_t;
+
+// Reads a memo back one frame at a time. Only the store's lock is taken, per
+// record, so a memo can be played while another is recorded.
+typedef struct storage_memos_cursor_t {
+  uint32_t memo;
+  uint8_t from_mac_address[STORAGE_MEMOS_MAC_LENGTH];
+  uint16_t frame_ms;
+  uint32_t offset;
+  // of the sector `offset` is in, so a sector rewritten since is noticed
+  uint32_t sequence;
+  uint32_t frames_left;
+  // the current record's payload
+  uint8_t payload[STORAGE_MEMOS_PAYLOAD_MAX_LENGTH];
+  int32_t payload_length;
+  int32_t payload_offset;
+} storage_memos_cursor_t;
+
+// A log-structured ring of memos in the `memos` partition. Records are only
+// ever appended, and the sector after the newest is erased to make room, so
+// the oldest memos are overwritten first and every sector is erased equally
+// often. That's all the wear levelling a ring needs.
+//
+// Writing is for one task, the recorder in `application/memos`. After a
+// reboot, writing starts at a fresh sector, so a record cut short by a
+// power loss is never appended to.
+typedef struct storage_memos_t {
+  const esp_partition_t *partition;
+  int32_t sectors;
+
+  // guards everything below, the ring is read while it's written
+  SemaphoreHandle_t mutex;
+  // the sector being written, and where in it
+  int32_t head_sector;
+  int32_t head_offset;
+  uint32_t head_sequence;
+  // erased sectors right after the head
+  int32_t erased_ahead;
+  uint32_t next_memo;
+
+  // the record being collected
+  storage_memos_record_header_t record;
+  uint8_t payload[STORAGE_MEMOS_PAYLOAD_MAX_LENGTH];
+
+  // oldest first
+  storage_memo_t index[STORAGE_MEMOS_INDEX_MAX];
+  int32_t index_count;
+
+  struct {
+    system_metric_handle_t written_bytes;
+    system_metric_handle_t refused;
+    system_metric_handle_t write_us;
+    system_metric_handle_t erase_us;
+    system_metric_handle_t memos;
+  } metrics;
+} storage_memos_t;
+
+typedef storage_memos_t *storage_memos_handle_t;
+
+// Finds the partition and rebuilds the index. `ESP_ERR_NOT_FOUND` if there's
+// no memos partition.
+esp_err_t storage_memos_init(storage_memos_handle_t *memos_handle_ptr);
+
+// Starts a memo and returns its id. Whatever was collected for the last one
+// is written first.
+esp_err_t storage_memos_begin(storage_memos_handle_t memos_handle,
+                              const uint8_t *from_mac_address,
+                              uint16_t frame_ms, uint32_t *memo_ptr);
+// Adds a frame to the record being collected, which is written when it's
+// full.
+esp_err_t storage_memos_append(storage_memos_handle_t memos_handle,
+                               uint32_t memo, const uint8_t *frame,
+                               int32_t length);
+// Writes the record being collected.
+esp_err_t storage_memos_flush(storage_memos_handle_t memos_handle);
+// Erases the next sector of the runway if it's shorter than `runway`
+// sectors. Call while idle, it stalls the flash for as long as an erase
+// takes.
+esp_err_t storage_memos_prepare(storage_memos_handle_t memos_handle,
+                                int32_t runway);
+// The runway a memo of `frames` frames of `frame_length` bytes needs.
+int32_t storage_memos_runway_for(uint32_t frames, int32_t frame_length);
+
+// Copies up to `max_memos` of the index, oldest first. Returns how many.
+int32_t storage_memos_list(storage_memos_handle_t memos_handle,
+                           storage_memo_t *memos, int32_t max_memos);
+
+// `ESP_ERR_NOT_FOUND` if the memo was overwritten or forgotten.
+esp_err_t storage_memos_get(storage_memos_handle_t memos_handle,
+                            uint32_t memo, storage_memo_t *memo_ptr);
+// `ESP_ERR_NOT_FOUND` if the memo was overwritten or forgotten.
+esp_err_t storage_memos_open(storage_memos_handle_t memos_handle,
+                             uint32_t memo, storage_memos_cursor_t *cursor);
+// Points `frame_ptr` into the cursor at the next frame. `ESP_ERR_NOT_FOUND`
+// after the last one, or where the rest was overwritten.
+esp_err_t storage_memos_next_frame(storage_memos_handle_t memos_handle,
+                                   storage_memos_cursor_t *cursor,
+                                   const uint8_t **frame_ptr,
+                                   int32_t *length_ptr);
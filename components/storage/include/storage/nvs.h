@@ -1,9 +1,32 @@
 #pragma once
 
 #include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
 
 #define NVS_DEVICE_INFO_NAMESPACE "device_info"
 #define NVS_DEVICE_INFO_NAME_KEY "name"
 
+// The group key is provisioned with the rest of the NVS, see the README.
+#define NVS_SECURITY_NAMESPACE "security"
+#define NVS_SECURITY_GROUP_KEY_KEY "group_key"
+#define NVS_SECURITY_EPOCH_KEY "epoch"
+#define NVS_SECURITY_FLOORS_KEY "floors"
+#define NVS_SECURITY_DIAGNOSTICS_TOKEN_KEY "diag_token"
+
 esp_err_t storage_nvs_init();
-esp_err_t storage_nvs_get_name(char **name_ptr);
\ No newline at end of file
+esp_err_t storage_nvs_get_name(char **name_ptr);
+
+// `length_ptr` is the size of `key`, and is set to the key's length.
+// `ESP_ERR_NOT_FOUND` when no group key was provisioned.
+esp_err_t storage_nvs_get_group_key(uint8_t *key, size_t *length_ptr);
+// `length_ptr` is the size of `token`, and is set to the token's length with
+// its terminator. `ESP_ERR_NOT_FOUND` when no token was provisioned.
+esp_err_t storage_nvs_get_diagnostics_token(char *token, size_t *length_ptr);
+// Counts boots, for nonces that must never repeat. Written straight away.
+esp_err_t storage_nvs_next_epoch(uint32_t *epoch_ptr);
+// Other stations' epochs, for `network/secure`, which owns the format.
+// `length_ptr` is the size of `floors` and is set to how much was saved,
+// `ESP_ERR_NOT_FOUND` when nothing was.
+esp_err_t storage_nvs_get_replay_floors(uint8_t *floors, size_t *length_ptr);
+esp_err_t storage_nvs_set_replay_floors(const uint8_t *floors, size_t length);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdint.h>
+
+#define NVS_SETTINGS_NAMESPACE "settings"
+
+#define STORAGE_SETTINGS_TASK_PRIORITY 1
+#define STORAGE_SETTINGS_TASK_STACK_DEPTH (1024 * 3)
+
+// writes are batched: NVS is written once no setting has changed for this
+// long.
+#define STORAGE_SETTINGS_FLUSH_DELAY_MS 2000
+
+typedef enum storage_setting_id_t {
+  STORAGE_SETTING_MULTICAST_ADDR = 0,
+  STORAGE_SETTING_MULTICAST_PORT,
+  STORAGE_SETTING_MULTICAST_TTL,
+  STORAGE_SETTING_WIFI_SSID,
+  STORAGE_SETTING_WIFI_PWD,
+  STORAGE_SETTING_HEARTBEAT_INTERVAL_MS,
+  STORAGE_SETTING_HEARTBEAT_INIT_INTERVAL_MS,
+  STORAGE_SETTING_PEERS_PRUNE_INTERVAL_MS,
+  STORAGE_SETTING_QUEUE_DEPTH_OUTGOING,
+  STORAGE_SETTING_QUEUE_DEPTH_INCOMING,
+  STORAGE_SETTING_AUDIO_FRAME_MS,
+  STORAGE_SETTING_AUDIO_BITRATE,
+  STORAGE_SETTING_JITTER_TARGET_MS,
+  STORAGE_SETTING_ZONE,
+  STORAGE_SETTING_COUNT,
+} storage_setting_id_t;
+
+typedef enum storage_setting_type_t {
+  STORAGE_SETTING_TYPE_U32 = 0,
+  STORAGE_SETTING_TYPE_STR = 1,
+} storage_setting_type_t;
+
+// All of the runtime tunables. Loaded from NVS at boot, falling back to the
+// compile time defaults for anything that was never set.
+typedef struct storage_settings_t {
+  // "255.255.255.255" + null terminator
+  char multicast_addr[16];
+  uint32_t multicast_port;
+  uint32_t multicast_ttl;
+  char wifi_ssid[33];
+  char wifi_pwd[65];
+  uint32_t heartbeat_interval_ms;
+  uint32_t heartbeat_init_interval_ms;
+  uint32_t peers_prune_interval_ms;
+  uint32_t queue_depth_outgoing;
+  uint32_t queue_depth_incoming;
+  uint32_t audio_frame_ms;
+  uint32_t audio_bitrate;
+  uint32_t jitter_target_ms;
+  // the zone's multicast group is joined at boot, 0 is none
+  uint32_t zone;
+} storage_settings_t;
+
+// Loads everything from NVS. Must be called after `storage_nvs_init` and
+// before any other `storage_settings_*` function.
+esp_err_t storage_settings_init();
+
+// Lock-free and never touches NVS, safe for hot paths.
+void storage_settings_get(storage_settings_t *settings_ptr);
+uint32_t storage_settings_get_u32(storage_setting_id_t id);
+
+// Updates the in-RAM value right away, NVS is written later in a batch.
+// Some settings (multicast, WiFi) are only picked up on the next reconnect.
+esp_err_t storage_settings_set_u32(storage_setting_id_t id, uint32_t value);
+esp_err_t storage_settings_set_str(storage_setting_id_t id, const char *value);
+
+// Looks a setting up by its NVS key, for remote configuration.
+esp_err_t storage_settings_find(const char *key, storage_setting_id_t *id_ptr,
+                                storage_setting_type_t *type_ptr);
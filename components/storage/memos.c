@@ -0,0 +1,618 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "storage/memos.h"
+#include "system/memory.h"
+
+static const char *TAG = "STORAGE:MEMOS";
+
+#define STORAGE_MEMOS_SECTOR_MAGIC 0x4f4d454d
+#define STORAGE_MEMOS_RECORD_MAGIC 0x524d
+#define STORAGE_MEMOS_ALIGN(length) (((length) + 3) & ~3)
+
+// Bitwise, records are small and written by a low priority task.
+static uint32_t storage_memos_crc32(const uint8_t *data, int32_t length) {
+  uint32_t crc = 0xffffffff;
+
+  for (int32_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int32_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t storage_memos_sector_offset(int32_t sector) {
+  return (uint32_t)sector * STORAGE_MEMOS_SECTOR_LENGTH;
+}
+
+static bool
+storage_memos_read_sector_header(storage_memos_handle_t memos, int32_t sector,
+                                 storage_memos_sector_header_t *header) {
+  if (esp_partition_read(memos->partition, storage_memos_sector_offset(sector),
+                         header, sizeof(*header)) != ESP_OK) {
+    return false;
+  }
+  return header->magic == STORAGE_MEMOS_SECTOR_MAGIC;
+}
+
+// false at the end of a sector's records
+static bool
+storage_memos_read_record_header(storage_memos_handle_t memos, uint32_t offset,
+                                 storage_memos_record_header_t *header) {
+  uint32_t in_sector = offset % STORAGE_MEMOS_SECTOR_LENGTH;
+  if (in_sector + sizeof(*header) > STORAGE_MEMOS_SECTOR_LENGTH ||
+      esp_partition_read(memos->partition, offset, header, sizeof(*header)) !=
+          ESP_OK) {
+    return false;
+  }
+  return header->magic == STORAGE_MEMOS_RECORD_MAGIC &&
+         header->length <= STORAGE_MEMOS_PAYLOAD_MAX_LENGTH &&
+         in_sector + sizeof(*header) + header->length <=
+             STORAGE_MEMOS_SECTOR_LENGTH;
+}
+
+// // ----------------
+// // Index
+// // ----------------
+
+static storage_memo_t *storage_memos_find_locked(storage_memos_handle_t memos,
+                                                 uint32_t memo) {
+  for (int32_t i = 0; i < memos->index_count; i++) {
+    if (memos->index[i].id == memo) {
+      return &memos->index[i];
+    }
+  }
+  return NULL;
+}
+
+static void storage_memos_index_add_locked(storage_memos_handle_t memos,
+                                           uint32_t memo, uint32_t offset,
+                                           const storage_memos_start_t *start) {
+  if (memos->index_count == STORAGE_MEMOS_INDEX_MAX) {
+    // still on flash, just not listed any more
+    memmove(&memos->index[0], &memos->index[1],
+            (STORAGE_MEMOS_INDEX_MAX - 1) * sizeof(storage_memo_t));
+    memos->index_count--;
+  }
+
+  storage_memo_t *entry = &memos->index[memos->index_count++];
+  memset(entry, 0, sizeof(storage_memo_t));
+  entry->id = memo;
+  memcpy(entry->from_mac_address, start->from_mac_address,
+         STORAGE_MEMOS_MAC_LENGTH);
+  entry->frame_ms = start->frame_ms;
+  entry->recorded_s = start->recorded_s;
+  entry->offset = offset;
+  system_metrics_set(memos->metrics.memos, memos->index_count);
+}
+
+// the memos that start in a sector go with it
+static void storage_memos_index_drop_locked(storage_memos_handle_t memos,
+                                            int32_t sector) {
+  int32_t kept = 0;
+
+  for (int32_t i = 0; i < memos->index_count; i++) {
+    if (memos->index[i].offset / STORAGE_MEMOS_SECTOR_LENGTH ==
+        (uint32_t)sector) {
+      continue;
+    }
+    memos->index[kept++] = memos->index[i];
+  }
+  memos->index_count = kept;
+  system_metrics_set(memos->metrics.memos, memos->index_count);
+}
+
+// // ----------------
+// // Writing
+// // ----------------
+
+static esp_err_t storage_memos_erase_locked(storage_memos_handle_t memos,
+                                            int32_t sector) {
+  storage_memos_index_drop_locked(memos, sector);
+
+  int64_t start_us = esp_timer_get_time();
+  ESP_RETURN_ON_ERROR(esp_partition_erase_range(
+                          memos->partition,
+                          storage_memos_sector_offset(sector),
+                          STORAGE_MEMOS_SECTOR_LENGTH),
+                      TAG, "Failed to erase sector %" PRId32, sector);
+  system_metrics_observe(memos->metrics.erase_us,
+                         (uint32_t)(esp_timer_get_time() - start_us));
+  return ESP_OK;
+}
+
+static esp_err_t storage_memos_write_locked(storage_memos_handle_t memos,
+                                            uint32_t offset,
+                                            const uint8_t *data,
+                                            int32_t length) {
+  for (int32_t written = 0; written < length;
+       written += STORAGE_MEMOS_WRITE_LENGTH) {
+    int32_t chunk = length - written < STORAGE_MEMOS_WRITE_LENGTH
+                        ? length - written
+                        : STORAGE_MEMOS_WRITE_LENGTH;
+
+    int64_t start_us = esp_timer_get_time();
+    ESP_RETURN_ON_ERROR(esp_partition_write(memos->partition, offset + written,
+                                            data + written, chunk),
+                        TAG, "Failed to write at 0x%" PRIx32,
+                        offset + written);
+    system_metrics_observe(memos->metrics.write_us,
+                           (uint32_t)(esp_timer_get_time() - start_us));
+  }
+
+  system_metrics_add(memos->metrics.written_bytes, length);
+  return ESP_OK;
+}
+
+// Moves the head to the next sector of the runway. Without one, only
+// `erase` makes room, `ESP_ERR_NO_MEM` otherwise.
+static esp_err_t storage_memos_advance_locked(storage_memos_handle_t memos,
+                                              bool erase) {
+  int32_t sector = (memos->head_sector + 1) % memos->sectors;
+
+  if (memos->erased_ahead > 0) {
+    memos->erased_ahead--;
+  } else if (erase) {
+    ESP_RETURN_ON_ERROR(storage_memos_erase_locked(memos, sector), TAG,
+                        "Failed to make room");
+  } else {
+    system_metrics_add(memos->metrics.refused, 1);
+    return ESP_ERR_NO_MEM;
+  }
+
+  storage_memos_sector_header_t header = {
+      .magic = STORAGE_MEMOS_SECTOR_MAGIC,
+      .sequence = memos->head_sequence + 1,
+  };
+  ESP_RETURN_ON_ERROR(
+      storage_memos_write_locked(memos, storage_memos_sector_offset(sector),
+                                 (const uint8_t *)&header, sizeof(header)),
+      TAG, "Failed to start sector %" PRId32, sector);
+
+  memos->head_sector = sector;
+  memos->head_sequence = header.sequence;
+  memos->head_offset = sizeof(storage_memos_sector_header_t);
+  return ESP_OK;
+}
+
+// Appends a record at the head and returns where it went. The header goes
+// last, so a record cut short never looks whole.
+static esp_err_t
+storage_memos_write_record_locked(storage_memos_handle_t memos,
+                                  storage_memos_record_header_t *header,
+                                  const uint8_t *payload,
+                                  uint32_t *offset_ptr) {
+  int32_t length = sizeof(storage_memos_record_header_t) + header->length;
+  if (memos->head_offset + length > STORAGE_MEMOS_SECTOR_LENGTH) {
+    esp_err_t ret = storage_memos_advance_locked(memos, false);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+
+  uint32_t offset =
+      storage_memos_sector_offset(memos->head_sector) + memos->head_offset;
+  header->magic = STORAGE_MEMOS_RECORD_MAGIC;
+  header->crc = storage_memos_crc32(payload, header->length);
+
+  ESP_RETURN_ON_ERROR(
+      storage_memos_write_locked(memos, offset + sizeof(*header), payload,
+                                 header->length),
+      TAG, "Failed to write record");
+  ESP_RETURN_ON_ERROR(storage_memos_write_locked(memos, offset,
+                                                 (const uint8_t *)header,
+                                                 sizeof(*header)),
+                      TAG, "Failed to write record header");
+
+  memos->head_offset += STORAGE_MEMOS_ALIGN(length);
+  if (offset_ptr != NULL) {
+    *offset_ptr = offset;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t storage_memos_flush_locked(storage_memos_handle_t memos) {
+  if (memos->record.frames == 0) {
+    return ESP_OK;
+  }
+
+  esp_err_t ret =
+      storage_memos_write_record_locked(memos, &memos->record, memos->payload,
+                                        NULL);
+  if (ret == ESP_OK) {
+    storage_memo_t *entry =
+        storage_memos_find_locked(memos, memos->record.memo);
+    if (entry != NULL) {
+      entry->frames += memos->record.frames;
+      entry->bytes += memos->record.length -
+                      memos->record.frames * STORAGE_MEMOS_FRAME_PREFIX_LENGTH;
+    }
+  }
+
+  // on failure the frames are lost, rather than retried forever
+  memos->record.frames = 0;
+  memos->record.length = 0;
+  return ret;
+}
+
+esp_err_t storage_memos_begin(storage_memos_handle_t memos_handle,
+                              const uint8_t *from_mac_address,
+                              uint16_t frame_ms, uint32_t *memo_ptr) {
+  esp_err_t ret = ESP_OK;
+  storage_memos_start_t start = {
+      .frame_ms = frame_ms,
+      .recorded_s = (int64_t)time(NULL),
+  };
+  memcpy(start.from_mac_address, from_mac_address, STORAGE_MEMOS_MAC_LENGTH);
+
+  xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+  storage_memos_flush_locked(memos_handle);
+
+  uint32_t memo = memos_handle->next_memo++;
+  storage_memos_record_header_t header = {
+      .kind = STORAGE_MEMOS_RECORD_START,
+      .length = sizeof(start),
+      .memo = memo,
+  };
+  uint32_t offset = 0;
+  ret = storage_memos_write_record_locked(memos_handle, &header,
+                                          (const uint8_t *)&start, &offset);
+  if (ret == ESP_OK) {
+    storage_memos_index_add_locked(memos_handle, memo, offset, &start);
+    memos_handle->record.kind = STORAGE_MEMOS_RECORD_FRAMES;
+    memos_handle->record.memo = memo;
+    *memo_ptr = memo;
+  }
+  xSemaphoreGive(memos_handle->mutex);
+
+  return ret;
+}
+
+esp_err_t storage_memos_append(storage_memos_handle_t memos_handle,
+                               uint32_t memo, const uint8_t *frame,
+                               int32_t length) {
+  esp_err_t ret = ESP_OK;
+  int32_t needed = STORAGE_MEMOS_FRAME_PREFIX_LENGTH + length;
+  if (length <= 0 || needed > STORAGE_MEMOS_PAYLOAD_MAX_LENGTH) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+  storage_memos_record_header_t *record = &memos_handle->record;
+  if (record->memo != memo || record->kind != STORAGE_MEMOS_RECORD_FRAMES ||
+      record->length + needed > STORAGE_MEMOS_PAYLOAD_MAX_LENGTH) {
+    ret = storage_memos_flush_locked(memos_handle);
+    record->kind = STORAGE_MEMOS_RECORD_FRAMES;
+    record->memo = memo;
+  }
+
+  uint16_t prefix = (uint16_t)length;
+  memcpy(memos_handle->payload + record->length, &prefix, sizeof(prefix));
+  memcpy(memos_handle->payload + record->length + sizeof(prefix), frame,
+         length);
+  record->length += needed;
+  record->frames++;
+  xSemaphoreGive(memos_handle->mutex);
+
+  return ret;
+}
+
+esp_err_t storage_memos_flush(storage_memos_handle_t memos_handle) {
+  xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+  esp_err_t ret = storage_memos_flush_locked(memos_handle);
+  xSemaphoreGive(memos_handle->mutex);
+  return ret;
+}
+
+esp_err_t storage_memos_prepare(storage_memos_handle_t memos_handle,
+                                int32_t runway) {
+  esp_err_t ret = ESP_OK;
+  int32_t runway_max =
+      memos_handle->sectors * STORAGE_MEMOS_RUNWAY_MAX_PERCENT / 100;
+  if (runway > runway_max) {
+    runway = runway_max;
+  }
+
+  xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+  // the head's own sector can't be erased, however small the ring
+  if (memos_handle->erased_ahead < runway &&
+      memos_handle->erased_ahead < memos_handle->sectors - 1) {
+    int32_t sector = (memos_handle->head_sector + 1 +
+                      memos_handle->erased_ahead) %
+                     memos_handle->sectors;
+    ret = storage_memos_erase_locked(memos_handle, sector);
+    if (ret == ESP_OK) {
+      memos_handle->erased_ahead++;
+    }
+  }
+  xSemaphoreGive(memos_handle->mutex);
+
+  return ret;
+}
+
+int32_t storage_memos_runway_for(uint32_t frames, int32_t frame_length) {
+  int32_t needed = STORAGE_MEMOS_FRAME_PREFIX_LENGTH + frame_length;
+  if (frame_length <= 0 || needed > STORAGE_MEMOS_PAYLOAD_MAX_LENGTH) {
+    return 0;
+  }
+
+  // records hold whole frames, two records to a sector
+  uint32_t per_record = STORAGE_MEMOS_PAYLOAD_MAX_LENGTH / needed;
+  uint32_t records = (frames + per_record - 1) / per_record;
+  // and the START record may not fit in the head's sector
+  return (int32_t)((records + 1) / 2 + 1);
+}
+
+// // ----------------
+// // Reading
+// // ----------------
+
+int32_t storage_memos_list(storage_memos_handle_t memos_handle,
+                           storage_memo_t *memos, int32_t max_memos) {
+  xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+  int32_t count = memos_handle->index_count < max_memos
+                      ? memos_handle->index_count
+                      : max_memos;
+  memcpy(memos, memos_handle->index, count * sizeof(storage_memo_t));
+  xSemaphoreGive(memos_handle->mutex);
+
+  return count;
+}
+
+esp_err_t storage_memos_get(storage_memos_handle_t memos_handle,
+                            uint32_t memo, storage_memo_t *memo_ptr) {
+  xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+  storage_memo_t *entry = storage_memos_find_locked(memos_handle, memo);
+  if (entry != NULL) {
+    *memo_ptr = *entry;
+  }
+  xSemaphoreGive(memos_handle->mutex);
+
+  return entry != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t storage_memos_open(storage_memos_handle_t memos_handle,
+                             uint32_t memo, storage_memos_cursor_t *cursor) {
+  esp_err_t ret = ESP_OK;
+  storage_memos_sector_header_t sector_header;
+
+  xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+  storage_memo_t *entry = storage_memos_find_locked(memos_handle, memo);
+  if (entry == NULL ||
+      !storage_memos_read_sector_header(
+          memos_handle, entry->offset / STORAGE_MEMOS_SECTOR_LENGTH,
+          &sector_header)) {
+    ret = ESP_ERR_NOT_FOUND;
+  } else {
+    cursor->memo = memo;
+    memcpy(cursor->from_mac_address, entry->from_mac_address,
+           STORAGE_MEMOS_MAC_LENGTH);
+    cursor->frame_ms = entry->frame_ms;
+    // the START record is always exactly this long
+    cursor->offset = entry->offset +
+                     STORAGE_MEMOS_ALIGN(sizeof(storage_memos_record_header_t) +
+                                         sizeof(storage_memos_start_t));
+    cursor->sequence = sector_header.sequence;
+    cursor->frames_left = entry->frames;
+    cursor->payload_length = 0;
+    cursor->payload_offset = 0;
+  }
+  xSemaphoreGive(memos_handle->mutex);
+
+  return ret;
+}
+
+// Reads the memo's next FRAMES record into the cursor, following the ring
+// into newer sectors. False at the head, or where the rest was overwritten.
+static bool storage_memos_load_locked(storage_memos_handle_t memos,
+                                      storage_memos_cursor_t *cursor) {
+  storage_memos_record_header_t header;
+  storage_memos_sector_header_t sector_header;
+  uint32_t head =
+      storage_memos_sector_offset(memos->head_sector) + memos->head_offset;
+
+  for (int32_t sectors = 0; sectors < memos->sectors;) {
+    if (cursor->offset == head) {
+      return false;
+    }
+
+    if (!storage_memos_read_record_header(memos, cursor->offset, &header)) {
+      int32_t sector =
+          (cursor->offset / STORAGE_MEMOS_SECTOR_LENGTH + 1) % memos->sectors;
+      // only ever forwards, an older sector means the ring moved on
+      if (!storage_memos_read_sector_header(memos, sector, &sector_header) ||
+          sector_header.sequence != cursor->sequence + 1) {
+        return false;
+      }
+      cursor->offset = storage_memos_sector_offset(sector) +
+                       sizeof(storage_memos_sector_header_t);
+      cursor->sequence = sector_header.sequence;
+      sectors++;
+      continue;
+    }
+
+    uint32_t offset = cursor->offset;
+    cursor->offset += STORAGE_MEMOS_ALIGN(sizeof(header) + header.length);
+    if (header.kind != STORAGE_MEMOS_RECORD_FRAMES ||
+        header.memo != cursor->memo) {
+      continue;
+    }
+
+    if (esp_partition_read(memos->partition, offset + sizeof(header),
+                           cursor->payload, header.length) != ESP_OK ||
+        storage_memos_crc32(cursor->payload, header.length) != header.crc) {
+      ESP_LOGW(TAG, "Memo %" PRIu32 " is corrupt at 0x%" PRIx32,
+               cursor->memo, offset);
+      return false;
+    }
+    cursor->payload_length = header.length;
+    cursor->payload_offset = 0;
+    cursor->frames_left = header.frames < cursor->frames_left
+                              ? cursor->frames_left - header.frames
+                              : 0;
+    return true;
+  }
+
+  return false;
+}
+
+esp_err_t storage_memos_next_frame(storage_memos_handle_t memos_handle,
+                                   storage_memos_cursor_t *cursor,
+                                   const uint8_t **frame_ptr,
+                                   int32_t *length_ptr) {
+  if (cursor->payload_offset >= cursor->payload_length) {
+    if (cursor->frames_left == 0) {
+      return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(memos_handle->mutex, portMAX_DELAY);
+    bool loaded = storage_memos_load_locked(memos_handle, cursor);
+    xSemaphoreGive(memos_handle->mutex);
+    if (!loaded) {
+      return ESP_ERR_NOT_FOUND;
+    }
+  }
+
+  uint16_t length = 0;
+  memcpy(&length, cursor->payload + cursor->payload_offset, sizeof(length));
+  int32_t start = cursor->payload_offset + sizeof(length);
+  if (start + length > cursor->payload_length) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  *frame_ptr = cursor->payload + start;
+  *length_ptr = length;
+  cursor->payload_offset = start + length;
+  return ESP_OK;
+}
+
+// // ----------------
+// // Init
+// // ----------------
+
+// Walks a sector's records, adding its memos to the index. Frames aren't
+// checked until they're played.
+static void storage_memos_scan_sector(storage_memos_handle_t memos,
+                                      int32_t sector) {
+  storage_memos_record_header_t header;
+  storage_memos_start_t start;
+  uint32_t offset = storage_memos_sector_offset(sector) +
+                    sizeof(storage_memos_sector_header_t);
+
+  while (storage_memos_read_record_header(memos, offset, &header)) {
+    if (header.memo >= memos->next_memo) {
+      memos->next_memo = header.memo + 1;
+    }
+
+    if (header.kind == STORAGE_MEMOS_RECORD_START &&
+        header.length == sizeof(start) &&
+        esp_partition_read(memos->partition, offset + sizeof(header), &start,
+                           sizeof(start)) == ESP_OK &&
+        storage_memos_crc32((const uint8_t *)&start, sizeof(start)) ==
+            header.crc) {
+      storage_memos_index_add_locked(memos, header.memo, offset, &start);
+    } else if (header.kind == STORAGE_MEMOS_RECORD_FRAMES) {
+      storage_memo_t *entry = storage_memos_find_locked(memos, header.memo);
+      if (entry != NULL) {
+        entry->frames += header.frames;
+        entry->bytes +=
+            header.length - header.frames * STORAGE_MEMOS_FRAME_PREFIX_LENGTH;
+      }
+    }
+
+    offset += STORAGE_MEMOS_ALIGN(sizeof(header) + header.length);
+  }
+}
+
+static esp_err_t storage_memos_metrics_init(storage_memos_handle_t memos) {
+  system_metric_config_t configs[] = {
+      {"memos_written_bytes_total", "Bytes written to the memos partition",
+       SYSTEM_METRIC_COUNTER},
+      {"memos_refused_total",
+       "Records refused while recording, the erased runway had run out",
+       SYSTEM_METRIC_COUNTER},
+      {"memos_write_us", "Programming one page of the memos partition",
+       SYSTEM_METRIC_HISTOGRAM},
+      {"memos_erase_us", "Erasing one sector of the memos partition",
+       SYSTEM_METRIC_HISTOGRAM},
+      {"memos", "Memos that can be played", SYSTEM_METRIC_GAUGE},
+  };
+  system_metric_handle_t *handles[] = {
+      &memos->metrics.written_bytes, &memos->metrics.refused,
+      &memos->metrics.write_us,      &memos->metrics.erase_us,
+      &memos->metrics.memos,
+  };
+
+  for (int32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    ESP_RETURN_ON_ERROR(system_metrics_register(handles[i], &configs[i]), TAG,
+                        "Failed to register '%s'", configs[i].name);
+  }
+  return ESP_OK;
+}
+
+esp_err_t storage_memos_init(storage_memos_handle_t *memos_handle_ptr) {
+  const esp_partition_t *partition = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+      STORAGE_MEMOS_PARTITION_LABEL);
+  if (partition == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  ESP_RETURN_ON_FALSE(partition->erase_size == STORAGE_MEMOS_SECTOR_LENGTH &&
+                          partition->size >= 2 * STORAGE_MEMOS_SECTOR_LENGTH,
+                      ESP_ERR_INVALID_SIZE, TAG,
+                      "Memos partition must be at least two %d byte sectors",
+                      STORAGE_MEMOS_SECTOR_LENGTH);
+
+  // the record is written straight from here
+  storage_memos_handle_t memos_handle = (storage_memos_handle_t)
+      system_memory_calloc(1, sizeof(storage_memos_t), SYSTEM_MEMORY_FAST);
+  ESP_RETURN_ON_FALSE(memos_handle != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to allocate memos");
+
+  memos_handle->partition = partition;
+  memos_handle->sectors = partition->size / STORAGE_MEMOS_SECTOR_LENGTH;
+  memos_handle->next_memo = 1;
+  memos_handle->mutex = xSemaphoreCreateMutex();
+  ESP_RETURN_ON_FALSE(memos_handle->mutex != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to create memos mutex");
+  ESP_RETURN_ON_ERROR(storage_memos_metrics_init(memos_handle), TAG,
+                      "Failed to register metrics");
+
+  // the newest sector, everything after it is older
+  storage_memos_sector_header_t header;
+  int32_t newest = -1;
+  for (int32_t i = 0; i < memos_handle->sectors; i++) {
+    if (storage_memos_read_sector_header(memos_handle, i, &header) &&
+        (newest < 0 || header.sequence > memos_handle->head_sequence)) {
+      newest = i;
+      memos_handle->head_sequence = header.sequence;
+    }
+  }
+
+  if (newest >= 0) {
+    for (int32_t i = 1; i <= memos_handle->sectors; i++) {
+      int32_t sector = (newest + i) % memos_handle->sectors;
+      if (storage_memos_read_sector_header(memos_handle, sector, &header)) {
+        storage_memos_scan_sector(memos_handle, sector);
+      }
+    }
+  }
+
+  // always a fresh sector, a record cut short is never appended to
+  memos_handle->head_sector = newest >= 0 ? newest : memos_handle->sectors - 1;
+  ESP_RETURN_ON_ERROR(storage_memos_advance_locked(memos_handle, true), TAG,
+                      "Failed to open the memos partition");
+
+  ESP_LOGI(TAG, "%" PRId32 " memos in %" PRId32 " sectors",
+           memos_handle->index_count,
+           memos_handle->sectors);
+  *memos_handle_ptr = memos_handle;
+
+  return ESP_OK;
+}
@@ -55,4 +55,130 @@ storage_nvs_get_name_cleanup:
   }
 
   return ret;
-}
\ No newline at end of file
+}
+
+esp_err_t storage_nvs_get_group_key(uint8_t *key, size_t *length_ptr) {
+  nvs_handle_t nvs_handle = 0;
+
+  // not provisioned is the usual case, so it isn't logged
+  esp_err_t ret = nvs_open_from_partition("nvs", NVS_SECURITY_NAMESPACE,
+                                          NVS_READONLY, &nvs_handle);
+  if (ret == ESP_OK) {
+    ret = nvs_get_blob(nvs_handle, NVS_SECURITY_GROUP_KEY_KEY, key,
+                       length_ptr);
+    nvs_close(nvs_handle);
+  }
+
+  if (ret == ESP_ERR_NVS_NOT_FOUND) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) getting group key!", esp_err_to_name(ret));
+  }
+  return ret;
+}
+
+esp_err_t storage_nvs_get_diagnostics_token(char *token, size_t *length_ptr) {
+  nvs_handle_t nvs_handle = 0;
+
+  // not provisioned is the usual case, so it isn't logged
+  esp_err_t ret = nvs_open_from_partition("nvs", NVS_SECURITY_NAMESPACE,
+                                          NVS_READONLY, &nvs_handle);
+  if (ret == ESP_OK) {
+    ret = nvs_get_str(nvs_handle, NVS_SECURITY_DIAGNOSTICS_TOKEN_KEY, token,
+                      length_ptr);
+    nvs_close(nvs_handle);
+  }
+
+  if (ret == ESP_ERR_NVS_NOT_FOUND) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) getting diagnostics token!",
+             esp_err_to_name(ret));
+  }
+  return ret;
+}
+
+esp_err_t storage_nvs_next_epoch(uint32_t *epoch_ptr) {
+  esp_err_t ret = ESP_OK;
+  nvs_handle_t nvs_handle = 0;
+  uint32_t epoch = 0;
+
+  ret = nvs_open_from_partition("nvs", NVS_SECURITY_NAMESPACE, NVS_READWRITE,
+                                &nvs_handle);
+  ESP_GOTO_ON_FALSE(ret == ESP_OK, ret, storage_nvs_next_epoch_cleanup, TAG,
+                    "Error (%s) opening NVS handle!", esp_err_to_name(ret));
+
+  ret = nvs_get_u32(nvs_handle, NVS_SECURITY_EPOCH_KEY, &epoch);
+  ESP_GOTO_ON_FALSE(ret == ESP_OK || ret == ESP_ERR_NVS_NOT_FOUND, ret,
+                    storage_nvs_next_epoch_cleanup, TAG,
+                    "Error (%s) getting epoch!", esp_err_to_name(ret));
+  ESP_GOTO_ON_FALSE(epoch < UINT32_MAX, ESP_ERR_INVALID_STATE,
+                    storage_nvs_next_epoch_cleanup, TAG,
+                    "Epochs used up, provision a new group key");
+  epoch++;
+
+  // committed before it's used, a crash must not reuse it
+  ret = nvs_set_u32(nvs_handle, NVS_SECURITY_EPOCH_KEY, epoch);
+  if (ret == ESP_OK) {
+    ret = nvs_commit(nvs_handle);
+  }
+  ESP_GOTO_ON_FALSE(ret == ESP_OK, ret, storage_nvs_next_epoch_cleanup, TAG,
+                    "Error (%s) saving epoch!", esp_err_to_name(ret));
+
+  *epoch_ptr = epoch;
+
+storage_nvs_next_epoch_cleanup:
+  if (nvs_handle != 0) {
+    nvs_close(nvs_handle);
+  }
+
+  return ret;
+}
+
+esp_err_t storage_nvs_get_replay_floors(uint8_t *floors, size_t *length_ptr) {
+  nvs_handle_t nvs_handle = 0;
+
+  esp_err_t ret = nvs_open_from_partition("nvs", NVS_SECURITY_NAMESPACE,
+                                          NVS_READONLY, &nvs_handle);
+  if (ret == ESP_OK) {
+    ret = nvs_get_blob(nvs_handle, NVS_SECURITY_FLOORS_KEY, floors,
+                       length_ptr);
+    nvs_close(nvs_handle);
+  }
+
+  if (ret == ESP_ERR_NVS_NOT_FOUND) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) getting replay floors!", esp_err_to_name(ret));
+  }
+  return ret;
+}
+
+esp_err_t storage_nvs_set_replay_floors(const uint8_t *floors, size_t length) {
+  esp_err_t ret = ESP_OK;
+  nvs_handle_t nvs_handle = 0;
+
+  ret = nvs_open_from_partition("nvs", NVS_SECURITY_NAMESPACE, NVS_READWRITE,
+                                &nvs_handle);
+  ESP_GOTO_ON_FALSE(ret == ESP_OK, ret, storage_nvs_set_replay_floors_cleanup,
+                    TAG, "Error (%s) opening NVS handle!",
+                    esp_err_to_name(ret));
+
+  ret = nvs_set_blob(nvs_handle, NVS_SECURITY_FLOORS_KEY, floors, length);
+  if (ret == ESP_OK) {
+    ret = nvs_commit(nvs_handle);
+  }
+  ESP_GOTO_ON_FALSE(ret == ESP_OK, ret, storage_nvs_set_replay_floors_cleanup,
+                    TAG, "Error (%s) saving replay floors!",
+                    esp_err_to_name(ret));
+
+storage_nvs_set_replay_floors_cleanup:
+  if (nvs_handle != 0) {
+    nvs_close(nvs_handle);
+  }
+
+  return ret;
+}
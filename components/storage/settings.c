@@ -0,0 +1,342 @@
+#include "esp_check.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "storage/settings.h"
+
+static const char *TAG = "STORAGE:SETTINGS";
+
+typedef struct storage_setting_desc_t {
+  // NVS keys are limited to 15 characters
+  const char *key;
+  storage_setting_type_t type;
+  size_t offset;
+  // for strings, this includes the null terminator
+  size_t size;
+  uint32_t min;
+  uint32_t max;
+  uint32_t default_u32;
+  const char *default_str;
+} storage_setting_desc_t;
+
+#define SETTING_U32(field, nvs_key, min_value, max_value, default_value)       \
+  {                                                                            \
+      .key = nvs_key,                                                          \
+      .type = STORAGE_SETTING_TYPE_U32,                                        \
+      .offset = offsetof(storage_settings_t, field),                           \
+      .size = sizeof(uint32_t),                                                \
+      .min = min_value,                                                        \
+      .max = max_value,                                                        \
+      .default_u32 = default_value,                                            \
+  }
+
+#define SETTING_STR(field, nvs_key, default_value)                             \
+  {                                                                            \
+      .key = nvs_key,                                                          \
+      .type = STORAGE_SETTING_TYPE_STR,                                        \
+      .offset = offsetof(storage_settings_t, field),                           \
+      .size = sizeof(((storage_settings_t *)0)->field),                        \
+      .default_str = default_value,                                            \
+  }
+
+static const storage_setting_desc_t SETTINGS[STORAGE_SETTING_COUNT] = {
+    [STORAGE_SETTING_MULTICAST_ADDR] =
+        SETTING_STR(multicast_addr, "mc_addr", CONFIG_MULTICAST_ADDR),
+    [STORAGE_SETTING_MULTICAST_PORT] =
+        SETTING_U32(multicast_port, "mc_port", 1, 65535, CONFIG_MULTICAST_PORT),
+    [STORAGE_SETTING_MULTICAST_TTL] =
+        SETTING_U32(multicast_ttl, "mc_ttl", 1, 255, CONFIG_MULTICAST_TTL),
+    [STORAGE_SETTING_WIFI_SSID] =
+        SETTING_STR(wifi_ssid, "wifi_ssid", CONFIG_WIFI_SSID),
+    [STORAGE_SETTING_WIFI_PWD] =
+        SETTING_STR(wifi_pwd, "wifi_pwd", CONFIG_WIFI_PWD),
+    [STORAGE_SETTING_HEARTBEAT_INTERVAL_MS] =
+        SETTING_U32(heartbeat_interval_ms, "hb_int_ms", 1000, 600000, 10000),
+    [STORAGE_SETTING_HEARTBEAT_INIT_INTERVAL_MS] = SETTING_U32(
+        heartbeat_init_interval_ms, "hb_init_ms", 100, 600000, 1000),
+    [STORAGE_SETTING_PEERS_PRUNE_INTERVAL_MS] =
+        SETTING_U32(peers_prune_interval_ms, "prune_ms", 2000, 3600000, 60000),
+    [STORAGE_SETTING_QUEUE_DEPTH_OUTGOING] =
+        SETTING_U32(queue_depth_outgoing, "q_out", 1, 256, 10),
+    [STORAGE_SETTING_QUEUE_DEPTH_INCOMING] =
+        SETTING_U32(queue_depth_incoming, "q_in", 1, 256, 10),
+    [STORAGE_SETTING_AUDIO_FRAME_MS] =
+        SETTING_U32(audio_frame_ms, "frame_ms", 5, 60, 20),
+    [STORAGE_SETTING_AUDIO_BITRATE] =
+        SETTING_U32(audio_bitrate, "bitrate", 6000, 256000, 24000),
+    [STORAGE_SETTING_JITTER_TARGET_MS] =
+        SETTING_U32(jitter_target_ms, "jitter_ms", 0, 1000, 60),
+    // up to `PROTOCOL_GROUP_ZONES`
+    [STORAGE_SETTING_ZONE] = SETTING_U32(zone, "zone", 0, 15, 0),
+};
+
+// Readers never block: `sequence` is odd while a write is in progress, and
+// readers retry if it changed while they were copying. The write runs in a
+// critical section, so a reader can't preempt it and spin on an odd
+// `sequence` forever. Readers on the other core spin for one short copy.
+static storage_settings_t settings;
+static atomic_uint_fast32_t sequence = 0;
+static portMUX_TYPE sequence_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// serializes writers and guards `dirty`
+static SemaphoreHandle_t write_mutex = NULL;
+static uint32_t dirty = 0;
+static TaskHandle_t flush_task = NULL;
+
+static void storage_settings_write_begin() {
+  xSemaphoreTake(write_mutex, portMAX_DELAY);
+  taskENTER_CRITICAL(&sequence_mux);
+  atomic_fetch_add_explicit(&sequence, 1, memory_order_acq_rel);
+}
+
+static void storage_settings_write_end(storage_setting_id_t id) {
+  atomic_fetch_add_explicit(&sequence, 1, memory_order_acq_rel);
+  taskEXIT_CRITICAL(&sequence_mux);
+  dirty |= (1 << id);
+  xSemaphoreGive(write_mutex);
+
+  xTaskNotifyGive(flush_task);
+}
+
+void storage_settings_get(storage_settings_t *settings_ptr) {
+  uint_fast32_t before;
+  uint_fast32_t after;
+
+  do {
+    before = atomic_load_explicit(&sequence, memory_order_acquire);
+    memcpy(settings_ptr, &settings, sizeof(storage_settings_t));
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&sequence, memory_order_relaxed);
+  } while ((before & 1) != 0 || before != after);
+}
+
+uint32_t storage_settings_get_u32(storage_setting_id_t id) {
+  if (id >= STORAGE_SETTING_COUNT ||
+      SETTINGS[id].type != STORAGE_SETTING_TYPE_U32) {
+    ESP_LOGE(TAG, "Setting %d is not a u32", id);
+    return 0;
+  }
+
+  uint_fast32_t before;
+  uint32_t value;
+
+  do {
+    before = atomic_load_explicit(&sequence, memory_order_acquire);
+    value = *(uint32_t *)((uint8_t *)&settings + SETTINGS[id].offset);
+    atomic_thread_fence(memory_order_acquire);
+  } while ((before & 1) != 0 ||
+           before != atomic_load_explicit(&sequence, memory_order_relaxed));
+
+  return value;
+}
+
+esp_err_t storage_settings_set_u32(storage_setting_id_t id, uint32_t value) {
+  if (id >= STORAGE_SETTING_COUNT ||
+      SETTINGS[id].type != STORAGE_SETTING_TYPE_U32) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (value < SETTINGS[id].min || value > SETTINGS[id].max) {
+    ESP_LOGE(TAG,
+             "Value %" PRIu32 " for '%s' out of range [%" PRIu32 ", %" PRIu32
+             "]",
+             value, SETTINGS[id].key, SETTINGS[id].min, SETTINGS[id].max);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  storage_settings_write_begin();
+  *(uint32_t *)((uint8_t *)&settings + SETTINGS[id].offset) = value;
+  storage_settings_write_end(id);
+
+  return ESP_OK;
+}
+
+esp_err_t storage_settings_set_str(storage_setting_id_t id, const char *value) {
+  if (id >= STORAGE_SETTING_COUNT ||
+      SETTINGS[id].type != STORAGE_SETTING_TYPE_STR || value == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (strlen(value) + 1 > SETTINGS[id].size) {
+    ESP_LOGE(TAG, "Value for '%s' too long", SETTINGS[id].key);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  storage_settings_write_begin();
+  strcpy((char *)&settings + SETTINGS[id].offset, value);
+  storage_settings_write_end(id);
+
+  return ESP_OK;
+}
+
+esp_err_t storage_settings_find(const char *key, storage_setting_id_t *id_ptr,
+                                storage_setting_type_t *type_ptr) {
+  for (int32_t i = 0; i < STORAGE_SETTING_COUNT; i++) {
+    if (strcmp(SETTINGS[i].key, key) == 0) {
+      *id_ptr = (storage_setting_id_t)i;
+      *type_ptr = SETTINGS[i].type;
+      return ESP_OK;
+    }
+  }
+
+  return ESP_ERR_NOT_FOUND;
+}
+
+static esp_err_t storage_settings_flush() {
+  esp_err_t ret = ESP_OK;
+  nvs_handle_t nvs_handle = 0;
+  storage_settings_t snapshot;
+  uint32_t to_write;
+
+  // take the dirty set and a consistent copy together, so a write racing the
+  // flush is either in this batch or marked dirty for the next one.
+  xSemaphoreTake(write_mutex, portMAX_DELAY);
+  to_write = dirty;
+  dirty = 0;
+  memcpy(&snapshot, &settings, sizeof(storage_settings_t));
+  xSemaphoreGive(write_mutex);
+
+  if (to_write == 0) {
+    return ESP_OK;
+  }
+
+  ESP_GOTO_ON_ERROR(nvs_open_from_partition("nvs", NVS_SETTINGS_NAMESPACE,
+                                            NVS_READWRITE, &nvs_handle),
+                    storage_settings_flush_end, TAG,
+                    "Error opening NVS handle");
+
+  for (int32_t i = 0; i < STORAGE_SETTING_COUNT; i++) {
+    if (!(to_write & (1 << i))) {
+      continue;
+    }
+
+    void *field = (uint8_t *)&snapshot + SETTINGS[i].offset;
+    if (SETTINGS[i].type == STORAGE_SETTING_TYPE_U32) {
+      ret = nvs_set_u32(nvs_handle, SETTINGS[i].key, *(uint32_t *)field);
+    } else {
+      ret = nvs_set_str(nvs_handle, SETTINGS[i].key, (char *)field);
+    }
+    ESP_GOTO_ON_ERROR(ret, storage_settings_flush_end, TAG,
+                      "Error (%s) writing '%s'", esp_err_to_name(ret),
+                      SETTINGS[i].key);
+  }
+
+  // one commit for the whole batch
+  ESP_GOTO_ON_ERROR(nvs_commit(nvs_handle), storage_settings_flush_end, TAG,
+                    "Error committing settings");
+
+  ESP_LOGI(TAG, "Saved settings");
+
+storage_settings_flush_end:
+  if (nvs_handle != 0) {
+    nvs_close(nvs_handle);
+  }
+  if (ret != ESP_OK) {
+    // try again on the next batch
+    xSemaphoreTake(write_mutex, portMAX_DELAY);
+    dirty |= to_write;
+    xSemaphoreGive(write_mutex);
+  }
+
+  return ret;
+}
+
+void storage_settings_flush_task(void *pvParameters) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // keep waiting while writes keep coming in
+    while (ulTaskNotifyTake(pdTRUE,
+                            pdMS_TO_TICKS(STORAGE_SETTINGS_FLUSH_DELAY_MS)) >
+           0) {
+    }
+
+    if (storage_settings_flush() != ESP_OK) {
+      vTaskDelay(pdMS_TO_TICKS(STORAGE_SETTINGS_FLUSH_DELAY_MS));
+      xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+    }
+  }
+}
+
+esp_err_t storage_settings_init() {
+  esp_err_t ret = ESP_OK;
+  nvs_handle_t nvs_handle = 0;
+
+  write_mutex = xSemaphoreCreateMutex();
+  if (write_mutex == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  // defaults first, anything in NVS overrides them
+  for (int32_t i = 0; i < STORAGE_SETTING_COUNT; i++) {
+    void *field = (uint8_t *)&settings + SETTINGS[i].offset;
+    if (SETTINGS[i].type == STORAGE_SETTING_TYPE_U32) {
+      *(uint32_t *)field = SETTINGS[i].default_u32;
+    } else {
+      strncpy((char *)field, SETTINGS[i].default_str, SETTINGS[i].size - 1);
+      ((char *)field)[SETTINGS[i].size - 1] = '\0';
+    }
+  }
+
+  ret = nvs_open_from_partition("nvs", NVS_SETTINGS_NAMESPACE, NVS_READONLY,
+                                &nvs_handle);
+  if (ret == ESP_ERR_NVS_NOT_FOUND) {
+    // nothing has ever been saved
+    ESP_LOGI(TAG, "No saved settings, using defaults");
+    ret = ESP_OK;
+    goto storage_settings_init_tasks;
+  }
+  ESP_GOTO_ON_ERROR(ret, storage_settings_init_end, TAG,
+                    "Error (%s) opening NVS handle!", esp_err_to_name(ret));
+
+  for (int32_t i = 0; i < STORAGE_SETTING_COUNT; i++) {
+    void *field = (uint8_t *)&settings + SETTINGS[i].offset;
+    esp_err_t read_ret;
+
+    if (SETTINGS[i].type == STORAGE_SETTING_TYPE_U32) {
+      uint32_t value = 0;
+      read_ret = nvs_get_u32(nvs_handle, SETTINGS[i].key, &value);
+      if (read_ret == ESP_OK &&
+          (value < SETTINGS[i].min || value > SETTINGS[i].max)) {
+        ESP_LOGW(TAG, "Saved '%s' out of range, using default",
+                 SETTINGS[i].key);
+        continue;
+      }
+      if (read_ret == ESP_OK) {
+        *(uint32_t *)field = value;
+      }
+    } else {
+      // nothing reads the settings yet, so read straight into them.
+      // `nvs_get_str` only writes on success.
+      size_t length = SETTINGS[i].size;
+      read_ret = nvs_get_str(nvs_handle, SETTINGS[i].key, (char *)field,
+                             &length);
+    }
+
+    if (read_ret != ESP_OK && read_ret != ESP_ERR_NVS_NOT_FOUND) {
+      ESP_LOGW(TAG, "Error (%s) reading '%s', using default",
+               esp_err_to_name(read_ret), SETTINGS[i].key);
+    }
+  }
+
+storage_settings_init_tasks:
+  ESP_GOTO_ON_FALSE(xTaskCreate(storage_settings_flush_task, TAG,
+                                STORAGE_SETTINGS_TASK_STACK_DEPTH, NULL,
+                                STORAGE_SETTINGS_TASK_PRIORITY,
+                                &flush_task) == pdPASS,
+                    ESP_ERR_NO_MEM, storage_settings_init_end, TAG,
+                    "Failed to create settings flush task");
+
+storage_settings_init_end:
+  if (nvs_handle != 0) {
+    nvs_close(nvs_handle);
+  }
+
+  return ret;
+}
@@ -0,0 +1,207 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "system/boot.h"
+
+static const char *TAG = "SYSTEM:BOOT";
+
+static system_boot_t boot = {0};
+
+static uint64_t system_boot_all(int32_t stage_count) {
+  if (stage_count == SYSTEM_BOOT_MAX_STAGES) {
+    return UINT64_MAX;
+  }
+  return SYSTEM_BOOT_DEP(stage_count) - 1;
+}
+
+// Claims the next stage whose dependencies are met, -1 if there's none yet.
+// A stage depending on a failed or skipped stage is skipped instead, which
+// finishes it. That can skip an earlier stage too, so the scan starts over.
+static int32_t system_boot_claim_locked(void) {
+  for (int32_t i = 0; i < boot.stage_count; i++) {
+    system_boot_stage_t *stage = &boot.stages[i];
+    if (boot.started & SYSTEM_BOOT_DEP(i)) {
+      continue;
+    }
+    if (stage->deps & boot.failed) {
+      stage->result = ESP_ERR_INVALID_STATE;
+      boot.started |= SYSTEM_BOOT_DEP(i);
+      boot.finished |= SYSTEM_BOOT_DEP(i);
+      boot.failed |= SYSTEM_BOOT_DEP(i);
+      i = -1;
+      continue;
+    }
+    if ((stage->deps & boot.finished) == stage->deps) {
+      boot.started |= SYSTEM_BOOT_DEP(i);
+      return i;
+    }
+  }
+  return -1;
+}
+
+void system_boot_worker_task(void *pvParameters) {
+  uint64_t all = system_boot_all(boot.stage_count);
+
+  xSemaphoreTake(boot.mutex, portMAX_DELAY);
+  while (boot.started != all) {
+    int32_t index = system_boot_claim_locked();
+    if (index < 0) {
+      // everything left waits on a stage that's running
+      xSemaphoreGive(boot.mutex);
+      xSemaphoreTake(boot.progress, portMAX_DELAY);
+      xSemaphoreTake(boot.mutex, portMAX_DELAY);
+      continue;
+    }
+    xSemaphoreGive(boot.mutex);
+
+    system_boot_stage_t *stage = &boot.stages[index];
+    stage->start_us = esp_timer_get_time();
+    stage->result = stage->fn();
+    stage->end_us = esp_timer_get_time();
+    if (stage->result != ESP_OK) {
+      ESP_LOGE(TAG, "Stage '%s' failed: %s", stage->name,
+               esp_err_to_name(stage->result));
+    }
+
+    xSemaphoreTake(boot.mutex, portMAX_DELAY);
+    boot.finished |= SYSTEM_BOOT_DEP(index);
+    if (stage->result != ESP_OK) {
+      boot.failed |= SYSTEM_BOOT_DEP(index);
+    }
+    // wakes every idle worker, it's already full if none are
+    for (int32_t i = 0; i < SYSTEM_BOOT_WORKERS; i++) {
+      xSemaphoreGive(boot.progress);
+    }
+  }
+
+  // whoever finishes or skips the last stage sees this
+  bool done = boot.finished == all;
+  xSemaphoreGive(boot.mutex);
+  if (done) {
+    xSemaphoreGive(boot.done);
+  }
+  vTaskDelete(NULL);
+}
+
+// Dependencies must name other stages that exist and mustn't form a cycle,
+// otherwise the graph never completes.
+static esp_err_t system_boot_check(system_boot_stage_t *stages,
+                                   int32_t stage_count) {
+  uint64_t all = system_boot_all(stage_count);
+  for (int32_t i = 0; i < stage_count; i++) {
+    if ((stages[i].deps & ~all) != 0 ||
+        (stages[i].deps & SYSTEM_BOOT_DEP(i)) != 0) {
+      ESP_LOGE(TAG, "Stage '%s' has invalid dependencies", stages[i].name);
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+
+  // runs the graph on paper, one round per level
+  uint64_t finished = 0;
+  while (finished != all) {
+    uint64_t round = 0;
+    for (int32_t i = 0; i < stage_count; i++) {
+      if (!(finished & SYSTEM_BOOT_DEP(i)) &&
+          (stages[i].deps & finished) == stages[i].deps) {
+        round |= SYSTEM_BOOT_DEP(i);
+      }
+    }
+    if (round == 0) {
+      ESP_LOGE(TAG, "Stages depend on each other in a cycle");
+      return ESP_ERR_INVALID_ARG;
+    }
+    finished |= round;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t system_boot_run(system_boot_stage_t *stages, int32_t stage_count) {
+  if (stage_count <= 0 || stage_count > SYSTEM_BOOT_MAX_STAGES) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  esp_err_t ret = system_boot_check(stages, stage_count);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  boot.stages = stages;
+  boot.stage_count = stage_count;
+  boot.started = 0;
+  boot.finished = 0;
+  boot.failed = 0;
+  boot.mutex = xSemaphoreCreateMutex();
+  boot.progress = xSemaphoreCreateCounting(SYSTEM_BOOT_WORKERS, 0);
+  boot.done = xSemaphoreCreateBinary();
+  if (boot.mutex == NULL || boot.progress == NULL || boot.done == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (int32_t i = 0; i < stage_count; i++) {
+    stages[i].start_us = 0;
+    stages[i].end_us = 0;
+    stages[i].result = ESP_ERR_NOT_FINISHED;
+  }
+
+  boot.run_start_us = esp_timer_get_time();
+
+  // any one worker gets through the whole graph, more only add concurrency
+  int32_t workers = 0;
+  for (int32_t i = 0; i < SYSTEM_BOOT_WORKERS && i < stage_count; i++) {
+    if (xTaskCreate(system_boot_worker_task, TAG,
+                    SYSTEM_BOOT_TASK_STACK_DEPTH, NULL,
+                    SYSTEM_BOOT_TASK_PRIORITY, NULL) == pdPASS) {
+      workers++;
+    }
+  }
+  if (workers == 0) {
+    ESP_LOGE(TAG, "Failed to create any boot worker");
+    return ESP_ERR_NO_MEM;
+  }
+
+  xSemaphoreTake(boot.done, portMAX_DELAY);
+  boot.run_end_us = esp_timer_get_time();
+
+  // a skipped stage only fails because one that ran did
+  for (int32_t i = 0; i < stage_count; i++) {
+    if (stages[i].start_us != 0 && stages[i].result != ESP_OK) {
+      return stages[i].result;
+    }
+  }
+
+  return ESP_OK;
+}
+
+void system_boot_mark_ready(void) {
+  boot.ready_us = esp_timer_get_time();
+}
+
+void system_boot_report(void) {
+  ESP_LOGI(TAG, "Boot report (ms since power on):");
+  ESP_LOGI(TAG, "  %-16s %8s %8s %8s", "stage", "start", "end", "took");
+
+  int64_t serial_us = 0;
+  for (int32_t i = 0; i < boot.stage_count; i++) {
+    system_boot_stage_t *stage = &boot.stages[i];
+    if (stage->result != ESP_OK) {
+      ESP_LOGI(TAG, "  %-16s %s", stage->name, esp_err_to_name(stage->result));
+      continue;
+    }
+    serial_us += stage->end_us - stage->start_us;
+    ESP_LOGI(TAG, "  %-16s %8.1f %8.1f %8.1f", stage->name,
+             stage->start_us / 1000.0, stage->end_us / 1000.0,
+             (stage->end_us - stage->start_us) / 1000.0);
+  }
+
+  ESP_LOGI(TAG, "  init took %.1fms (%.1fms if run in sequence)",
+           (boot.run_end_us - boot.run_start_us) / 1000.0,
+           serial_us / 1000.0);
+  if (boot.ready_us != 0) {
+    ESP_LOGI(TAG, "  ready at %.1fms", boot.ready_us / 1000.0);
+  } else {
+    ESP_LOGI(TAG, "  not ready yet");
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// A few short lived workers take whichever stages have their dependencies
+// met, so independent stages run concurrently without a task and a stack
+// for each.
+#define SYSTEM_BOOT_TASK_PRIORITY 5
+#define SYSTEM_BOOT_TASK_STACK_DEPTH (1024 * 4)
+#define SYSTEM_BOOT_WORKERS 4
+
+// one bit per stage in `deps`
+#define SYSTEM_BOOT_MAX_STAGES 64
+
+#define SYSTEM_BOOT_DEP(stage_index) (1ULL << (stage_index))
+
+typedef esp_err_t (*system_boot_stage_fn_t)(void);
+
+typedef struct system_boot_stage_t {
+  const char *name;
+  system_boot_stage_fn_t fn;
+  // `SYSTEM_BOOT_DEP` bits of the stages that must finish before this one
+  uint64_t deps;
+
+  // filled in by `system_boot_run`
+  int64_t start_us;
+  int64_t end_us;
+  esp_err_t result;
+} system_boot_stage_t;
+
+typedef struct system_boot_t {
+  system_boot_stage_t *stages;
+  int32_t stage_count;
+  // guards the masks
+  SemaphoreHandle_t mutex;
+  uint64_t started;
+  uint64_t finished;
+  // stages that failed or were skipped
+  uint64_t failed;
+  // given whenever a stage finishes, to wake idle workers
+  SemaphoreHandle_t progress;
+  // given once every stage has finished
+  SemaphoreHandle_t done;
+  int64_t run_start_us;
+  int64_t run_end_us;
+  // set by `system_boot_mark_ready`, 0 until then
+  int64_t ready_us;
+} system_boot_t;
+
+// Runs the stages as a dependency graph and blocks until all of them are done.
+// Returns the first failure. Stages depending on a failed stage, directly or
+// not, are skipped. The rest still run.
+esp_err_t system_boot_run(system_boot_stage_t *stages, int32_t stage_count);
+
+// Records the power-on-to-ready time. "Ready" is up to the caller.
+void system_boot_mark_ready(void);
+
+// Logs when each stage ran, relative to power on.
+void system_boot_report(void);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#include "system/metrics.h"
+
+#define SYSTEM_MEMORY_TASK_PRIORITY 1
+#define SYSTEM_MEMORY_TASK_STACK_DEPTH (1024 * 3)
+
+#define SYSTEM_MEMORY_SAMPLE_INTERVAL_MS 1000
+
+// Suggested stack depths leave this much above the deepest use seen, and are
+// rounded up to `SYSTEM_MEMORY_STACK_ROUNDING`.
+#define SYSTEM_MEMORY_STACK_MARGIN 768
+#define SYSTEM_MEMORY_STACK_ROUNDING 256
+#define SYSTEM_MEMORY_MAX_STACKS 24
+
+// Where an allocation lives. Decide by who waits on it, not by its size.
+typedef enum system_memory_region_t {
+  // Internal RAM. Anything touched on the message or audio path, and anything
+  // used while the flash cache is disabled.
+  SYSTEM_MEMORY_FAST = 0,
+  // Internal, DMA capable RAM. I2S and SPI buffers.
+  SYSTEM_MEMORY_DMA = 1,
+  // PSRAM when there is some, internal RAM otherwise. Large buffers and pools
+  // nothing latency sensitive waits on.
+  SYSTEM_MEMORY_BULK = 2,
+} system_memory_region_t;
+
+typedef struct system_memory_stack_t {
+  TaskHandle_t task;
+  uint32_t depth;
+} system_memory_stack_t;
+
+typedef struct system_memory_t {
+  system_memory_stack_t stacks[SYSTEM_MEMORY_MAX_STACKS];
+  int32_t stack_count;
+  SemaphoreHandle_t mutex;
+  int64_t last_report_us;
+  struct {
+    system_metric_handle_t free;
+    system_metric_handle_t free_min;
+    system_metric_handle_t internal_free;
+    system_metric_handle_t internal_free_min;
+    system_metric_handle_t internal_largest_block;
+    system_metric_handle_t psram_free;
+  } metrics;
+  struct {
+    TaskHandle_t sampler;
+  } tasks;
+} system_memory_t;
+
+esp_err_t system_memory_init();
+
+// `free` releases memory from any region.
+void *system_memory_alloc(size_t size, system_memory_region_t region);
+void *system_memory_calloc(size_t count, size_t size,
+                           system_memory_region_t region);
+
+// Remembers a task's stack depth so the report can compare it with what the
+// task really uses. Called by `system_tasks_create`, tasks created before
+// `system_memory_init` aren't tracked.
+void system_memory_track_stack(TaskHandle_t task, uint32_t stack_depth);
+
+// Logs each region's free, minimum free and largest block, then each task's
+// stack depth, deepest use and a suggested depth. Also runs every
+// `CONFIG_SYSTEM_MEMORY_REPORT_INTERVAL_S`, and warns whenever internal RAM
+// drops below `CONFIG_SYSTEM_MEMORY_INTERNAL_HEADROOM`.
+void system_memory_report();
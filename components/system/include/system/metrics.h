@@ -0,0 +1,155 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SYSTEM_METRICS_TASK_PRIORITY 1
+#define SYSTEM_METRICS_TASK_STACK_DEPTH (1024 * 3)
+
+// task stacks are polled this often, everything else is live
+#define SYSTEM_METRICS_SAMPLE_INTERVAL_MS 1000
+
+// Every series counts, each label set of a name too. A device registers
+// about 100, most of them the router's three per subscriber and one
+// `udp_dropped_total` per reason. Registering past this fails the boot.
+#define SYSTEM_METRICS_MAX 128
+#define SYSTEM_METRICS_MAX_TASKS 32
+#define SYSTEM_METRICS_LABELS_LENGTH 48
+
+// Bucket `i` counts values below `2^i`, the last one counts everything else.
+// With microseconds, 20 buckets cover up to ~0.5s.
+#define SYSTEM_METRICS_HISTOGRAM_BUCKETS 20
+
+typedef enum system_metric_type_t {
+  // only goes up, wraps at 2^32 (which scrapers treat as a reset)
+  SYSTEM_METRIC_COUNTER = 0,
+  SYSTEM_METRIC_GAUGE = 1,
+  SYSTEM_METRIC_HISTOGRAM = 2,
+} system_metric_type_t;
+
+typedef struct system_metric_config_t {
+  // Prometheus style, e.g. "udp_rx_packets_total". Must outlive the metric.
+  const char *name;
+  const char *help;
+  system_metric_type_t type;
+  // e.g. `reason="decode"`, copied. NULL for none.
+  const char *labels;
+} system_metric_config_t;
+
+typedef struct system_metric_t {
+  const char *name;
+  const char *help;
+  system_metric_type_t type;
+  char labels[SYSTEM_METRICS_LABELS_LENGTH];
+  // the counter or gauge, unused by histograms
+  atomic_int_fast32_t value;
+  struct {
+    atomic_uint_fast32_t count;
+    atomic_uint_fast32_t sum;
+    atomic_uint_fast32_t *buckets;
+  } histogram;
+} system_metric_t;
+
+typedef system_metric_t *system_metric_handle_t;
+
+// A copy taken by `system_metrics_snapshot`. Each field is read atomically,
+// but a histogram's fields may be a few observations apart.
+typedef struct system_metric_value_t {
+  int32_t value;
+  uint32_t count;
+  uint32_t sum;
+  uint32_t buckets[SYSTEM_METRICS_HISTOGRAM_BUCKETS];
+} system_metric_value_t;
+
+typedef void (*system_metrics_visitor_t)(const system_metric_t *metric,
+                                         const system_metric_value_t *value,
+                                         void *ctx);
+
+typedef struct system_metrics_task_t {
+  char name[configMAX_TASK_NAME_LEN];
+  uint32_t stack_free_min_bytes;
+} system_metrics_task_t;
+
+typedef struct system_metrics_t {
+  // Only appended to, so the hot paths and snapshots read it without locking.
+  system_metric_t metrics[SYSTEM_METRICS_MAX];
+  atomic_int_fast32_t count;
+  // serializes registering, and guards `stacks`
+  SemaphoreHandle_t mutex;
+  // rebuilt every sample, so deleted tasks drop out
+  system_metrics_task_t stacks[SYSTEM_METRICS_MAX_TASKS];
+  int32_t stack_count;
+  struct {
+    TaskHandle_t sampler;
+  } tasks;
+} system_metrics_t;
+
+esp_err_t system_metrics_init();
+
+// Registering the same name and labels twice returns the same metric, so
+// several instances of a component share it. `ESP_ERR_NO_MEM` once
+// `SYSTEM_METRICS_MAX` series are registered. On errors `*metric_ptr` is set
+// to NULL, which every update below accepts.
+esp_err_t system_metrics_register(system_metric_handle_t *metric_ptr,
+                                  const system_metric_config_t *config);
+
+// Calls `visitor` for every metric, series sharing a name one after another,
+// then for every task's stack as a `task_stack_free_min_bytes` gauge. Doesn't
+// block the hot paths.
+void system_metrics_snapshot(system_metrics_visitor_t visitor, void *ctx);
+
+// // ----------------
+// // Updates, lock-free and safe from any task
+// // ----------------
+
+static inline void system_metrics_add(system_metric_handle_t metric,
+                                      int32_t amount) {
+  if (metric == NULL) {
+    return;
+  }
+  atomic_fetch_add_explicit(&metric->value, amount, memory_order_relaxed);
+}
+
+static inline void system_metrics_set(system_metric_handle_t metric,
+                                      int32_t value) {
+  if (metric == NULL) {
+    return;
+  }
+  atomic_store_explicit(&metric->value, value, memory_order_relaxed);
+}
+
+// for high-water marks, only ever raises the gauge
+static inline void system_metrics_max(system_metric_handle_t metric,
+                                      int32_t value) {
+  if (metric == NULL) {
+    return;
+  }
+  int_fast32_t current =
+      atomic_load_explicit(&metric->value, memory_order_relaxed);
+  while (value > current &&
+         !atomic_compare_exchange_weak_explicit(&metric->value, &current,
+                                                value, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+static inline void system_metrics_observe(system_metric_handle_t metric,
+                                          uint32_t value) {
+  if (metric == NULL || metric->histogram.buckets == NULL) {
+    return;
+  }
+  uint32_t bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+  if (bucket >= SYSTEM_METRICS_HISTOGRAM_BUCKETS) {
+    bucket = SYSTEM_METRICS_HISTOGRAM_BUCKETS - 1;
+  }
+  atomic_fetch_add_explicit(&metric->histogram.buckets[bucket], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&metric->histogram.count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&metric->histogram.sum, value,
+                            memory_order_relaxed);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#include "system/metrics.h"
+
+// The scheduling plan. Wi-Fi and lwIP are pinned to core 0 (see
+// sdkconfig.defaults), so the UDP tasks join them there and a datagram never
+// waits on a wakeup from the other core. Core 1 is kept for work with a
+// deadline: audio capture and playout above everything, then the inputs and
+// message handling. Housekeeping (heartbeats, power, metrics, diagnostics)
+// runs at priority 1-2 on whichever core is free.
+//
+//   core 0    Wi-Fi 23, lwIP 18, UDP socket 6, UDP multicast 5
+//   core 1    audio 10, inputs 4, message handler 3
+//   either    heartbeats 2, power 2, everything else 1
+#if CONFIG_IDF_TARGET_LINUX || CONFIG_FREERTOS_UNICORE
+#define SYSTEM_TASKS_CORES 1
+#define SYSTEM_TASKS_CORE_NETWORK tskNO_AFFINITY
+#define SYSTEM_TASKS_CORE_REALTIME tskNO_AFFINITY
+#else
+#define SYSTEM_TASKS_CORES CONFIG_FREERTOS_NUMBER_OF_CORES
+#define SYSTEM_TASKS_CORE_NETWORK 0
+#define SYSTEM_TASKS_CORE_REALTIME 1
+#endif
+#define SYSTEM_TASKS_CORE_ANY tskNO_AFFINITY
+
+#define SYSTEM_TASKS_PRIORITY_AUDIO 10
+
+// Just above the network and control tasks, so the probes see what those
+// can't avoid: interrupts, critical sections, Wi-Fi and lwIP on core 0 and
+// audio on core 1.
+#define SYSTEM_TASKS_PROBE_PRIORITY 7
+#define SYSTEM_TASKS_PROBE_STACK_DEPTH (1024 * 2)
+#define SYSTEM_TASKS_PROBE_INTERVAL_MS 10
+// CPU load is averaged over this many probe wakeups
+#define SYSTEM_TASKS_LOAD_PROBES 100
+
+typedef struct system_tasks_core_t {
+  TaskHandle_t probe;
+  // how much later than asked the probe woke up
+  system_metric_handle_t latency_us;
+  // time not spent in the idle task, since the last sample
+  system_metric_handle_t load_percent;
+} system_tasks_core_t;
+
+typedef struct system_tasks_t {
+  system_tasks_core_t cores[SYSTEM_TASKS_CORES];
+} system_tasks_t;
+
+// Starts one probe per core, measuring scheduling latency into
+// `sched_latency_us{core}` and CPU load into `cpu_load_percent{core}`. Load
+// needs `CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS`.
+esp_err_t system_tasks_init();
+
+// `xTaskCreatePinnedToCore`, with the stack tracked by `system/memory`. Only
+// for tasks that never exit.
+BaseType_t system_tasks_create(TaskFunction_t fn, const char *name,
+                               uint32_t stack_depth, void *params,
+                               UBaseType_t priority, BaseType_t core,
+                               TaskHandle_t *task_ptr);
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SYSTEM_TRACE_TASK_PRIORITY 1
+#define SYSTEM_TRACE_TASK_STACK_DEPTH (1024 * 3)
+
+// Each core's cycle counter runs on its own, so every core records a sync
+// event pairing it with `esp_timer_get_time()` this often. The host tool uses
+// them to put all the events on one timeline.
+#define SYSTEM_TRACE_SYNC_INTERVAL_MS 1000
+
+#if CONFIG_IDF_TARGET_LINUX
+#define SYSTEM_TRACE_CORES 1
+#else
+#define SYSTEM_TRACE_CORES CONFIG_FREERTOS_NUMBER_OF_CORES
+#endif
+
+// Only ever append, the host tool matches on the numbers.
+typedef enum system_trace_event_id_t {
+  // the `uuid` holds the `esp_timer_get_time()` the timestamp was taken at
+  SYSTEM_TRACE_SYNC = 0,
+  // a datagram was read from the socket
+  SYSTEM_TRACE_UDP_RECEIVE = 1,
+  // a subscriber got its reference to an incoming message
+  SYSTEM_TRACE_ROUTER_PUBLISH = 2,
+  // a subscriber was full
+  SYSTEM_TRACE_ROUTER_DROP = 3,
+  // a subscriber took an incoming message off its queue
+  SYSTEM_TRACE_ROUTER_RECEIVE = 4,
+  // a consumer finished with an incoming message
+  SYSTEM_TRACE_HANDLE = 5,
+  SYSTEM_TRACE_OUTGOING_ENQUEUE = 6,
+  SYSTEM_TRACE_OUTGOING_DEQUEUE = 7,
+  // a datagram was handed to the socket
+  SYSTEM_TRACE_UDP_SEND = 8,
+  // A frame was handed to the network, and one was handed to the router to
+  // be played, identified by the message UUID. All-call pages and memos
+  // record them. 10 and 11 are left for a codec's encode and decode.
+  SYSTEM_TRACE_AUDIO_CAPTURE = 9,
+  SYSTEM_TRACE_AUDIO_PLAYOUT = 12,
+} system_trace_event_id_t;
+
+// 24 bytes, written as-is by `system_trace_dump`.
+typedef struct system_trace_event_t {
+  // the ring position + 1, written last. 0 while the event is being written.
+  uint32_t seq;
+  // CPU cycles on `core`
+  uint32_t timestamp;
+  // the recording task's handle, the dump maps it to a name
+  uint32_t task;
+  uint16_t id;
+  uint8_t core;
+  uint8_t reserved;
+  // the message the event is about, zero if none
+  uint8_t uuid[8];
+} system_trace_event_t;
+
+typedef struct system_trace_ring_t {
+  atomic_uint_fast32_t head;
+  system_trace_event_t *events;
+} system_trace_ring_t;
+
+typedef struct system_trace_t {
+  system_trace_ring_t rings[SYSTEM_TRACE_CORES];
+  // cleared while dumping, so the rings hold still
+  atomic_bool recording;
+  struct {
+    TaskHandle_t sync[SYSTEM_TRACE_CORES];
+    TaskHandle_t dump;
+  } tasks;
+} system_trace_t;
+
+#if CONFIG_SYSTEM_TRACE
+// `uuid` is the 8 byte message UUID or NULL. Lock-free and safe from ISRs.
+#define SYSTEM_TRACE(id, uuid) system_trace_record((id), (uuid))
+#else
+#define SYSTEM_TRACE(id, uuid) ((void)0)
+#endif
+
+// Events recorded before this are dropped.
+esp_err_t system_trace_init();
+
+void system_trace_record(system_trace_event_id_t id, const uint8_t *uuid);
+
+// Prints every ring to the console between `TRACE_BEGIN` and `TRACE_END`
+// lines for `tools/trace/render.py`, then clears them. Recording is paused
+// while dumping.
+void system_trace_dump();
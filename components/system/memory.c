@@ -0,0 +1,228 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#endif
+
+#include "system/memory.h"
+#include "system/tasks.h"
+
+static const char *TAG = "SYSTEM:MEMORY";
+
+static system_memory_t memory = {0};
+
+#if !CONFIG_IDF_TARGET_LINUX
+static uint32_t system_memory_caps(system_memory_region_t region) {
+  switch (region) {
+  case SYSTEM_MEMORY_DMA:
+    return MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  case SYSTEM_MEMORY_BULK:
+    return MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+  case SYSTEM_MEMORY_FAST:
+  default:
+    return MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  }
+}
+#endif
+
+void *system_memory_alloc(size_t size, system_memory_region_t region) {
+#if CONFIG_IDF_TARGET_LINUX
+  return malloc(size);
+#else
+  if (region == SYSTEM_MEMORY_BULK) {
+    // boards without PSRAM still get their bulk buffers
+    return heap_caps_malloc_prefer(size, 2, system_memory_caps(region),
+                                   MALLOC_CAP_DEFAULT);
+  }
+  return heap_caps_malloc(size, system_memory_caps(region));
+#endif
+}
+
+void *system_memory_calloc(size_t count, size_t size,
+                           system_memory_region_t region) {
+#if CONFIG_IDF_TARGET_LINUX
+  return calloc(count, size);
+#else
+  if (region == SYSTEM_MEMORY_BULK) {
+    return heap_caps_calloc_prefer(count, size, 2, system_memory_caps(region),
+                                   MALLOC_CAP_DEFAULT);
+  }
+  return heap_caps_calloc(count, size, system_memory_caps(region));
+#endif
+}
+
+void system_memory_track_stack(TaskHandle_t task, uint32_t stack_depth) {
+  if (memory.mutex == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(memory.mutex, portMAX_DELAY);
+  if (memory.stack_count < SYSTEM_MEMORY_MAX_STACKS) {
+    memory.stacks[memory.stack_count++] = (system_memory_stack_t){
+        .task = task,
+        .depth = stack_depth,
+    };
+  } else {
+    ESP_LOGW(TAG, "Too many tasks, '%s' won't be reported",
+             pcTaskGetName(task));
+  }
+  xSemaphoreGive(memory.mutex);
+}
+
+static uint32_t system_memory_suggest(uint32_t used) {
+  uint32_t depth = used + SYSTEM_MEMORY_STACK_MARGIN;
+  return (depth + SYSTEM_MEMORY_STACK_ROUNDING - 1) /
+         SYSTEM_MEMORY_STACK_ROUNDING * SYSTEM_MEMORY_STACK_ROUNDING;
+}
+
+void system_memory_report() {
+#if !CONFIG_IDF_TARGET_LINUX
+  static const struct {
+    const char *name;
+    uint32_t caps;
+  } regions[] = {
+      {"internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT},
+      {"dma", MALLOC_CAP_DMA},
+      {"psram", MALLOC_CAP_SPIRAM},
+  };
+  for (int32_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+    if (heap_caps_get_total_size(regions[i].caps) == 0) {
+      continue;
+    }
+    uint32_t caps = regions[i].caps;
+    ESP_LOGI(TAG, "%-8s free %7lu  min %7lu  largest %7lu", regions[i].name,
+             (unsigned long)heap_caps_get_free_size(caps),
+             (unsigned long)heap_caps_get_minimum_free_size(caps),
+             (unsigned long)heap_caps_get_largest_free_block(caps));
+  }
+#endif
+
+  if (memory.mutex == NULL) {
+    return;
+  }
+
+  system_memory_stack_t stacks[SYSTEM_MEMORY_MAX_STACKS];
+  xSemaphoreTake(memory.mutex, portMAX_DELAY);
+  int32_t stack_count = memory.stack_count;
+  memcpy(stacks, memory.stacks, stack_count * sizeof(system_memory_stack_t));
+  xSemaphoreGive(memory.mutex);
+
+  // Depths are in `StackType_t`s, which are bytes on the esp32 but words on
+  // the linux target, so everything is converted to bytes to compare.
+  for (int32_t i = 0; i < stack_count; i++) {
+    uint32_t depth = stacks[i].depth * sizeof(StackType_t);
+    uint32_t free =
+        uxTaskGetStackHighWaterMark(stacks[i].task) * sizeof(StackType_t);
+    uint32_t used = depth - free;
+    uint32_t suggested = system_memory_suggest(used);
+    ESP_LOGI(TAG, "%-16s stack %6lu  used %6lu  suggested %6lu%s",
+             pcTaskGetName(stacks[i].task), (unsigned long)depth,
+             (unsigned long)used, (unsigned long)suggested,
+             suggested < depth ? "" : "  (too small)");
+  }
+}
+
+static void system_memory_sample() {
+#if !CONFIG_IDF_TARGET_LINUX
+  const uint32_t internal = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  uint32_t internal_free = heap_caps_get_free_size(internal);
+
+  system_metrics_set(memory.metrics.free, esp_get_free_heap_size());
+  system_metrics_set(memory.metrics.free_min,
+                     esp_get_minimum_free_heap_size());
+  system_metrics_set(memory.metrics.internal_free, internal_free);
+  system_metrics_set(memory.metrics.internal_free_min,
+                     heap_caps_get_minimum_free_size(internal));
+  system_metrics_set(memory.metrics.internal_largest_block,
+                     heap_caps_get_largest_free_block(internal));
+  system_metrics_set(memory.metrics.psram_free,
+                     heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+
+  // stacks, queues and lwIP can only come from internal RAM, running out
+  // of it is fatal long before PSRAM is
+  if (internal_free < CONFIG_SYSTEM_MEMORY_INTERNAL_HEADROOM) {
+    ESP_LOGW(TAG, "Internal RAM is low, %lu bytes free",
+             (unsigned long)internal_free);
+  }
+#endif
+
+#if CONFIG_SYSTEM_MEMORY_REPORT_INTERVAL_S > 0
+  int64_t now_us = esp_timer_get_time();
+  if (now_us - memory.last_report_us >=
+      CONFIG_SYSTEM_MEMORY_REPORT_INTERVAL_S * 1000000LL) {
+    memory.last_report_us = now_us;
+    system_memory_report();
+  }
+#endif
+}
+
+void system_memory_sampler_task(void *pvParameters) {
+  while (true) {
+    system_memory_sample();
+
+    vTaskDelay(pdMS_TO_TICKS(SYSTEM_MEMORY_SAMPLE_INTERVAL_MS));
+  }
+}
+
+static esp_err_t system_memory_gauge(system_metric_handle_t *metric_ptr,
+                                     const char *name, const char *help) {
+  system_metric_config_t config = {
+      .name = name,
+      .help = help,
+      .type = SYSTEM_METRIC_GAUGE,
+  };
+  ESP_RETURN_ON_ERROR(system_metrics_register(metric_ptr, &config), TAG,
+                      "Failed to register '%s'", name);
+  return ESP_OK;
+}
+
+esp_err_t system_memory_init() {
+  memory.mutex = xSemaphoreCreateMutex();
+  if (memory.mutex == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  // the first report comes after an interval, once the tasks have run
+  memory.last_report_us = esp_timer_get_time();
+
+#if !CONFIG_IDF_TARGET_LINUX
+  const struct {
+    system_metric_handle_t *metric;
+    const char *name;
+    const char *help;
+  } gauges[] = {
+      {&memory.metrics.free, "heap_free_bytes",
+       "Free heap across all regions"},
+      {&memory.metrics.free_min, "heap_free_min_bytes",
+       "Smallest free heap since boot"},
+      {&memory.metrics.internal_free, "heap_internal_free_bytes",
+       "Free internal RAM"},
+      {&memory.metrics.internal_free_min, "heap_internal_free_min_bytes",
+       "Smallest free internal RAM since boot"},
+      {&memory.metrics.internal_largest_block,
+       "heap_internal_largest_block_bytes",
+       "Largest internal RAM allocation that would succeed"},
+      {&memory.metrics.psram_free, "heap_psram_free_bytes",
+       "Free PSRAM, 0 without any"},
+  };
+  for (int32_t i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++) {
+    ESP_RETURN_ON_ERROR(
+        system_memory_gauge(gauges[i].metric, gauges[i].name, gauges[i].help),
+        TAG, "Failed to register memory gauges");
+  }
+#endif
+
+  if (system_tasks_create(system_memory_sampler_task, TAG,
+                          SYSTEM_MEMORY_TASK_STACK_DEPTH, NULL,
+                          SYSTEM_MEMORY_TASK_PRIORITY, SYSTEM_TASKS_CORE_ANY,
+                          &memory.tasks.sampler) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
@@ -0,0 +1,204 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "system/memory.h"
+#include "system/metrics.h"
+
+static const char *TAG = "SYSTEM:METRICS";
+
+static system_metrics_t metrics = {0};
+
+static system_metric_handle_t
+system_metrics_find(const system_metric_config_t *config, const char *labels,
+                    int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    system_metric_handle_t metric = &metrics.metrics[i];
+    if (strcmp(metric->name, config->name) == 0 &&
+        strcmp(metric->labels, labels) == 0) {
+      return metric;
+    }
+  }
+  return NULL;
+}
+
+esp_err_t system_metrics_register(system_metric_handle_t *metric_ptr,
+                                  const system_metric_config_t *config) {
+  esp_err_t ret = ESP_OK;
+  const char *labels = config->labels != NULL ? config->labels : "";
+  *metric_ptr = NULL;
+
+  ESP_RETURN_ON_FALSE(metrics.mutex != NULL, ESP_ERR_INVALID_STATE, TAG,
+                      "Metrics aren't initialized, can't add '%s'",
+                      config->name);
+  ESP_RETURN_ON_FALSE(strlen(labels) < SYSTEM_METRICS_LABELS_LENGTH,
+                      ESP_ERR_INVALID_ARG, TAG, "Labels of '%s' are too long",
+                      config->name);
+
+  xSemaphoreTake(metrics.mutex, portMAX_DELAY);
+
+  int32_t count = atomic_load(&metrics.count);
+  system_metric_handle_t metric = system_metrics_find(config, labels, count);
+  if (metric != NULL) {
+    ESP_GOTO_ON_FALSE(metric->type == config->type, ESP_ERR_INVALID_ARG,
+                      system_metrics_register_end, TAG,
+                      "'%s' is already registered as another type",
+                      config->name);
+    *metric_ptr = metric;
+    goto system_metrics_register_end;
+  }
+
+  // Fatal, which series went missing would depend on the order the boot
+  // stages happened to run in.
+  ESP_GOTO_ON_FALSE(count < SYSTEM_METRICS_MAX, ESP_ERR_NO_MEM,
+                    system_metrics_register_end, TAG,
+                    "Too many metrics, raise SYSTEM_METRICS_MAX for '%s{%s}'",
+                    config->name, labels);
+
+  metric = &metrics.metrics[count];
+  if (config->type == SYSTEM_METRIC_HISTOGRAM) {
+    // observed on the message path
+    metric->histogram.buckets = (atomic_uint_fast32_t *)system_memory_calloc(
+        SYSTEM_METRICS_HISTOGRAM_BUCKETS, sizeof(atomic_uint_fast32_t),
+        SYSTEM_MEMORY_FAST);
+    ESP_GOTO_ON_FALSE(metric->histogram.buckets != NULL, ESP_ERR_NO_MEM,
+                      system_metrics_register_end, TAG,
+                      "Failed to allocate buckets for '%s'", config->name);
+  }
+
+  metric->name = config->name;
+  metric->help = config->help;
+  metric->type = config->type;
+  strcpy(metric->labels, labels);
+  atomic_init(&metric->value, 0);
+  atomic_init(&metric->histogram.count, 0);
+  atomic_init(&metric->histogram.sum, 0);
+
+  // snapshots read the count without the lock, so the slot must be filled in
+  // before the count covers it.
+  atomic_store_explicit(&metrics.count, count + 1, memory_order_release);
+  *metric_ptr = metric;
+
+system_metrics_register_end:
+  xSemaphoreGive(metrics.mutex);
+  return ret;
+}
+
+static void system_metrics_visit(system_metric_handle_t metric,
+                                 system_metrics_visitor_t visitor, void *ctx) {
+  system_metric_value_t value = {0};
+
+  if (metric->type == SYSTEM_METRIC_HISTOGRAM) {
+    value.count =
+        atomic_load_explicit(&metric->histogram.count, memory_order_relaxed);
+    value.sum =
+        atomic_load_explicit(&metric->histogram.sum, memory_order_relaxed);
+    for (int32_t i = 0; i < SYSTEM_METRICS_HISTOGRAM_BUCKETS; i++) {
+      value.buckets[i] = atomic_load_explicit(&metric->histogram.buckets[i],
+                                              memory_order_relaxed);
+    }
+  } else {
+    value.value = atomic_load_explicit(&metric->value, memory_order_relaxed);
+  }
+
+  visitor(metric, &value, ctx);
+}
+
+void system_metrics_snapshot(system_metrics_visitor_t visitor, void *ctx) {
+  system_metric_value_t value;
+  int32_t count = atomic_load_explicit(&metrics.count, memory_order_acquire);
+
+  // text formats want every series of a name together, and they're
+  // registered in any order
+  for (int32_t i = 0; i < count; i++) {
+    system_metric_handle_t first = &metrics.metrics[i];
+    bool seen = false;
+    for (int32_t j = 0; j < i && !seen; j++) {
+      seen = strcmp(metrics.metrics[j].name, first->name) == 0;
+    }
+    if (seen) {
+      continue;
+    }
+
+    for (int32_t j = i; j < count; j++) {
+      if (strcmp(metrics.metrics[j].name, first->name) == 0) {
+        system_metrics_visit(&metrics.metrics[j], visitor, ctx);
+      }
+    }
+  }
+
+  if (metrics.mutex == NULL) {
+    return;
+  }
+
+  // copied out, so a slow visitor doesn't hold up the sampler
+  system_metrics_task_t stacks[SYSTEM_METRICS_MAX_TASKS];
+  xSemaphoreTake(metrics.mutex, portMAX_DELAY);
+  int32_t stack_count = metrics.stack_count;
+  memcpy(stacks, metrics.stacks, stack_count * sizeof(system_metrics_task_t));
+  xSemaphoreGive(metrics.mutex);
+
+  system_metric_t stack = {
+      .name = "task_stack_free_min_bytes",
+      .help = "Smallest amount of stack each task has had left",
+      .type = SYSTEM_METRIC_GAUGE,
+  };
+  for (int32_t i = 0; i < stack_count; i++) {
+    snprintf(stack.labels, sizeof(stack.labels), "task=\"%s\"",
+             stacks[i].name);
+    memset(&value, 0, sizeof(value));
+    value.value = (int32_t)stacks[i].stack_free_min_bytes;
+    visitor(&stack, &value, ctx);
+  }
+}
+
+static void system_metrics_sample_stacks() {
+#if configUSE_TRACE_FACILITY
+  UBaseType_t count = uxTaskGetNumberOfTasks();
+  TaskStatus_t *statuses = (TaskStatus_t *)malloc(count * sizeof(TaskStatus_t));
+  if (statuses == NULL) {
+    return;
+  }
+  count = uxTaskGetSystemState(statuses, count, NULL);
+
+  xSemaphoreTake(metrics.mutex, portMAX_DELAY);
+  metrics.stack_count = 0;
+  for (UBaseType_t i = 0;
+       i < count && metrics.stack_count < SYSTEM_METRICS_MAX_TASKS; i++) {
+    system_metrics_task_t *task = &metrics.stacks[metrics.stack_count++];
+    snprintf(task->name, sizeof(task->name), "%s", statuses[i].pcTaskName);
+    task->stack_free_min_bytes =
+        statuses[i].usStackHighWaterMark * sizeof(StackType_t);
+  }
+  xSemaphoreGive(metrics.mutex);
+
+  free(statuses);
+#endif
+}
+
+void system_metrics_sampler_task(void *pvParameters) {
+  while (true) {
+    system_metrics_sample_stacks();
+
+    vTaskDelay(pdMS_TO_TICKS(SYSTEM_METRICS_SAMPLE_INTERVAL_MS));
+  }
+}
+
+esp_err_t system_metrics_init() {
+  atomic_init(&metrics.count, 0);
+  metrics.mutex = xSemaphoreCreateMutex();
+  if (metrics.mutex == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  if (xTaskCreate(system_metrics_sampler_task, TAG,
+                  SYSTEM_METRICS_TASK_STACK_DEPTH, NULL,
+                  SYSTEM_METRICS_TASK_PRIORITY,
+                  &metrics.tasks.sampler) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
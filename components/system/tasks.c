@@ -0,0 +1,127 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <stdio.h>
+
+#include "system/memory.h"
+#include "system/tasks.h"
+
+static const char *TAG = "SYSTEM:TASKS";
+
+static system_tasks_t tasks = {0};
+
+BaseType_t system_tasks_create(TaskFunction_t fn, const char *name,
+                               uint32_t stack_depth, void *params,
+                               UBaseType_t priority, BaseType_t core,
+                               TaskHandle_t *task_ptr) {
+  TaskHandle_t task = NULL;
+  BaseType_t ret = xTaskCreatePinnedToCore(fn, name, stack_depth, params,
+                                           priority, &task, core);
+  if (task_ptr != NULL) {
+    *task_ptr = task;
+  }
+  if (ret == pdPASS) {
+    system_memory_track_stack(task, stack_depth);
+  }
+  return ret;
+}
+
+#if configGENERATE_RUN_TIME_STATS
+typedef struct system_tasks_load_t {
+  configRUN_TIME_COUNTER_TYPE idle;
+  configRUN_TIME_COUNTER_TYPE total;
+} system_tasks_load_t;
+
+static void system_tasks_sample_load(int32_t core, system_tasks_load_t *last) {
+  TaskHandle_t idle_task = xTaskGetIdleTaskHandleForCore(core);
+  system_tasks_load_t now = {
+      .idle = ulTaskGetRunTimeCounter(idle_task),
+      .total = portGET_RUN_TIME_COUNTER_VALUE(),
+  };
+
+  // unsigned, so a counter that wrapped still gives the right difference
+  configRUN_TIME_COUNTER_TYPE total = now.total - last->total;
+  configRUN_TIME_COUNTER_TYPE idle = now.idle - last->idle;
+  if (last->total != 0 && total > 0 && idle <= total) {
+    system_metrics_set(tasks.cores[core].load_percent,
+                       (int32_t)(100 - (uint64_t)idle * 100 / total));
+  }
+  *last = now;
+}
+#endif
+
+void system_tasks_probe_task(void *pvParameters) {
+  int32_t core = (int32_t)(intptr_t)pvParameters;
+  const TickType_t interval = pdMS_TO_TICKS(SYSTEM_TASKS_PROBE_INTERVAL_MS);
+  const int64_t interval_us = (int64_t)pdTICKS_TO_MS(interval) * 1000;
+#if configGENERATE_RUN_TIME_STATS
+  system_tasks_load_t load = {0};
+#endif
+
+  TickType_t wake = xTaskGetTickCount();
+  int64_t last_us = esp_timer_get_time();
+  for (uint32_t probe = 0;; probe++) {
+    vTaskDelayUntil(&wake, interval);
+    int64_t now_us = esp_timer_get_time();
+
+    // A late wakeup makes the next one early by as much, so only the
+    // lateness is recorded.
+    int64_t late_us = now_us - last_us - interval_us;
+    last_us = now_us;
+    if (late_us > 0) {
+      system_metrics_observe(tasks.cores[core].latency_us, (uint32_t)late_us);
+    } else {
+      system_metrics_observe(tasks.cores[core].latency_us, 0);
+    }
+
+#if configGENERATE_RUN_TIME_STATS
+    if (probe % SYSTEM_TASKS_LOAD_PROBES == 0) {
+      system_tasks_sample_load(core, &load);
+    }
+#endif
+  }
+}
+
+esp_err_t system_tasks_init() {
+  char labels[SYSTEM_METRICS_LABELS_LENGTH];
+  char name[configMAX_TASK_NAME_LEN];
+
+  for (int32_t core = 0; core < SYSTEM_TASKS_CORES; core++) {
+    snprintf(labels, sizeof(labels), "core=\"%ld\"", (long)core);
+
+    system_metric_config_t latency_config = {
+        .name = "sched_latency_us",
+        .help = "How late a task just above the message path woke up",
+        .type = SYSTEM_METRIC_HISTOGRAM,
+        .labels = labels,
+    };
+    ESP_RETURN_ON_ERROR(system_metrics_register(&tasks.cores[core].latency_us,
+                                                &latency_config),
+                        TAG, "Failed to register '%s'", latency_config.name);
+
+#if configGENERATE_RUN_TIME_STATS
+    system_metric_config_t load_config = {
+        .name = "cpu_load_percent",
+        .help = "Time not spent idle",
+        .type = SYSTEM_METRIC_GAUGE,
+        .labels = labels,
+    };
+    ESP_RETURN_ON_ERROR(system_metrics_register(
+                            &tasks.cores[core].load_percent, &load_config),
+                        TAG, "Failed to register '%s'", load_config.name);
+#endif
+
+    snprintf(name, sizeof(name), "probe%ld", (long)core);
+    // on a single core there's nothing to pin to
+    BaseType_t affinity = SYSTEM_TASKS_CORES > 1 ? core : tskNO_AFFINITY;
+    ESP_RETURN_ON_FALSE(
+        system_tasks_create(system_tasks_probe_task, name,
+                            SYSTEM_TASKS_PROBE_STACK_DEPTH,
+                            (void *)(intptr_t)core, SYSTEM_TASKS_PROBE_PRIORITY,
+                            affinity, &tasks.cores[core].probe) == pdPASS,
+        ESP_ERR_NO_MEM, TAG, "Failed to create probe task on core %ld",
+        (long)core);
+  }
+
+  return ESP_OK;
+}
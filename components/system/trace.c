@@ -0,0 +1,218 @@
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "system/memory.h"
+#include "system/trace.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#endif
+
+static const char *TAG = "SYSTEM:TRACE";
+
+#if CONFIG_SYSTEM_TRACE
+
+#define SYSTEM_TRACE_RING_MASK (CONFIG_SYSTEM_TRACE_RING_SIZE - 1)
+
+static system_trace_t trace = {0};
+
+// on the host there are no cycles to count, microseconds are used instead
+static inline uint32_t system_trace_timestamp() {
+#if CONFIG_IDF_TARGET_LINUX
+  return (uint32_t)esp_timer_get_time();
+#else
+  return esp_cpu_get_cycle_count();
+#endif
+}
+
+static inline uint32_t system_trace_core() {
+#if CONFIG_IDF_TARGET_LINUX
+  return 0;
+#else
+  return esp_cpu_get_core_id();
+#endif
+}
+
+static uint32_t system_trace_ticks_per_us() {
+#if CONFIG_IDF_TARGET_LINUX
+  return 1;
+#else
+  return esp_rom_get_cpu_ticks_per_us();
+#endif
+}
+
+void IRAM_ATTR system_trace_record(system_trace_event_id_t id,
+                                   const uint8_t *uuid) {
+  if (!atomic_load_explicit(&trace.recording, memory_order_relaxed)) {
+    return;
+  }
+
+  uint32_t core = system_trace_core();
+  system_trace_ring_t *ring = &trace.rings[core];
+  // a writer preempting us gets the next slot, so there's no lock to take
+  uint32_t position =
+      atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+  system_trace_event_t *event =
+      &ring->events[position & SYSTEM_TRACE_RING_MASK];
+
+  event->seq = 0;
+  event->timestamp = system_trace_timestamp();
+  event->task = (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle();
+  event->id = (uint16_t)id;
+  event->core = (uint8_t)core;
+  if (uuid != NULL) {
+    memcpy(event->uuid, uuid, sizeof(event->uuid));
+  } else {
+    memset(event->uuid, 0, sizeof(event->uuid));
+  }
+
+  atomic_thread_fence(memory_order_release);
+  event->seq = position + 1;
+}
+
+void system_trace_sync_task(void *pvParameters) {
+  uint8_t uuid[8];
+
+  while (true) {
+    int64_t now_us = esp_timer_get_time();
+    // little endian, like the rest of the event
+    memcpy(uuid, &now_us, sizeof(uuid));
+    system_trace_record(SYSTEM_TRACE_SYNC, uuid);
+    vTaskDelay(pdMS_TO_TICKS(SYSTEM_TRACE_SYNC_INTERVAL_MS));
+  }
+}
+
+void system_trace_dump_task(void *pvParameters) {
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_SYSTEM_TRACE_DUMP_INTERVAL_S * 1000));
+    system_trace_dump();
+  }
+}
+
+static void system_trace_dump_tasks() {
+#if configUSE_TRACE_FACILITY
+  UBaseType_t count = uxTaskGetNumberOfTasks();
+  TaskStatus_t *statuses = (TaskStatus_t *)malloc(count * sizeof(TaskStatus_t));
+  if (statuses == NULL) {
+    return;
+  }
+
+  count = uxTaskGetSystemState(statuses, count, NULL);
+  for (UBaseType_t i = 0; i < count; i++) {
+    printf("TRACE_TASK %08" PRIx32 " %s\n",
+           (uint32_t)(uintptr_t)statuses[i].xHandle, statuses[i].pcTaskName);
+  }
+
+  free(statuses);
+#endif
+}
+
+void system_trace_dump() {
+  static const char HEX[] = "0123456789abcdef";
+  char line[sizeof(system_trace_event_t) * 2 + 1];
+
+  if (trace.rings[0].events == NULL) {
+    return;
+  }
+
+  atomic_store(&trace.recording, false);
+  // let writers that already passed the check finish
+  vTaskDelay(1);
+
+  printf("TRACE_BEGIN {\"ticks_per_us\":%" PRIu32
+         ",\"cores\":%d,\"ring_size\":%d}\n",
+         system_trace_ticks_per_us(), SYSTEM_TRACE_CORES,
+         CONFIG_SYSTEM_TRACE_RING_SIZE);
+  system_trace_dump_tasks();
+
+  for (int32_t core = 0; core < SYSTEM_TRACE_CORES; core++) {
+    system_trace_ring_t *ring = &trace.rings[core];
+    uint32_t head = atomic_load(&ring->head);
+    uint32_t start = head > CONFIG_SYSTEM_TRACE_RING_SIZE
+                         ? head - CONFIG_SYSTEM_TRACE_RING_SIZE
+                         : 0;
+
+    for (uint32_t position = start; position != head; position++) {
+      system_trace_event_t *event =
+          &ring->events[position & SYSTEM_TRACE_RING_MASK];
+      // overwritten or torn by a writer that was preempted
+      if (event->seq != position + 1) {
+        continue;
+      }
+
+      const uint8_t *bytes = (const uint8_t *)event;
+      for (int32_t i = 0; i < sizeof(system_trace_event_t); i++) {
+        line[i * 2] = HEX[bytes[i] >> 4];
+        line[i * 2 + 1] = HEX[bytes[i] & 0xf];
+      }
+      line[sizeof(line) - 1] = '\0';
+      printf("TRACE_EVENT %s\n", line);
+    }
+
+    memset(ring->events, 0,
+           CONFIG_SYSTEM_TRACE_RING_SIZE * sizeof(system_trace_event_t));
+    atomic_store(&ring->head, 0);
+  }
+
+  printf("TRACE_END\n");
+  fflush(stdout);
+
+  atomic_store(&trace.recording, true);
+}
+
+esp_err_t system_trace_init() {
+  if ((CONFIG_SYSTEM_TRACE_RING_SIZE & SYSTEM_TRACE_RING_MASK) != 0) {
+    ESP_LOGE(TAG, "Ring size %d is not a power of 2",
+             CONFIG_SYSTEM_TRACE_RING_SIZE);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  for (int32_t core = 0; core < SYSTEM_TRACE_CORES; core++) {
+    atomic_init(&trace.rings[core].head, 0);
+    // written on the message path
+    trace.rings[core].events = (system_trace_event_t *)system_memory_calloc(
+        CONFIG_SYSTEM_TRACE_RING_SIZE, sizeof(system_trace_event_t),
+        SYSTEM_MEMORY_FAST);
+    if (trace.rings[core].events == NULL) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  atomic_store(&trace.recording, true);
+
+  for (int32_t core = 0; core < SYSTEM_TRACE_CORES; core++) {
+    if (xTaskCreatePinnedToCore(
+            system_trace_sync_task, TAG, SYSTEM_TRACE_TASK_STACK_DEPTH, NULL,
+            SYSTEM_TRACE_TASK_PRIORITY, &trace.tasks.sync[core],
+            core) != pdPASS) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  if (CONFIG_SYSTEM_TRACE_DUMP_INTERVAL_S > 0 &&
+      xTaskCreate(system_trace_dump_task, TAG, SYSTEM_TRACE_TASK_STACK_DEPTH,
+                  NULL, SYSTEM_TRACE_TASK_PRIORITY,
+                  &trace.tasks.dump) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+#else
+
+void system_trace_record(system_trace_event_id_t id, const uint8_t *uuid) {}
+
+void system_trace_dump() {
+  ESP_LOGW(TAG, "Tracing is disabled, see CONFIG_SYSTEM_TRACE");
+}
+
+esp_err_t system_trace_init() { return ESP_OK; }
+
+#endif
@@ -3,71 +3,437 @@
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include <inttypes.h>
+#include <string.h>
 
+#include "application/clock.h"
 #include "application/device_info.h"
+#include "application/fragments.h"
+#include "application/memos.h"
 #include "application/message_handler.h"
+#include "application/paging.h"
 #include "application/peers.h"
 #include "application/queues.h"
+#include "application/reliable.h"
+#include "application/session.h"
 #include "io/inputs.h"
+#include "network/diagnostics.h"
 #include "network/events.h"
+#include "network/power.h"
+#include "network/secure.h"
 #include "network/udp.h"
 #include "network/wifi.h"
 #include "storage/nvs.h"
+#include "storage/settings.h"
+#include "system/boot.h"
+#include "system/memory.h"
+#include "system/tasks.h"
+#include "system/metrics.h"
+#include "system/trace.h"
 
 static char *TAG = "APP_MAIN";
 
 #define TALK_BTN_PIN GPIO_NUM_35
+#define BOOT_READY_TIMEOUT_MS 30000
 
+static app_clock_handle_t app_clock_handle;
 static app_device_info_handle_t device_info_handle;
+static app_fragments_handle_t app_fragments_handle;
+static app_memos_handle_t app_memos_handle;
+static app_paging_handle_t app_paging_handle;
 static io_inputs_handle_t io_inputs_handle;
+static network_diagnostics_handle_t network_diagnostics_handle;
 static network_events_handle_t network_events_handle;
+static network_power_handle_t network_power_handle;
+static network_secure_handle_t network_secure_handle;
 static app_peers_handle_t app_peers_handle;
 static app_queues_handle_t app_queues_handle;
+static app_reliable_handle_t app_reliable_handle;
+static app_session_handle_t app_session_handle;
 static network_udp_handle_t network_udp_handle;
 static network_wifi_handle_t network_wifi_handle;
 static protocol_message_handler_handle_t protocol_message_handler_handle;
 
-esp_err_t init_app() {
-  esp_err_t ret = ESP_OK;
+// ----------------
+// Init stages
+// ----------------
+
+typedef enum init_stage_t {
+  INIT_STAGE_TRACE,
+  INIT_STAGE_METRICS,
+  INIT_STAGE_MEMORY,
+  INIT_STAGE_TASKS,
+  INIT_STAGE_NVS,
+  INIT_STAGE_SETTINGS,
+  INIT_STAGE_EVENT_LOOP,
+  INIT_STAGE_DEVICE_INFO,
+  INIT_STAGE_EVENTS,
+  INIT_STAGE_QUEUES,
+  INIT_STAGE_FRAGMENTS,
+  INIT_STAGE_RELIABLE,
+  INIT_STAGE_WIFI,
+  INIT_STAGE_PEERS,
+  INIT_STAGE_POWER,
+  INIT_STAGE_SECURE,
+  INIT_STAGE_UDP,
+  INIT_STAGE_MESSAGE_HANDLER,
+  INIT_STAGE_SESSION,
+  INIT_STAGE_CLOCK,
+  INIT_STAGE_PAGING,
+  INIT_STAGE_IO,
+  INIT_STAGE_MEMOS,
+  INIT_STAGE_DIAGNOSTICS,
+  INIT_STAGE_COUNT,
+} init_stage_t;
+
+static esp_err_t init_trace(void) { return system_trace_init(); }
+
+static esp_err_t init_metrics(void) { return system_metrics_init(); }
+
+static esp_err_t init_memory(void) { return system_memory_init(); }
+
+static esp_err_t init_tasks(void) { return system_tasks_init(); }
+
+static esp_err_t init_nvs(void) { return storage_nvs_init(); }
+
+static esp_err_t init_settings(void) { return storage_settings_init(); }
+
+static esp_err_t init_event_loop(void) {
+  return esp_event_loop_create_default();
+}
+
+static esp_err_t init_device_info(void) {
+  return app_device_info_init(&device_info_handle);
+}
+
+static esp_err_t init_events(void) {
+  return network_events_init(&network_events_handle);
+}
+
+static esp_err_t init_queues(void) {
+  return app_queues_init(&app_queues_handle);
+}
+
+static esp_err_t init_wifi(void) {
+  return network_wifi_init(&network_wifi_handle, network_events_handle);
+}
+
+static esp_err_t init_peers(void) {
+  return app_peers_init(&app_peers_handle, device_info_handle,
+                        app_queues_handle);
+}
+
+static esp_err_t init_power(void) {
+  return network_power_init(&network_power_handle, network_events_handle,
+                            app_peers_handle);
+}
+
+// without a provisioned group key, datagrams are sent in the clear
+static esp_err_t init_secure(void) {
+  uint8_t key[NETWORK_SECURE_KEY_MAX_LENGTH];
+  size_t key_length = sizeof(key);
+  uint32_t epoch = 0;
+
+  esp_err_t ret = storage_nvs_get_group_key(key, &key_length);
+  if (ret == ESP_ERR_NOT_FOUND) {
+    ESP_LOGW(TAG, "No group key, datagrams are not encrypted");
+    return ESP_OK;
+  }
+  ESP_GOTO_ON_ERROR(ret, init_secure_end, TAG, "Failed to read group key");
+  ESP_GOTO_ON_ERROR(storage_nvs_next_epoch(&epoch), init_secure_end, TAG,
+                    "Failed to advance epoch");
+  ret = network_secure_init(&network_secure_handle, key, key_length,
+                            device_info_handle->mac_address, epoch);
+
+init_secure_end:
+  memset(key, 0, sizeof(key));
+  return ret;
+}
 
-  ESP_GOTO_ON_ERROR(storage_nvs_init(), init_app_cleanup, TAG,
-                    "Failed to initialize NVS");
+static esp_err_t init_udp(void) {
+  ESP_RETURN_ON_ERROR(network_udp_init(&network_udp_handle,
+                                       network_events_handle,
+                                       network_power_handle, app_queues_handle,
+                                       device_info_handle),
+                      TAG, "Failed to init UDP");
+  if (network_secure_handle != NULL) {
+    network_udp_set_secure(network_udp_handle, network_secure_handle);
+  }
+  // for the rest of the session, a new zone is joined on the next boot
+  uint32_t zone = storage_settings_get_u32(STORAGE_SETTING_ZONE);
+  if (zone != 0) {
+    ESP_RETURN_ON_ERROR(
+        network_udp_join(network_udp_handle, protocol_group_zone(zone)), TAG,
+        "Failed to join zone %" PRIu32, zone);
+  }
+  return ESP_OK;
+}
 
-  ESP_GOTO_ON_ERROR(esp_event_loop_create_default(), init_app_cleanup, TAG,
-                    "Failed to create event loop");
+static esp_err_t init_fragments(void) {
+  return app_fragments_init(&app_fragments_handle, app_queues_handle);
+}
 
-  ESP_GOTO_ON_ERROR(app_device_info_init(&device_info_handle), init_app_cleanup,
-                    TAG, "Failed to initialize app device info");
+static esp_err_t init_reliable(void) {
+  return app_reliable_init(&app_reliable_handle, device_info_handle,
+                           app_queues_handle);
+}
 
-  ESP_GOTO_ON_ERROR(network_events_init(&network_events_handle),
-                    init_app_cleanup, TAG,
-                    "Failed to initialize network events");
+static esp_err_t init_message_handler(void) {
+  return protocol_message_handler_init(&protocol_message_handler_handle,
+                                       app_peers_handle, app_queues_handle,
+                                       device_info_handle);
+}
 
-  ESP_GOTO_ON_ERROR(app_queues_init(&app_queues_handle), init_app_cleanup, TAG,
-                    "Failed to initialize network queues");
+// Capture would start and stop here, there's none yet. Losing the floor
+// mid-talk is reported here within a frame of the winner's start.
+static void floor_listener(const app_session_floor_t *floor, bool ours,
+                           void *ctx) {
+  if (floor == NULL) {
+    ESP_LOGI(TAG, "The floor is free");
+    return;
+  }
+  ESP_LOGI(TAG, "%02X:%02X:%02X:%02X:%02X:%02X has the floor%s",
+           floor->talker[0], floor->talker[1], floor->talker[2],
+           floor->talker[3], floor->talker[4], floor->talker[5],
+           ours ? ", it's us" : "");
+}
 
-  ESP_GOTO_ON_ERROR(network_udp_init(&network_udp_handle, network_events_handle,
-                                     app_queues_handle, device_info_handle),
-                    init_app_cleanup, TAG, "Failed to initialize network UDP");
+static esp_err_t init_session(void) {
+  ESP_RETURN_ON_ERROR(app_session_init(&app_session_handle, device_info_handle,
+                                       app_queues_handle, app_peers_handle),
+                      TAG, "Failed to init session");
+  app_session_set_listener(app_session_handle, floor_listener, NULL);
+  return ESP_OK;
+}
 
-  ESP_GOTO_ON_ERROR(network_wifi_init(&network_wifi_handle,
-                                      network_events_handle,
-                                      network_udp_handle),
-                    init_app_cleanup, TAG, "Failed to initialize network WiFi");
+static esp_err_t init_clock(void) {
+  return app_clock_init(&app_clock_handle, device_info_handle,
+                        app_peers_handle);
+}
 
-  ESP_GOTO_ON_ERROR(
-      app_peers_init(&app_peers_handle, device_info_handle, app_queues_handle),
-      init_app_cleanup, TAG, "Failed to initialize network peers");
+static esp_err_t init_paging(void) {
+  return app_paging_init(&app_paging_handle, device_info_handle,
+                         app_queues_handle, app_clock_handle);
+}
 
-  ESP_GOTO_ON_ERROR(protocol_message_handler_init(
-                        &protocol_message_handler_handle, app_peers_handle,
-                        app_queues_handle, device_info_handle),
-                    init_app_cleanup, TAG,
-                    "Failed to initialize app message handler");
+// the button is the floor: pressing takes it, releasing gives it back
+static void talk_handler(io_inputs_event_t event, int64_t edge_us, void *ctx) {
+  app_session_handle_t session_handle = (app_session_handle_t)ctx;
 
-  ESP_GOTO_ON_ERROR(io_inputs_init(&io_inputs_handle, TALK_BTN_PIN,
-                                   device_info_handle, app_queues_handle),
-                    init_app_cleanup, TAG, "Failed to initialize IO inputs");
+  switch (event) {
+  case IO_INPUTS_PRESS:
+    if (app_session_talk_start(session_handle) != ESP_OK) {
+      ESP_LOGI(TAG, "Someone else is talking");
+    }
+    break;
+  case IO_INPUTS_RELEASE:
+    app_session_talk_stop(session_handle);
+    break;
+  case IO_INPUTS_HOLD:
+    break;
+  }
+}
+
+static esp_err_t init_io(void) {
+  ESP_RETURN_ON_ERROR(io_inputs_init(&io_inputs_handle, TALK_BTN_PIN,
+                                     device_info_handle, app_queues_handle,
+                                     network_power_handle),
+                      TAG, "Failed to init inputs");
+  io_inputs_set_talk_handler(io_inputs_handle, talk_handler,
+                             app_session_handle);
+  return ESP_OK;
+}
+
+// without a memos partition, nothing is recorded
+static esp_err_t init_memos(void) {
+  esp_err_t ret = app_memos_init(&app_memos_handle, device_info_handle,
+                                 app_queues_handle, app_session_handle);
+  if (ret == ESP_ERR_NOT_FOUND) {
+    ESP_LOGW(TAG, "No memos partition, audio is not recorded");
+    return ESP_OK;
+  }
+  return ret;
+}
+
+static esp_err_t init_diagnostics(void) {
+  ESP_RETURN_ON_ERROR(
+      network_diagnostics_init(&network_diagnostics_handle,
+                               network_events_handle, device_info_handle,
+                               app_peers_handle, app_queues_handle),
+      TAG, "Failed to init diagnostics");
+  if (app_memos_handle != NULL) {
+    network_diagnostics_set_memos(network_diagnostics_handle,
+                                  app_memos_handle);
+  }
+  return ESP_OK;
+}
+
+// WiFi association is by far the slowest part of boot, so it only depends on
+// what the driver needs. Everything else runs while it associates.
+static system_boot_stage_t init_stages[INIT_STAGE_COUNT] = {
+    [INIT_STAGE_TRACE] = {.name = "trace", .fn = init_trace},
+    [INIT_STAGE_METRICS] = {.name = "metrics", .fn = init_metrics},
+    [INIT_STAGE_MEMORY] =
+        {
+            .name = "memory",
+            .fn = init_memory,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_METRICS),
+        },
+    [INIT_STAGE_TASKS] =
+        {
+            .name = "tasks",
+            .fn = init_tasks,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_MEMORY),
+        },
+    [INIT_STAGE_NVS] = {.name = "nvs", .fn = init_nvs},
+    [INIT_STAGE_SETTINGS] =
+        {
+            .name = "settings",
+            .fn = init_settings,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_NVS),
+        },
+    [INIT_STAGE_EVENT_LOOP] = {.name = "event_loop", .fn = init_event_loop},
+    [INIT_STAGE_DEVICE_INFO] =
+        {
+            .name = "device_info",
+            .fn = init_device_info,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_NVS),
+        },
+    [INIT_STAGE_EVENTS] = {.name = "events", .fn = init_events},
+    // everything registering metrics or tracking its stack comes after the
+    // queues
+    [INIT_STAGE_QUEUES] =
+        {
+            .name = "queues",
+            .fn = init_queues,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_SETTINGS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_MEMORY),
+        },
+    [INIT_STAGE_WIFI] =
+        {
+            .name = "wifi",
+            .fn = init_wifi,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_SETTINGS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_EVENT_LOOP) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_EVENTS),
+        },
+    [INIT_STAGE_PEERS] =
+        {
+            .name = "peers",
+            .fn = init_peers,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_SETTINGS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES),
+        },
+    [INIT_STAGE_POWER] =
+        {
+            .name = "power",
+            .fn = init_power,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_EVENTS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_PEERS),
+        },
+    [INIT_STAGE_SECURE] =
+        {
+            .name = "secure",
+            .fn = init_secure,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_NVS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_MEMORY),
+        },
+    [INIT_STAGE_FRAGMENTS] =
+        {
+            .name = "fragments",
+            .fn = init_fragments,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_MEMORY) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_TASKS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES),
+        },
+    [INIT_STAGE_RELIABLE] =
+        {
+            .name = "reliable",
+            .fn = init_reliable,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_TASKS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES),
+        },
+    [INIT_STAGE_UDP] =
+        {
+            .name = "udp",
+            .fn = init_udp,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_SETTINGS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_EVENTS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_POWER) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_SECURE),
+        },
+    [INIT_STAGE_MESSAGE_HANDLER] =
+        {
+            .name = "message_handler",
+            .fn = init_message_handler,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_PEERS),
+        },
+    [INIT_STAGE_SESSION] =
+        {
+            .name = "session",
+            .fn = init_session,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_PEERS),
+        },
+    [INIT_STAGE_CLOCK] =
+        {
+            .name = "clock",
+            .fn = init_clock,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_PEERS),
+        },
+    [INIT_STAGE_PAGING] =
+        {
+            .name = "paging",
+            .fn = init_paging,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_CLOCK),
+        },
+    [INIT_STAGE_IO] =
+        {
+            .name = "io",
+            .fn = init_io,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_POWER) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_SESSION),
+        },
+    [INIT_STAGE_MEMOS] =
+        {
+            .name = "memos",
+            .fn = init_memos,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_TASKS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_SETTINGS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_QUEUES) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_SESSION),
+        },
+    [INIT_STAGE_DIAGNOSTICS] =
+        {
+            .name = "diagnostics",
+            .fn = init_diagnostics,
+            .deps = SYSTEM_BOOT_DEP(INIT_STAGE_DEVICE_INFO) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_EVENTS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_PEERS) |
+                    SYSTEM_BOOT_DEP(INIT_STAGE_MEMOS),
+        },
+};
+
+esp_err_t init_app() {
+  esp_err_t ret = ESP_OK;
+
+  ESP_GOTO_ON_ERROR(system_boot_run(init_stages, INIT_STAGE_COUNT),
+                    init_app_cleanup, TAG, "Failed to run init stages");
 
   ESP_LOGI(TAG, "Device name: %s", device_info_handle->name);
   ESP_LOGI(
@@ -93,4 +459,13 @@ void app_main(void) {
   }
 
   ESP_LOGD(TAG, "App initialized successfully");
+
+  // "ready" is when we can talk to peers
+  if (xEventGroupWaitBits(network_events_handle->group_handle,
+                          NETWORK_EVENT_SOCKET_READY, pdFALSE, pdFALSE,
+                          pdMS_TO_TICKS(BOOT_READY_TIMEOUT_MS)) &
+      NETWORK_EVENT_SOCKET_READY) {
+    system_boot_mark_ready();
+  }
+  system_boot_report();
 }
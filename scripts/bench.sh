@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Builds and runs the message pipeline benchmarks on the host, saving the
+# output so runs can be compared with `tools/bench/compare.py`:
+#   ./scripts/bench.sh before.txt
+#   ./scripts/bench.sh after.txt
+#   ./tools/bench/compare.py before.txt after.txt
+#
+# On device, build `tools/bench` for esp32 and save the monitor output instead,
+# the same `BENCH {...}` lines are printed.
+
+OUTPUT=${1:-bench_output.txt}
+
+echo "Building benchmarks...\n"
+
+source ${HOME}/.espressif/tools/activate_idf_v5.5.2.sh;
+
+cd tools/bench;
+${IDF_PATH}/tools/idf.py --preview set-target linux;
+${IDF_PATH}/tools/idf.py -G Ninja build || exit 1;
+cd ../..;
+
+./tools/bench/build/cominter_bench.elf | tee ${OUTPUT};
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# Builds and runs the host simulator. Everything is configured through
+# environment variables, for example:
+#   SIM_STATIONS=8 SIM_LOSS_PCT=5 SIM_LATENCY_MS=20 SIM_JITTER_MS=10 \
+#     SIM_REORDER_PCT=2 SIM_DURATION_S=60 ./scripts/simulate.sh
+#
+# SIM_STATIONS        stations in this process (default 4, max 32)
+# SIM_FIRST_ID        id of the first station, for running several processes
+# SIM_EXPECTED_PEERS  peers each station must find (default SIM_STATIONS - 1)
+# SIM_DURATION_S      how long to run before checking peers (default 30)
+# SIM_HEARTBEAT_MS    overrides the heartbeat interval setting
+# SIM_LOSS_PCT        percent of datagrams dropped
+# SIM_LATENCY_MS      added to every datagram
+# SIM_JITTER_MS       up to this much more, at random
+# SIM_REORDER_PCT     percent of datagrams held back by SIM_REORDER_MS (50)
+# SIM_SEED            same seed, same impairments (default 1)
+# SIM_SECURE          1 seals every datagram with a shared test key
+# SIM_TEXTS           texts each station sends, then reports how many were
+#                     delivered and how late (default 0)
+# SIM_TEXT_INTERVAL_MS  between texts (default 500)
+# SIM_RELIABLE        0 sends the texts best-effort, to compare (default 1)
+# SIM_CLOCK_PPM       each station's clock runs up to this fast or slow, the
+#                     report shows how far the shared clocks are apart
+#                     (default 100)
+# SIM_PAGE_S          the last station pages every other for this long, the
+#                     report shows how far apart they played each frame
+#                     (default 0)
+# SIM_JOIN_S          the last station starts this far into the run, the
+#                     report shows how long until it and the rest knew
+#                     each other (default 0)
+# SIM_ZONES           stations are dealt into this many zones, each joining
+#                     its zone's group, and pages go to the first zone only
+#                     (default 0)
+# SIM_TALKS           rounds in which every station presses talk at once, the
+#                     report shows how many settled on one talker and how
+#                     soon the losers stopped (default 0)
+#
+# Exits non-zero if any station is missing peers, or the stations never
+# agree on a shared clock. Loopback multicast must be
+# enabled: `sudo ip link set lo multicast on`.
+
+echo "Building simulator...\n"
+
+source ${HOME}/.espressif/tools/activate_idf_v5.5.2.sh;
+
+cd tools/simulator;
+${IDF_PATH}/tools/idf.py --preview set-target linux;
+${IDF_PATH}/tools/idf.py -G Ninja build || exit 1;
+
+./build/cominter_simulator.elf;
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Compares two benchmark runs and exits non-zero on a regression.
+
+Each run is the captured output of the bench app (host or device monitor),
+only the `BENCH {...}` lines are read:
+
+  ./tools/bench/compare.py before.txt after.txt [--threshold 10]
+"""
+
+import argparse
+import json
+import sys
+
+# higher is better for ops, lower is better for the latencies
+METRICS = [
+    ("ops_per_sec", True),
+    ("p50_ns", False),
+    ("p99_ns", False),
+    ("p999_ns", False),
+]
+
+
+def load(path):
+    results = {}
+    with open(path, encoding="utf-8", errors="replace") as f:
+        for line in f:
+            start = line.find("BENCH {")
+            if start < 0:
+                continue
+            result = json.loads(line[start + len("BENCH "):])
+            results[result["name"]] = result
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("before")
+    parser.add_argument("after")
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=10.0,
+        help="percent change that counts as a regression (default 10)",
+    )
+    args = parser.parse_args()
+
+    before = load(args.before)
+    after = load(args.after)
+    regressions = 0
+
+    print(f"{'benchmark':<28}" + "".join(f"{m:>22}" for m, _ in METRICS))
+    for name in sorted(before.keys() & after.keys()):
+        row = f"{name:<28}"
+        for metric, higher_is_better in METRICS:
+            old = before[name][metric]
+            new = after[name][metric]
+            change = (new - old) * 100.0 / old if old else 0.0
+            worse = -change if higher_is_better else change
+            flag = "!" if worse > args.threshold else " "
+            regressions += flag == "!"
+            row += f"{old:>9} > {new:>9}{flag}".rjust(22)
+        print(row)
+
+    for name in sorted(before.keys() ^ after.keys()):
+        print(f"{name}: only in one run")
+
+    if regressions:
+        print(f"{regressions} metrics regressed by more than {args.threshold}%")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
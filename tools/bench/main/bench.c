@@ -0,0 +1,1136 @@
+// Measures each stage of the message lifecycle, from creating a message to a
+// subscriber receiving it. See `scripts/bench.sh`.
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "application/queues.h"
+#include "application/router.h"
+#include "audio/comfort_noise.h"
+#include "audio/drift.h"
+#include "audio/echo.h"
+#include "audio/resampler.h"
+#include "audio/vad.h"
+#include "clips.h"
+#include "harness.h"
+#include "network/secure.h"
+#include "protocols/messages.h"
+#include "storage/memos.h"
+#include "storage/nvs.h"
+#include "storage/settings.h"
+#include "system/metrics.h"
+
+// match the UDP read task and the message handler
+#define BENCH_PIPELINE_TASK_PRIORITY_FORWARD 5
+#define BENCH_PIPELINE_TASK_PRIORITY_CONSUME 3
+#define BENCH_PIPELINE_TASK_STACK_DEPTH                                        \
+  ((1024 * 4) + PROTOCOL_MESSAGE_MAX_LENGTH)
+#define BENCH_PIPELINE_ITERATIONS (BENCH_ITERATIONS / 10)
+
+#define BENCH_ROUTER_QUEUE_DEPTH 16
+
+// Type lookups are too quick to time one at a time, each sample is this
+// many. Mostly audio, like the wire.
+#define BENCH_TYPES_BATCH 64
+
+// about a 20ms frame of compressed speech
+#define BENCH_MEMOS_FRAME_LENGTH 160
+// A sector holds about 25 frames, so a runway of two never runs out when
+// it's topped up between frames.
+#define BENCH_MEMOS_RUNWAY 2
+
+// the clip the VAD's cost is measured on, small enough for the device
+#define BENCH_VAD_CLIP_SECONDS 1
+// the accuracy clips, host only
+#define BENCH_VAD_ACCURACY_SECONDS 30
+// of the speech frames, in any clip at least 10dB above its noise
+#define BENCH_VAD_SPEECH_KEPT_MIN 0.9
+
+// the far end talking, heard through each path, host only
+#define BENCH_ECHO_ACCURACY_SECONDS 30
+// left for the canceller to converge before it's measured
+#define BENCH_ECHO_CONVERGE_S 5
+// with only the far end talking, on every path within the canceller's tail
+#define BENCH_ECHO_ERLE_MIN_DB 20.0
+// the microphone's own noise, about -60dBov
+#define BENCH_ECHO_NOISE_PEAK 32.0f
+
+// both crystals as far off as they're specified, either way
+#define BENCH_DRIFT_CLOCK_PPM 100
+// a session of, host only
+#define BENCH_DRIFT_SESSION_S 3600
+// on top of the quickest a frame gets through
+#define BENCH_DRIFT_JITTER_MS 20
+// the depth isn't counted until the estimate settles
+#define BENCH_DRIFT_SETTLE_S 60
+// a tone well inside every rate's passband, its reproduction
+#define BENCH_RESAMPLER_TONE_HZ 1000
+#define BENCH_RESAMPLER_SNR_MIN_DB 40.0
+
+static const char *TAG = "BENCH";
+
+static protocol_mac_address_t FROM_MAC_ADDRESS = {0x02, 0, 0, 0, 0, 1};
+static protocol_mac_address_t TO_MAC_ADDRESS = {255, 255, 255, 255, 255, 255};
+// a typical short text, 64 bytes with the terminator
+static char TEXT[] =
+    "The quick brown fox jumps over the lazy dog, again and again...";
+// only for the benchmarks, never provisioned
+static const uint8_t GROUP_KEY[16] = {0x42, 0x65, 0x6e, 0x63, 0x68};
+// the largest body, so the result bounds every frame size
+static uint8_t AUDIO[PROTOCOL_MESSAGE_BODY_MAX_LENGTH];
+
+typedef struct bench_pipeline_t {
+  app_queues_handle_t queues;
+  app_router_subscriber_handle_t subscriber;
+  bench_run_t *run;
+  uint32_t received;
+  bench_ticks_t last_ticks;
+  SemaphoreHandle_t done;
+} bench_pipeline_t;
+
+static bench_pipeline_t pipeline;
+static app_router_handle_t router;
+static app_router_subscriber_handle_t router_subscriber;
+// the two ends of a link, so the receiver keeps its own replay state
+static network_secure_handle_t secure_sender;
+static network_secure_handle_t secure_receiver;
+static storage_memos_handle_t memos;
+static bench_clip_t vad_clip;
+static audio_vad_handle_t vad;
+static bench_clip_t echo_clip;
+static audio_echo_handle_t echo;
+static int16_t *echo_output;
+static audio_resampler_handle_t resampler;
+static int16_t *resampler_output;
+
+// // ----------------
+// // Messages
+// // ----------------
+
+static void bench_message_init(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    bench_ticks_t start = bench_ticks();
+    protocol_message_init_text(&message, TEXT, FROM_MAC_ADDRESS,
+                               TO_MAC_ADDRESS);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+    protocol_message_free(message);
+  }
+}
+
+static void bench_message_free(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    protocol_message_init_text(&message, TEXT, FROM_MAC_ADDRESS,
+                               TO_MAC_ADDRESS);
+
+    bench_ticks_t start = bench_ticks();
+    protocol_message_free(message);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+  }
+}
+
+static void bench_message_encode(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+  uint8_t buffer[PROTOCOL_MESSAGE_MAX_LENGTH];
+  int32_t length = 0;
+
+  protocol_message_init_text(&message, TEXT, FROM_MAC_ADDRESS, TO_MAC_ADDRESS);
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    bench_ticks_t start = bench_ticks();
+    protocol_message_encode(message, buffer, &length);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+  }
+
+  protocol_message_free(message);
+}
+
+static void bench_message_decode(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+  uint8_t buffer[PROTOCOL_MESSAGE_MAX_LENGTH];
+  int32_t length = 0;
+
+  protocol_message_init_text(&message, TEXT, FROM_MAC_ADDRESS, TO_MAC_ADDRESS);
+  protocol_message_encode(message, buffer, &length);
+  protocol_message_free(message);
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    bench_ticks_t start = bench_ticks();
+    protocol_message_decode(&message, buffer, length);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+    protocol_message_free(message);
+  }
+}
+
+// // ----------------
+// // Message types
+// // ----------------
+
+static protocol_message_type_t bench_types[BENCH_TYPES_BATCH];
+static volatile int32_t bench_types_sink;
+
+static void bench_types_init() {
+  for (int32_t i = 0; i < BENCH_TYPES_BATCH; i++) {
+    bench_types[i] = i % 16 == 0   ? MESSAGE_TYPE_HEARTBEAT
+                     : i % 16 == 8 ? MESSAGE_TYPE_COMFORT_NOISE
+                     : i % 32 == 4 ? MESSAGE_TYPE_TEXT
+                                   : MESSAGE_TYPE_AUDIO;
+  }
+}
+
+// what the per-type switches answered before the registry, kept out of line
+// like `protocol_message_type_get`
+static __attribute__((noinline)) int32_t
+bench_types_switch(protocol_message_type_t type,
+                   protocol_message_priority_t *priority_ptr) {
+  switch (type) {
+  case MESSAGE_TYPE_HEARTBEAT:
+    *priority_ptr = PROTOCOL_MESSAGE_PRIORITY_NORMAL;
+    return PROTOCOL_MESSAGE_BODY_MAX_LENGTH;
+  case MESSAGE_TYPE_TEXT:
+    *priority_ptr = PROTOCOL_MESSAGE_PRIORITY_NORMAL;
+    return 4096;
+  case MESSAGE_TYPE_AUDIO:
+    *priority_ptr = PROTOCOL_MESSAGE_PRIORITY_HIGH;
+    return PROTOCOL_MESSAGE_BODY_MAX_LENGTH;
+  case MESSAGE_TYPE_COMFORT_NOISE:
+    *priority_ptr = PROTOCOL_MESSAGE_PRIORITY_HIGH;
+    return 16;
+  default:
+    return -1;
+  }
+}
+
+static void bench_types_registry(bench_run_t *run) {
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    int32_t sum = 0;
+
+    bench_ticks_t start = bench_ticks();
+    for (int32_t j = 0; j < BENCH_TYPES_BATCH; j++) {
+      const protocol_message_type_info_t *info =
+          protocol_message_type_get(bench_types[j]);
+      if (info != NULL) {
+        sum += info->max_length + info->priority;
+      }
+    }
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+    bench_types_sink = sum;
+  }
+}
+
+static void bench_types_switched(bench_run_t *run) {
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    int32_t sum = 0;
+
+    bench_ticks_t start = bench_ticks();
+    for (int32_t j = 0; j < BENCH_TYPES_BATCH; j++) {
+      protocol_message_priority_t priority = PROTOCOL_MESSAGE_PRIORITY_NORMAL;
+      int32_t max_length = bench_types_switch(bench_types[j], &priority);
+      if (max_length >= 0) {
+        sum += max_length + priority;
+      }
+    }
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+    bench_types_sink = sum;
+  }
+}
+
+// // ----------------
+// // Queues
+// // ----------------
+
+static void bench_queues_outgoing(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+
+  protocol_message_init_text(&message, TEXT, FROM_MAC_ADDRESS, TO_MAC_ADDRESS);
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    bench_ticks_t start = bench_ticks();
+    app_queues_add_outgoing_message(pipeline.queues, &message, 0, false);
+    app_queues_receive_outgoing_message(pipeline.queues, &message, 0);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+  }
+
+  protocol_message_free(message);
+}
+
+static void bench_router_publish_receive(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    protocol_message_init_text(&message, TEXT, FROM_MAC_ADDRESS,
+                               TO_MAC_ADDRESS);
+
+    bench_ticks_t start = bench_ticks();
+    app_router_publish(router, &message);
+    app_router_receive(router_subscriber, &message, 0);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+    protocol_message_free(message);
+  }
+}
+
+// // ----------------
+// // Security
+// // ----------------
+
+// what a talker and each listener spend on one audio frame
+static void bench_secure_roundtrip(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+  uint8_t buffer[PROTOCOL_MESSAGE_MAX_LENGTH];
+  int32_t length = 0;
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    // every datagram needs its own UUID, or it's a replay
+    protocol_message_init_audio(&message, AUDIO, sizeof(AUDIO),
+                                FROM_MAC_ADDRESS, TO_MAC_ADDRESS);
+    protocol_message_encode(message, buffer, &length);
+    protocol_message_free(message);
+
+    bench_ticks_t start = bench_ticks();
+    network_secure_seal(secure_sender, buffer, &length);
+    esp_err_t ret = network_secure_open(secure_receiver, buffer, &length);
+    bench_ticks_t end = bench_ticks();
+
+    if (ret == ESP_OK) {
+      bench_sample(run, start, end);
+    }
+  }
+}
+
+// // ----------------
+// // Memos
+// // ----------------
+
+// What the recorder spends on a frame, flash writes and erasing its share
+// of the runway included.
+static void bench_memos_append(bench_run_t *run) {
+  uint32_t memo = 0;
+
+  storage_memos_begin(memos, FROM_MAC_ADDRESS, 20, &memo);
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    bench_ticks_t start = bench_ticks();
+    storage_memos_prepare(memos, BENCH_MEMOS_RUNWAY);
+    esp_err_t ret =
+        storage_memos_append(memos, memo, AUDIO, BENCH_MEMOS_FRAME_LENGTH);
+    bench_ticks_t end = bench_ticks();
+
+    if (ret == ESP_OK) {
+      bench_sample(run, start, end);
+    }
+  }
+  storage_memos_flush(memos);
+}
+
+// the same, with the runway topped up between frames like the recorder does
+// while it's idle
+static void bench_memos_append_prepared(bench_run_t *run) {
+  uint32_t memo = 0;
+
+  storage_memos_begin(memos, FROM_MAC_ADDRESS, 20, &memo);
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    storage_memos_prepare(memos, BENCH_MEMOS_RUNWAY);
+
+    bench_ticks_t start = bench_ticks();
+    esp_err_t ret =
+        storage_memos_append(memos, memo, AUDIO, BENCH_MEMOS_FRAME_LENGTH);
+    bench_ticks_t end = bench_ticks();
+
+    if (ret == ESP_OK) {
+      bench_sample(run, start, end);
+    }
+  }
+  storage_memos_flush(memos);
+}
+
+// // ----------------
+// // Voice activity
+// // ----------------
+
+// what the capture task spends deciding whether to send a frame
+static void bench_vad_process(bench_run_t *run) {
+  audio_comfort_noise_descriptor_t descriptor;
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    const int16_t *frame =
+        vad_clip.samples + (i % vad_clip.frames) * vad_clip.frame_length;
+
+    bench_ticks_t start = bench_ticks();
+    audio_vad_process(vad, frame, vad_clip.frame_length, &descriptor);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+  }
+}
+
+// what a receiver spends on each frame of a silent talker
+static void bench_comfort_noise_generate(bench_run_t *run) {
+  audio_comfort_noise_t noise;
+  audio_comfort_noise_descriptor_t descriptor = {
+      .level = 50,
+      .reflection = {20, 120, 127, 127},
+  };
+  int16_t *frame = (int16_t *)calloc(vad_clip.frame_length, sizeof(int16_t));
+  if (frame == NULL) {
+    return;
+  }
+
+  audio_comfort_noise_init(&noise, 1);
+  audio_comfort_noise_set(&noise, &descriptor);
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    bench_ticks_t start = bench_ticks();
+    audio_comfort_noise_generate(&noise, frame, vad_clip.frame_length);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+  }
+  free(frame);
+}
+
+// what the capture task spends cancelling the speaker's echo
+static void bench_echo_process(bench_run_t *run) {
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    int32_t at = (i % echo_clip.frames) * echo_clip.frame_length;
+
+    bench_ticks_t start = bench_ticks();
+    audio_echo_process(echo, vad_clip.samples + at, echo_clip.samples + at,
+                       echo_output, echo_clip.frame_length);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+  }
+}
+
+// what the playback task spends following a sender's clock
+static void bench_resampler_process(bench_run_t *run) {
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    const int16_t *frame =
+        vad_clip.samples + (i % vad_clip.frames) * vad_clip.frame_length;
+
+    bench_ticks_t start = bench_ticks();
+    audio_resampler_process(resampler, frame, vad_clip.frame_length,
+                            resampler_output);
+    bench_ticks_t end = bench_ticks();
+
+    bench_sample(run, start, end);
+  }
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+
+// Resamples a tone between each pair of rates and prints one line per pair:
+//   RESAMPLER {"from_hz":...,"to_hz":...,"snr_db":...}
+// against the tone as it should come out. Returns how many were too noisy.
+static int32_t bench_resampler_accuracy() {
+  const struct {
+    uint32_t from_hz;
+    uint32_t to_hz;
+    float drift_ppm;
+  } pairs[] = {
+      {16000, 16000, BENCH_DRIFT_CLOCK_PPM * 2},
+      {16000, 16000, -BENCH_DRIFT_CLOCK_PPM * 2},
+      {8000, 16000, 0},
+      {48000, 16000, 0},
+      {16000, 48000, 0},
+  };
+  int32_t failed = 0;
+
+  for (int32_t p = 0; p < sizeof(pairs) / sizeof(pairs[0]); p++) {
+    audio_resampler_handle_t pair_resampler = NULL;
+    int32_t count = pairs[p].from_hz;
+    int16_t *input = (int16_t *)calloc(count, sizeof(int16_t));
+    int16_t *output = NULL;
+    if (input == NULL || audio_resampler_init(&pair_resampler, pairs[p].from_hz,
+                                              pairs[p].to_hz) != ESP_OK) {
+      free(input);
+      failed++;
+      continue;
+    }
+    audio_resampler_set_drift_ppm(pair_resampler, pairs[p].drift_ppm);
+    output = (int16_t *)calloc(
+        audio_resampler_output_max(pair_resampler, count), sizeof(int16_t));
+    if (output == NULL) {
+      free(input);
+      free(pair_resampler);
+      failed++;
+      continue;
+    }
+
+    double omega = 2 * M_PI * BENCH_RESAMPLER_TONE_HZ / pairs[p].from_hz;
+    for (int32_t i = 0; i < count; i++) {
+      input[i] = (int16_t)(10000 * sin(omega * i));
+    }
+    int32_t written = audio_resampler_process(pair_resampler, input, count,
+                                              output);
+
+    // output n is the input at n steps, half the filter late, once the
+    // filter is past the silence it started with
+    double step = (double)pair_resampler->step / 4294967296.0;
+    double signal_energy = 0;
+    double noise_energy = 0;
+    for (int32_t n = (int32_t)(pair_resampler->taps / step); n < written;
+         n++) {
+      double expected = 10000 * sin(omega * (n * step -
+                                             pair_resampler->taps / 2));
+      signal_energy += expected * expected;
+      noise_energy += (output[n] - expected) * (output[n] - expected);
+    }
+
+    double snr_db = 10 * log10((signal_energy + 1) / (noise_energy + 1));
+    printf("RESAMPLER {\"from_hz\":%u,\"to_hz\":%u,\"drift_ppm\":%.0f,"
+           "\"snr_db\":%.1f}\n",
+           (unsigned)pairs[p].from_hz, (unsigned)pairs[p].to_hz,
+           pairs[p].drift_ppm, snr_db);
+    if (snr_db < BENCH_RESAMPLER_SNR_MIN_DB) {
+      ESP_LOGE(TAG, "%u to %uHz: only %.1fdB", (unsigned)pairs[p].from_hz,
+               (unsigned)pairs[p].to_hz, snr_db);
+      failed++;
+    }
+    free(input);
+    free(output);
+    free(pair_resampler);
+  }
+
+  fflush(stdout);
+  return failed;
+}
+
+// Plays an hour of a sender's frames through a playout buffer, the two
+// clocks as far apart as the crystals allow, and prints one line per run:
+//   DRIFT {"from_hz":...,"sender_ppm":...,"estimated_ppm":...,...}
+// Frames are stamped with the sender's clock and delayed by up to
+// `BENCH_DRIFT_JITTER_MS`; the receiver's own clock plays one every frame,
+// the buffer filled to `target_ms` first. Returns how many runs ran dry or
+// overflowed.
+static int32_t bench_drift_session(uint32_t frame_ms, uint32_t target_ms) {
+  const struct {
+    uint32_t from_hz;
+    int32_t sender_ppm;
+    int32_t receiver_ppm;
+  } runs[] = {
+      {16000, BENCH_DRIFT_CLOCK_PPM, -BENCH_DRIFT_CLOCK_PPM},
+      {16000, -BENCH_DRIFT_CLOCK_PPM, BENCH_DRIFT_CLOCK_PPM},
+      {8000, BENCH_DRIFT_CLOCK_PPM, -BENCH_DRIFT_CLOCK_PPM},
+      {48000, -BENCH_DRIFT_CLOCK_PPM, BENCH_DRIFT_CLOCK_PPM},
+  };
+  const uint32_t to_hz = BENCH_CLIPS_SAMPLE_RATE_HZ;
+  const double frame_us = frame_ms * 1000.0;
+  const int32_t played = to_hz * frame_ms / 1000;
+  // three times the target is as much as the buffer holds
+  const int32_t capacity = 3 * to_hz * target_ms / 1000;
+  int32_t failed = 0;
+
+  for (int32_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+    audio_drift_handle_t drift = NULL;
+    audio_resampler_handle_t session_resampler = NULL;
+    int32_t sent = runs[r].from_hz * frame_ms / 1000;
+    int16_t *frame = (int16_t *)calloc(sent, sizeof(int16_t));
+    int16_t *output = NULL;
+    if (frame == NULL || audio_drift_init(&drift) != ESP_OK ||
+        audio_resampler_init(&session_resampler, runs[r].from_hz, to_hz) !=
+            ESP_OK) {
+      free(frame);
+      free(drift);
+      failed++;
+      continue;
+    }
+    output = (int16_t *)calloc(
+        audio_resampler_output_max(session_resampler, sent), sizeof(int16_t));
+    if (output == NULL) {
+      free(frame);
+      free(drift);
+      free(session_resampler);
+      failed++;
+      continue;
+    }
+    for (int32_t i = 0; i < sent; i++) {
+      frame[i] = (int16_t)(8000 * sin(2 * M_PI * i * 5 / sent));
+    }
+
+    double sender_rate = 1 + runs[r].sender_ppm * 1e-6;
+    double receiver_rate = 1 + runs[r].receiver_ppm * 1e-6;
+    uint32_t seed = 3;
+    double last_arrival_us = 0;
+    // when playback started, and frames played since
+    double start_us = -1;
+    int64_t ticks = 0;
+    int32_t depth = 0;
+    int32_t depth_min = INT32_MAX;
+    int32_t depth_max = 0;
+    int32_t underruns = 0;
+    int32_t overflows = 0;
+
+    int64_t frames = (int64_t)BENCH_DRIFT_SESSION_S * 1000 / frame_ms;
+    for (int64_t k = 0; k < frames; k++) {
+      // in true time, which neither station sees
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      double arrival_us = k * frame_us / sender_rate + 2000 +
+                          BENCH_DRIFT_JITTER_MS * 1000.0 * (seed >> 8) /
+                              16777216.0;
+      // the network keeps them in order
+      if (arrival_us < last_arrival_us) {
+        arrival_us = last_arrival_us;
+      }
+      last_arrival_us = arrival_us;
+
+      // the frames played before this one got here
+      while (start_us >= 0 &&
+             start_us + ticks * frame_us / receiver_rate <= arrival_us) {
+        float depth_ms = depth * 1000.0f / to_hz;
+        audio_resampler_set_drift_ppm(
+            session_resampler,
+            audio_drift_playout_ppm(drift, depth_ms, target_ms));
+        if (depth < played) {
+          underruns++;
+          depth = 0;
+        } else {
+          depth -= played;
+        }
+        if (start_us + ticks * frame_us / receiver_rate >=
+            BENCH_DRIFT_SETTLE_S * 1e6) {
+          depth_min = depth < depth_min ? depth : depth_min;
+          depth_max = depth > depth_max ? depth : depth_max;
+        }
+        ticks++;
+      }
+
+      // each station's clock started at a different time
+      int64_t sent_us = (int64_t)(k * frame_us) + 5000000;
+      int64_t local_us = (int64_t)(arrival_us * receiver_rate) + 70000000;
+      audio_drift_update(drift, sent_us, local_us);
+
+      depth += audio_resampler_process(session_resampler, frame, sent, output);
+      if (depth > capacity) {
+        overflows++;
+        depth -= sent;
+      }
+      if (start_us < 0 && depth * 1000 >= (int32_t)(target_ms * to_hz)) {
+        start_us = arrival_us;
+      }
+    }
+
+    // what the clocks would have done to the buffer without any of this
+    double uncompensated_ms = (runs[r].sender_ppm - runs[r].receiver_ppm) *
+                              1e-6 * BENCH_DRIFT_SESSION_S * 1000;
+    printf("DRIFT {\"from_hz\":%u,\"to_hz\":%u,\"sender_ppm\":%d,"
+           "\"receiver_ppm\":%d,\"estimated_ppm\":%.1f,"
+           "\"depth_ms_min\":%.1f,\"depth_ms_max\":%.1f,"
+           "\"depth_ms_end\":%.1f,\"underruns\":%d,\"overflows\":%d,"
+           "\"uncompensated_ms\":%.0f}\n",
+           (unsigned)runs[r].from_hz, (unsigned)to_hz, (int)runs[r].sender_ppm,
+           (int)runs[r].receiver_ppm, audio_drift_ppm(drift),
+           depth_min * 1000.0 / to_hz, depth_max * 1000.0 / to_hz,
+           depth * 1000.0 / to_hz, (int)underruns, (int)overflows,
+           uncompensated_ms);
+    if (underruns > 0 || overflows > 0) {
+      ESP_LOGE(TAG, "%uHz at %dppm: %d underruns, %d overflows",
+               (unsigned)runs[r].from_hz, (int)runs[r].sender_ppm,
+               (int)underruns, (int)overflows);
+      failed++;
+    }
+    free(frame);
+    free(output);
+    free(drift);
+    free(session_resampler);
+  }
+
+  fflush(stdout);
+  return failed;
+}
+
+// Runs the canceller on the far end's echo through each path, alone and with
+// the near end talking over it, and prints one line per run:
+//   ECHO {"path":...,"talk":...,"erle_db":...,"us_per_frame":...}
+// ERLE is measured on the frames only the far end talks in, after the first
+// few seconds, against the true echo. Returns how many paths within the
+// tail cancelled too little with only the far end talking.
+static int32_t bench_echo_accuracy(uint32_t frame_ms) {
+  const struct {
+    bench_echo_path_t path;
+    bool within_tail;
+  } paths[] = {
+      {{"enclosure", 0.5f, 15, 0}, true},
+      {{"room", 2, 50, -6}, true},
+      {{"loud", 1, 30, 6}, true},
+      // reflections past the tail are left in
+      {{"hall", 3, 120, -6}, false},
+  };
+  const int32_t latency = AUDIO_ECHO_BLOCK_LENGTH;
+  bench_clip_t far;
+  bench_clip_t near;
+  bench_clip_t heard;
+  audio_echo_handle_t path_echo = NULL;
+  int32_t failed = 0;
+
+  if (bench_clip_generate(&far, "far", BENCH_CLIP_NOISE_WHITE, 50,
+                          BENCH_ECHO_ACCURACY_SECONDS, frame_ms,
+                          111) != ESP_OK) {
+    return 1;
+  }
+  if (bench_clip_generate(&near, "near", BENCH_CLIP_NOISE_WHITE, 50,
+                          BENCH_ECHO_ACCURACY_SECONDS, frame_ms,
+                          777) != ESP_OK) {
+    bench_clip_free(&far);
+    return 1;
+  }
+  int16_t *capture = (int16_t *)calloc(far.count, sizeof(int16_t));
+  int16_t *output = (int16_t *)calloc(far.count, sizeof(int16_t));
+  if (capture == NULL || output == NULL ||
+      audio_echo_init(&path_echo, BENCH_CLIPS_SAMPLE_RATE_HZ) != ESP_OK) {
+    failed++;
+    goto cleanup;
+  }
+
+  for (int32_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+    if (bench_clip_echo(&heard, &far, &paths[p].path, 5) != ESP_OK) {
+      failed++;
+      continue;
+    }
+
+    for (int32_t talk = 0; talk < 2; talk++) {
+      bool double_talk = talk == 1;
+      uint32_t seed = 9;
+      for (int32_t i = 0; i < far.count; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        float sample = heard.samples[i] +
+                       BENCH_ECHO_NOISE_PEAK * (int32_t)seed / 2147483648.0f;
+        // someone at arm's length, the speaker is right by the microphone
+        if (double_talk) {
+          sample += 0.5f * near.samples[i];
+        }
+        if (sample > 32767.0f) {
+          sample = 32767.0f;
+        } else if (sample < -32768.0f) {
+          sample = -32768.0f;
+        }
+        capture[i] = (int16_t)sample;
+      }
+
+      uint64_t elapsed_ns = 0;
+      audio_echo_reset(path_echo);
+      for (int32_t f = 0; f < far.frames; f++) {
+        int32_t at = f * far.frame_length;
+        bench_ticks_t start = bench_ticks();
+        audio_echo_process(path_echo, far.samples + at, capture + at,
+                           output + at, far.frame_length);
+        elapsed_ns += bench_ticks_to_ns(start, bench_ticks());
+      }
+
+      double echo_energy = 0;
+      double left_energy = 0;
+      int32_t first = BENCH_ECHO_CONVERGE_S * 1000 / frame_ms;
+      for (int32_t f = first; f < far.frames; f++) {
+        if (!far.speech[f] || (double_talk && near.speech[f])) {
+          continue;
+        }
+        for (int32_t i = 0; i < far.frame_length; i++) {
+          int32_t at = f * far.frame_length + i;
+          if (at + latency >= far.count) {
+            break;
+          }
+          // what's left of the echo, the output less everything else
+          double left =
+              output[at + latency] - (capture[at] - heard.samples[at]);
+          echo_energy += (double)heard.samples[at] * heard.samples[at];
+          left_energy += left * left;
+        }
+      }
+
+      double erle_db = 10 * log10((echo_energy + 1) / (left_energy + 1));
+      printf("ECHO {\"path\":\"%s\",\"talk\":\"%s\",\"erle_db\":%.1f,"
+             "\"us_per_frame\":%.1f}\n",
+             paths[p].path.name, double_talk ? "double" : "single", erle_db,
+             (double)elapsed_ns / 1000 / far.frames);
+      if (!double_talk && paths[p].within_tail &&
+          erle_db < BENCH_ECHO_ERLE_MIN_DB) {
+        ESP_LOGE(TAG, "%s: only %.1fdB of echo cancelled", paths[p].path.name,
+                 erle_db);
+        failed++;
+      }
+    }
+    bench_clip_free(&heard);
+  }
+
+cleanup:
+  fflush(stdout);
+  free(path_echo);
+  free(capture);
+  free(output);
+  bench_clip_free(&far);
+  bench_clip_free(&near);
+  return failed;
+}
+
+// Runs the VAD over labelled clips and prints one line per clip:
+//   VAD {"clip":...,"speech_kept":...,"silence_suppressed":...,...}
+// Returns how many kept too little of the speech.
+static int32_t bench_vad_accuracy(uint32_t frame_ms) {
+  const struct {
+    const char *name;
+    bench_clip_noise_t noise;
+    float snr_db;
+  } clips[] = {
+      {"white_20db", BENCH_CLIP_NOISE_WHITE, 20},
+      {"white_10db", BENCH_CLIP_NOISE_WHITE, 10},
+      {"white_5db", BENCH_CLIP_NOISE_WHITE, 5},
+      {"brown_20db", BENCH_CLIP_NOISE_BROWN, 20},
+      {"brown_10db", BENCH_CLIP_NOISE_BROWN, 10},
+      {"brown_5db", BENCH_CLIP_NOISE_BROWN, 5},
+      {"swelling_10db", BENCH_CLIP_NOISE_SWELLING, 10},
+  };
+  audio_comfort_noise_descriptor_t descriptor;
+  audio_vad_handle_t clip_vad = NULL;
+  bench_clip_t clip;
+  int32_t failed = 0;
+
+  if (audio_vad_init(&clip_vad, frame_ms) != ESP_OK) {
+    return 1;
+  }
+
+  for (int32_t c = 0; c < sizeof(clips) / sizeof(clips[0]); c++) {
+    if (bench_clip_generate(&clip, clips[c].name, clips[c].noise,
+                            clips[c].snr_db, BENCH_VAD_ACCURACY_SECONDS,
+                            frame_ms, 12345) != ESP_OK) {
+      failed++;
+      continue;
+    }
+
+    int32_t speech = 0;
+    int32_t kept = 0;
+    int32_t silence = 0;
+    int32_t suppressed = 0;
+    int32_t sent = 0;
+    audio_vad_reset(clip_vad);
+    for (int32_t f = 0; f < clip.frames; f++) {
+      audio_vad_decision_t decision =
+          audio_vad_process(clip_vad, clip.samples + f * clip.frame_length,
+                            clip.frame_length, &descriptor);
+      if (clip.speech[f]) {
+        speech++;
+        kept += decision == AUDIO_VAD_SPEECH;
+      } else {
+        silence++;
+        suppressed += decision != AUDIO_VAD_SPEECH;
+      }
+      sent += decision != AUDIO_VAD_SILENT;
+    }
+
+    double speech_kept = speech > 0 ? (double)kept / speech : 1;
+    printf("VAD {\"clip\":\"%s\",\"speech_kept\":%.3f,"
+           "\"silence_suppressed\":%.3f,\"frames_sent\":%.3f}\n",
+           clip.name, speech_kept,
+           silence > 0 ? (double)suppressed / silence : 1,
+           (double)sent / clip.frames);
+    if (clips[c].snr_db >= 10 && speech_kept < BENCH_VAD_SPEECH_KEPT_MIN) {
+      ESP_LOGE(TAG, "%s: only %.3f of the speech kept", clip.name,
+               speech_kept);
+      failed++;
+    }
+    bench_clip_free(&clip);
+  }
+
+  fflush(stdout);
+  free(clip_vad);
+  return failed;
+}
+
+#endif
+
+// // ----------------
+// // Pipeline
+// // ----------------
+
+// stands in for the UDP write and read tasks, without the socket
+void bench_pipeline_forward_task(void *pvParameters) {
+  protocol_message_handle_t message = NULL;
+  uint8_t buffer[PROTOCOL_MESSAGE_MAX_LENGTH];
+  int32_t length = 0;
+
+  while (true) {
+    if (app_queues_receive_outgoing_message(pipeline.queues, &message,
+                                            portMAX_DELAY) != ESP_OK) {
+      continue;
+    }
+
+    esp_err_t ret = protocol_message_encode(message, buffer, &length);
+    protocol_message_free(message);
+    message = NULL;
+    if (ret != ESP_OK) {
+      continue;
+    }
+
+    if (protocol_message_decode(&message, buffer, length) != ESP_OK) {
+      continue;
+    }
+    app_router_publish(pipeline.queues->incoming, &message);
+  }
+}
+
+void bench_pipeline_consume_task(void *pvParameters) {
+  protocol_message_handle_t message = NULL;
+
+  while (true) {
+    if (app_router_receive(pipeline.subscriber, &message, portMAX_DELAY) !=
+        ESP_OK) {
+      continue;
+    }
+
+    bench_ticks_t end = bench_ticks();
+    bench_ticks_t start =
+        (bench_ticks_t)strtoull(message->text.value, NULL, 16);
+    protocol_message_free(message);
+    message = NULL;
+
+    bench_sample(pipeline.run, start, end);
+    if (++pipeline.received == pipeline.run->iterations) {
+      pipeline.last_ticks = end;
+      xSemaphoreGive(pipeline.done);
+    }
+  }
+}
+
+// from `app_queues_add_outgoing_message` to a subscriber receiving it
+static void bench_pipeline(bench_run_t *run) {
+  protocol_message_handle_t message = NULL;
+  // the send time travels in the text, so it survives encode/decode
+  char text[17];
+
+  pipeline.run = run;
+  pipeline.received = 0;
+  bench_ticks_t first_ticks = bench_ticks();
+
+  for (uint32_t i = 0; i < run->iterations; i++) {
+    bench_ticks_t start = bench_ticks();
+    snprintf(text, sizeof(text), "%016" PRIx64, (uint64_t)start);
+    protocol_message_init_text(&message, text, FROM_MAC_ADDRESS,
+                               TO_MAC_ADDRESS);
+    app_queues_add_outgoing_message(pipeline.queues, &message, portMAX_DELAY,
+                                    false);
+  }
+
+  xSemaphoreTake(pipeline.done, portMAX_DELAY);
+  run->elapsed_ns = bench_ticks_to_ns(first_ticks, pipeline.last_ticks);
+}
+
+static esp_err_t bench_init() {
+  bench_types_init();
+
+  esp_err_t ret = app_queues_init(&pipeline.queues);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  app_router_subscriber_config_t pipeline_config = {
+      .name = "bench_pipeline",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_TEXT)},
+      // nothing may be lost, or the run never finishes
+      .overflow = APP_ROUTER_OVERFLOW_BLOCK,
+      .block_ticks = portMAX_DELAY,
+      .queue_depth =
+          storage_settings_get_u32(STORAGE_SETTING_QUEUE_DEPTH_INCOMING),
+  };
+  ret = app_router_subscribe(pipeline.queues->incoming, &pipeline.subscriber,
+                             &pipeline_config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  ret = app_router_init(&router);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  app_router_subscriber_config_t router_config = {
+      .name = "bench_router",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_TEXT)},
+      .overflow = APP_ROUTER_OVERFLOW_DROP_NEWEST,
+      .queue_depth = BENCH_ROUTER_QUEUE_DEPTH,
+  };
+  ret = app_router_subscribe(router, &router_subscriber, &router_config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  ret = network_secure_init(&secure_sender, GROUP_KEY, sizeof(GROUP_KEY),
+                            FROM_MAC_ADDRESS, 1);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  ret = network_secure_init(&secure_receiver, GROUP_KEY, sizeof(GROUP_KEY),
+                            TO_MAC_ADDRESS, 1);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  ret = storage_memos_init(&memos);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  uint32_t frame_ms = storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS);
+  ret = bench_clip_generate(&vad_clip, "white_10db", BENCH_CLIP_NOISE_WHITE, 10,
+                            BENCH_VAD_CLIP_SECONDS, frame_ms, 12345);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  ret = audio_vad_init(&vad, frame_ms);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  bench_echo_path_t echo_path = {"room", 2, 50, -6};
+  ret = bench_clip_echo(&echo_clip, &vad_clip, &echo_path, 5);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  ret = audio_echo_init(&echo, BENCH_CLIPS_SAMPLE_RATE_HZ);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  echo_output = (int16_t *)calloc(echo_clip.frame_length, sizeof(int16_t));
+  if (echo_output == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  // a sender's clock as far off as a crystal gets
+  ret = audio_resampler_init(&resampler, BENCH_CLIPS_SAMPLE_RATE_HZ,
+                             BENCH_CLIPS_SAMPLE_RATE_HZ);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  audio_resampler_set_drift_ppm(resampler, BENCH_DRIFT_CLOCK_PPM);
+  resampler_output = (int16_t *)calloc(
+      audio_resampler_output_max(resampler, vad_clip.frame_length),
+      sizeof(int16_t));
+  if (resampler_output == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  pipeline.done = xSemaphoreCreateBinary();
+  if (pipeline.done == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  if (xTaskCreate(bench_pipeline_forward_task, "BENCH:FORWARD",
+                  BENCH_PIPELINE_TASK_STACK_DEPTH, NULL,
+                  BENCH_PIPELINE_TASK_PRIORITY_FORWARD, NULL) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (xTaskCreate(bench_pipeline_consume_task, "BENCH:CONSUME",
+                  BENCH_PIPELINE_TASK_STACK_DEPTH, NULL,
+                  BENCH_PIPELINE_TASK_PRIORITY_CONSUME, NULL) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+void app_main(void) {
+  ESP_ERROR_CHECK(system_metrics_init());
+  ESP_ERROR_CHECK(storage_nvs_init());
+  ESP_ERROR_CHECK(storage_settings_init());
+  ESP_ERROR_CHECK(bench_init());
+
+  int32_t failed = 0;
+  failed += bench_run("message_init_text", bench_message_init,
+                      BENCH_ITERATIONS) != ESP_OK;
+  failed += bench_run("message_free", bench_message_free, BENCH_ITERATIONS) !=
+            ESP_OK;
+  failed += bench_run("message_encode", bench_message_encode,
+                      BENCH_ITERATIONS) != ESP_OK;
+  failed += bench_run("message_decode", bench_message_decode,
+                      BENCH_ITERATIONS) != ESP_OK;
+  // per batch of `BENCH_TYPES_BATCH` lookups, compare the two
+  failed += bench_run("message_types_registry", bench_types_registry,
+                      BENCH_ITERATIONS) != ESP_OK;
+  failed += bench_run("message_types_switch", bench_types_switched,
+                      BENCH_ITERATIONS) != ESP_OK;
+  failed += bench_run("queues_outgoing_roundtrip", bench_queues_outgoing,
+                      BENCH_ITERATIONS) != ESP_OK;
+  failed += bench_run("router_publish_receive", bench_router_publish_receive,
+                      BENCH_ITERATIONS) != ESP_OK;
+  // a tenth of an audio frame
+  failed += bench_run_within(
+                "secure_roundtrip", bench_secure_roundtrip, BENCH_ITERATIONS,
+                storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) *
+                    100000) != ESP_OK;
+  failed += bench_run("pipeline_loopback", bench_pipeline,
+                      BENCH_PIPELINE_ITERATIONS) != ESP_OK;
+  // ops per second times the frame length is the write throughput
+  failed += bench_run("memos_append", bench_memos_append, BENCH_ITERATIONS) !=
+            ESP_OK;
+  // must never hold the recorder up for a whole frame
+  failed += bench_run_within(
+                "memos_append_prepared", bench_memos_append_prepared,
+                BENCH_ITERATIONS,
+                storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) *
+                    1000000) != ESP_OK;
+  // a hundredth of an audio frame, on every frame captured or played
+  failed += bench_run_within(
+                "vad_process", bench_vad_process, BENCH_ITERATIONS,
+                storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) *
+                    10000) != ESP_OK;
+  failed += bench_run_within(
+                "comfort_noise_generate", bench_comfort_noise_generate,
+                BENCH_ITERATIONS,
+                storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) *
+                    10000) != ESP_OK;
+  // a fifth of an audio frame, leaving the rest for the codec and mixing
+  failed += bench_run_within(
+                "echo_process", bench_echo_process, BENCH_ITERATIONS,
+                storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) *
+                    200000) != ESP_OK;
+  // a twentieth of an audio frame, on every frame played
+  failed += bench_run_within(
+                "resampler_process", bench_resampler_process, BENCH_ITERATIONS,
+                storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS) *
+                    50000) != ESP_OK;
+#if CONFIG_IDF_TARGET_LINUX
+  failed += bench_vad_accuracy(
+      storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS));
+  failed += bench_echo_accuracy(
+      storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS));
+  failed += bench_resampler_accuracy();
+  failed += bench_drift_session(
+      storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS),
+      storage_settings_get_u32(STORAGE_SETTING_JITTER_TARGET_MS));
+#endif
+
+  if (failed > 0) {
+    ESP_LOGE(TAG, "%d benchmarks failed", (int)failed);
+  }
+  printf("BENCH_DONE\n");
+  fflush(stdout);
+
+#if CONFIG_IDF_TARGET_LINUX
+  exit(failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+#endif
+}
@@ -0,0 +1,263 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clips.h"
+
+#define BENCH_CLIPS_PI 3.14159265f
+#define BENCH_CLIPS_HARMONICS 24
+
+typedef struct bench_clips_random_t {
+  uint32_t state;
+} bench_clips_random_t;
+
+// in [0, 1)
+static float bench_clips_uniform(bench_clips_random_t *random) {
+  uint32_t x = random->state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  random->state = x;
+  return (float)(x >> 8) / 16777216.0f;
+}
+
+static float bench_clips_between(bench_clips_random_t *random, float low,
+                                 float high) {
+  return low + (high - low) * bench_clips_uniform(random);
+}
+
+// // ----------------
+// // Speech
+// // ----------------
+
+// One syllable added into `speech`, returns its length in samples.
+static int32_t bench_clips_syllable(bench_clips_random_t *random, float *speech,
+                                    int32_t available) {
+  int32_t length = (int32_t)(bench_clips_between(random, 0.12f, 0.3f) *
+                             BENCH_CLIPS_SAMPLE_RATE_HZ);
+  if (length > available) {
+    length = available;
+  }
+
+  bool fricative = bench_clips_uniform(random) < 0.2f;
+  float pitch_hz = bench_clips_between(random, 95.0f, 220.0f);
+  float glide = bench_clips_between(random, -0.3f, 0.3f);
+  // a formant, the harmonics near it are loudest
+  float formant_hz = bench_clips_between(random, 400.0f, 2200.0f);
+  float phase = 0;
+  float last_noise = 0;
+
+  for (int32_t i = 0; i < length; i++) {
+    float t = (float)i / (float)length;
+    // rises quickly and dies away, like a spoken syllable
+    float envelope = sinf(BENCH_CLIPS_PI * sqrtf(t));
+    float sample = 0;
+
+    if (fricative) {
+      // differenced noise, most of its energy is high up
+      float noise = bench_clips_between(random, -1.0f, 1.0f);
+      sample = 0.5f * (noise - last_noise);
+      last_noise = noise;
+    } else {
+      float f0 = pitch_hz * (1.0f + glide * t);
+      phase += 2.0f * BENCH_CLIPS_PI * f0 / BENCH_CLIPS_SAMPLE_RATE_HZ;
+      for (int32_t h = 1; h <= BENCH_CLIPS_HARMONICS; h++) {
+        float distance = (h * f0 - formant_hz) / 600.0f;
+        float weight = (1.0f / h) * (0.3f + expf(-distance * distance));
+        sample += weight * sinf(h * phase);
+      }
+    }
+
+    speech[i] += envelope * sample;
+  }
+
+  return length;
+}
+
+// Fills `speech` with talk spurts and marks their frames, returns the mean
+// square of the speech frames.
+static float bench_clips_speech(bench_clips_random_t *random, float *speech,
+                                bench_clip_t *clip) {
+  int32_t position = (int32_t)(bench_clips_between(random, 0.5f, 1.5f) *
+                               BENCH_CLIPS_SAMPLE_RATE_HZ);
+
+  while (position < clip->count) {
+    int32_t spurt_end =
+        position + (int32_t)(bench_clips_between(random, 0.8f, 3.0f) *
+                             BENCH_CLIPS_SAMPLE_RATE_HZ);
+    int32_t start = position;
+    while (position < spurt_end && position < clip->count) {
+      position += bench_clips_syllable(random, speech + position,
+                                       clip->count - position);
+      // between syllables of a word, or words
+      position += (int32_t)(bench_clips_between(random, 0.0f, 0.08f) *
+                            BENCH_CLIPS_SAMPLE_RATE_HZ);
+    }
+    int32_t end = position < clip->count ? position : clip->count;
+
+    for (int32_t frame = start / clip->frame_length;
+         frame < clip->frames && frame * clip->frame_length < end; frame++) {
+      clip->speech[frame] = true;
+    }
+
+    position += (int32_t)(bench_clips_between(random, 0.5f, 2.0f) *
+                          BENCH_CLIPS_SAMPLE_RATE_HZ);
+  }
+
+  float energy = 0;
+  int32_t samples = 0;
+  for (int32_t frame = 0; frame < clip->frames; frame++) {
+    if (!clip->speech[frame]) {
+      continue;
+    }
+    for (int32_t i = 0; i < clip->frame_length; i++) {
+      float sample = speech[frame * clip->frame_length + i];
+      energy += sample * sample;
+    }
+    samples += clip->frame_length;
+  }
+  return samples > 0 ? energy / samples : 0;
+}
+
+// // ----------------
+// // Noise
+// // ----------------
+
+// returns the mean square
+static float bench_clips_noise(bench_clips_random_t *random, float *noise,
+                               int32_t count, bench_clip_noise_t kind) {
+  float brown = 0;
+  float energy = 0;
+
+  for (int32_t i = 0; i < count; i++) {
+    float white = bench_clips_between(random, -1.0f, 1.0f);
+    float sample = white;
+
+    if (kind == BENCH_CLIP_NOISE_BROWN) {
+      // leaky, so it doesn't wander off
+      brown = 0.995f * brown + 0.05f * white;
+      sample = brown;
+    } else if (kind == BENCH_CLIP_NOISE_SWELLING) {
+      brown = 0.9f * brown + 0.1f * white;
+      float t = (float)i / BENCH_CLIPS_SAMPLE_RATE_HZ;
+      // up and down by 6dB over about eight seconds
+      sample = brown * (1.5f + 0.5f * sinf(2.0f * BENCH_CLIPS_PI * t / 8.0f));
+    }
+
+    noise[i] = sample;
+    energy += sample * sample;
+  }
+
+  return energy / count;
+}
+
+esp_err_t bench_clip_generate(bench_clip_t *clip, const char *name,
+                              bench_clip_noise_t noise, float snr_db,
+                              uint32_t seconds, uint32_t frame_ms,
+                              uint32_t seed) {
+  bench_clips_random_t speech_random = {.state = seed};
+  bench_clips_random_t noise_random = {.state = seed * 2654435761u + 1};
+
+  memset(clip, 0, sizeof(bench_clip_t));
+  clip->name = name;
+  clip->frame_length = BENCH_CLIPS_SAMPLE_RATE_HZ * frame_ms / 1000;
+  clip->frames = seconds * 1000 / frame_ms;
+  clip->count = clip->frames * clip->frame_length;
+
+  float *speech = (float *)calloc(clip->count, sizeof(float));
+  float *background = (float *)calloc(clip->count, sizeof(float));
+  clip->samples = (int16_t *)calloc(clip->count, sizeof(int16_t));
+  clip->speech = (bool *)calloc(clip->frames, sizeof(bool));
+  if (speech == NULL || background == NULL || clip->samples == NULL ||
+      clip->speech == NULL) {
+    free(speech);
+    free(background);
+    bench_clip_free(clip);
+    return ESP_ERR_NO_MEM;
+  }
+
+  float speech_energy = bench_clips_speech(&speech_random, speech, clip);
+  float noise_energy =
+      bench_clips_noise(&noise_random, background, clip->count, noise);
+
+  // scaled to the speech level, and the noise below it by the SNR
+  float full_scale = 32767.0f * 32767.0f;
+  float speech_gain = sqrtf(full_scale *
+                            powf(10.0f, BENCH_CLIPS_SPEECH_DBOV / 10.0f) /
+                            speech_energy);
+  float noise_gain = sqrtf(full_scale *
+                           powf(10.0f, (BENCH_CLIPS_SPEECH_DBOV - snr_db) /
+                                           10.0f) /
+                           noise_energy);
+
+  for (int32_t i = 0; i < clip->count; i++) {
+    float sample = speech_gain * speech[i] + noise_gain * background[i];
+    if (sample > 32767.0f) {
+      sample = 32767.0f;
+    } else if (sample < -32768.0f) {
+      sample = -32768.0f;
+    }
+    clip->samples[i] = (int16_t)sample;
+  }
+
+  free(speech);
+  free(background);
+  return ESP_OK;
+}
+
+esp_err_t bench_clip_echo(bench_clip_t *echo, const bench_clip_t *far,
+                          const bench_echo_path_t *path, uint32_t seed) {
+  bench_clips_random_t random = {.state = seed};
+  int32_t delay = (int32_t)(path->delay_ms * BENCH_CLIPS_SAMPLE_RATE_HZ / 1000);
+  int32_t decay = (int32_t)(path->decay_ms * BENCH_CLIPS_SAMPLE_RATE_HZ / 1000);
+  int32_t length = delay + decay;
+
+  memset(echo, 0, sizeof(bench_clip_t));
+  echo->name = path->name;
+  echo->count = far->count;
+  echo->frame_length = far->frame_length;
+  echo->frames = far->frames;
+
+  float *response = (float *)calloc(length + 1, sizeof(float));
+  echo->samples = (int16_t *)calloc(echo->count, sizeof(int16_t));
+  echo->speech = (bool *)calloc(echo->frames, sizeof(bool));
+  if (response == NULL || echo->samples == NULL || echo->speech == NULL) {
+    free(response);
+    bench_clip_free(echo);
+    return ESP_ERR_NO_MEM;
+  }
+  memcpy(echo->speech, far->speech, echo->frames * sizeof(bool));
+
+  float energy = 1;
+  response[delay] = 1;
+  for (int32_t i = 1; i <= decay; i++) {
+    response[delay + i] = 0.5f * bench_clips_between(&random, -1.0f, 1.0f) *
+                          powf(10.0f, -3.0f * (float)i / (float)decay);
+    energy += response[delay + i] * response[delay + i];
+  }
+  float gain = powf(10.0f, path->gain_db / 20.0f) / sqrtf(energy);
+
+  for (int32_t i = 0; i < echo->count; i++) {
+    float sample = 0;
+    for (int32_t j = 0; j <= length && j <= i; j++) {
+      sample += response[j] * far->samples[i - j];
+    }
+    sample *= gain;
+    if (sample > 32767.0f) {
+      sample = 32767.0f;
+    } else if (sample < -32768.0f) {
+      sample = -32768.0f;
+    }
+    echo->samples[i] = (int16_t)sample;
+  }
+
+  free(response);
+  return ESP_OK;
+}
+
+void bench_clip_free(bench_clip_t *clip) {
+  free(clip->samples);
+  free(clip->speech);
+  clip->samples = NULL;
+  clip->speech = NULL;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BENCH_CLIPS_SAMPLE_RATE_HZ 16000
+// active speech level, as on a telephone line
+#define BENCH_CLIPS_SPEECH_DBOV -26.0f
+
+typedef enum bench_clip_noise_t {
+  // hiss, like a cheap microphone's preamp
+  BENCH_CLIP_NOISE_WHITE = 0,
+  // rumble, like a fan or air conditioning
+  BENCH_CLIP_NOISE_BROWN = 1,
+  // noise that swells and fades, like a street outside
+  BENCH_CLIP_NOISE_SWELLING = 2,
+} bench_clip_noise_t;
+
+// A synthetic recording of someone talking in spurts over background noise,
+// labelled per frame. Talk spurts are voiced syllables with a wandering
+// pitch and a few fricatives, separated by pauses of half a second to two
+// seconds. A frame is speech from the first syllable of a spurt to the end
+// of its last, as a person marking up a recording would.
+typedef struct bench_clip_t {
+  const char *name;
+  int16_t *samples;
+  int32_t count;
+  int32_t frame_length;
+  int32_t frames;
+  // one per frame
+  bool *speech;
+} bench_clip_t;
+
+// The same `seed` gives the same speech, whatever the noise. Takes about
+// 10 bytes per sample while generating.
+esp_err_t bench_clip_generate(bench_clip_t *clip, const char *name,
+                              bench_clip_noise_t noise, float snr_db,
+                              uint32_t seconds, uint32_t frame_ms,
+                              uint32_t seed);
+void bench_clip_free(bench_clip_t *clip);
+
+// A speaker's sound reaching a microphone: the direct path, then
+// reflections that die away.
+typedef struct bench_echo_path_t {
+  const char *name;
+  float delay_ms;
+  // for the reflections to fall by 60dB
+  float decay_ms;
+  // the echo's level against the playback's
+  float gain_db;
+} bench_echo_path_t;
+
+// `echo` is `far` as heard through `path`, with the same labels.
+esp_err_t bench_clip_echo(bench_clip_t *echo, const bench_clip_t *far,
+                          const bench_echo_path_t *path, uint32_t seed);
@@ -0,0 +1,123 @@
+#include "esp_log.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+#include "system/memory.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <time.h>
+#else
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#endif
+
+static const char *TAG = "BENCH:HARNESS";
+
+bench_ticks_t bench_ticks() {
+#if CONFIG_IDF_TARGET_LINUX
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  return esp_cpu_get_cycle_count();
+#endif
+}
+
+uint32_t bench_ticks_to_ns(bench_ticks_t start, bench_ticks_t end) {
+#if CONFIG_IDF_TARGET_LINUX
+  return (uint32_t)(end - start);
+#else
+  // unsigned subtraction handles the counter wrapping
+  return (uint32_t)(((uint64_t)(bench_ticks_t)(end - start) * 1000) /
+                    esp_rom_get_cpu_ticks_per_us());
+#endif
+}
+
+void bench_sample(bench_run_t *run, bench_ticks_t start, bench_ticks_t end) {
+  if (run->count >= run->iterations) {
+    return;
+  }
+  run->samples_ns[run->count++] = bench_ticks_to_ns(start, end);
+}
+
+static int bench_compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// nearest rank, `per_mille` of 500 is the median
+static uint32_t bench_percentile(const bench_run_t *run, uint32_t per_mille) {
+  uint32_t rank = (uint32_t)(((uint64_t)run->count * per_mille + 999) / 1000);
+  return run->samples_ns[rank > 0 ? rank - 1 : 0];
+}
+
+// returns the p99
+static uint32_t bench_report(bench_run_t *run) {
+  qsort(run->samples_ns, run->count, sizeof(uint32_t), bench_compare_u32);
+
+  uint64_t elapsed_ns = run->elapsed_ns;
+  if (elapsed_ns == 0) {
+    for (uint32_t i = 0; i < run->count; i++) {
+      elapsed_ns += run->samples_ns[i];
+    }
+  }
+  double ops_per_sec =
+      elapsed_ns > 0 ? (double)run->count * 1e9 / (double)elapsed_ns : 0;
+
+  printf("BENCH {\"name\":\"%s\",\"target\":\"%s\",\"iterations\":%" PRIu32
+         ",\"ops_per_sec\":%.0f,\"p50_ns\":%" PRIu32 ",\"p99_ns\":%" PRIu32
+         ",\"p999_ns\":%" PRIu32 ",\"max_ns\":%" PRIu32 "}\n",
+         run->name, CONFIG_IDF_TARGET, run->count, ops_per_sec,
+         bench_percentile(run, 500), bench_percentile(run, 990),
+         bench_percentile(run, 999), run->samples_ns[run->count - 1]);
+  fflush(stdout);
+  return bench_percentile(run, 990);
+}
+
+esp_err_t bench_run_within(const char *name, bench_fn_t fn,
+                           uint32_t iterations, uint32_t budget_ns) {
+  // only written between timings, so it can be in PSRAM
+  uint32_t *samples_ns = (uint32_t *)system_memory_alloc(
+      iterations * sizeof(uint32_t), SYSTEM_MEMORY_BULK);
+  if (samples_ns == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate samples for '%s'", name);
+    return ESP_ERR_NO_MEM;
+  }
+
+  bench_run_t run = {
+      .name = name,
+      .iterations = BENCH_WARMUP_ITERATIONS < iterations
+                        ? BENCH_WARMUP_ITERATIONS
+                        : iterations,
+      .samples_ns = samples_ns,
+  };
+  fn(&run);
+
+  run.iterations = iterations;
+  run.count = 0;
+  run.elapsed_ns = 0;
+  fn(&run);
+
+  esp_err_t ret = ESP_OK;
+  if (run.count == 0) {
+    ESP_LOGE(TAG, "'%s' recorded no samples", name);
+    ret = ESP_FAIL;
+  } else {
+    uint32_t p99_ns = bench_report(&run);
+    if (budget_ns > 0 && p99_ns > budget_ns) {
+      ESP_LOGE(TAG, "'%s' p99 of %" PRIu32 "ns is over its %" PRIu32
+               "ns budget", name, p99_ns, budget_ns);
+      ret = ESP_FAIL;
+    }
+  }
+
+  free(samples_ns);
+  return ret;
+}
+
+esp_err_t bench_run(const char *name, bench_fn_t fn, uint32_t iterations) {
+  return bench_run_within(name, fn, iterations, 0);
+}
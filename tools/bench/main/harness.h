@@ -0,0 +1,49 @@
+#pragma once
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#if CONFIG_IDF_TARGET_LINUX
+#define BENCH_ITERATIONS 100000
+#else
+#define BENCH_ITERATIONS 5000
+#endif
+
+// untimed runs before each benchmark, to warm caches and the allocator
+#define BENCH_WARMUP_ITERATIONS (BENCH_ITERATIONS / 10)
+
+// CPU cycles on device, nanoseconds on the host. Only differences are
+// meaningful, see `bench_ticks_to_ns`.
+#if CONFIG_IDF_TARGET_LINUX
+typedef uint64_t bench_ticks_t;
+#else
+typedef uint32_t bench_ticks_t;
+#endif
+
+typedef struct bench_run_t {
+  const char *name;
+  uint32_t iterations;
+  uint32_t count;
+  // one latency per operation
+  uint32_t *samples_ns;
+  // Wall time for all of the operations. Left at 0 the samples are summed,
+  // pipelined benchmarks set it themselves since their samples overlap.
+  uint64_t elapsed_ns;
+} bench_run_t;
+
+typedef void (*bench_fn_t)(bench_run_t *run);
+
+bench_ticks_t bench_ticks();
+uint32_t bench_ticks_to_ns(bench_ticks_t start, bench_ticks_t end);
+
+// records one operation, extra samples are ignored
+void bench_sample(bench_run_t *run, bench_ticks_t start, bench_ticks_t end);
+
+// Runs a warmup pass, then the measured pass, and prints one line:
+//   BENCH {"name":...,"ops_per_sec":...,"p50_ns":...,...}
+// which `tools/bench/compare.py` reads.
+esp_err_t bench_run(const char *name, bench_fn_t fn, uint32_t iterations);
+// Like `bench_run`, but fails when the p99 is over `budget_ns`.
+esp_err_t bench_run_within(const char *name, bench_fn_t fn,
+                           uint32_t iterations, uint32_t budget_ns);
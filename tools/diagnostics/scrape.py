@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""Scrapes the diagnostics endpoint of every station on the LAN.
+
+Stations are found by listening for their heartbeats on the multicast group,
+or given with --hosts. Prints a summary per station, and with --out saves each
+station's full Prometheus text for later:
+
+  ./tools/diagnostics/scrape.py [--listen 5] [--out scrapes/]
+  ./tools/diagnostics/scrape.py --hosts 192.168.1.20 192.168.1.21
+
+Prometheus can also scrape the stations directly, the port is
+CONFIG_NETWORK_DIAGNOSTICS_PORT.
+"""
+
+import argparse
+import collections
+import os
+import re
+import socket
+import struct
+import sys
+import time
+import urllib.request
+
+# the Kconfig defaults
+MULTICAST_ADDR = "232.10.11.12"
+MULTICAST_PORT = 3333
+DIAGNOSTICS_PORT = 9100
+
+SAMPLE = re.compile(r"^([a-zA-Z_:][a-zA-Z0-9_:]*)(\{(.*)\})?\s+(\S+)$")
+LABEL = re.compile(r'(\w+)="((?:[^"\\]|\\.)*)"')
+
+
+def discover(addr, port, seconds):
+    """Returns the addresses heard on the multicast group."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", port))
+    membership = struct.pack("4sl", socket.inet_aton(addr), socket.INADDR_ANY)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+
+    hosts = set()
+    deadline = time.monotonic() + seconds
+    while (remaining := deadline - time.monotonic()) > 0:
+        sock.settimeout(remaining)
+        try:
+            _, (host, _) = sock.recvfrom(2048)
+        except socket.timeout:
+            break
+        hosts.add(host)
+    sock.close()
+    return sorted(hosts)
+
+
+def scrape(host, port, timeout):
+    url = f"http://{host}:{port}/metrics"
+    with urllib.request.urlopen(url, timeout=timeout) as response:
+        return response.read().decode("utf-8", errors="replace")
+
+
+def parse(text):
+    """Returns {name: [(labels, value)]}, ignoring comments."""
+    samples = collections.defaultdict(list)
+    for line in text.splitlines():
+        match = SAMPLE.match(line)
+        if match is None:
+            continue
+        name, _, labels, value = match.groups()
+        samples[name].append((dict(LABEL.findall(labels or "")), float(value)))
+    return samples
+
+
+def total(samples, name):
+    return sum(value for _, value in samples.get(name, []))
+
+
+def peak(samples, name):
+    return max((value for _, value in samples.get(name, [])), default=0)
+
+
+def summarize(host, samples):
+    info = samples.get("station_info", [({}, 0)])[0][0]
+    return [
+        host,
+        info.get("name", "?"),
+        f"{total(samples, 'uptime_seconds'):.0f}",
+        f"{len(samples.get('peer_heartbeat_age_ms', [])):.0f}",
+        f"{total(samples, 'udp_rx_packets_total'):.0f}",
+        f"{total(samples, 'udp_tx_packets_total'):.0f}",
+        f"{total(samples, 'udp_dropped_total'):.0f}",
+        f"{total(samples, 'router_dropped_total'):.0f}",
+        f"{peak(samples, 'router_queue_high_water'):.0f}",
+        f"{total(samples, 'heap_free_min_bytes'):.0f}",
+    ]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--hosts", nargs="*", help="skip discovery")
+    parser.add_argument(
+        "--listen",
+        type=float,
+        default=5.0,
+        help="seconds to listen for heartbeats (default 5)",
+    )
+    parser.add_argument("--multicast-addr", default=MULTICAST_ADDR)
+    parser.add_argument("--multicast-port", type=int, default=MULTICAST_PORT)
+    parser.add_argument("--port", type=int, default=DIAGNOSTICS_PORT)
+    parser.add_argument("--timeout", type=float, default=3.0)
+    parser.add_argument("--out", help="save each station's metrics here")
+    args = parser.parse_args()
+
+    hosts = args.hosts or discover(
+        args.multicast_addr, args.multicast_port, args.listen
+    )
+    if not hosts:
+        print("no stations found", file=sys.stderr)
+        return 1
+
+    if args.out:
+        os.makedirs(args.out, exist_ok=True)
+    stamp = time.strftime("%Y%m%d-%H%M%S")
+
+    header = [
+        "host",
+        "name",
+        "uptime_s",
+        "peers",
+        "rx",
+        "tx",
+        "udp_drop",
+        "route_drop",
+        "queue_hwm",
+        "heap_min",
+    ]
+    rows = [header]
+    failed = 0
+    for host in hosts:
+        try:
+            text = scrape(host, args.port, args.timeout)
+        except OSError as error:
+            print(f"{host}: {error}", file=sys.stderr)
+            failed += 1
+            continue
+        if args.out:
+            path = os.path.join(args.out, f"{stamp}-{host}.prom")
+            with open(path, "w", encoding="utf-8") as f:
+                f.write(text)
+        rows.append(summarize(host, parse(text)))
+
+    widths = [max(len(row[i]) for row in rows) for i in range(len(header))]
+    for row in rows:
+        print("  ".join(cell.rjust(width) for cell, width in zip(row, widths)))
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,166 @@
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <string.h>
+
+#include "impairment.h"
+
+static const char *TAG = "SIMULATOR:IMPAIRMENT";
+
+// xorshift32, must be called with the mutex held
+static uint32_t sim_impairment_rand(sim_impairment_handle_t impairment_handle) {
+  uint32_t x = impairment_handle->rand_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  impairment_handle->rand_state = x;
+  return x;
+}
+
+static bool sim_impairment_rx_hook(const uint8_t *buffer, int32_t length,
+                                   void *ctx) {
+  sim_impairment_handle_t impairment_handle = (sim_impairment_handle_t)ctx;
+  sim_impairment_config_t *config = &impairment_handle->config;
+  protocol_message_header_t header;
+  bool deliver_now = false;
+
+  memcpy(&header, buffer, sizeof(protocol_message_header_t));
+  if (memcmp(header.from_mac_address,
+             impairment_handle->device_info->mac_address,
+             sizeof(protocol_mac_address_t)) == 0) {
+    return false;
+  }
+
+  xSemaphoreTake(impairment_handle->mutex, portMAX_DELAY);
+  impairment_handle->stats.received++;
+
+  if (config->loss_pct > 0 &&
+      sim_impairment_rand(impairment_handle) % 100 < config->loss_pct) {
+    impairment_handle->stats.lost++;
+    goto sim_impairment_rx_hook_end;
+  }
+
+  int64_t delay_us = (int64_t)config->latency_ms * 1000;
+  if (config->jitter_ms > 0) {
+    delay_us += sim_impairment_rand(impairment_handle) %
+                ((uint32_t)config->jitter_ms * 1000 + 1);
+  }
+  if (config->reorder_pct > 0 &&
+      sim_impairment_rand(impairment_handle) % 100 < config->reorder_pct) {
+    delay_us += (int64_t)config->reorder_ms * 1000;
+    impairment_handle->stats.reordered++;
+  }
+
+  if (delay_us == 0) {
+    impairment_handle->stats.delivered++;
+    deliver_now = true;
+    goto sim_impairment_rx_hook_end;
+  }
+
+  sim_impairment_slot_t *slot = NULL;
+  for (int32_t i = 0; i < SIM_IMPAIRMENT_SLOTS; i++) {
+    if (!impairment_handle->slots[i].in_use) {
+      slot = &impairment_handle->slots[i];
+      break;
+    }
+  }
+  if (slot == NULL) {
+    impairment_handle->stats.overflowed++;
+    goto sim_impairment_rx_hook_end;
+  }
+
+  slot->in_use = true;
+  slot->deliver_at_us = esp_timer_get_time() + delay_us;
+  slot->length = length;
+  memcpy(slot->buffer, buffer, length);
+
+sim_impairment_rx_hook_end:
+  xSemaphoreGive(impairment_handle->mutex);
+  return deliver_now;
+}
+
+// hands held datagrams back to UDP once they're due, earliest first
+void sim_impairment_delivery_task(void *pvParameters) {
+  sim_impairment_handle_t impairment_handle =
+      (sim_impairment_handle_t)pvParameters;
+
+  while (true) {
+    vTaskDelay(1);
+
+    while (true) {
+      int64_t now_us = esp_timer_get_time();
+      sim_impairment_slot_t *slot = NULL;
+
+      xSemaphoreTake(impairment_handle->mutex, portMAX_DELAY);
+      for (int32_t i = 0; i < SIM_IMPAIRMENT_SLOTS; i++) {
+        sim_impairment_slot_t *candidate = &impairment_handle->slots[i];
+        if (candidate->in_use && candidate->deliver_at_us <= now_us &&
+            (slot == NULL || candidate->deliver_at_us < slot->deliver_at_us)) {
+          slot = candidate;
+        }
+      }
+      xSemaphoreGive(impairment_handle->mutex);
+
+      if (slot == NULL) {
+        break;
+      }
+
+      // the hook never touches a slot that's in use, so no lock is needed
+      network_udp_receive_datagram(impairment_handle->udp, slot->buffer,
+                                   slot->length);
+
+      xSemaphoreTake(impairment_handle->mutex, portMAX_DELAY);
+      slot->in_use = false;
+      impairment_handle->stats.delivered++;
+      xSemaphoreGive(impairment_handle->mutex);
+    }
+  }
+}
+
+void sim_impairment_get_stats(sim_impairment_handle_t impairment_handle,
+                              sim_impairment_stats_t *stats_ptr) {
+  xSemaphoreTake(impairment_handle->mutex, portMAX_DELAY);
+  *stats_ptr = impairment_handle->stats;
+  xSemaphoreGive(impairment_handle->mutex);
+}
+
+esp_err_t sim_impairment_init(sim_impairment_handle_t *impairment_handle_ptr,
+                              const sim_impairment_config_t *config,
+                              network_udp_handle_t udp_handle,
+                              app_device_info_handle_t device_info_handle) {
+  esp_err_t ret = ESP_OK;
+
+  sim_impairment_handle_t impairment_handle =
+      (sim_impairment_handle_t)calloc(1, sizeof(sim_impairment_t));
+  ESP_GOTO_ON_FALSE(impairment_handle != NULL, ESP_ERR_NO_MEM,
+                    sim_impairment_init_error, TAG,
+                    "Failed to allocate memory for impairment handle");
+
+  impairment_handle->config = *config;
+  impairment_handle->udp = udp_handle;
+  impairment_handle->device_info = device_info_handle;
+  // xorshift gets stuck on 0
+  impairment_handle->rand_state = config->seed != 0 ? config->seed : 1;
+
+  impairment_handle->mutex = xSemaphoreCreateMutex();
+  ESP_GOTO_ON_FALSE(impairment_handle->mutex != NULL, ESP_ERR_NO_MEM,
+                    sim_impairment_init_error, TAG,
+                    "Failed to create impairment mutex");
+
+  ESP_GOTO_ON_FALSE(xTaskCreate(sim_impairment_delivery_task, TAG,
+                                SIM_IMPAIRMENT_TASK_STACK_DEPTH,
+                                impairment_handle,
+                                SIM_IMPAIRMENT_TASK_PRIORITY,
+                                &impairment_handle->tasks.delivery) == pdPASS,
+                    ESP_ERR_NO_MEM, sim_impairment_init_error, TAG,
+                    "Failed to create impairment delivery task");
+
+  network_udp_set_rx_hook(udp_handle, sim_impairment_rx_hook,
+                          impairment_handle);
+
+  *impairment_handle_ptr = impairment_handle;
+  return ESP_OK;
+
+sim_impairment_init_error:
+  return ret;
+}
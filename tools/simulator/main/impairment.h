@@ -0,0 +1,72 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "application/device_info.h"
+#include "network/udp.h"
+#include "protocols/messages.h"
+
+#define SIM_IMPAIRMENT_TASK_PRIORITY 6
+#define SIM_IMPAIRMENT_TASK_STACK_DEPTH (1024 * 4)
+
+// datagrams held at once per station, more are dropped
+#define SIM_IMPAIRMENT_SLOTS 64
+
+typedef struct sim_impairment_config_t {
+  // percent of datagrams dropped
+  uint32_t loss_pct;
+  // every datagram is delayed by `latency_ms` plus up to `jitter_ms`
+  uint32_t latency_ms;
+  uint32_t jitter_ms;
+  // percent of datagrams held back an extra `reorder_ms`, so later ones
+  // overtake them
+  uint32_t reorder_pct;
+  uint32_t reorder_ms;
+  // same seed, same impairments
+  uint32_t seed;
+} sim_impairment_config_t;
+
+typedef struct sim_impairment_slot_t {
+  bool in_use;
+  int64_t deliver_at_us;
+  int32_t length;
+  uint8_t buffer[PROTOCOL_MESSAGE_MAX_LENGTH];
+} sim_impairment_slot_t;
+
+typedef struct sim_impairment_stats_t {
+  uint32_t received;
+  uint32_t lost;
+  uint32_t reordered;
+  // no free slot
+  uint32_t overflowed;
+  uint32_t delivered;
+} sim_impairment_stats_t;
+
+typedef struct sim_impairment_t {
+  sim_impairment_config_t config;
+  network_udp_handle_t udp;
+  app_device_info_handle_t device_info;
+  uint32_t rand_state;
+  sim_impairment_slot_t slots[SIM_IMPAIRMENT_SLOTS];
+  sim_impairment_stats_t stats;
+  // guards the slots, the stats and `rand_state`
+  SemaphoreHandle_t mutex;
+  struct {
+    TaskHandle_t delivery;
+  } tasks;
+} sim_impairment_t;
+
+typedef sim_impairment_t *sim_impairment_handle_t;
+
+// Hooks into the station's UDP receive path. Datagrams from the station itself
+// are always dropped, like on the device where multicast isn't looped back.
+esp_err_t sim_impairment_init(sim_impairment_handle_t *impairment_handle_ptr,
+                              const sim_impairment_config_t *config,
+                              network_udp_handle_t udp_handle,
+                              app_device_info_handle_t device_info_handle);
+
+void sim_impairment_get_stats(sim_impairment_handle_t impairment_handle,
+                              sim_impairment_stats_t *stats_ptr);
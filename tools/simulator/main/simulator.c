@@ -0,0 +1,833 @@
+// Runs N virtual stations in one process over loopback multicast, using the
+// real UDP, peers, queues and message handler code. Configured through
+// environment variables, see `scripts/simulate.sh`.
+
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "application/clock.h"
+#include "application/device_info.h"
+#include "application/message_handler.h"
+#include "application/paging.h"
+#include "application/peers.h"
+#include "application/queues.h"
+#include "application/reliable.h"
+#include "application/session.h"
+#include "impairment.h"
+#include "network/events.h"
+#include "network/power.h"
+#include "network/secure.h"
+#include "network/udp.h"
+#include "storage/nvs.h"
+#include "storage/settings.h"
+#include "system/metrics.h"
+#include "system/trace.h"
+
+#define SIM_MAX_STATIONS 32
+// texts whose delivery latency is kept, for the percentiles
+#define SIM_MAX_LATENCIES 4096
+// the texts start once every station is up
+#define SIM_TEXTS_START_MS 2000
+// how often the shared clocks are compared, and how many comparisons kept
+#define SIM_CLOCK_CHECK_MS 100
+#define SIM_MAX_CLOCK_ERRORS 16384
+// all-call frames whose playout is compared, about five minutes at 20ms
+#define SIM_MAX_PAGES 16384
+// the synthetic frames, about 20ms of compressed voice
+#define SIM_PAGE_LENGTH 60
+// Between talk rounds, past the talker timeout so a lost TALK_STOP can't
+// carry over. After every station presses, the floor gets past a lost
+// announcement before it's checked.
+#define SIM_TALK_INTERVAL_MS (APP_SESSION_TALKER_TIMEOUT_MS + 1000)
+#define SIM_TALK_SETTLE_MS (APP_SESSION_ANNOUNCE_MS * 3 / 2)
+#define SIM_MAX_TALK_STOPS 4096
+
+static const char *TAG = "SIMULATOR";
+
+// shared by every simulated station, never provisioned on a device
+static const uint8_t SIM_GROUP_KEY[16] = {0x53, 0x69, 0x6d, 0x75, 0x6c};
+
+typedef struct sim_config_t {
+  uint32_t stations;
+  // lets several processes run side by side without MAC collisions
+  uint32_t first_id;
+  // defaults to every other station in this process
+  uint32_t expected_peers;
+  uint32_t duration_s;
+  // 0 keeps the setting
+  uint32_t heartbeat_ms;
+  // seal every datagram with `SIM_GROUP_KEY`
+  bool secure;
+  // texts each station sends, alternately broadcast and to the next station
+  uint32_t texts;
+  uint32_t text_interval_ms;
+  // sends them with `PROTOCOL_MESSAGE_FLAG_RELIABLE`
+  bool reliable;
+  // each station's crystal is up to this far off
+  uint32_t clock_ppm;
+  // how long the last station pages every other, once its clock is synced
+  uint32_t page_s;
+  // how far into the run the last station starts, 0 starts it with the rest
+  uint32_t join_s;
+  // stations are dealt into this many zones, and pages go to the first
+  uint32_t zones;
+  // rounds in which every station presses talk at once
+  uint32_t talks;
+  sim_impairment_config_t impairment;
+} sim_config_t;
+
+typedef struct sim_station_t {
+  uint32_t id;
+  app_device_info_t device_info;
+  network_events_handle_t events;
+  app_queues_handle_t queues;
+  app_peers_handle_t peers;
+  app_clock_handle_t clock;
+  app_paging_handle_t paging;
+  app_router_subscriber_handle_t pages;
+  app_session_handle_t session;
+  // guarded by `sim_talks.mutex`, `pressed_us` is 0 outside a round
+  bool talking;
+  int64_t pressed_us;
+  // this station's crystal, against the process clock
+  double clock_ppm;
+  int64_t clock_offset_us;
+  app_reliable_handle_t reliable;
+  app_router_subscriber_handle_t texts;
+  protocol_message_handler_handle_t message_handler;
+  network_power_handle_t power;
+  network_udp_handle_t udp;
+  network_secure_handle_t secure;
+  sim_impairment_handle_t impairment;
+} sim_station_t;
+
+static sim_station_t stations[SIM_MAX_STATIONS];
+
+// texts received by every station together
+static struct {
+  SemaphoreHandle_t mutex;
+  uint32_t expected;
+  uint32_t delivered;
+  uint32_t latency_count;
+  uint32_t latencies_us[SIM_MAX_LATENCIES];
+} sim_texts;
+
+// when each all-call frame was played, by every station together
+static struct {
+  SemaphoreHandle_t mutex;
+  uint32_t sent;
+  struct {
+    int64_t first_us;
+    int64_t last_us;
+    uint32_t played;
+  } frames[SIM_MAX_PAGES];
+} sim_pages;
+
+// whether each round ended with one talker, and how soon the rest heard
+static struct {
+  SemaphoreHandle_t mutex;
+  uint32_t rounds;
+  uint32_t settled;
+  uint32_t stop_count;
+  uint32_t stops_us[SIM_MAX_TALK_STOPS];
+} sim_talks;
+
+// how long after the last station started each side knew the other
+static struct {
+  int64_t started_us;
+  // -1 until then
+  int64_t newcomer_us;
+  int64_t everyone_us;
+} sim_join;
+
+// every station's shared clock against the lowest station's own clock
+static struct {
+  SemaphoreHandle_t mutex;
+  // since the stations started, -1 until every one is synced
+  int64_t synced_us;
+  uint32_t count;
+  uint32_t errors_us[SIM_MAX_CLOCK_ERRORS];
+} sim_clocks;
+
+static uint32_t sim_env_u32(const char *name, uint32_t default_value) {
+  const char *value = getenv(name);
+  if (value == NULL || value[0] == '\0') {
+    return default_value;
+  }
+  return (uint32_t)strtoul(value, NULL, 10);
+}
+
+static void sim_config_load(sim_config_t *config) {
+  config->stations = sim_env_u32("SIM_STATIONS", 4);
+  if (config->stations > SIM_MAX_STATIONS) {
+    ESP_LOGW(TAG, "Limiting to %d stations", SIM_MAX_STATIONS);
+    config->stations = SIM_MAX_STATIONS;
+  }
+  config->first_id = sim_env_u32("SIM_FIRST_ID", 0);
+  config->expected_peers =
+      sim_env_u32("SIM_EXPECTED_PEERS", config->stations - 1);
+  config->duration_s = sim_env_u32("SIM_DURATION_S", 30);
+  config->heartbeat_ms = sim_env_u32("SIM_HEARTBEAT_MS", 0);
+  config->secure = sim_env_u32("SIM_SECURE", 0) != 0;
+  config->texts = sim_env_u32("SIM_TEXTS", 0);
+  config->text_interval_ms = sim_env_u32("SIM_TEXT_INTERVAL_MS", 500);
+  config->reliable = sim_env_u32("SIM_RELIABLE", 1) != 0;
+  config->clock_ppm = sim_env_u32("SIM_CLOCK_PPM", 100);
+  config->page_s = sim_env_u32("SIM_PAGE_S", 0);
+  config->join_s = sim_env_u32("SIM_JOIN_S", 0);
+  config->zones = sim_env_u32("SIM_ZONES", 0);
+  config->talks = sim_env_u32("SIM_TALKS", 0);
+  if (config->zones > PROTOCOL_GROUP_ZONES) {
+    config->zones = PROTOCOL_GROUP_ZONES;
+  }
+  if (config->join_s >= config->duration_s) {
+    config->join_s = 0;
+  }
+  config->impairment = (sim_impairment_config_t){
+      .loss_pct = sim_env_u32("SIM_LOSS_PCT", 0),
+      .latency_ms = sim_env_u32("SIM_LATENCY_MS", 0),
+      .jitter_ms = sim_env_u32("SIM_JITTER_MS", 0),
+      .reorder_pct = sim_env_u32("SIM_REORDER_PCT", 0),
+      .reorder_ms = sim_env_u32("SIM_REORDER_MS", 50),
+      .seed = sim_env_u32("SIM_SEED", 1),
+  };
+}
+
+// Counts the texts meant for the station. Every station shares the process
+// clock, so a text's UUID timestamp is when it was sent.
+static esp_err_t sim_text_handler(protocol_message_handle_t message,
+                                  void *ctx) {
+  sim_station_t *station = (sim_station_t *)ctx;
+
+  if (memcmp(message->header.to_mac_address,
+             station->device_info.mac_address,
+             sizeof(protocol_mac_address_t)) == 0 ||
+      memcmp(message->header.to_mac_address,
+             NETWORK_MESSAGE_BROADCAST_MAC_ADDRESS,
+             sizeof(protocol_mac_address_t)) == 0) {
+    int64_t latency_us =
+        esp_timer_get_time() -
+        protocol_message_uuid_timestamp(message->header.uuid);
+
+    xSemaphoreTake(sim_texts.mutex, portMAX_DELAY);
+    sim_texts.delivered++;
+    if (sim_texts.latency_count < SIM_MAX_LATENCIES) {
+      sim_texts.latencies_us[sim_texts.latency_count++] = (uint32_t)latency_us;
+    }
+    xSemaphoreGive(sim_texts.mutex);
+  }
+
+  protocol_message_free(message);
+  return ESP_OK;
+}
+
+static void sim_texts_task(void *pvParameters) {
+  const sim_config_t *config = (const sim_config_t *)pvParameters;
+
+  vTaskDelay(pdMS_TO_TICKS(SIM_TEXTS_START_MS));
+  for (uint32_t i = 0; i < config->texts; i++) {
+    for (uint32_t j = 0; j < config->stations; j++) {
+      sim_station_t *station = &stations[j];
+      sim_station_t *next = &stations[(j + 1) % config->stations];
+      bool broadcast = i % 2 == 0;
+      protocol_message_handle_t message = NULL;
+
+      if (protocol_message_init_text(
+              &message, "Button pressed!", station->device_info.mac_address,
+              broadcast ? NULL : next->device_info.mac_address) != ESP_OK) {
+        continue;
+      }
+      if (config->reliable) {
+        message->header.flags |= PROTOCOL_MESSAGE_FLAG_RELIABLE;
+      }
+      if (app_queues_add_outgoing_message(station->queues, &message,
+                                          pdMS_TO_TICKS(100),
+                                          false) != ESP_OK) {
+        protocol_message_free(message);
+        continue;
+      }
+
+      xSemaphoreTake(sim_texts.mutex, portMAX_DELAY);
+      sim_texts.expected += broadcast ? config->stations - 1 : 1;
+      xSemaphoreGive(sim_texts.mutex);
+    }
+    vTaskDelay(pdMS_TO_TICKS(config->text_interval_ms));
+  }
+  vTaskDelete(NULL);
+}
+
+static int sim_compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void sim_texts_report(const sim_config_t *config) {
+  xSemaphoreTake(sim_texts.mutex, portMAX_DELAY);
+  uint32_t count = sim_texts.latency_count;
+  qsort(sim_texts.latencies_us, count, sizeof(uint32_t), sim_compare_u32);
+
+  ESP_LOGI(TAG,
+           "%s texts: delivered %" PRIu32 "/%" PRIu32 " (%.1f%%), latency "
+           "p50 %" PRIu32 "us, p99 %" PRIu32 "us, max %" PRIu32 "us",
+           config->reliable ? "reliable" : "best-effort", sim_texts.delivered,
+           sim_texts.expected,
+           sim_texts.expected > 0
+               ? 100.0 * sim_texts.delivered / sim_texts.expected
+               : 0.0,
+           count > 0 ? sim_texts.latencies_us[count / 2] : 0,
+           count > 0 ? sim_texts.latencies_us[count * 99 / 100] : 0,
+           count > 0 ? sim_texts.latencies_us[count - 1] : 0);
+  xSemaphoreGive(sim_texts.mutex);
+}
+
+static int64_t sim_clock_source(int64_t timer_us, void *ctx) {
+  sim_station_t *station = (sim_station_t *)ctx;
+  return station->clock_offset_us + timer_us +
+         (int64_t)((double)timer_us * station->clock_ppm * 1e-6);
+}
+
+// Every station shares the process clock, so what each one thinks the
+// shared clock reads can be compared at the same instant. The lowest
+// station in the process is the reference, with SIM_FIRST_ID that is only
+// right if no other process has lower ones.
+static void sim_clocks_task(void *pvParameters) {
+  const sim_config_t *config = (const sim_config_t *)pvParameters;
+  int64_t start_us = esp_timer_get_time();
+
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(SIM_CLOCK_CHECK_MS));
+
+    int64_t timer_us = esp_timer_get_time();
+    int64_t reference_us = sim_clock_source(timer_us, &stations[0]);
+    bool synced = true;
+    uint32_t errors_us[SIM_MAX_STATIONS];
+
+    for (uint32_t i = 1; i < config->stations; i++) {
+      sim_station_t *station = &stations[i];
+      bool station_synced = false;
+      int64_t shared_us = app_clock_shared_at(
+          station->clock, app_clock_local_at(station->clock, timer_us),
+          &station_synced);
+      int64_t error_us = shared_us - reference_us;
+      synced = synced && station_synced;
+      errors_us[i] = (uint32_t)(error_us < 0 ? -error_us : error_us);
+    }
+
+    if (!synced) {
+      continue;
+    }
+    xSemaphoreTake(sim_clocks.mutex, portMAX_DELAY);
+    if (sim_clocks.synced_us < 0) {
+      sim_clocks.synced_us = timer_us - start_us;
+    }
+    for (uint32_t i = 1; i < config->stations &&
+                         sim_clocks.count < SIM_MAX_CLOCK_ERRORS;
+         i++) {
+      sim_clocks.errors_us[sim_clocks.count++] = errors_us[i];
+    }
+    xSemaphoreGive(sim_clocks.mutex);
+  }
+}
+
+// returns false if the stations never agreed on a clock
+static bool sim_clocks_report(const sim_config_t *config) {
+  if (config->stations < 2) {
+    return true;
+  }
+  xSemaphoreTake(sim_clocks.mutex, portMAX_DELAY);
+  if (sim_clocks.synced_us < 0) {
+    xSemaphoreGive(sim_clocks.mutex);
+    ESP_LOGE(TAG, "clocks: never synced");
+    return false;
+  }
+
+  uint32_t count = sim_clocks.count;
+  qsort(sim_clocks.errors_us, count, sizeof(uint32_t), sim_compare_u32);
+  ESP_LOGI(TAG,
+           "clocks: %" PRIu32 "ppm crystals synced after %" PRId64
+           "ms, error p50 %" PRIu32 "us, p99 %" PRIu32 "us, max %" PRIu32
+           "us",
+           config->clock_ppm, sim_clocks.synced_us / 1000,
+           count > 0 ? sim_clocks.errors_us[count / 2] : 0,
+           count > 0 ? sim_clocks.errors_us[count * 99 / 100] : 0,
+           count > 0 ? sim_clocks.errors_us[count - 1] : 0);
+  xSemaphoreGive(sim_clocks.mutex);
+  return true;
+}
+
+// Watches the stations find the one that joined late, and it them.
+static void sim_join_task(void *pvParameters) {
+  const sim_config_t *config = (const sim_config_t *)pvParameters;
+  sim_station_t *newcomer = &stations[config->stations - 1];
+
+  while (sim_join.everyone_us < 0) {
+    vTaskDelay(pdMS_TO_TICKS(SIM_CLOCK_CHECK_MS));
+    int64_t since_us = esp_timer_get_time() - sim_join.started_us;
+
+    if (sim_join.newcomer_us < 0 && app_peers_count(newcomer->peers) >=
+                                        (int32_t)config->expected_peers) {
+      sim_join.newcomer_us = since_us;
+    }
+    bool everyone = sim_join.newcomer_us >= 0;
+    for (uint32_t i = 0; i + 1 < config->stations && everyone; i++) {
+      everyone = app_peers_count(stations[i].peers) >=
+                 (int32_t)config->expected_peers;
+    }
+    if (everyone) {
+      sim_join.everyone_us = since_us;
+    }
+  }
+  vTaskDelete(NULL);
+}
+
+// Heartbeat sizes and tables are counted by metrics every station shares.
+static void sim_peers_report(const sim_config_t *config) {
+  app_peers_handle_t peers = stations[0].peers;
+  system_metric_handle_t sizes = peers->metrics.heartbeat_bytes;
+  uint32_t heartbeats = atomic_load(&sizes->histogram.count);
+  uint32_t bytes = atomic_load(&sizes->histogram.sum);
+
+  ESP_LOGI(TAG,
+           "heartbeats: %" PRIu32 " sent, %.1f bytes each, %" PRId32
+           " peer tables sent, %" PRId32 " peers learned from them",
+           heartbeats, heartbeats > 0 ? (double)bytes / heartbeats : 0.0,
+           (int32_t)atomic_load(&peers->metrics.tables_sent->value),
+           (int32_t)atomic_load(&peers->metrics.learned->value));
+  if (config->join_s > 0) {
+    ESP_LOGI(TAG,
+             "join: %s knew every peer after %" PRId64
+             "ms, every station knew it after %" PRId64 "ms",
+             stations[config->stations - 1].device_info.name,
+             sim_join.newcomer_us < 0 ? -1 : sim_join.newcomer_us / 1000,
+             sim_join.everyone_us < 0 ? -1 : sim_join.everyone_us / 1000);
+  }
+}
+
+// the `index`th station's zone, 0 without zones
+static uint32_t sim_zone(const sim_config_t *config, uint32_t index) {
+  return config->zones > 0 ? 1 + index % config->zones : 0;
+}
+
+// Capture would stop when a station loses the floor, so how long after its
+// press that happens is how much of the loser's audio goes out.
+static void sim_floor_listener(const app_session_floor_t *floor, bool ours,
+                               void *ctx) {
+  sim_station_t *station = (sim_station_t *)ctx;
+  int64_t now_us = esp_timer_get_time();
+
+  xSemaphoreTake(sim_talks.mutex, portMAX_DELAY);
+  if (ours) {
+    station->talking = true;
+  } else if (station->talking) {
+    station->talking = false;
+    if (station->pressed_us != 0 &&
+        sim_talks.stop_count < SIM_MAX_TALK_STOPS) {
+      sim_talks.stops_us[sim_talks.stop_count++] =
+          (uint32_t)(now_us - station->pressed_us);
+    }
+  }
+  xSemaphoreGive(sim_talks.mutex);
+}
+
+// Every station presses talk at once, which is as close a collision as
+// there can be. A round is settled when only one station still talks and
+// every station agrees it has the floor.
+static void sim_talks_task(void *pvParameters) {
+  const sim_config_t *config = (const sim_config_t *)pvParameters;
+
+  for (uint32_t round = 0; round < config->talks; round++) {
+    vTaskDelay(pdMS_TO_TICKS(SIM_TALK_INTERVAL_MS));
+    for (uint32_t i = 0; i < config->stations; i++) {
+      xSemaphoreTake(sim_talks.mutex, portMAX_DELAY);
+      stations[i].pressed_us = esp_timer_get_time();
+      xSemaphoreGive(sim_talks.mutex);
+      app_session_talk_start(stations[i].session);
+    }
+    vTaskDelay(pdMS_TO_TICKS(SIM_TALK_SETTLE_MS));
+
+    uint32_t talking = 0;
+    bool agreed = true;
+    app_session_floor_t floor = {0};
+    for (uint32_t i = 0; i < config->stations; i++) {
+      app_session_handle_t session = stations[i].session;
+      xSemaphoreTake(session->mutex, portMAX_DELAY);
+      if (i == 0) {
+        floor = session->floor;
+      }
+      agreed = agreed && session->held &&
+               memcmp(session->floor.talker, floor.talker,
+                      sizeof(protocol_mac_address_t)) == 0;
+      xSemaphoreGive(session->mutex);
+
+      xSemaphoreTake(sim_talks.mutex, portMAX_DELAY);
+      talking += stations[i].talking ? 1 : 0;
+      stations[i].pressed_us = 0;
+      xSemaphoreGive(sim_talks.mutex);
+    }
+
+    xSemaphoreTake(sim_talks.mutex, portMAX_DELAY);
+    sim_talks.rounds++;
+    sim_talks.settled += talking == 1 && agreed ? 1 : 0;
+    xSemaphoreGive(sim_talks.mutex);
+
+    for (uint32_t i = 0; i < config->stations; i++) {
+      app_session_talk_stop(stations[i].session);
+    }
+  }
+  vTaskDelete(NULL);
+}
+
+static void sim_talks_report(const sim_config_t *config) {
+  xSemaphoreTake(sim_talks.mutex, portMAX_DELAY);
+  uint32_t count = sim_talks.stop_count;
+  qsort(sim_talks.stops_us, count, sizeof(uint32_t), sim_compare_u32);
+
+  ESP_LOGI(TAG,
+           "talks: %" PRIu32 "/%" PRIu32 " rounds settled on one talker, "
+           "losers stopped %" PRIu32 " times, after p50 %" PRIu32
+           "us, p99 %" PRIu32 "us, max %" PRIu32 "us (a frame is %" PRIu32
+           "ms)",
+           sim_talks.settled, sim_talks.rounds, count,
+           count > 0 ? sim_talks.stops_us[count / 2] : 0,
+           count > 0 ? sim_talks.stops_us[count * 99 / 100] : 0,
+           count > 0 ? sim_talks.stops_us[count - 1] : 0,
+           storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS));
+  xSemaphoreGive(sim_talks.mutex);
+}
+
+// Every station shares the process clock, so when each played a frame can
+// be compared directly. The frame's number is its first bytes.
+static esp_err_t sim_page_handler(protocol_message_handle_t message,
+                                  void *ctx) {
+  int64_t now_us = esp_timer_get_time();
+  uint32_t frame = 0;
+
+  if ((message->header.flags & PROTOCOL_MESSAGE_FLAG_PAGED) &&
+      message->header.length >= (int32_t)sizeof(frame)) {
+    memcpy(&frame, message->audio.value, sizeof(frame));
+  } else {
+    frame = SIM_MAX_PAGES;
+  }
+
+  if (frame < SIM_MAX_PAGES) {
+    xSemaphoreTake(sim_pages.mutex, portMAX_DELAY);
+    if (sim_pages.frames[frame].played == 0 ||
+        now_us < sim_pages.frames[frame].first_us) {
+      sim_pages.frames[frame].first_us = now_us;
+    }
+    if (now_us > sim_pages.frames[frame].last_us) {
+      sim_pages.frames[frame].last_us = now_us;
+    }
+    sim_pages.frames[frame].played++;
+    xSemaphoreGive(sim_pages.mutex);
+  }
+
+  protocol_message_free(message);
+  return ESP_OK;
+}
+
+// Pages from the last station, paced like capture.
+static void sim_pages_task(void *pvParameters) {
+  const sim_config_t *config = (const sim_config_t *)pvParameters;
+  sim_station_t *station = &stations[config->stations - 1];
+  uint32_t frame_ms = storage_settings_get_u32(STORAGE_SETTING_AUDIO_FRAME_MS);
+  uint8_t audio[SIM_PAGE_LENGTH] = {0};
+
+  bool synced = false;
+  while (!synced) {
+    vTaskDelay(pdMS_TO_TICKS(SIM_CLOCK_CHECK_MS));
+    app_clock_shared_at(station->clock, app_clock_local_us(station->clock),
+                        &synced);
+  }
+
+  TickType_t wake = xTaskGetTickCount();
+  uint32_t frames = config->page_s * 1000 / frame_ms;
+  for (uint32_t frame = 0; frame < frames && frame < SIM_MAX_PAGES; frame++) {
+    memcpy(audio, &frame, sizeof(frame));
+    if (app_paging_send(station->paging, sim_zone(config, 0), audio,
+                        sizeof(audio)) == ESP_OK) {
+      xSemaphoreTake(sim_pages.mutex, portMAX_DELAY);
+      sim_pages.sent++;
+      xSemaphoreGive(sim_pages.mutex);
+    }
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(frame_ms));
+  }
+  vTaskDelete(NULL);
+}
+
+// The skew of a frame is how far apart the first and last station played
+// it, counted only for frames every paged station played.
+static void sim_pages_report(const sim_config_t *config) {
+  static uint32_t skews_us[SIM_MAX_PAGES];
+  uint32_t expected = 0;
+  uint32_t played = 0;
+  uint32_t count = 0;
+
+  // the pager is last, and only the paged zone plays
+  for (uint32_t i = 0; i + 1 < config->stations; i++) {
+    if (config->zones == 0 || sim_zone(config, i) == sim_zone(config, 0)) {
+      expected++;
+    }
+  }
+
+  xSemaphoreTake(sim_pages.mutex, portMAX_DELAY);
+  for (uint32_t i = 0; i < SIM_MAX_PAGES; i++) {
+    played += sim_pages.frames[i].played;
+    if (sim_pages.frames[i].played == expected) {
+      skews_us[count++] = (uint32_t)(sim_pages.frames[i].last_us -
+                                     sim_pages.frames[i].first_us);
+    }
+  }
+  qsort(skews_us, count, sizeof(uint32_t), sim_compare_u32);
+
+  ESP_LOGI(TAG,
+           "all-call: played %" PRIu32 "/%" PRIu32 " (%.1f%%), skew between "
+           "stations p50 %" PRIu32 "us, p99 %" PRIu32 "us, max %" PRIu32 "us",
+           played, sim_pages.sent * expected,
+           sim_pages.sent > 0 ? 100.0 * played / (sim_pages.sent * expected)
+                              : 0.0,
+           count > 0 ? skews_us[count / 2] : 0,
+           count > 0 ? skews_us[count * 99 / 100] : 0,
+           count > 0 ? skews_us[count - 1] : 0);
+  xSemaphoreGive(sim_pages.mutex);
+}
+
+static esp_err_t sim_station_init(sim_station_t *station,
+                                  const sim_config_t *config, uint32_t id) {
+  esp_err_t ret = ESP_OK;
+
+  station->id = id;
+
+  // locally administered, so it can't clash with a real device
+  protocol_mac_address_t mac_address = {0x02, 0x00, 0x00, 0x00,
+                                        (uint8_t)(id >> 8), (uint8_t)id};
+  memcpy(station->device_info.mac_address, mac_address,
+         sizeof(protocol_mac_address_t));
+  station->device_info.name = (char *)malloc(16);
+  ESP_RETURN_ON_FALSE(station->device_info.name != NULL, ESP_ERR_NO_MEM, TAG,
+                      "Failed to allocate station name");
+  snprintf(station->device_info.name, 16, "sim-%03" PRIu32, id);
+
+  ESP_RETURN_ON_ERROR(network_events_init(&station->events), TAG,
+                      "Failed to init events for %s",
+                      station->device_info.name);
+  ESP_RETURN_ON_ERROR(app_queues_init(&station->queues), TAG,
+                      "Failed to init queues for %s",
+                      station->device_info.name);
+  ESP_RETURN_ON_ERROR(
+      app_peers_init(&station->peers, &station->device_info, station->queues),
+      TAG, "Failed to init peers for %s", station->device_info.name);
+
+  // repeatable, anywhere up to the configured error either way
+  uint32_t crystal = (config->impairment.seed + id) * 2654435761u;
+  station->clock_ppm =
+      config->clock_ppm * ((double)(crystal >> 8) / 8388608.0 - 1.0);
+  station->clock_offset_us = (int64_t)(crystal % 1000000);
+  ESP_RETURN_ON_ERROR(app_clock_init(&station->clock, &station->device_info,
+                                     station->peers),
+                      TAG, "Failed to init clock for %s",
+                      station->device_info.name);
+  app_clock_set_source(station->clock, sim_clock_source, station);
+  ESP_RETURN_ON_ERROR(app_paging_init(&station->paging, &station->device_info,
+                                      station->queues, station->clock),
+                      TAG, "Failed to init paging for %s",
+                      station->device_info.name);
+  ESP_RETURN_ON_ERROR(app_session_init(&station->session,
+                                       &station->device_info, station->queues,
+                                       station->peers),
+                      TAG, "Failed to init session for %s",
+                      station->device_info.name);
+  app_session_set_listener(station->session, sim_floor_listener, station);
+  ESP_RETURN_ON_ERROR(app_reliable_init(&station->reliable,
+                                        &station->device_info,
+                                        station->queues),
+                      TAG, "Failed to init reliable for %s",
+                      station->device_info.name);
+  app_router_subscriber_config_t texts_config = {
+      .name = "sim_texts",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_TEXT)},
+      .handler = sim_text_handler,
+      .handler_ctx = station,
+  };
+  ESP_RETURN_ON_ERROR(app_router_subscribe(station->queues->incoming,
+                                           &station->texts, &texts_config),
+                      TAG, "Failed to subscribe to texts for %s",
+                      station->device_info.name);
+  app_router_subscriber_config_t pages_config = {
+      .name = "sim_pages",
+      .filter = {.types = APP_ROUTER_TYPE_BIT(MESSAGE_TYPE_AUDIO)},
+      .handler = sim_page_handler,
+  };
+  ESP_RETURN_ON_ERROR(app_router_subscribe(station->queues->incoming,
+                                           &station->pages, &pages_config),
+                      TAG, "Failed to subscribe to audio for %s",
+                      station->device_info.name);
+  ESP_RETURN_ON_ERROR(protocol_message_handler_init(
+                          &station->message_handler, station->peers,
+                          station->queues, &station->device_info),
+                      TAG, "Failed to init message handler for %s",
+                      station->device_info.name);
+  ESP_RETURN_ON_ERROR(
+      network_power_init(&station->power, station->events, station->peers),
+      TAG, "Failed to init power for %s", station->device_info.name);
+  ESP_RETURN_ON_ERROR(network_udp_init(&station->udp, station->events,
+                                       station->power, station->queues,
+                                       &station->device_info),
+                      TAG, "Failed to init UDP for %s",
+                      station->device_info.name);
+
+  if (config->secure) {
+    // the wall clock only goes forward between runs, like a device's epoch
+    ESP_RETURN_ON_ERROR(network_secure_init(&station->secure, SIM_GROUP_KEY,
+                                            sizeof(SIM_GROUP_KEY),
+                                            station->device_info.mac_address,
+                                            (uint32_t)time(NULL)),
+                        TAG, "Failed to init security for %s",
+                        station->device_info.name);
+    network_udp_set_secure(station->udp, station->secure);
+  }
+  uint32_t zone = sim_zone(config, id - config->first_id);
+  if (zone != 0) {
+    ESP_RETURN_ON_ERROR(
+        network_udp_join(station->udp, protocol_group_zone(zone)), TAG,
+        "Failed to join zone %" PRIu32 " for %s", zone,
+        station->device_info.name);
+  }
+
+  sim_impairment_config_t impairment_config = config->impairment;
+  // every station gets its own, but repeatable, impairments
+  impairment_config.seed += id;
+  ESP_RETURN_ON_ERROR(sim_impairment_init(&station->impairment,
+                                          &impairment_config, station->udp,
+                                          &station->device_info),
+                      TAG, "Failed to init impairment for %s",
+                      station->device_info.name);
+
+  // stands in for WiFi getting an IP
+  station->events->ip_info.ip.addr = htonl(INADDR_LOOPBACK);
+  xEventGroupSetBits(station->events->group_handle, NETWORK_EVENT_GOT_NEW_IP);
+
+  return ret;
+}
+
+// returns how many stations found fewer peers than expected
+static uint32_t sim_report(const sim_config_t *config) {
+  uint32_t failed = 0;
+
+  for (uint32_t i = 0; i < config->stations; i++) {
+    sim_station_t *station = &stations[i];
+    sim_impairment_stats_t stats;
+    sim_impairment_get_stats(station->impairment, &stats);
+    int32_t peers = app_peers_count(station->peers);
+
+    if (peers < (int32_t)config->expected_peers) {
+      failed++;
+    }
+
+    ESP_LOGI(TAG,
+             "%s: %" PRId32 "/%" PRIu32 " peers, rx %" PRIu32 ", lost %" PRIu32
+             ", reordered %" PRIu32 ", overflowed %" PRIu32
+             ", delivered %" PRIu32,
+             station->device_info.name, peers, config->expected_peers,
+             stats.received, stats.lost, stats.reordered, stats.overflowed,
+             stats.delivered);
+    network_power_report(station->power);
+  }
+
+  return failed;
+}
+
+void app_main(void) {
+  sim_config_t config;
+  sim_config_load(&config);
+
+  // the stations are chatty, only keep our own logs
+  esp_log_level_set("*", ESP_LOG_WARN);
+  esp_log_level_set(TAG, ESP_LOG_INFO);
+  esp_log_level_set("NETWORK:POWER", ESP_LOG_INFO);
+
+  ESP_ERROR_CHECK(system_trace_init());
+  ESP_ERROR_CHECK(system_metrics_init());
+  ESP_ERROR_CHECK(storage_nvs_init());
+  ESP_ERROR_CHECK(storage_settings_init());
+  if (config.heartbeat_ms > 0) {
+    ESP_ERROR_CHECK(storage_settings_set_u32(
+        STORAGE_SETTING_HEARTBEAT_INTERVAL_MS, config.heartbeat_ms));
+  }
+
+  ESP_LOGI(TAG,
+           "%" PRIu32 " stations, loss %" PRIu32 "%%, latency %" PRIu32
+           "ms + %" PRIu32 "ms jitter, reorder %" PRIu32 "%% by %" PRIu32
+           "ms, seed %" PRIu32 ", running for %" PRIu32 "s",
+           config.stations, config.impairment.loss_pct,
+           config.impairment.latency_ms, config.impairment.jitter_ms,
+           config.impairment.reorder_pct, config.impairment.reorder_ms,
+           config.impairment.seed, config.duration_s);
+
+  sim_texts.mutex = xSemaphoreCreateMutex();
+  sim_clocks.mutex = xSemaphoreCreateMutex();
+  sim_pages.mutex = xSemaphoreCreateMutex();
+  sim_talks.mutex = xSemaphoreCreateMutex();
+  sim_clocks.synced_us = -1;
+  sim_join.newcomer_us = -1;
+  sim_join.everyone_us = -1;
+  // the rest wait for it, they'd look at a station that isn't there
+  uint32_t joining = config.join_s > 0 && config.stations > 1 ? 1 : 0;
+  for (uint32_t i = 0; i < config.stations - joining; i++) {
+    ESP_ERROR_CHECK(
+        sim_station_init(&stations[i], &config, config.first_id + i));
+  }
+  if (joining > 0) {
+    vTaskDelay(pdMS_TO_TICKS(config.join_s * 1000));
+    sim_join.started_us = esp_timer_get_time();
+    uint32_t last = config.stations - 1;
+    ESP_ERROR_CHECK(
+        sim_station_init(&stations[last], &config, config.first_id + last));
+    xTaskCreate(sim_join_task, "sim_join", 1024 * 4, &config, 3, NULL);
+  }
+  if (config.texts > 0) {
+    xTaskCreate(sim_texts_task, "sim_texts", 1024 * 4, &config, 3, NULL);
+  }
+  xTaskCreate(sim_clocks_task, "sim_clocks", 1024 * 4, &config, 3, NULL);
+  if (config.page_s > 0 && config.stations > 1) {
+    xTaskCreate(sim_pages_task, "sim_pages", 1024 * 4, &config, 4, NULL);
+  }
+  if (config.talks > 0 && config.stations > 1) {
+    xTaskCreate(sim_talks_task, "sim_talks", 1024 * 4, &config, 4, NULL);
+  }
+
+  vTaskDelay(pdMS_TO_TICKS((config.duration_s - config.join_s) * 1000));
+
+  uint32_t failed = sim_report(&config);
+  sim_peers_report(&config);
+  if (config.texts > 0) {
+    sim_texts_report(&config);
+  }
+  bool clocks_synced = sim_clocks_report(&config);
+  if (config.page_s > 0 && config.stations > 1) {
+    sim_pages_report(&config);
+  }
+  if (config.talks > 0 && config.stations > 1) {
+    sim_talks_report(&config);
+  }
+  // the most recent events of every station, for `tools/trace/render.py`
+  system_trace_dump();
+  if (failed > 0) {
+    ESP_LOGE(TAG, "%" PRIu32 " stations are missing peers", failed);
+    exit(EXIT_FAILURE);
+  }
+  if (!clocks_synced) {
+    exit(EXIT_FAILURE);
+  }
+
+  ESP_LOGI(TAG, "All stations found their peers");
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+"""Renders a hot-path trace dumped by `system_trace_dump`.
+
+The input is the captured console output (host or device monitor), only the
+lines between `TRACE_BEGIN` and `TRACE_END` are read. Prints the slowest
+per-message timelines and a log2 latency histogram for every pair of
+consecutive stages:
+
+  ./tools/trace/render.py monitor.txt [--messages 10] [--chrome trace.json]
+
+The Chrome trace opens in chrome://tracing or https://ui.perfetto.dev.
+"""
+
+import argparse
+import collections
+import json
+import struct
+import sys
+
+# must match `system_trace_event_id_t`
+EVENTS = [
+    "sync",
+    "udp_receive",
+    "router_publish",
+    "router_drop",
+    "router_receive",
+    "handle",
+    "outgoing_enqueue",
+    "outgoing_dequeue",
+    "udp_send",
+    "audio_capture",
+    # left for a codec
+    "event_10",
+    "event_11",
+    "audio_playout",
+]
+SYNC = 0
+
+# must match `system_trace_event_t`
+EVENT = struct.Struct("<IIIHBB8s")
+HISTOGRAM_WIDTH = 40
+
+Event = collections.namedtuple("Event", "us core task name uuid")
+
+
+def event_name(id):
+    return EVENTS[id] if id < len(EVENTS) else f"event_{id}"
+
+
+def load(path):
+    """Returns the config, task names and raw events of the last dump."""
+    config, tasks, raw = None, {}, []
+    with open(path, encoding="utf-8", errors="replace") as f:
+        for line in f:
+            if "TRACE_BEGIN " in line:
+                start = line.index("TRACE_BEGIN ") + len("TRACE_BEGIN ")
+                config, tasks, raw = json.loads(line[start:]), {}, []
+            elif config is None:
+                continue
+            elif "TRACE_TASK " in line:
+                fields = line.split("TRACE_TASK ", 1)[1].split(None, 1)
+                tasks[int(fields[0], 16)] = fields[1].strip()
+            elif "TRACE_EVENT " in line:
+                data = bytes.fromhex(line.split("TRACE_EVENT ", 1)[1].strip())
+                if len(data) == EVENT.size:
+                    raw.append(EVENT.unpack(data))
+    return config, tasks, raw
+
+
+def to_timeline(config, tasks, raw):
+    """Maps every core's timestamps onto `esp_timer_get_time()`."""
+    ticks_per_us = config["ticks_per_us"]
+    syncs = collections.defaultdict(list)
+    for seq, timestamp, task, id, core, _, uuid in raw:
+        if id == SYNC:
+            syncs[core].append((seq, timestamp, struct.unpack("<q", uuid)[0]))
+
+    events = []
+    for seq, timestamp, task, id, core, _, uuid in raw:
+        if id == SYNC or not syncs[core]:
+            continue
+        # the closest sync recorded before the event, else the first one
+        _, sync_timestamp, sync_us = min(
+            syncs[core],
+            key=lambda s: (s[0] > seq, abs(s[0] - seq)),
+        )
+        # the counter is 32 bits and wraps, so take the shorter way round
+        delta = (timestamp - sync_timestamp) & 0xFFFFFFFF
+        if delta >= 0x80000000:
+            delta -= 0x100000000
+        events.append(
+            Event(
+                us=sync_us + delta / ticks_per_us,
+                core=core,
+                task=tasks.get(task, f"{task:08x}"),
+                name=event_name(id),
+                uuid=uuid.hex() if any(uuid) else None,
+            )
+        )
+    events.sort(key=lambda e: e.us)
+    return events
+
+
+def by_message(events):
+    messages = collections.defaultdict(list)
+    for event in events:
+        if event.uuid is not None:
+            messages[event.uuid].append(event)
+    return messages
+
+
+def print_timelines(messages, count):
+    slowest = sorted(
+        messages.items(),
+        key=lambda m: m[1][-1].us - m[1][0].us,
+        reverse=True,
+    )
+    print(f"slowest {min(count, len(slowest))} of {len(slowest)} messages")
+    for uuid, events in slowest[:count]:
+        print(f"\n{uuid} {events[-1].us - events[0].us:.1f}us")
+        for event in events:
+            print(
+                f"  {event.us - events[0].us:>10.1f}us  core {event.core}"
+                f"  {event.name:<18} {event.task}"
+            )
+
+
+def print_histograms(messages):
+    stages = collections.defaultdict(list)
+    for events in messages.values():
+        for a, b in zip(events, events[1:]):
+            stages[f"{a.name} > {b.name}"].append(b.us - a.us)
+
+    for stage, latencies in sorted(stages.items()):
+        latencies.sort()
+        buckets = collections.Counter(
+            max(0, int(latency).bit_length()) for latency in latencies
+        )
+        p50 = latencies[len(latencies) // 2]
+        p99 = latencies[min(len(latencies) - 1, len(latencies) * 99 // 100)]
+        print(
+            f"\n{stage}: {len(latencies)} samples, p50 {p50:.1f}us,"
+            f" p99 {p99:.1f}us, max {latencies[-1]:.1f}us"
+        )
+        most = max(buckets.values())
+        for bucket in range(min(buckets), max(buckets) + 1):
+            low = 0 if bucket == 0 else 1 << (bucket - 1)
+            bar = "#" * (buckets[bucket] * HISTOGRAM_WIDTH // most)
+            print(f"  {low:>8}us {buckets[bucket]:>7} {bar}")
+
+
+def write_chrome(path, events, messages):
+    trace = []
+    for event in events:
+        trace.append(
+            {
+                "name": event.name,
+                "ph": "i",
+                "s": "t",
+                "ts": event.us,
+                "pid": event.core,
+                "tid": event.task,
+                "args": {"uuid": event.uuid},
+            }
+        )
+    # one async span per message, from its first to its last stage
+    for uuid, stages in messages.items():
+        for phase, event in (("b", stages[0]), ("e", stages[-1])):
+            trace.append(
+                {
+                    "name": "message",
+                    "cat": "message",
+                    "ph": phase,
+                    "id": uuid,
+                    "ts": event.us,
+                    "pid": event.core,
+                    "tid": event.task,
+                }
+            )
+    with open(path, "w", encoding="utf-8") as f:
+        json.dump({"traceEvents": trace, "displayTimeUnit": "ns"}, f)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input")
+    parser.add_argument(
+        "--messages",
+        type=int,
+        default=10,
+        help="number of slowest message timelines to print (default 10)",
+    )
+    parser.add_argument("--chrome", help="also write a Chrome trace here")
+    args = parser.parse_args()
+
+    config, tasks, raw = load(args.input)
+    if config is None:
+        print("no TRACE_BEGIN found", file=sys.stderr)
+        return 1
+
+    events = to_timeline(config, tasks, raw)
+    if not events:
+        print("no events with a sync on their core", file=sys.stderr)
+        return 1
+
+    messages = by_message(events)
+    print_timelines(messages, args.messages)
+    print_histograms(messages)
+
+    if args.chrome:
+        write_chrome(args.chrome, events, messages)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())